@@ -28,6 +28,21 @@ LOCAL_CFLAGS := \
     -Wno-unused-private-field \
     -Wno-unused-variable \
 
+# Optional coroutine based command sequencing, see cpp_coroutines.h
+ifeq ($(TI_WIFI_HAL_COROUTINES), true)
+LOCAL_CPPFLAGS += -std=c++2a -DWIFI_HAL_COROUTINES
+endif
+
+# Abort on counted allocations made while handling events, see wifi_alloc_set_strict()
+ifeq ($(TI_WIFI_HAL_STRICT_ALLOC), true)
+LOCAL_CFLAGS += -DWIFI_HAL_STRICT_ALLOC
+endif
+
+# Where recent scan results are kept across restarts, see warm_start.h
+ifneq ($(TI_WIFI_HAL_WARM_START_DIR),)
+LOCAL_CFLAGS += -DWIFI_HAL_WARM_START_DIR=\"$(TI_WIFI_HAL_WARM_START_DIR)\"
+endif
+
 LOCAL_C_INCLUDES += \
 	external/libnl/include \
 	$(call include-path-for, libhardware_legacy)/hardware_legacy \
@@ -38,10 +53,23 @@ LOCAL_HEADER_LIBRARIES := libutils_headers liblog_headers
 LOCAL_SRC_FILES := \
 	wifi_hal.cpp \
 	rtt.cpp \
+	anqp_cache.cpp \
+	capabilities.cpp \
 	common.cpp \
 	cpp_bindings.cpp \
+	epno_match.cpp \
 	gscan.cpp \
+	gscan_mux.cpp \
+	ie_index.cpp \
+	ie_pool.cpp \
 	link_layer_stats.cpp \
+	scan_cache.cpp \
+	scan_export.cpp \
+	scan_filter.cpp \
+	scan_history.cpp \
+	scan_planner.cpp \
+	significant_change.cpp \
+	warm_start.cpp \
 	wifi_logger.cpp \
 	wifi_offload.cpp
 
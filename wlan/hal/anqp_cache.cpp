@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "anqp_cache.h"
+
+
+/*
+ * A handful of recent ANQP responses. Hotspots of one HESS share their operator's
+ * ANQP answers, so a response from one BSSID stands in for its neighbours.
+ */
+
+static const mac_addr zero_hessid = { 0, 0, 0, 0, 0, 0 };
+
+bool anqp_get_hessid(const u8 *ies, int ie_length, u8 *hessid)
+{
+    wifi_ie_index index;
+    wifi_ie_index_init(&index, ies, ie_length);
+
+    /* access network options, optional venue info, then the optional HESSID */
+    int len;
+    const u8 *interworking = wifi_ie_get(&index, WIFI_IE_INTERWORKING, &len);
+    if (interworking == NULL || (len != 7 && len != 9)) {
+        return false;
+    }
+    memcpy(hessid, interworking + len - sizeof(mac_addr), sizeof(mac_addr));
+    return true;
+}
+
+static void drop_entry(anqp_cache *cache, anqp_cache_entry *entry)
+{
+    if (entry->expires_ms) {
+        entry->expires_ms = 0;
+        cache->stats.entries--;
+    }
+}
+
+static void free_cache(anqp_cache *cache)
+{
+    wifi_hal_free(WIFI_ALLOC_GSCAN, cache);
+}
+
+static anqp_cache *alloc_cache(int ttl_ms)
+{
+    anqp_cache *cache = (anqp_cache *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*cache));
+    if (cache) {
+        memset(cache, 0, offsetof(anqp_cache, data));
+        cache->ttl_ms = ttl_ms;
+        for (int i = 0; i < ANQP_CACHE_ENTRIES; i++) {
+            cache->entries[i].anqp = &cache->data[i * ANQP_CACHE_MAX_DATA];
+        }
+    }
+    return cache;
+}
+
+void anqp_cache_prepare(interface_info *iface)
+{
+    anqp_cache *cache = NULL;
+
+    if (iface->anqp_cache || iface->anqp_cache_off) {
+        return;                             /* checked again under the lock */
+    }
+
+    cache = alloc_cache(ANQP_CACHE_DEFAULT_TTL_MS);
+    if (cache == NULL) {
+        ALOGE("Could not allocate the ANQP cache");
+        return;
+    }
+
+    pthread_mutex_lock(&iface->anqp_cache_lock);
+    if (iface->anqp_cache == NULL && !iface->anqp_cache_off) {
+        iface->anqp_cache = cache;
+        cache = NULL;
+    }
+    pthread_mutex_unlock(&iface->anqp_cache_lock);
+
+    if (cache) {
+        free_cache(cache);
+    }
+}
+
+void anqp_cache_store(interface_info *iface, const mac_addr bssid, const u8 *hessid,
+        int network_id, const u8 *anqp, int anqp_len)
+{
+    if (anqp_len <= 0 || anqp_len > ANQP_CACHE_MAX_DATA) {
+        return;
+    }
+
+    /* set up by anqp_cache_prepare(); nothing is allocated here on the event loop */
+    pthread_mutex_lock(&iface->anqp_cache_lock);
+    anqp_cache *cache = iface->anqp_cache;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&iface->anqp_cache_lock);
+        return;
+    }
+
+    /* the same BSSID, else a free slot, else whichever is closest to expiring */
+    u64 now = wifi_get_monotonic_ms();
+    anqp_cache_entry *entry = NULL;
+    for (int i = 0; i < ANQP_CACHE_ENTRIES; i++) {
+        anqp_cache_entry *e = &cache->entries[i];
+        if (e->expires_ms && e->expires_ms <= now) {
+            drop_entry(cache, e);
+            cache->stats.expired++;
+        }
+        if (e->expires_ms && memcmp(e->bssid, bssid, sizeof(mac_addr)) == 0) {
+            entry = e;
+            break;
+        }
+        if (entry == NULL || (entry->expires_ms && e->expires_ms < entry->expires_ms)) {
+            entry = e;
+        }
+    }
+
+    if (entry->expires_ms == 0) {
+        cache->stats.entries++;
+    }
+    memcpy(entry->bssid, bssid, sizeof(mac_addr));
+    memcpy(entry->hessid, hessid ? hessid : zero_hessid, sizeof(mac_addr));
+    entry->network_id = network_id;
+    entry->expires_ms = now + cache->ttl_ms;
+    entry->anqp_len = anqp_len;
+    memcpy(entry->anqp, anqp, anqp_len);
+    cache->stats.stores++;
+    pthread_mutex_unlock(&iface->anqp_cache_lock);
+}
+
+wifi_error wifi_set_anqp_cache_ttl(wifi_interface_handle handle, int ttl_ms)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    if (ttl_ms < 0) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    anqp_cache *old = NULL;
+    pthread_mutex_lock(&iface->anqp_cache_lock);
+    if (ttl_ms == 0) {
+        old = iface->anqp_cache;
+        iface->anqp_cache = NULL;
+    } else if (iface->anqp_cache) {
+        /* held entries keep the expiry they were stored with */
+        iface->anqp_cache->ttl_ms = ttl_ms;
+    } else {
+        iface->anqp_cache = alloc_cache(ttl_ms);
+        if (iface->anqp_cache == NULL) {
+            /* left as it was, off or not */
+            pthread_mutex_unlock(&iface->anqp_cache_lock);
+            ALOGE("Could not allocate the ANQP cache");
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    iface->anqp_cache_off = ttl_ms == 0;
+    pthread_mutex_unlock(&iface->anqp_cache_lock);
+
+    if (old) {
+        free_cache(old);
+    }
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_anqp_cache_lookup(wifi_interface_handle handle, mac_addr bssid,
+        const u8 *hessid, int *network_id, u8 *buf, int buf_len, int *anqp_len)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    pthread_mutex_lock(&iface->anqp_cache_lock);
+    anqp_cache *cache = iface->anqp_cache;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&iface->anqp_cache_lock);
+        return WIFI_ERROR_NOT_AVAILABLE;
+    }
+
+    bool by_hessid = hessid && memcmp(hessid, zero_hessid, sizeof(mac_addr)) != 0;
+    u64 now = wifi_get_monotonic_ms();
+    anqp_cache_entry *found = NULL;
+    for (int i = 0; i < ANQP_CACHE_ENTRIES; i++) {
+        anqp_cache_entry *e = &cache->entries[i];
+        if (e->expires_ms == 0) {
+            continue;
+        } else if (e->expires_ms <= now) {
+            drop_entry(cache, e);
+            cache->stats.expired++;
+        } else if (memcmp(e->bssid, bssid, sizeof(mac_addr)) == 0) {
+            found = e;
+            break;
+        } else if (by_hessid && found == NULL &&
+                memcmp(e->hessid, hessid, sizeof(mac_addr)) == 0) {
+            found = e;                          /* keep looking for the BSSID itself */
+        }
+    }
+
+    wifi_error result = WIFI_ERROR_NOT_AVAILABLE;
+    if (found == NULL) {
+        cache->stats.misses++;
+    } else {
+        if (memcmp(found->bssid, bssid, sizeof(mac_addr)) == 0) {
+            cache->stats.hits++;
+        } else {
+            cache->stats.hessid_hits++;
+        }
+        *network_id = found->network_id;
+        *anqp_len = found->anqp_len;
+        if (found->anqp_len <= buf_len) {
+            memcpy(buf, found->anqp, found->anqp_len);
+            result = WIFI_SUCCESS;
+        } else {
+            result = WIFI_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    pthread_mutex_unlock(&iface->anqp_cache_lock);
+    return result;
+}
+
+wifi_error wifi_get_anqp_cache_stats(wifi_interface_handle handle, wifi_anqp_cache_stats *stats)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    pthread_mutex_lock(&iface->anqp_cache_lock);
+    if (iface->anqp_cache) {
+        *stats = iface->anqp_cache->stats;
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+    pthread_mutex_unlock(&iface->anqp_cache_lock);
+    return WIFI_SUCCESS;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_ANQP_CACHE_H__
+#define __WIFI_HAL_ANQP_CACHE_H__
+
+#include "common.h"
+
+#define ANQP_CACHE_ENTRIES          32
+#define ANQP_CACHE_MAX_DATA         2048            // larger responses aren't kept
+#define ANQP_CACHE_DEFAULT_TTL_MS   (60 * 60 * 1000)
+
+/* One ANQP response, keyed by the BSSID it came from and its HESSID if it has one */
+typedef struct {
+    mac_addr bssid;
+    mac_addr hessid;                                // all zero if not advertised
+    int network_id;
+    u64 expires_ms;
+    u16 anqp_len;
+    u8 *anqp;                                       // ANQP_CACHE_MAX_DATA bytes of data[]
+} anqp_cache_entry;
+
+struct anqp_cache {
+    int ttl_ms;
+    anqp_cache_entry entries[ANQP_CACHE_ENTRIES];
+    wifi_anqp_cache_stats stats;
+    u8 data[ANQP_CACHE_ENTRIES * ANQP_CACHE_MAX_DATA];  // allocated up front; responses are
+                                                    // stored from the event loop
+};
+
+/* Reads the HESSID from an Interworking element; false if there is none */
+bool anqp_get_hessid(const u8 *ies, int ie_length, u8 *hessid);
+/* Sets the cache up ahead of the matches that fill it, unless caching is off */
+void anqp_cache_prepare(interface_info *iface);
+void anqp_cache_store(interface_info *iface, const mac_addr bssid, const u8 *hessid,
+        int network_id, const u8 *anqp, int anqp_len);
+
+#endif /* __WIFI_HAL_ANQP_CACHE_H__ */
@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "cpp_bindings.h"
+#include "capabilities.h"
+
+/*
+ * Everything the framework asks about the driver and firmware, read with one batch of
+ * requests after init (or when first asked following a driver restart) and answered
+ * from memory after that. Queries that failed are asked again by the next caller.
+ */
+
+static const char *capability_names[CAP_MAX] = {
+    "gscan", "feature set", "concurrency matrix", "rtt", "logger features", "apf",
+    "firmware version", "driver version",
+};
+
+/* Answers worth keeping: the value, or the driver saying it doesn't do that */
+static bool capability_known(int status)
+{
+    return status == WIFI_SUCCESS || status == -EOPNOTSUPP || status == WIFI_ERROR_NOT_SUPPORTED;
+}
+
+static bool capabilities_complete(const wifi_capabilities *caps)
+{
+    for (int i = 0; i < CAP_MAX; i++) {
+        if (!capability_known(caps->status[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static WifiCommand *new_capability_query(wifi_interface_handle handle, wifi_capabilities *caps,
+        int id)
+{
+    switch (id) {
+    case CAP_GSCAN:
+        return wifi_new_gscan_capabilities_query(handle, &caps->gscan);
+    case CAP_FEATURE_SET:
+        return wifi_new_feature_set_query(handle, &caps->features);
+    case CAP_CONCURRENCY_MATRIX:
+        return wifi_new_concurrency_matrix_query(handle, caps->concurrency,
+                &caps->num_concurrency, MAX_CONCURRENCY_SETS);
+    case CAP_RTT:
+        return wifi_new_rtt_capabilities_query(handle, &caps->rtt);
+    case CAP_LOGGER_FEATURES:
+        return wifi_new_logger_features_query(handle, &caps->logger_features);
+    case CAP_APF:
+        return wifi_new_apf_capabilities_query(handle, &caps->apf_version, &caps->apf_max_len);
+    case CAP_FIRMWARE_VERSION:
+        caps->firmware_version_len = sizeof(caps->firmware_version);
+        return wifi_new_version_query(handle, true, caps->firmware_version,
+                &caps->firmware_version_len);
+    case CAP_DRIVER_VERSION:
+        caps->driver_version_len = sizeof(caps->driver_version);
+        return wifi_new_version_query(handle, false, caps->driver_version,
+                &caps->driver_version_len);
+    }
+    return NULL;
+}
+
+/* Reads a new snapshot; with prev, only what it has no answer for is asked again */
+static wifi_capabilities *build_capabilities(wifi_interface_handle handle,
+        const wifi_capabilities *prev)
+{
+    wifi_capabilities *caps =
+            (wifi_capabilities *)wifi_hal_malloc(WIFI_ALLOC_CORE, sizeof(*caps));
+    if (caps == NULL) {
+        return NULL;
+    }
+    if (prev) {
+        memcpy(caps, prev, sizeof(*caps));
+    } else {
+        memset(caps, 0, sizeof(*caps));
+        for (int i = 0; i < CAP_MAX; i++) {
+            caps->status[i] = WIFI_ERROR_UNKNOWN;
+        }
+    }
+    caps->refs = 1;
+
+    WifiCommand *cmds[CAP_MAX];
+    int ids[CAP_MAX];
+    int status[CAP_MAX];
+    int num = 0;
+    int result = WIFI_SUCCESS;
+    for (int i = 0; i < CAP_MAX; i++) {
+        if (capability_known(caps->status[i])) {
+            continue;
+        }
+        ids[num] = i;
+        cmds[num] = new_capability_query(handle, caps, i);
+        if (cmds[num++] == NULL) {
+            result = WIFI_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    if (result == WIFI_SUCCESS) {
+        result = WifiCommand::requestBatch(getHalInfo(handle), cmds, status, num);
+    }
+    for (int i = 0; i < num; i++) {
+        if (cmds[i]) {
+            cmds[i]->releaseRef();
+        }
+    }
+    if (result != WIFI_SUCCESS) {
+        ALOGE("Could not read driver capabilities: %d", result);
+        wifi_hal_free(WIFI_ALLOC_CORE, caps);
+        return NULL;
+    }
+
+    for (int i = 0; i < num; i++) {
+        caps->status[ids[i]] = status[i];
+        if (status[i] != WIFI_SUCCESS) {
+            ALOGD("Driver capability %s not available: %d", capability_names[ids[i]],
+                    status[i]);
+        }
+    }
+
+    /* a version that didn't fit was not copied */
+    if (caps->status[CAP_FIRMWARE_VERSION] != WIFI_SUCCESS) {
+        caps->firmware_version_len = 0;
+    }
+    if (caps->status[CAP_DRIVER_VERSION] != WIFI_SUCCESS) {
+        caps->driver_version_len = 0;
+    }
+    caps->built_ms = wifi_get_monotonic_ms();
+    return caps;
+}
+
+wifi_capabilities *wifi_get_capabilities(wifi_interface_handle handle)
+{
+    hal_info *info = getHalInfo(handle);
+
+    pthread_mutex_lock(&info->caps_lock);
+    wifi_capabilities *caps = info->caps;
+    int generation = info->caps_generation;
+    if (caps) {
+        __sync_add_and_fetch(&caps->refs, 1);
+    }
+    pthread_mutex_unlock(&info->caps_lock);
+    if (caps && capabilities_complete(caps)) {
+        return caps;
+    }
+
+    /* read without the lock; a driver restart meanwhile means it is used once, not kept.
+     * Queries that failed are asked again, rather than their failure kept */
+    wifi_capabilities *built = build_capabilities(handle, caps);
+    if (built == NULL) {
+        return caps;                        /* what there was, if anything */
+    }
+
+    wifi_capabilities *old = NULL;
+    pthread_mutex_lock(&info->caps_lock);
+    if (info->caps && info->caps != caps) {
+        /* another caller got there first */
+        wifi_capabilities *current = info->caps;
+        __sync_add_and_fetch(&current->refs, 1);
+        pthread_mutex_unlock(&info->caps_lock);
+        wifi_put_capabilities(built);
+        wifi_put_capabilities(caps);
+        return current;
+    }
+    if (info->caps_generation == generation) {
+        __sync_add_and_fetch(&built->refs, 1);
+        old = info->caps;
+        info->caps = built;
+        ALOGI("Read driver capabilities; features = 0x%llx",
+                (unsigned long long)built->features);
+    }
+    pthread_mutex_unlock(&info->caps_lock);
+
+    wifi_put_capabilities(old);
+    wifi_put_capabilities(caps);
+    return built;
+}
+
+void wifi_put_capabilities(wifi_capabilities *caps)
+{
+    if (caps && __sync_sub_and_fetch(&caps->refs, 1) == 0) {
+        wifi_hal_free(WIFI_ALLOC_CORE, caps);
+    }
+}
+
+void wifi_invalidate_capabilities(hal_info *info, const char *reason)
+{
+    pthread_mutex_lock(&info->caps_lock);
+    wifi_capabilities *caps = info->caps;
+    info->caps = NULL;
+    info->caps_generation++;
+    pthread_mutex_unlock(&info->caps_lock);
+
+    if (caps) {
+        ALOGI("Dropping driver capabilities: %s", reason);
+        wifi_put_capabilities(caps);
+    }
+}
+
+void wifi_prefetch_capabilities(hal_info *info)
+{
+    /* the queries are per device; any station interface will do */
+    interface_info *iface = info->interfaces[0];
+    for (int i = 0; i < info->num_interfaces; i++) {
+        if (strncmp(info->interfaces[i]->name, "wlan", 4) == 0) {
+            iface = info->interfaces[i];
+            break;
+        }
+    }
+    wifi_put_capabilities(wifi_get_capabilities(getIfaceHandle(iface)));
+}
+
+/* Appends to the dump buffer, keeping count of what didn't fit */
+static void dump_printf(char *buffer, int size, int *pos, const char *fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+static void dump_printf(char *buffer, int size, int *pos, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer + min(*pos, size), size - min(*pos, size), fmt, args);
+    va_end(args);
+    if (n > 0) {
+        *pos += n;
+    }
+}
+
+wifi_error wifi_dump_capabilities(wifi_interface_handle handle, char *buffer, int buffer_size)
+{
+    if (buffer == NULL || buffer_size <= 0) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    wifi_capabilities *caps = wifi_get_capabilities(handle);
+    NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+
+    int pos = 0;
+    dump_printf(buffer, buffer_size, &pos, "read %llu ms ago\n",
+            (unsigned long long)(wifi_get_monotonic_ms() - caps->built_ms));
+    for (int i = 0; i < CAP_MAX; i++) {
+        if (caps->status[i] != WIFI_SUCCESS) {
+            dump_printf(buffer, buffer_size, &pos, "%s: error %d\n", capability_names[i],
+                    caps->status[i]);
+        }
+    }
+
+    const wifi_gscan_capabilities *gscan = &caps->gscan;
+    dump_printf(buffer, buffer_size, &pos, "gscan: cache %d buckets %d ap/scan %d "
+            "rssi samples %d threshold %d hotlist %d/%d sig change %d history %d "
+            "epno %d/%d whitelist %d\n", gscan->max_scan_cache_size,
+            gscan->max_scan_buckets, gscan->max_ap_cache_per_scan,
+            gscan->max_rssi_sample_size, gscan->max_scan_reporting_threshold,
+            gscan->max_hotlist_bssids, gscan->max_hotlist_ssids,
+            gscan->max_significant_wifi_change_aps, gscan->max_bssid_history_entries,
+            gscan->max_number_epno_networks, gscan->max_number_epno_networks_by_ssid,
+            gscan->max_number_of_white_listed_ssid);
+
+    dump_printf(buffer, buffer_size, &pos, "features: 0x%llx\nconcurrency:",
+            (unsigned long long)caps->features);
+    for (int i = 0; i < caps->num_concurrency; i++) {
+        dump_printf(buffer, buffer_size, &pos, " 0x%llx",
+                (unsigned long long)caps->concurrency[i]);
+    }
+
+    const wifi_rtt_capabilities *rtt = &caps->rtt;
+    dump_printf(buffer, buffer_size, &pos, "\nrtt: one sided %d ftm %d lci %d lcr %d "
+            "preamble 0x%x bw 0x%x responder %d mc %d\n", rtt->rtt_one_sided_supported,
+            rtt->rtt_ftm_supported, rtt->lci_support, rtt->lcr_support,
+            rtt->preamble_support, rtt->bw_support, rtt->responder_supported,
+            rtt->mc_version);
+
+    dump_printf(buffer, buffer_size, &pos, "logger features: 0x%x\napf: version %u max len %u\n",
+            caps->logger_features, caps->apf_version, caps->apf_max_len);
+    dump_printf(buffer, buffer_size, &pos, "firmware: %.*s\ndriver: %.*s\n",
+            (int)strnlen(caps->firmware_version, caps->firmware_version_len),
+            caps->firmware_version,
+            (int)strnlen(caps->driver_version, caps->driver_version_len),
+            caps->driver_version);
+
+    wifi_put_capabilities(caps);
+    return pos < buffer_size ? WIFI_SUCCESS : WIFI_ERROR_OUT_OF_MEMORY;
+}
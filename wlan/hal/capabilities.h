@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_CAPABILITIES_H__
+#define __WIFI_HAL_CAPABILITIES_H__
+
+#include "common.h"
+
+#define MAX_CONCURRENCY_SETS    16
+#define MAX_VERSION_LEN         256
+
+typedef enum {
+    CAP_GSCAN,
+    CAP_FEATURE_SET,
+    CAP_CONCURRENCY_MATRIX,
+    CAP_RTT,
+    CAP_LOGGER_FEATURES,
+    CAP_APF,
+    CAP_FIRMWARE_VERSION,
+    CAP_DRIVER_VERSION,
+    CAP_MAX
+} capability_id;
+
+/* What the driver reports about itself, read in one batch. Never changed once built;
+ * a driver restart, or asking again for what failed, replaces it with a new snapshot */
+struct wifi_capabilities {
+    int refs;                                       // the HAL's reference plus readers'
+    int status[CAP_MAX];                            // what each query returned
+    u64 built_ms;                                   // monotonic time it was read
+    wifi_gscan_capabilities gscan;
+    feature_set features;
+    feature_set concurrency[MAX_CONCURRENCY_SETS];
+    int num_concurrency;
+    wifi_rtt_capabilities rtt;
+    unsigned int logger_features;
+    u32 apf_version;
+    u32 apf_max_len;
+    char firmware_version[MAX_VERSION_LEN];         // as reported; not null terminated
+    int firmware_version_len;
+    char driver_version[MAX_VERSION_LEN];
+    int driver_version_len;
+};
+
+/* Returns a reference to the current snapshot, reading it from the driver first if
+ * there is none or a query failed; NULL if out of memory. Drop it with
+ * wifi_put_capabilities() */
+wifi_capabilities *wifi_get_capabilities(wifi_interface_handle iface);
+void wifi_put_capabilities(wifi_capabilities *caps);
+void wifi_prefetch_capabilities(hal_info *info);
+
+/* One query per subsystem, each filling its part of a snapshot */
+WifiCommand *wifi_new_gscan_capabilities_query(wifi_interface_handle iface,
+        wifi_gscan_capabilities *capabilities);
+WifiCommand *wifi_new_feature_set_query(wifi_interface_handle iface, feature_set *set);
+WifiCommand *wifi_new_concurrency_matrix_query(wifi_interface_handle iface,
+        feature_set set[], int *set_size, int set_size_max);
+WifiCommand *wifi_new_rtt_capabilities_query(wifi_interface_handle iface,
+        wifi_rtt_capabilities *capabilities);
+WifiCommand *wifi_new_logger_features_query(wifi_interface_handle iface, unsigned int *support);
+WifiCommand *wifi_new_apf_capabilities_query(wifi_interface_handle iface, u32 *version,
+        u32 *max_len);
+WifiCommand *wifi_new_version_query(wifi_interface_handle iface, bool firmware, char *buffer,
+        int *buffer_size);
+
+#endif /* __WIFI_HAL_CAPABILITIES_H__ */
@@ -176,6 +176,7 @@ wifi_error wifi_register_cmd(wifi_handle handle, int id, WifiCommand *cmd)
 
     wifi_error result = WIFI_ERROR_OUT_OF_MEMORY;
 
+    pthread_mutex_lock(&info->cb_lock);
     if (info->num_cmd < info->alloc_cmd) {
         info->cmd[info->num_cmd].id   = id;
         info->cmd[info->num_cmd].cmd  = cmd;
@@ -186,6 +187,7 @@ wifi_error wifi_register_cmd(wifi_handle handle, int id, WifiCommand *cmd)
         ALOGE("Failed to add command %d: %p at %d, reached max limit %d",
                 id, cmd, info->num_cmd, info->alloc_cmd);
     }
+    pthread_mutex_unlock(&info->cb_lock);
 
     return result;
 }
@@ -198,6 +200,7 @@ WifiCommand *wifi_unregister_cmd(wifi_handle handle, int id)
 
     WifiCommand *cmd = NULL;
 
+    pthread_mutex_lock(&info->cb_lock);
     for (int i = 0; i < info->num_cmd; i++) {
         if (info->cmd[i].id == id) {
             cmd = info->cmd[i].cmd;
@@ -207,6 +210,7 @@ WifiCommand *wifi_unregister_cmd(wifi_handle handle, int id)
             break;
         }
     }
+    pthread_mutex_unlock(&info->cb_lock);
 
     if (!cmd) {
         ALOGI("Failed to remove command %d: %p", id, cmd);
@@ -235,6 +239,7 @@ void wifi_unregister_cmd(wifi_handle handle, WifiCommand *cmd)
 {
     hal_info *info = (hal_info *)handle;
 
+    pthread_mutex_lock(&info->cb_lock);
     for (int i = 0; i < info->num_cmd; i++) {
         if (info->cmd[i].cmd == cmd) {
             int id = info->cmd[i].id;
@@ -244,6 +249,357 @@ void wifi_unregister_cmd(wifi_handle handle, WifiCommand *cmd)
             break;
         }
     }
+    pthread_mutex_unlock(&info->cb_lock);
+}
+
+wifi_error wifi_register_async_cmd(wifi_handle handle, WifiCommand *cmd,
+        wifi_async_handler func, void *arg, uint32_t *seq)
+{
+    hal_info *info = (hal_info *)handle;
+
+    pthread_mutex_lock(&info->cb_lock);
+
+    wifi_error result = WIFI_ERROR_OUT_OF_MEMORY;
+
+    if (info->num_async_cmd < info->alloc_async_cmd) {
+        *seq = nl_socket_use_seq(info->async_sock);
+        info->async_cmd[info->num_async_cmd].seq  = *seq;
+        info->async_cmd[info->num_async_cmd].cmd  = cmd;
+        info->async_cmd[info->num_async_cmd].func = func;
+        info->async_cmd[info->num_async_cmd].arg  = arg;
+        ALOGV("Successfully added async request %u: %p at %d", *seq, cmd, info->num_async_cmd);
+        info->num_async_cmd++;
+        result = WIFI_SUCCESS;
+    } else {
+        ALOGE("Failed to add async request of %p, reached max limit %d",
+                cmd, info->alloc_async_cmd);
+    }
+
+    pthread_mutex_unlock(&info->cb_lock);
+    return result;
+}
+
+bool wifi_unregister_async_cmd(wifi_handle handle, uint32_t seq, async_info *async)
+{
+    hal_info *info = (hal_info *)handle;
+    bool found = false;
+
+    pthread_mutex_lock(&info->cb_lock);
+
+    for (int i = 0; i < info->num_async_cmd; i++) {
+        if (info->async_cmd[i].seq == seq) {
+            *async = info->async_cmd[i];
+            memmove(&info->async_cmd[i], &info->async_cmd[i+1],
+                (info->num_async_cmd - i - 1) * sizeof(async_info));
+            info->num_async_cmd--;
+            ALOGV("Successfully removed async request %u: %p from %d", seq, async->cmd, i);
+            found = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&info->cb_lock);
+    return found;
+}
+
+/* returns the command with a reference held; caller must releaseRef() it */
+WifiCommand *wifi_get_async_cmd(wifi_handle handle, uint32_t seq)
+{
+    hal_info *info = (hal_info *)handle;
+    WifiCommand *cmd = NULL;
+
+    pthread_mutex_lock(&info->cb_lock);
+
+    for (int i = 0; i < info->num_async_cmd; i++) {
+        if (info->async_cmd[i].seq == seq) {
+            cmd = info->async_cmd[i].cmd;
+            cmd->addRef();
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&info->cb_lock);
+    return cmd;
+}
+
+/* requests sent without NLM_F_ACK are only remembered to name them in error reports */
+uint32_t wifi_register_noack_cmd(wifi_handle handle, const char *type)
+{
+    hal_info *info = (hal_info *)handle;
+
+    pthread_mutex_lock(&info->cb_lock);
+
+    uint32_t seq = nl_socket_use_seq(info->async_sock);
+    info->noack_cmd[info->next_noack_cmd].seq  = seq;
+    info->noack_cmd[info->next_noack_cmd].type = type;
+    info->next_noack_cmd = (info->next_noack_cmd + 1) % NOACK_HISTORY_SIZE;
+
+    pthread_mutex_unlock(&info->cb_lock);
+    return seq;
+}
+
+const char *wifi_get_noack_cmd(wifi_handle handle, uint32_t seq)
+{
+    hal_info *info = (hal_info *)handle;
+    const char *type = NULL;
+
+    pthread_mutex_lock(&info->cb_lock);
+
+    for (int i = 0; i < NOACK_HISTORY_SIZE; i++) {
+        if (info->noack_cmd[i].type != NULL && info->noack_cmd[i].seq == seq) {
+            type = info->noack_cmd[i].type;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&info->cb_lock);
+    return type;
+}
+
+static bool shadow_begin(shadow_state *shadow, const char *name, shadow_field field,
+        uint64_t value)
+{
+    pthread_mutex_lock(&shadow->lock);
+
+    /* let an earlier set of the same field land first, so the result is in order */
+    while (shadow->busy & (1 << field)) {
+        pthread_cond_wait(&shadow->idle, &shadow->lock);
+    }
+
+    if ((shadow->valid & (1 << field)) && shadow->value[field] == value) {
+        shadow->suppressed++;
+        ALOGV("%s: skipping set of field %d, already applied (%u skipped)",
+                name, field, shadow->suppressed);
+        pthread_mutex_unlock(&shadow->lock);
+        return true;
+    }
+
+    shadow->busy |= (1 << field);
+    shadow->begun[field] = shadow->generation;
+    pthread_mutex_unlock(&shadow->lock);
+    return false;
+}
+
+static void shadow_end(shadow_state *shadow, shadow_field field, uint64_t value, int result)
+{
+    pthread_mutex_lock(&shadow->lock);
+
+    /* an invalidation while the set was in flight may have undone it */
+    if (result == WIFI_SUCCESS && shadow->begun[field] == shadow->generation) {
+        shadow->value[field] = value;
+        shadow->valid |= (1 << field);
+    } else {
+        /* the driver may have applied part of it */
+        shadow->valid &= ~(1 << field);
+    }
+
+    shadow->busy &= ~(1 << field);
+    pthread_cond_broadcast(&shadow->idle);
+    pthread_mutex_unlock(&shadow->lock);
+}
+
+static void shadow_invalidate(shadow_state *shadow)
+{
+    pthread_mutex_lock(&shadow->lock);
+    shadow->valid = 0;
+    shadow->generation++;
+    pthread_mutex_unlock(&shadow->lock);
+}
+
+bool wifi_shadow_begin(interface_info *iface, shadow_field field, uint64_t value)
+{
+    return shadow_begin(&iface->shadow, iface->name, field, value);
+}
+
+void wifi_shadow_end(interface_info *iface, shadow_field field, uint64_t value, int result)
+{
+    shadow_end(&iface->shadow, field, value, result);
+}
+
+bool wifi_wiphy_shadow_begin(hal_info *info, shadow_field field, uint64_t value)
+{
+    return shadow_begin(&info->shadow, "wiphy", field, value);
+}
+
+void wifi_wiphy_shadow_end(hal_info *info, shadow_field field, uint64_t value, int result)
+{
+    shadow_end(&info->shadow, field, value, result);
+}
+
+void wifi_shadow_invalidate(interface_info *iface)
+{
+    shadow_invalidate(&iface->shadow);
+}
+
+void wifi_wiphy_shadow_invalidate(hal_info *info)
+{
+    shadow_invalidate(&info->shadow);
+}
+
+void wifi_shadow_invalidate_all(hal_info *info)
+{
+    wifi_wiphy_shadow_invalidate(info);
+    for (int i = 0; i < info->num_interfaces; i++) {
+        wifi_shadow_invalidate(info->interfaces[i]);
+    }
+}
+
+/* FNV-1a, to reduce blobs such as APF programs to a shadow value */
+uint64_t wifi_shadow_hash(const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+u64 wifi_get_monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint32_t wifi_get_suppressed_cmd_count(wifi_interface_handle iface)
+{
+    interface_info *info = getIfaceInfo(iface);
+    hal_info *hal = getHalInfo(info->handle);
+    return info->shadow.suppressed + hal->shadow.suppressed;
+}
+
+static wifi_alloc_stats alloc_stats[WIFI_ALLOC_MAX];
+static __thread int alloc_dispatch_depth;           // > 0 while the event loop dispatches
+#ifdef WIFI_HAL_STRICT_ALLOC
+static bool alloc_strict = true;
+#else
+static bool alloc_strict = false;
+#endif
+
+void *wifi_hal_malloc(wifi_alloc_subsys subsys, size_t size)
+{
+    wifi_alloc_stats *stats = &alloc_stats[subsys];
+
+    __sync_add_and_fetch(&stats->allocs, 1);
+    __sync_add_and_fetch(&stats->bytes, size);
+    if (alloc_dispatch_depth > 0) {
+        __sync_add_and_fetch(&stats->dispatch_allocs, 1);
+        LOG_ALWAYS_FATAL_IF(alloc_strict, "allocated %zu bytes (subsystem %d) while "
+                "handling an event", size, subsys);
+    }
+    return malloc(size);
+}
+
+void wifi_hal_free(wifi_alloc_subsys subsys, void *ptr)
+{
+    if (ptr) {
+        __sync_add_and_fetch(&alloc_stats[subsys].frees, 1);
+        free(ptr);
+    }
+}
+
+void wifi_get_alloc_stats(wifi_alloc_subsys subsys, wifi_alloc_stats *stats)
+{
+    stats->allocs = __sync_fetch_and_add(&alloc_stats[subsys].allocs, 0);
+    stats->frees = __sync_fetch_and_add(&alloc_stats[subsys].frees, 0);
+    stats->bytes = __sync_fetch_and_add(&alloc_stats[subsys].bytes, 0);
+    stats->dispatch_allocs = __sync_fetch_and_add(&alloc_stats[subsys].dispatch_allocs, 0);
+}
+
+void wifi_alloc_dispatch_begin()
+{
+    alloc_dispatch_depth++;
+}
+
+void wifi_alloc_dispatch_end()
+{
+    alloc_dispatch_depth--;
+}
+
+void wifi_alloc_set_strict(bool strict)
+{
+    alloc_strict = strict;
+}
+
+bool wifi_alloc_restricted()
+{
+    return alloc_strict && alloc_dispatch_depth > 0;
+}
+
+static wifi_arena_chunk *wifi_arena_add_chunk(wifi_arena *arena, size_t size)
+{
+    size = max(size, (size_t)ARENA_CHUNK_SIZE);
+    wifi_arena_chunk *chunk = (wifi_arena_chunk *)wifi_hal_malloc(arena->subsys,
+            sizeof(wifi_arena_chunk) + size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    wifi_arena_chunk **tail = &arena->head;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = chunk;
+    return chunk;
+}
+
+int wifi_arena_init(wifi_arena *arena, wifi_alloc_subsys subsys, size_t reserve)
+{
+    arena->subsys = subsys;
+    arena->head = NULL;
+    arena->cur = wifi_arena_add_chunk(arena, reserve);
+    return arena->cur ? WIFI_SUCCESS : WIFI_ERROR_OUT_OF_MEMORY;
+}
+
+void *wifi_arena_alloc(wifi_arena *arena, size_t size)
+{
+    size = (size + 7) & ~(size_t)7;
+
+    wifi_arena_chunk *chunk = arena->cur;
+    while (chunk != NULL && chunk->used + size > chunk->size) {
+        chunk = chunk->next;
+    }
+    if (chunk == NULL) {
+        if (wifi_alloc_restricted()) {
+            return NULL;
+        }
+        chunk = wifi_arena_add_chunk(arena, size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+
+    arena->cur = chunk;
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void wifi_arena_reset(wifi_arena *arena)
+{
+    for (wifi_arena_chunk *chunk = arena->head; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->cur = arena->head;
+}
+
+void wifi_arena_free(wifi_arena *arena)
+{
+    wifi_arena_chunk *chunk = arena->head;
+    while (chunk != NULL) {
+        wifi_arena_chunk *next = chunk->next;
+        wifi_hal_free(arena->subsys, chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->cur = NULL;
 }
 
 wifi_error wifi_cancel_cmd(wifi_request_id id, wifi_interface_handle iface)
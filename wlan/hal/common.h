@@ -17,6 +17,7 @@
  */
 
 #include "wifi_hal.h"
+#include "wifi_hal_ext.h"
 
 #ifndef __WIFI_HAL_COMMON_H__
 #define __WIFI_HAL_COMMON_H__
@@ -31,6 +32,13 @@
 #define RECV_BUF_SIZE           (4096)
 #define DEFAULT_EVENT_CB_SIZE   (64)
 #define DEFAULT_CMD_SIZE        (64)
+#define DEFAULT_ASYNC_CMD_SIZE  (16)
+#define MAX_CMD_SOCKS           (4)
+#define NOACK_HISTORY_SIZE      (16)
+#define EVENT_BUF_SIZE          (16384)
+#define CMD_REPLY_BUF_SIZE      (32768)     /* largest reply a command socket takes */
+#define ARENA_CHUNK_SIZE        (4096)
+#define FULL_SCAN_BATCH_RESERVE (32768)
 #define DOT11_OUI_LEN             3
 #define DOT11_MAX_SSID_LEN        32
 
@@ -128,6 +136,7 @@ typedef enum {
     GSCAN_SUBCMD_ANQPO_CONFIG,                          /* 0x1015 */
     WIFI_SUBCMD_SET_RSSI_MONITOR,                       /* 0x1016 */
     WIFI_SUBCMD_CONFIG_ND_OFFLOAD,                      /* 0x1017 */
+    GSCAN_SUBCMD_SET_SCAN_FILTER,                       /* 0x1018 */
     /* Add more sub commands here */
 
     GSCAN_SUBCMD_MAX,
@@ -170,16 +179,177 @@ typedef struct {
     WifiCommand *cmd;
 } cmd_info;
 
+/* continuation invoked on the event loop thread once an async request is acked */
+typedef void (*wifi_async_handler)(WifiCommand *cmd, int result, void *arg);
+
+typedef struct {
+    uint32_t seq;                                   // netlink sequence number of the request
+    WifiCommand *cmd;                               // command that issued the request
+    wifi_async_handler func;                        // continuation to run on completion
+    void *arg;                                      // argument passed to the continuation
+} async_info;
+
+typedef struct {
+    uint32_t seq;                                   // netlink sequence number of the request
+    const char *type;                               // type of the command that sent it
+} noack_info;
+
+typedef struct {
+    struct nl_sock *sock;                           // command socket object
+    struct nl_cb *cb;                               // callbacks, reused by every request
+    bool in_use;                                    // leased by a request
+} cmd_sock_info;
+
+#define MAX_CACHED_CHANNELS     64
+#define NUM_CHANNEL_BANDS       8                   // wifi_band values
+
+typedef struct {
+    bool valid;
+    int num;
+    wifi_channel channels[MAX_CACHED_CHANNELS];
+    u8 flags[MAX_CACHED_CHANNELS];                  // WIFI_CHANNEL_FLAG_
+} channel_list;
+
+/* Valid channels by band, fetched once per regulatory state */
+typedef struct {
+    u32 generation;                                 // bumped by every invalidation
+    channel_list bands[NUM_CHANNEL_BANDS];
+    bool have_flags;                                // freqs/freq_flags are filled in
+    int num_freqs;
+    wifi_channel freqs[MAX_CACHED_CHANNELS];        // usable frequencies of the wiphy
+    u8 freq_flags[MAX_CACHED_CHANNELS];
+    wifi_channel_cache_stats stats;
+} channel_cache;
+
+/* Configuration last applied to the driver; sets that would change nothing are skipped */
+typedef enum {
+    SHADOW_COUNTRY_CODE,                            // wiphy-wide; kept in hal_info's shadow
+    SHADOW_NODFS,
+    SHADOW_PNO_OUI,
+    SHADOW_ND_OFFLOAD,
+    SHADOW_APF_PROGRAM,
+    SHADOW_RSSI_MONITOR,
+    SHADOW_SCAN_FILTER,
+    SHADOW_MAX
+} shadow_field;
+
+typedef struct {
+    uint64_t value[SHADOW_MAX];                     // last value applied, reduced to a key
+    uint32_t valid;                                 // bit per field whose value is in effect
+    uint32_t busy;                                  // bit per field with a set in flight
+    uint32_t generation;                            // bumped by every invalidation
+    uint32_t begun[SHADOW_MAX];                     // generation each set in flight started in
+    uint32_t suppressed;                            // number of sets skipped
+    pthread_mutex_t lock;                           // protects the above; never held across
+                                                    // a driver request
+    pthread_cond_t idle;                            // signalled as sets finish
+} shadow_state;
+
+/* Allocations made through wifi_hal_malloc() are counted per subsystem */
+typedef enum {
+    WIFI_ALLOC_CORE,
+    WIFI_ALLOC_GSCAN,
+    WIFI_ALLOC_RTT,
+    WIFI_ALLOC_LOGGER,
+    WIFI_ALLOC_MAX
+} wifi_alloc_subsys;
+
+typedef struct {
+    uint32_t allocs;                                // number of allocations
+    uint32_t frees;                                 // number of frees
+    uint64_t bytes;                                 // bytes allocated in total
+    uint32_t dispatch_allocs;                       // allocations made while handling events
+} wifi_alloc_stats;
+
+/* Bump allocator; reset() rewinds it but keeps its chunks for reuse */
+typedef struct wifi_arena_chunk {
+    struct wifi_arena_chunk *next;
+    size_t size;                                    // usable bytes in data[]
+    size_t used;                                    // bytes handed out since the last reset
+    u8 data[0] __attribute__((aligned(8)));
+} wifi_arena_chunk;
+
+typedef struct {
+    wifi_alloc_subsys subsys;                       // subsystem the chunks are counted against
+    wifi_arena_chunk *head;                         // all chunks, oldest first
+    wifi_arena_chunk *cur;                          // chunk allocations are made from
+} wifi_arena;
+
+struct scan_cache;
+struct scan_history;
+struct scan_export;
+struct scan_filter_table;
+struct warm_start;
+struct anqp_cache;
+struct wifi_capabilities;
+struct gscan_mux;
+
+/* Full scan results buffered for one batch callback */
+typedef struct {
+    wifi_full_scan_batch_params params;
+    wifi_full_scan_batch_handler handler;
+    wifi_arena arena;                               // holds the buffered results
+    wifi_scan_result *results[MAX_FULL_SCAN_BATCH];
+    unsigned buckets[MAX_FULL_SCAN_BATCH];
+    wifi_request_id ids[MAX_FULL_SCAN_BATCH];       // request each result is for
+    wifi_scan_result *group[MAX_FULL_SCAN_BATCH];   // one request's share, as delivered
+    unsigned group_buckets[MAX_FULL_SCAN_BATCH];
+    int num_results;
+    int bytes;
+    u64 first_ms;                                   // arrival of the oldest buffered result
+    bool delivering;                                // results are out with the handler
+    bool retired;                                   // replaced while delivering; freed after
+} full_scan_batch;
+
 typedef struct {
     wifi_handle handle;                             // handle to wifi data
     char name[IFNAMSIZ+1];                          // interface name + trailing null
     int  id;                                        // id to use when talking to driver
+    shadow_state shadow;                            // driver configuration mirror
+    wifi_scan_result *full_scan_buf;                // full scan results are decoded here
+    full_scan_batch *batch;                         // set while full scan batching is on
+    wifi_full_scan_batch_stats batch_stats;         // kept across enable/disable
+    pthread_mutex_t batch_lock;                     // protects batch and batch_stats
+    struct scan_cache *scan_cache;                  // set while the scan cache is on
+    pthread_mutex_t scan_cache_lock;                // protects scan_cache
+    struct scan_history *scan_history;              // set while the scan history is on
+    pthread_mutex_t scan_history_lock;              // protects scan_history
+    struct scan_export *scan_export;                // set while results are being exported
+    pthread_mutex_t scan_export_lock;               // protects scan_export
+    struct scan_filter_table *scan_filters;         // full scan result filters, once one is set
+    pthread_mutex_t scan_filter_lock;               // protects scan_filters
+    pthread_mutex_t scan_filter_push_lock;          // one firmware filter refresh at a time
+    struct warm_start *warm_start;                  // recent results kept across restarts
+    pthread_mutex_t warm_start_lock;                // protects warm_start
+    WifiCommand *sig_change;                        // host significant change, if running
+    pthread_mutex_t sig_change_lock;                // protects sig_change
+    WifiCommand *epno;                              // ePNO with host matching, if running
+    pthread_mutex_t epno_lock;                      // protects epno
+    struct anqp_cache *anqp_cache;                  // recent ANQP responses
+    bool anqp_cache_off;                            // caching turned off by the framework
+    pthread_mutex_t anqp_cache_lock;                // protects anqp_cache
+    struct gscan_mux *gscan_mux;                    // background scan sessions, if any
+    bool scan_planner;                              // rewrite schedules before they run
+    wifi_scan_plan_stats scan_plan_stats;
+    pthread_mutex_t gscan_mux_lock;                 // protects gscan_mux and the planner
+    pthread_mutex_t gscan_apply_lock;               // one schedule change at a time; held
+                                                    // while the driver is told of it
 } interface_info;
 
 typedef struct {
 
     struct nl_sock *cmd_sock;                       // command socket object
     struct nl_sock *event_sock;                     // event socket object
+    struct nl_sock *async_sock;                     // socket for non-blocking requests
+    struct nl_msg *event_msg;                       // events are received straight into this
+    int event_msg_size;                             // bytes event_msg can hold
+
+    cmd_sock_info cmd_socks[MAX_CMD_SOCKS];         // pool of command sockets; [0] is cmd_sock
+    int num_cmd_socks;                              // number of command sockets created
+    int cmd_socks_in_use;                           // number of command sockets leased
+    int max_cmd_socks_in_use;                       // highest concurrency seen so far
+    pthread_mutex_t cmd_sock_lock;                  // protects the command socket pool
+    pthread_cond_t cmd_sock_cond;                   // signalled when a socket is returned
     int nl80211_family_id;                          // family id for 80211 driver
     int cleanup_socks[2];                           // sockets used to implement wifi_cleanup
 
@@ -198,6 +368,22 @@ typedef struct {
     int num_cmd;                                    // number of commands
     int alloc_cmd;                                  // number of commands allocated
 
+    async_info *async_cmd;                          // Outstanding async requests
+    int num_async_cmd;                              // number of async requests
+    int alloc_async_cmd;                            // number of async requests allocated
+
+    noack_info noack_cmd[NOACK_HISTORY_SIZE];       // recent requests sent without ack
+    int next_noack_cmd;                             // next slot to use in noack_cmd
+
+    shadow_state shadow;                            // wiphy-wide configuration mirror
+    WifiCommand *driver_monitor;                    // resets driver state on iface changes
+    bool scan_dump_unsupported;                     // driver rejected dumping cached results
+    channel_cache channels;                         // answers wifi_get_valid_channels
+    pthread_mutex_t channel_lock;                   // protects channels
+    struct wifi_capabilities *caps;                 // driver capabilities; see capabilities.h
+    int caps_generation;                            // bumped each time caps is dropped
+    pthread_mutex_t caps_lock;                      // protects caps and caps_generation
+
     interface_info **interfaces;                    // array of interfaces
     int num_interfaces;                             // number of interfaces
 
@@ -246,9 +432,79 @@ void wifi_unregister_vendor_handler(wifi_handle handle, uint32_t id, int subcmd)
 
 wifi_error wifi_register_cmd(wifi_handle handle, int id, WifiCommand *cmd);
 WifiCommand *wifi_unregister_cmd(wifi_handle handle, int id);
+/* call with cb_lock held, and take a reference before dropping it, to use the command */
 WifiCommand *wifi_get_cmd(wifi_handle handle, int id);
 void wifi_unregister_cmd(wifi_handle handle, WifiCommand *cmd);
 
+wifi_error wifi_register_async_cmd(wifi_handle handle, WifiCommand *cmd,
+            wifi_async_handler func, void *arg, uint32_t *seq);
+bool wifi_unregister_async_cmd(wifi_handle handle, uint32_t seq, async_info *async);
+WifiCommand *wifi_get_async_cmd(wifi_handle handle, uint32_t seq);
+
+uint32_t wifi_register_noack_cmd(wifi_handle handle, const char *type);
+const char *wifi_get_noack_cmd(wifi_handle handle, uint32_t seq);
+
+/* returns true (and counts it) if value is already in effect; otherwise the caller
+ * must apply it and then call wifi_shadow_end(). Sets of one field are applied one at
+ * a time; other fields and invalidation go ahead meanwhile */
+bool wifi_shadow_begin(interface_info *iface, shadow_field field, uint64_t value);
+void wifi_shadow_end(interface_info *iface, shadow_field field, uint64_t value, int result);
+void wifi_shadow_invalidate(interface_info *iface);
+/* the same for wiphy-wide settings, which all interfaces share */
+bool wifi_wiphy_shadow_begin(hal_info *info, shadow_field field, uint64_t value);
+void wifi_wiphy_shadow_end(hal_info *info, shadow_field field, uint64_t value, int result);
+void wifi_wiphy_shadow_invalidate(hal_info *info);
+void wifi_shadow_invalidate_all(hal_info *info);
+uint64_t wifi_shadow_hash(const void *data, size_t len);
+u64 wifi_get_monotonic_ms();
+void wifi_invalidate_channel_cache(hal_info *info, const char *reason);
+/* The wifi_band bit a channel falls in; DFS as the flags last read from the driver say */
+u32 wifi_channel_band(hal_info *info, wifi_channel channel);
+
+static inline bool wifi_is_5ghz(wifi_channel channel)
+{
+    return channel >= 4900;
+}
+void wifi_invalidate_capabilities(hal_info *info, const char *reason);
+
+/* Hash for BSSID keyed tables; mask the result with a power of two table size */
+static inline unsigned wifi_bssid_hash(const u8 *bssid)
+{
+    u32 h = ((u32)bssid[2] << 24) | (bssid[3] << 16) | (bssid[4] << 8) | bssid[5];
+    h ^= ((bssid[0] << 8) | bssid[1]) * 0x9e3779b1U;
+
+    /* murmur3 finalizer, so every address bit reaches the low bits callers keep */
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+uint32_t wifi_get_suppressed_cmd_count(wifi_interface_handle iface);
+
+cmd_sock_info *wifi_lease_cmd_sock(hal_info *info);
+void wifi_release_cmd_sock(hal_info *info, cmd_sock_info *sock);
+
+void *wifi_hal_malloc(wifi_alloc_subsys subsys, size_t size);
+void wifi_hal_free(wifi_alloc_subsys subsys, void *ptr);
+void wifi_get_alloc_stats(wifi_alloc_subsys subsys, wifi_alloc_stats *stats);
+
+/* Brackets event dispatch on the event loop thread. In strict mode (the default with
+ * WIFI_HAL_STRICT_ALLOC) any counted allocation made in between is fatal */
+void wifi_alloc_dispatch_begin();
+void wifi_alloc_dispatch_end();
+void wifi_alloc_set_strict(bool strict);
+/* True where a counted allocation would be fatal; callers fall back to what they reserved */
+bool wifi_alloc_restricted();
+
+/* Arenas only grow outside restricted dispatch; there they return NULL once the reserve
+ * is used up */
+int wifi_arena_init(wifi_arena *arena, wifi_alloc_subsys subsys, size_t reserve);
+void *wifi_arena_alloc(wifi_arena *arena, size_t size);
+void wifi_arena_reset(wifi_arena *arena);
+void wifi_arena_free(wifi_arena *arena);
+
 interface_info *getIfaceInfo(wifi_interface_handle);
 wifi_handle getWifiHandle(wifi_interface_handle handle);
 hal_info *getHalInfo(wifi_handle handle);
@@ -17,6 +17,7 @@
  */
 
 #include <stdint.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netlink/genl/genl.h>
@@ -39,6 +40,16 @@
 #include "common.h"
 #include "cpp_bindings.h"
 
+/* extended ack definitions, for kernel headers that predate them */
+#ifndef NLM_F_CAPPED
+#define NLM_F_CAPPED            0x100
+#endif
+#ifndef NLM_F_ACK_TLVS
+#define NLM_F_ACK_TLVS          0x200
+#define NLMSGERR_ATTR_MSG       1
+#define NLMSGERR_ATTR_MAX       3
+#endif
+
 void appendFmt(char *buf, int &offset, const char *fmt, ...)
 {
     va_list params;
@@ -592,6 +603,129 @@ int WifiRequest::create(uint32_t id, int subcmd) {
 }
 
 
+int WifiRequest::put_external(int attribute, const void *ptr, unsigned len) {
+    /* nla_len is 16 bits, for the attribute and for every nest around it */
+    if (len > 0xffff - NLA_HDRLEN) {
+        return -EMSGSIZE;
+    }
+    for (int i = 0; i < mNumNests; i++) {
+        unsigned nest_len = (u8 *)nlmsg_tail(nlmsg_hdr(mMsg)) - (u8 *)mNests[i] +
+                mExternalLen - mNestExternalLen[i] + NLA_HDRLEN + NLA_ALIGN(len);
+        if (nest_len > 0xffff) {
+            return -EMSGSIZE;
+        }
+    }
+
+    if (mNumExternal == WIFI_REQUEST_MAX_EXTERNAL) {
+        /* out of slots; fall back to copying */
+        return nla_put(mMsg, attribute, len, ptr);
+    }
+
+    /* only the attribute header goes into the message; it already covers the payload */
+    struct nlattr *attr = (struct nlattr *)nlmsg_reserve(mMsg, NLA_HDRLEN, NLA_ALIGNTO);
+    if (attr == NULL) {
+        return -NLE_NOMEM;
+    }
+    attr->nla_type = attribute;
+    attr->nla_len = NLA_HDRLEN + len;
+
+    ExternalData *ext = &mExternal[mNumExternal++];
+    ext->offset = nlmsg_hdr(mMsg)->nlmsg_len;
+    ext->data = ptr;
+    ext->len = len;
+    mExternalLen += NLA_ALIGN(len);
+    return 0;
+}
+
+struct nlattr * WifiRequest::attr_start(int attribute) {
+    struct nlattr *attr = nla_nest_start(mMsg, attribute);
+    if (attr != NULL && mNumNests < WIFI_REQUEST_MAX_NESTING) {
+        mNests[mNumNests] = attr;
+        mNestExternalLen[mNumNests] = mExternalLen;
+        mNumNests++;
+    }
+    return attr;
+}
+
+void WifiRequest::attr_end(struct nlattr *attr) {
+    nla_nest_end(mMsg, attr);
+
+    /* nests are closed innermost first; count external payloads added inside this one */
+    if (mNumNests > 0 && mNests[mNumNests - 1] == attr) {
+        mNumNests--;
+        attr->nla_len += mExternalLen - mNestExternalLen[mNumNests];
+    }
+}
+
+int WifiRequest::send(struct nl_sock *sock) {
+    if (mNumExternal == 0) {
+        return nl_send(sock, mMsg);
+    }
+
+    static const uint8_t padding[NLA_ALIGNTO] = { 0 };
+    struct iovec iov[3 * WIFI_REQUEST_MAX_EXTERNAL + 1];
+    struct nlmsghdr *hdr = nlmsg_hdr(mMsg);
+    unsigned msg_len = hdr->nlmsg_len;
+    unsigned pos = 0;
+    int n = 0;
+
+    for (int i = 0; i < mNumExternal; i++) {
+        ExternalData *ext = &mExternal[i];
+        if (ext->offset > pos) {
+            iov[n].iov_base = (char *)hdr + pos;
+            iov[n].iov_len = ext->offset - pos;
+            n++;
+        }
+        iov[n].iov_base = (void *)ext->data;
+        iov[n].iov_len = ext->len;
+        n++;
+        if (NLA_ALIGN(ext->len) != ext->len) {
+            iov[n].iov_base = (void *)padding;
+            iov[n].iov_len = NLA_ALIGN(ext->len) - ext->len;
+            n++;
+        }
+        pos = ext->offset;
+    }
+    if (msg_len > pos) {
+        iov[n].iov_base = (char *)hdr + pos;
+        iov[n].iov_len = msg_len - pos;
+        n++;
+    }
+
+    /* the header has to describe the message as the kernel will see it */
+    hdr->nlmsg_len = msg_len + mExternalLen;
+    int err = nl_send_iovec(sock, mMsg, iov, n);
+    hdr->nlmsg_len = msg_len;
+    return err;
+}
+
+
+/* With NETLINK_EXT_ACK the kernel may attach a message explaining an error */
+static const char *get_ext_ack_msg(struct nlmsgerr *err)
+{
+    struct nlmsghdr *hdr = (struct nlmsghdr *)((char *)err - NLMSG_HDRLEN);
+    if (!(hdr->nlmsg_flags & NLM_F_ACK_TLVS)) {
+        return NULL;
+    }
+
+    /* TLVs follow the echoed request, which is only its header with NETLINK_CAP_ACK */
+    unsigned ack_len = NLMSG_HDRLEN + sizeof(*err);
+    if (!(hdr->nlmsg_flags & NLM_F_CAPPED)) {
+        ack_len += err->msg.nlmsg_len - NLMSG_HDRLEN;
+    }
+    if (hdr->nlmsg_len <= ack_len) {
+        return NULL;
+    }
+
+    struct nlattr *tb[NLMSGERR_ATTR_MAX + 1];
+    if (nla_parse(tb, NLMSGERR_ATTR_MAX, (struct nlattr *)((char *)hdr + ack_len),
+            hdr->nlmsg_len - ack_len, NULL) < 0 || tb[NLMSGERR_ATTR_MSG] == NULL) {
+        return NULL;
+    }
+
+    return (const char *)nla_data(tb[NLMSGERR_ATTR_MSG]);
+}
+
 static int no_seq_check(struct nl_msg *msg, void *arg)
 {
 	return NL_OK;
@@ -609,37 +743,232 @@ int WifiCommand::requestResponse() {
 int WifiCommand::requestResponse(WifiRequest& request) {
     int err = 0;
 
-    struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
-    if (!cb)
-        goto out;
+    /* each concurrent request gets its own socket, so acks can't cross */
+    cmd_sock_info *sock = wifi_lease_cmd_sock(mInfo);
+    if (sock == NULL)
+        return WIFI_ERROR_OUT_OF_MEMORY;
 
-    err = nl_send_auto_complete(mInfo->cmd_sock, request.getMessage());    /* send message */
+    nl_complete_msg(sock->sock, request.getMessage());
+    err = request.send(sock->sock);     /* send message */
     if (err < 0)
         goto out;
 
     err = 1;
 
-    nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
-    nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &err);
-    nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
-    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
-    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, response_handler, this);
+    nl_cb_set(sock->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+    nl_cb_err(sock->cb, NL_CB_CUSTOM, error_handler, &err);
+    nl_cb_set(sock->cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
+    nl_cb_set(sock->cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
+    nl_cb_set(sock->cb, NL_CB_VALID, NL_CB_CUSTOM, response_handler, this);
 
     while (err > 0) {                   /* wait for reply */
-        int res = nl_recvmsgs(mInfo->cmd_sock, cb);
+        int res = nl_recvmsgs(sock->sock, sock->cb);
+        if (res) {
+            ALOGE("nl80211: %s->nl_recvmsgs failed: %d", __func__, res);
+        }
+    }
+out:
+    wifi_release_cmd_sock(mInfo, sock);
+    return err;
+}
+
+/* per-request state for dump_handler() */
+struct dump_info {
+    WifiCommand *cmd;
+    int parts;                          // parts handed to handleResponse()
+    bool stopped;                       // handler returned NL_STOP; drain the rest
+};
+
+int WifiCommand::requestDump() {
+    int err = create();                 /* create the message */
+    if (err < 0) {
+        return err;
+    }
+
+    return requestDump(mMsg);
+}
+
+int WifiCommand::requestDump(WifiRequest& request) {
+    struct nl_msg *msg = request.getMessage();
+    if (msg == NULL)
+        return WIFI_ERROR_INVALID_ARGS;
+
+    cmd_sock_info *sock = wifi_lease_cmd_sock(mInfo);
+    if (sock == NULL)
+        return WIFI_ERROR_OUT_OF_MEMORY;
+
+    dump_info dump = { this, 0, false };
+
+    nlmsg_hdr(msg)->nlmsg_flags |= NLM_F_DUMP;
+    nl_complete_msg(sock->sock, msg);
+    int err = request.send(sock->sock);     /* send message */
+    if (err < 0)
+        goto out;
+
+    err = 1;
+
+    nl_cb_set(sock->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+    nl_cb_err(sock->cb, NL_CB_CUSTOM, error_handler, &err);
+    nl_cb_set(sock->cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
+    nl_cb_set(sock->cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
+    nl_cb_set(sock->cb, NL_CB_VALID, NL_CB_CUSTOM, dump_handler, &dump);
+
+    /* the dump ends with NLMSG_DONE, however many parts it has */
+    while (err > 0) {
+        int res = nl_recvmsgs(sock->sock, sock->cb);
         if (res) {
             ALOGE("nl80211: %s->nl_recvmsgs failed: %d", __func__, res);
         }
     }
+
+    ALOGV("%s: dump finished after %d parts, err = %d", getType(), dump.parts, err);
 out:
-    nl_cb_put(cb);
+    wifi_release_cmd_sock(mInfo, sock);
     return err;
 }
 
+/* per-request state for the batch_*_handler()s */
+struct batch_info {
+    WifiCommand **cmds;
+    int *results;                       // > 0 while a request is waiting for its ack
+    uint32_t seqs[WIFI_MAX_BATCH];
+    int num;
+    int pending;                        // requests still waiting
+};
+
+static int find_batch_request(batch_info *batch, uint32_t seq) {
+    for (int i = 0; i < batch->num; i++) {
+        if (batch->results[i] > 0 && batch->seqs[i] == seq) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int WifiCommand::requestBatch(hal_info *info, WifiCommand *cmds[], int results[], int num) {
+    if (num > WIFI_MAX_BATCH)
+        return WIFI_ERROR_INVALID_ARGS;
+
+    cmd_sock_info *sock = wifi_lease_cmd_sock(info);
+    if (sock == NULL)
+        return WIFI_ERROR_OUT_OF_MEMORY;
+
+    batch_info batch = { cmds, results, { 0 }, num, 0 };
+
+    /* the kernel handles each request as it is sent and queues the replies in order */
+    for (int i = 0; i < num; i++) {
+        results[i] = cmds[i]->create();
+        if (results[i] < 0)
+            continue;
+
+        struct nl_msg *msg = cmds[i]->mMsg.getMessage();
+        nl_complete_msg(sock->sock, msg);
+        batch.seqs[i] = nlmsg_hdr(msg)->nlmsg_seq;
+        results[i] = cmds[i]->mMsg.send(sock->sock);
+        if (results[i] < 0) {
+            ALOGE("Failed to send %s; err = %d", cmds[i]->getType(), results[i]);
+            continue;
+        }
+        results[i] = 1;
+        batch.pending++;
+    }
+
+    nl_cb_set(sock->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+    nl_cb_err(sock->cb, NL_CB_CUSTOM, batch_error_handler, &batch);
+    nl_cb_set(sock->cb, NL_CB_FINISH, NL_CB_CUSTOM, batch_ack_handler, &batch);
+    nl_cb_set(sock->cb, NL_CB_ACK, NL_CB_CUSTOM, batch_ack_handler, &batch);
+    nl_cb_set(sock->cb, NL_CB_VALID, NL_CB_CUSTOM, batch_response_handler, &batch);
+
+    while (batch.pending > 0) {         /* wait for all the replies */
+        int res = nl_recvmsgs(sock->sock, sock->cb);
+        if (res < 0) {
+            /* the handlers never fail, so the socket did; what hasn't been acked failed */
+            ALOGE("nl80211: %s->nl_recvmsgs failed: %d", __func__, res);
+            for (int i = 0; i < num; i++) {
+                if (results[i] > 0) {
+                    results[i] = res;
+                }
+            }
+            batch.pending = 0;
+        }
+    }
+
+    wifi_release_cmd_sock(info, sock);
+    return WIFI_SUCCESS;
+}
+
+int WifiCommand::requestResponseAsync(WifiRequest& request, wifi_async_handler func, void *arg) {
+    uint32_t seq;
+
+    struct nl_msg *msg = request.getMessage();
+    if (msg == NULL)
+        return WIFI_ERROR_INVALID_ARGS;
+
+    addRef();                           /* held until the request completes */
+
+    int err = wifi_register_async_cmd(wifiHandle(), this, func, arg, &seq);
+    if (err < 0) {
+        releaseRef();
+        return err;
+    }
+
+    /* reply may be processed before this returns, so register before sending */
+    nlmsg_hdr(msg)->nlmsg_seq = seq;
+    nl_complete_msg(mInfo->async_sock, msg);
+    err = request.send(mInfo->async_sock);
+    if (err < 0) {
+        async_info async;
+        if (wifi_unregister_async_cmd(wifiHandle(), seq, &async)) {
+            releaseRef();
+        }
+        return err;
+    }
+
+    return WIFI_SUCCESS;
+}
+
+int WifiCommand::requestNoAck() {
+    int err = create();                 /* create the message */
+    if (err < 0) {
+        return err;
+    }
+
+    return requestNoAck(mMsg);
+}
+
+int WifiCommand::requestNoAck(WifiRequest& request) {
+    struct nl_msg *msg = request.getMessage();
+    if (msg == NULL)
+        return WIFI_ERROR_INVALID_ARGS;
+
+    /* complete the header by hand; nl_send_auto_complete() would add NLM_F_ACK */
+    struct nlmsghdr *hdr = nlmsg_hdr(msg);
+    hdr->nlmsg_flags |= NLM_F_REQUEST;
+    hdr->nlmsg_seq = wifi_register_noack_cmd(wifiHandle(), getType());
+    hdr->nlmsg_pid = nl_socket_get_local_port(mInfo->async_sock);
+
+    int err = request.send(mInfo->async_sock);
+    if (err < 0) {
+        ALOGE("Failed to send %s; err = %d", getType(), err);
+        return err;
+    }
+
+    return WIFI_SUCCESS;
+}
+
+void WifiCommand::setAsyncHandlers(struct nl_cb *cb, hal_info *info) {
+    nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+    nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, async_response_handler, info);
+    nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, async_ack_handler, info);
+    nl_cb_err(cb, NL_CB_CUSTOM, async_error_handler, info);
+}
+
 int WifiCommand::requestEvent(int cmd) {
 
     ALOGD("requesting event %d", cmd);
 
+    /* the event may arrive while we wait for the ack; the condition keeps it */
+    mCondition.reset();
     int res = wifi_register_handler(wifiHandle(), cmd, event_handler, this);
     if (res < 0) {
         return res;
@@ -651,7 +980,8 @@ int WifiCommand::requestEvent(int cmd) {
 
     ALOGD("waiting for response %d", cmd);
 
-    res = nl_send_auto_complete(mInfo->cmd_sock, mMsg.getMessage());    /* send message */
+    /* on a leased socket, taking the ack with it so the next lessee doesn't read it */
+    res = requestResponse(mMsg);
     if (res < 0)
         goto out;
 
@@ -667,6 +997,7 @@ out:
 
 int WifiCommand::requestVendorEvent(uint32_t id, int subcmd) {
 
+    mCondition.reset();
     int res = wifi_register_vendor_handler(wifiHandle(), id, subcmd, event_handler, this);
     if (res < 0) {
         return res;
@@ -676,7 +1007,7 @@ int WifiCommand::requestVendorEvent(uint32_t id, int subcmd) {
     if (res < 0)
         goto out;
 
-    res = nl_send_auto_complete(mInfo->cmd_sock, mMsg.getMessage());    /* send message */
+    res = requestResponse(mMsg);
     if (res < 0)
         goto out;
 
@@ -704,6 +1035,20 @@ int WifiCommand::response_handler(struct nl_msg *msg, void *arg) {
     }
 }
 
+int WifiCommand::dump_handler(struct nl_msg *msg, void *arg) {
+    dump_info *dump = (dump_info *)arg;
+    if (dump->stopped) {
+        /* the socket goes back to the pool, so it must be read up to NLMSG_DONE */
+        return NL_SKIP;
+    }
+
+    dump->parts++;
+    if (response_handler(msg, dump->cmd) == NL_STOP) {
+        dump->stopped = true;
+    }
+    return NL_SKIP;
+}
+
 int WifiCommand::event_handler(struct nl_msg *msg, void *arg) {
     WifiCommand *cmd = (WifiCommand *)arg;
     WifiEvent event(msg);
@@ -745,6 +1090,107 @@ int WifiCommand::error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, vo
     int *ret = (int *)arg;
     *ret = err->error;
 
+    const char *msg = get_ext_ack_msg(err);
+    if (msg) {
+        ALOGE("Request failed: %d (%s)", err->error, msg);
+    }
+
     // ALOGD("error_handler received : %d", err->error);
     return NL_SKIP;
 }
+
+/* Batch request handlers; they never stop, later replies may share the datagram */
+int WifiCommand::batch_response_handler(struct nl_msg *msg, void *arg) {
+    batch_info *batch = (batch_info *)arg;
+    int i = find_batch_request(batch, nlmsg_hdr(msg)->nlmsg_seq);
+    if (i < 0) {
+        ALOGW("Dropping reply to unknown batch request %u", nlmsg_hdr(msg)->nlmsg_seq);
+        return NL_SKIP;
+    }
+
+    response_handler(msg, batch->cmds[i]);
+    return NL_SKIP;
+}
+
+int WifiCommand::batch_ack_handler(struct nl_msg *msg, void *arg) {
+    batch_info *batch = (batch_info *)arg;
+    int i = find_batch_request(batch, nlmsg_hdr(msg)->nlmsg_seq);
+    if (i >= 0) {
+        batch->results[i] = 0;
+        batch->pending--;
+    }
+    return NL_SKIP;
+}
+
+int WifiCommand::batch_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg) {
+    batch_info *batch = (batch_info *)arg;
+    int i = find_batch_request(batch, err->msg.nlmsg_seq);
+    if (i < 0) {
+        return NL_SKIP;
+    }
+
+    const char *msg = get_ext_ack_msg(err);
+    if (msg) {
+        ALOGE("%s failed: %d (%s)", batch->cmds[i]->getType(), err->error, msg);
+    }
+    batch->results[i] = err->error;
+    batch->pending--;
+    return NL_SKIP;
+}
+
+/* Async request handlers */
+static void complete_async_request(hal_info *info, uint32_t seq, int result) {
+    async_info async;
+    if (!wifi_unregister_async_cmd(getWifiHandle(info), seq, &async)) {
+        ALOGW("Dropping completion of unknown async request %u: %d", seq, result);
+        return;
+    }
+
+    if (async.func) {
+        (*async.func)(async.cmd, result, async.arg);
+    }
+    async.cmd->releaseRef();
+}
+
+int WifiCommand::async_response_handler(struct nl_msg *msg, void *arg) {
+    hal_info *info = (hal_info *)arg;
+    uint32_t seq = nlmsg_hdr(msg)->nlmsg_seq;
+
+    WifiCommand *cmd = wifi_get_async_cmd(getWifiHandle(info), seq);
+    if (cmd == NULL) {
+        ALOGW("Dropping reply to unknown async request %u", seq);
+        return NL_SKIP;
+    }
+
+    response_handler(msg, cmd);
+    cmd->releaseRef();
+
+    /* never stop here, the ack may follow in the same datagram */
+    return NL_SKIP;
+}
+
+int WifiCommand::async_ack_handler(struct nl_msg *msg, void *arg) {
+    complete_async_request((hal_info *)arg, nlmsg_hdr(msg)->nlmsg_seq, WIFI_SUCCESS);
+    return NL_SKIP;
+}
+
+int WifiCommand::async_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg) {
+    hal_info *info = (hal_info *)arg;
+    uint32_t seq = err->msg.nlmsg_seq;
+    const char *msg = get_ext_ack_msg(err);
+
+    /* requests sent with requestNoAck() only ever hear back on failure */
+    const char *type = wifi_get_noack_cmd(getWifiHandle(info), seq);
+    if (type != NULL) {
+        ALOGE("%s failed: %d (%s)", type, err->error, msg ? msg : "no details");
+        /* we can't tell which interface it was for; forget what we think is applied */
+        wifi_shadow_invalidate_all(info);
+        return NL_SKIP;
+    }
+
+    if (msg) {
+        ALOGE("Async request %u failed: %d (%s)", seq, err->error, msg);
+    }
+    complete_async_request(info, seq, err->error);
+    return NL_SKIP;
+}
@@ -147,6 +147,9 @@ private:
     nl_iterator(const nl_iterator&);    // hide copy constructor to prevent copies
 };
 
+#define WIFI_REQUEST_MAX_EXTERNAL   32
+#define WIFI_REQUEST_MAX_NESTING    8
+
 class WifiRequest
 {
 private:
@@ -154,17 +157,39 @@ private:
     int mIface;
     struct nl_msg *mMsg;
 
+    /* Payloads referenced by put_external(); they stay in the caller's buffer and are
+     * spliced in after 'offset' bytes of mMsg when the request is sent */
+    struct ExternalData {
+        unsigned offset;
+        const void *data;
+        unsigned len;
+    };
+    ExternalData mExternal[WIFI_REQUEST_MAX_EXTERNAL];
+    int mNumExternal;
+    unsigned mExternalLen;                  // external bytes, including padding
+
+    /* open nests, with mExternalLen at the time they were started */
+    struct nlattr *mNests[WIFI_REQUEST_MAX_NESTING];
+    unsigned mNestExternalLen[WIFI_REQUEST_MAX_NESTING];
+    int mNumNests;
+
 public:
     WifiRequest(int family) {
         mMsg = NULL;
         mFamily = family;
         mIface = -1;
+        mNumExternal = 0;
+        mExternalLen = 0;
+        mNumNests = 0;
     }
 
     WifiRequest(int family, int iface) {
         mMsg = NULL;
         mFamily = family;
         mIface = iface;
+        mNumExternal = 0;
+        mExternalLen = 0;
+        mNumNests = 0;
     }
 
     ~WifiRequest() {
@@ -176,6 +201,9 @@ public:
             nlmsg_free(mMsg);
             mMsg = NULL;
         }
+        mNumExternal = 0;
+        mExternalLen = 0;
+        mNumNests = 0;
     }
 
     nl_msg *getMessage() {
@@ -212,21 +240,27 @@ public:
         return nla_put(mMsg, attribute, sizeof(mac_addr), value);
     }
 
-    struct nlattr * attr_start(int attribute) {
-        return nla_nest_start(mMsg, attribute);
-    }
-    void attr_end(struct nlattr *attr) {
-        nla_nest_end(mMsg, attr);
-    }
+    /* Like put(), but the payload is not copied into the message; it is handed to the
+     * kernel straight from 'ptr' by send(), so it must stay valid until then */
+    int put_external(int attribute, const void *ptr, unsigned len);
+
+    struct nlattr * attr_start(int attribute);
+    void attr_end(struct nlattr *attr);
 
     int set_iface_id(int ifindex) {
         return put_u32(NL80211_ATTR_IFINDEX, ifindex);
     }
+
+    /* Sends the completed message along with any external payloads, in one sendmsg() */
+    int send(struct nl_sock *sock);
 private:
     WifiRequest(const WifiRequest&);        // hide copy constructor to prevent copies
 
 };
 
+/* most requests sent together by WifiCommand::requestBatch() */
+#define WIFI_MAX_BATCH  8
+
 class WifiCommand
 {
 protected:
@@ -297,6 +331,27 @@ public:
     int requestVendorEvent(uint32_t id, int subcmd);
     int requestResponse(WifiRequest& request);
 
+    /* Sends the request with NLM_F_DUMP; handleResponse() sees each part as it arrives,
+     * until NLMSG_DONE. Returning NL_STOP from it discards the remaining parts */
+    int requestDump();
+    int requestDump(WifiRequest& request);
+
+    /* Creates and sends the request of each command back to back on one socket, then
+     * collects all the replies, so the batch costs a single round trip. results[i] is
+     * what requestResponse() would have returned for cmds[i] */
+    static int requestBatch(hal_info *info, WifiCommand *cmds[], int results[], int num);
+
+    /* Sends the request without waiting for its reply; safe to call from the event loop.
+     * Replies go to handleResponse() and func runs once the request is acked or fails */
+    int requestResponseAsync(WifiRequest& request, wifi_async_handler func, void *arg);
+
+    /* Fire-and-forget: sends without NLM_F_ACK and returns at once. Only for idempotent,
+     * non-critical commands; failures are logged from the event loop */
+    int requestNoAck();
+    int requestNoAck(WifiRequest& request);
+
+    static void setAsyncHandlers(struct nl_cb *cb, hal_info *info);
+
 protected:
     wifi_handle wifiHandle() {
         return getWifiHandle(mInfo);
@@ -311,7 +366,8 @@ protected:
     }
 
     int ifaceId() {
-        return mIfaceInfo->id;
+        /* the driver monitor updates it from the event loop if the interface is recreated */
+        return __atomic_load_n(&mIfaceInfo->id, __ATOMIC_RELAXED);
     }
 
     /* Override this method to parse reply and dig out data; save it in the object */
@@ -350,6 +406,8 @@ private:
 
     static int event_handler(struct nl_msg *msg, void *arg);
 
+    static int dump_handler(struct nl_msg *msg, void *arg);
+
     /* Other event handlers */
     static int valid_handler(struct nl_msg *msg, void *arg);
 
@@ -358,6 +416,20 @@ private:
     static int finish_handler(struct nl_msg *msg, void *arg);
 
     static int error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg);
+
+    /* Batch request handlers */
+    static int batch_response_handler(struct nl_msg *msg, void *arg);
+
+    static int batch_ack_handler(struct nl_msg *msg, void *arg);
+
+    static int batch_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg);
+
+    /* Async request handlers, run from the event loop */
+    static int async_response_handler(struct nl_msg *msg, void *arg);
+
+    static int async_ack_handler(struct nl_msg *msg, void *arg);
+
+    static int async_error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg);
 };
 
 /* nl message processing macros (required to pass C++ type checks) */
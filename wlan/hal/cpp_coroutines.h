@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_CPP_COROUTINES_H__
+#define __WIFI_HAL_CPP_COROUTINES_H__
+
+/*
+ * Optional C++20 coroutine layer over WifiCommand; enabled by building with
+ * WIFI_HAL_COROUTINES defined (see Android.mk).
+ *
+ * A CoroutineCommand runs one WifiTask at a time, started with spawn(). The
+ * task suspends on 'co_await request(req)', which sends req with
+ * requestResponseAsync(), or on 'co_await event(subcmd)', which waits for a
+ * GOOGLE_OUI vendor event. Both are resumed from the event loop thread, so
+ * several sequences can be in flight without extra threads. Cancelling the task destroys its frame, which
+ * releases everything it holds and unregisters its event handlers.
+ */
+
+#ifdef WIFI_HAL_COROUTINES
+
+#include <stdlib.h>
+#include <coroutine>
+
+/* include after cpp_bindings.h */
+
+#define MAX_COROUTINE_EVENTS        4
+
+class CoroutineCommand;
+
+class WifiTask
+{
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+        void await_suspend(handle_type h) noexcept;
+        void await_resume() noexcept { }
+    };
+
+    struct promise_type {
+        CoroutineCommand *mCmd;                     // set by CoroutineCommand::spawn()
+        int mResult;
+
+        promise_type() : mCmd(NULL), mResult(WIFI_SUCCESS) { }
+
+        WifiTask get_return_object() {
+            return WifiTask(handle_type::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        FinalAwaiter final_suspend() noexcept {
+            return {};
+        }
+        void return_value(int result) {
+            mResult = result;
+        }
+        void unhandled_exception() {
+            abort();
+        }
+    };
+
+    WifiTask(WifiTask&& other) : mHandle(other.mHandle) {
+        other.mHandle = nullptr;
+    }
+
+    ~WifiTask() {
+        /* never spawned */
+        if (mHandle) {
+            mHandle.destroy();
+        }
+    }
+
+private:
+    friend class CoroutineCommand;
+
+    explicit WifiTask(handle_type h) : mHandle(h) { }
+    WifiTask(const WifiTask&);                      // hide copy constructor to prevent copies
+
+    handle_type release() {
+        handle_type h = mHandle;
+        mHandle = nullptr;
+        return h;
+    }
+
+    handle_type mHandle;
+};
+
+class CoroutineCommand : public WifiCommand
+{
+    friend struct WifiTask::FinalAwaiter;
+
+    WifiTask::handle_type mTask;                    // running task, if any
+    std::coroutine_handle<> mWaiter;                // task suspended on a request or event
+    unsigned mGeneration;                           // bumped when the waiter is dropped
+    int mResult;                                    // result of the last awaited request
+    WifiEvent *mEvent;                              // event being handed to the waiter
+    int mWaitEvent;                                 // vendor subcmd the waiter wants
+    int mEvents[MAX_COROUTINE_EVENTS];              // vendor subcmds with handlers registered
+    int mNumEvents;
+
+    pthread_mutex_t mDoneLock;
+    pthread_cond_t mDoneCond;
+    bool mDone;
+
+public:
+    CoroutineCommand(const char *type, wifi_interface_handle iface, wifi_request_id id)
+        : WifiCommand(type, iface, id), mGeneration(0), mResult(WIFI_SUCCESS), mEvent(NULL),
+            mWaitEvent(-1), mNumEvents(0), mDone(true)
+    {
+        pthread_mutex_init(&mDoneLock, NULL);
+        pthread_cond_init(&mDoneCond, NULL);
+    }
+
+    virtual ~CoroutineCommand() {
+        pthread_cond_destroy(&mDoneCond);
+        pthread_mutex_destroy(&mDoneLock);
+    }
+
+    struct RequestAwaiter {
+        CoroutineCommand *mCmd;
+        WifiRequest *mRequest;
+
+        bool await_ready() {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            CoroutineCommand *cmd = mCmd;
+            cmd->mWaiter = h;
+            int result = cmd->requestResponseAsync(*mRequest, &CoroutineCommand::onRequestDone,
+                    (void *)(uintptr_t)cmd->mGeneration);
+            if (result != WIFI_SUCCESS) {
+                /* nothing was sent, carry on with the error */
+                cmd->mWaiter = nullptr;
+                cmd->mResult = result;
+                return false;
+            }
+            /* the task may already be running on the event loop; don't touch 'this' */
+            return true;
+        }
+
+        int await_resume() {
+            return mCmd->mResult;
+        }
+    };
+
+    struct EventAwaiter {
+        CoroutineCommand *mCmd;
+        int mSubcmd;
+
+        bool await_ready() {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) {
+            int result = mCmd->watchEvent(mSubcmd);
+            if (result != WIFI_SUCCESS) {
+                mCmd->mEvent = NULL;
+                return false;
+            }
+            mCmd->mWaitEvent = mSubcmd;
+            mCmd->mWaiter = h;
+            return true;
+        }
+
+        /* the event is only valid until the task suspends again */
+        WifiEvent *await_resume() {
+            WifiEvent *event = mCmd->mEvent;
+            mCmd->mEvent = NULL;
+            return event;
+        }
+    };
+
+    /* 'int result = co_await request(req)'; replies still go to handleResponse() */
+    RequestAwaiter request(WifiRequest& request) {
+        return RequestAwaiter{this, &request};
+    }
+
+    /* 'WifiEvent *event = co_await event(subcmd)'; NULL if the handler can't be registered */
+    EventAwaiter event(int subcmd) {
+        return EventAwaiter{this, subcmd};
+    }
+
+    /* runs the task on the calling thread up to its first suspension */
+    int spawn(WifiTask task) {
+        if (mTask) {
+            ALOGE("%s: a task is already running", getType());
+            return WIFI_ERROR_BUSY;
+        }
+
+        WifiTask::handle_type h = task.release();
+        h.promise().mCmd = this;
+        taskStarted(h);
+        h.resume();
+        return WIFI_SUCCESS;
+    }
+
+    bool running() {
+        return (bool)mTask;
+    }
+
+    /* blocks the calling thread (never the event loop) until the task has finished */
+    int waitForTask() {
+        pthread_mutex_lock(&mDoneLock);
+        while (!mDone) {
+            pthread_cond_wait(&mDoneCond, &mDoneLock);
+        }
+        pthread_mutex_unlock(&mDoneLock);
+        return mResult;
+    }
+
+    /* destroys the task frame; replies to requests it had in flight are dropped */
+    void cancelTask() {
+        if (!mTask) {
+            return;
+        }
+
+        WifiTask::handle_type task = mTask;
+        mTask = nullptr;
+        mWaiter = nullptr;
+        mGeneration++;
+        task.destroy();
+        taskFinished(WIFI_ERROR_UNINITIALIZED);
+    }
+
+protected:
+    /* Override this to learn about a finished (or cancelled) task */
+    virtual void onTaskDone(int result) { }
+
+    virtual int handleEvent(WifiEvent& event) {
+        if (mWaiter && event.get_vendor_subcmd() == mWaitEvent) {
+            mWaitEvent = -1;
+            mEvent = &event;
+            resumeWaiter();
+            mEvent = NULL;
+        } else {
+            ALOGV("%s: no task waiting for event %d", getType(), event.get_vendor_subcmd());
+        }
+        return NL_OK;
+    }
+
+private:
+    int watchEvent(int subcmd) {
+        for (int i = 0; i < mNumEvents; i++) {
+            if (mEvents[i] == subcmd) {
+                return WIFI_SUCCESS;
+            }
+        }
+
+        if (mNumEvents == MAX_COROUTINE_EVENTS) {
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+
+        int result = registerVendorHandler(GOOGLE_OUI, subcmd);
+        if (result == WIFI_SUCCESS) {
+            mEvents[mNumEvents++] = subcmd;
+        }
+        return result;
+    }
+
+    void resumeWaiter() {
+        std::coroutine_handle<> waiter = mWaiter;
+        mWaiter = nullptr;
+        if (waiter) {
+            waiter.resume();
+        }
+    }
+
+    void taskStarted(WifiTask::handle_type task) {
+        addRef();                                   /* dropped in taskFinished() */
+        mTask = task;
+        pthread_mutex_lock(&mDoneLock);
+        mDone = false;
+        pthread_mutex_unlock(&mDoneLock);
+    }
+
+    void taskFinished(int result) {
+        for (int i = 0; i < mNumEvents; i++) {
+            unregisterVendorHandler(GOOGLE_OUI, mEvents[i]);
+        }
+        mNumEvents = 0;
+        mWaitEvent = -1;
+        mResult = result;
+
+        onTaskDone(result);
+
+        pthread_mutex_lock(&mDoneLock);
+        mDone = true;
+        pthread_cond_broadcast(&mDoneCond);
+        pthread_mutex_unlock(&mDoneLock);
+        releaseRef();
+    }
+
+    static void onRequestDone(WifiCommand *cmd, int result, void *arg) {
+        CoroutineCommand *self = (CoroutineCommand *)cmd;
+        if ((unsigned)(uintptr_t)arg != self->mGeneration) {
+            ALOGD("%s: dropping completion for a cancelled task", self->getType());
+            return;
+        }
+        self->mResult = result;
+        self->resumeWaiter();
+    }
+};
+
+inline void WifiTask::FinalAwaiter::await_suspend(handle_type h) noexcept {
+    CoroutineCommand *cmd = h.promise().mCmd;
+    int result = h.promise().mResult;
+    cmd->mTask = nullptr;
+    h.destroy();
+    cmd->taskFinished(result);
+}
+
+#endif /* WIFI_HAL_COROUTINES */
+
+#endif /* __WIFI_HAL_CPP_COROUTINES_H__ */
@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "epno_match.h"
+
+
+#define BLOOM_BITS_PER_NETWORK  16                  // three probes; well under 1% false hits
+#define BLOOM_PROBES            3
+
+#define CAPABILITY_PRIVACY      0x0010
+
+static u32 ssid_hash(const char *ssid)
+{
+    /* FNV-1a */
+    u32 hash = 2166136261U;
+    for (int i = 0; i < DOT11_MAX_SSID_LEN && ssid[i]; i++) {
+        hash = (hash ^ (u8)ssid[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/* double hashing off the one SSID hash */
+static inline u32 bloom_bit(const epno_matcher *matcher, u32 hash, int probe)
+{
+    return (hash + probe * ((hash >> 17) | (hash << 15) | 1)) & matcher->bloom_mask;
+}
+
+static bool bloom_test(const epno_matcher *matcher, u32 hash)
+{
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        u32 bit = bloom_bit(matcher, hash, i);
+        if (!(matcher->bloom[bit >> 5] & (1U << (bit & 31)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void bloom_add(epno_matcher *matcher, u32 hash)
+{
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        u32 bit = bloom_bit(matcher, hash, i);
+        matcher->bloom[bit >> 5] |= 1U << (bit & 31);
+    }
+}
+
+/* Maps the AKM suites of an RSN or WPA element, starting at the group cipher, to
+ * WIFI_PNO_AUTH_CODE_ bits; 0 if none are known */
+static u8 akm_auth(const u8 *ie, int len, const u8 *oui)
+{
+    /* the element may stop early, leaving the 802.1X default */
+    if (len < 6) {
+        return WIFI_PNO_AUTH_CODE_EAPOL;
+    }
+    int pairwise = ie[4] | (ie[5] << 8);
+    int pos = 6 + 4 * pairwise;
+    if (pos + 2 > len) {
+        return WIFI_PNO_AUTH_CODE_EAPOL;
+    }
+    int num_akm = ie[pos] | (ie[pos + 1] << 8);
+    pos += 2;
+
+    u8 auth = 0;
+    for (int i = 0; i < num_akm && pos + 4 <= len; i++, pos += 4) {
+        if (memcmp(&ie[pos], oui, 3) != 0) {
+            continue;
+        }
+        switch (ie[pos + 3]) {
+        case 1: case 3: case 5: case 11: case 12: case 13:     /* 802.1X flavours */
+            auth |= WIFI_PNO_AUTH_CODE_EAPOL;
+            break;
+        case 2: case 4: case 6: case 8: case 9:                 /* PSK and SAE */
+            auth |= WIFI_PNO_AUTH_CODE_PSK;
+            break;
+        }
+    }
+    return auth;
+}
+
+static u8 result_auth(const wifi_scan_result *result)
+{
+    static const u8 rsn_oui[3] = { 0x00, 0x0f, 0xac };
+    static const u8 wpa_oui[3] = { 0x00, 0x50, 0xf2 };
+
+    wifi_ie_index index;
+    wifi_ie_index_init(&index, (const u8 *)result->ie_data, result->ie_length);
+
+    int len;
+    const u8 *rsn = wifi_ie_rsn(&index, &len);
+    if (rsn) {
+        return akm_auth(rsn + 2, len - 2, rsn_oui);         /* past the version */
+    }
+    const u8 *wpa = wifi_ie_get_vendor(&index, wpa_oui, 1, &len);
+    if (wpa && len >= 6) {
+        return akm_auth(wpa + 6, len - 6, wpa_oui);         /* past OUI, type, version */
+    }
+
+    /* WEP goes with open, as the framework configures it */
+    return WIFI_PNO_AUTH_CODE_OPEN;
+}
+
+epno_matcher *epno_matcher_create(const wifi_epno_ext_params *params, const int *members,
+        int num_members)
+{
+    int num_buckets = 1;
+    while (num_buckets < num_members) {
+        num_buckets <<= 1;
+    }
+    u32 bloom_bits = 32;
+    while (bloom_bits < (u32)num_members * BLOOM_BITS_PER_NETWORK) {
+        bloom_bits <<= 1;
+    }
+
+    epno_matcher *matcher = (epno_matcher *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*matcher));
+    NULL_CHECK_RETURN(matcher, "memory allocation failure", NULL);
+    memset(matcher, 0, sizeof(*matcher));
+    matcher->networks = (epno_host_network *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+            sizeof(epno_host_network) * num_members);
+    matcher->buckets = (int *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(int) * num_buckets);
+    matcher->bloom = (u32 *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, bloom_bits / 8);
+    matcher->hits = (wifi_scan_result *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+            sizeof(wifi_scan_result) * WIFI_EPNO_MAX_HOST_HITS);
+    matcher->hit_score = (int *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+            sizeof(int) * WIFI_EPNO_MAX_HOST_HITS);
+    if (!matcher->networks || !matcher->buckets || !matcher->bloom || !matcher->hits ||
+            !matcher->hit_score) {
+        epno_matcher_free(matcher);
+        return NULL;
+    }
+
+    matcher->min5GHz_rssi = params->min5GHz_rssi;
+    matcher->min24GHz_rssi = params->min24GHz_rssi;
+    matcher->secure_bonus = params->secure_bonus;
+    matcher->band5GHz_bonus = params->band5GHz_bonus;
+    matcher->bucket_mask = num_buckets - 1;
+    matcher->bloom_mask = bloom_bits - 1;
+    memset(matcher->bloom, 0, bloom_bits / 8);
+    for (int i = 0; i < num_buckets; i++) {
+        matcher->buckets[i] = -1;
+    }
+
+    for (int i = 0; i < num_members; i++) {
+        const wifi_epno_network_ext *from = &params->networks[members[i]];
+        epno_host_network *network = &matcher->networks[i];
+        memcpy(network->ssid, from->ssid, sizeof(network->ssid));
+        network->ssid[DOT11_MAX_SSID_LEN] = '\0';
+        network->flags = from->flags;
+        network->auth_bit_field = from->auth_bit_field;
+        network->min_rssi = from->min_rssi;
+        network->hash = ssid_hash(network->ssid);
+
+        /* the same SSID may be listed more than once, with different auth */
+        int bucket = network->hash & matcher->bucket_mask;
+        network->next = matcher->buckets[bucket];
+        matcher->buckets[bucket] = i;
+        bloom_add(matcher, network->hash);
+    }
+    matcher->num_networks = num_members;
+    return matcher;
+}
+
+void epno_matcher_free(epno_matcher *matcher)
+{
+    wifi_hal_free(WIFI_ALLOC_GSCAN, matcher->networks);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, matcher->buckets);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, matcher->bloom);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, matcher->hits);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, matcher->hit_score);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, matcher);
+}
+
+static void add_hit(epno_matcher *matcher, const wifi_scan_result *result, int score)
+{
+    int slot = -1;
+    for (int i = 0; i < matcher->num_hits; i++) {
+        if (memcmp(matcher->hits[i].bssid, result->bssid, sizeof(mac_addr)) == 0) {
+            if (matcher->hit_score[i] >= score) {
+                return;
+            }
+            slot = i;                                       /* seen again, stronger */
+            break;
+        }
+    }
+
+    if (slot < 0 && matcher->num_hits < WIFI_EPNO_MAX_HOST_HITS) {
+        slot = matcher->num_hits++;
+    } else if (slot < 0) {
+        /* full; replace the weakest if this one beats it */
+        slot = 0;
+        for (int i = 1; i < matcher->num_hits; i++) {
+            if (matcher->hit_score[i] < matcher->hit_score[slot]) {
+                slot = i;
+            }
+        }
+        if (matcher->hit_score[slot] >= score) {
+            return;
+        }
+    }
+
+    /* IEs aren't carried, the same as firmware ePNO results */
+    memcpy(&matcher->hits[slot], result, offsetof(wifi_scan_result, ie_length));
+    matcher->hits[slot].ie_length = 0;
+    matcher->hit_score[slot] = score;
+}
+
+void epno_matcher_observe(epno_matcher *matcher, const wifi_scan_result *result)
+{
+    u32 hash = ssid_hash(result->ssid);
+    if (!bloom_test(matcher, hash)) {
+        matcher->rejected++;
+        return;
+    }
+
+    bool is_5g = wifi_is_5ghz(result->channel);
+    bool have_auth = false;
+    u8 auth = 0;
+    bool matched = false;
+    for (int i = matcher->buckets[hash & matcher->bucket_mask]; i >= 0;
+            i = matcher->networks[i].next) {
+        const epno_host_network *network = &matcher->networks[i];
+        if (network->hash != hash ||
+                strncmp(network->ssid, result->ssid, DOT11_MAX_SSID_LEN) != 0) {
+            continue;
+        }
+        matched = true;
+
+        u8 bands = network->flags & (WIFI_PNO_FLAG_A_BAND | WIFI_PNO_FLAG_G_BAND);
+        if (bands && !(bands & (is_5g ? WIFI_PNO_FLAG_A_BAND : WIFI_PNO_FLAG_G_BAND))) {
+            continue;
+        }
+        int min_rssi = network->min_rssi ? network->min_rssi :
+                (is_5g ? matcher->min5GHz_rssi : matcher->min24GHz_rssi);
+        if (result->rssi < min_rssi) {
+            continue;
+        }
+        if (!have_auth) {
+            auth = result_auth(result);
+            have_auth = true;
+        }
+        if (network->auth_bit_field && !(network->auth_bit_field & auth)) {
+            continue;
+        }
+
+        int score = result->rssi + (is_5g ? matcher->band5GHz_bonus : 0) +
+                (auth != WIFI_PNO_AUTH_CODE_OPEN ? matcher->secure_bonus : 0);
+        add_hit(matcher, result, score);
+        return;
+    }
+
+    if (!matched) {
+        matcher->false_positives++;
+    }
+}
+
+int epno_matcher_complete_scan(epno_matcher *matcher)
+{
+    /* insertion sort, best first; there are at most WIFI_EPNO_MAX_HOST_HITS */
+    for (int i = 1; i < matcher->num_hits; i++) {
+        wifi_scan_result hit = matcher->hits[i];
+        int score = matcher->hit_score[i];
+        int j = i;
+        for (; j > 0 && matcher->hit_score[j - 1] < score; j--) {
+            matcher->hits[j] = matcher->hits[j - 1];
+            matcher->hit_score[j] = matcher->hit_score[j - 1];
+        }
+        matcher->hits[j] = hit;
+        matcher->hit_score[j] = score;
+    }
+
+    int num = matcher->num_hits;
+    matcher->num_hits = 0;
+    return num;
+}
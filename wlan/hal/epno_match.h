@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_EPNO_MATCH_H__
+#define __WIFI_HAL_EPNO_MATCH_H__
+
+#include "common.h"
+
+typedef struct {
+    char ssid[DOT11_MAX_SSID_LEN + 1];
+    u8 flags;
+    u8 auth_bit_field;
+    int min_rssi;
+    u32 hash;
+    int next;                                       // next network in the bucket
+} epno_host_network;
+
+/*
+ * Networks left out of the firmware list. A Bloom filter over the SSID hashes turns
+ * away almost every result before the exact table is walked; the auth check parses
+ * IEs, so it only runs for SSIDs that matched.
+ */
+struct epno_matcher {
+    int min5GHz_rssi;
+    int min24GHz_rssi;
+    int secure_bonus;
+    int band5GHz_bonus;
+
+    int num_networks;
+    epno_host_network *networks;
+    int *buckets;
+    int bucket_mask;
+    u32 *bloom;
+    u32 bloom_mask;                                 // bits - 1
+
+    wifi_scan_result *hits;                         // best WIFI_EPNO_MAX_HOST_HITS this scan
+    int *hit_score;
+    int num_hits;
+
+    u32 rejected;                                   // results stopped by the filter
+    u32 false_positives;                            // passed the filter, no SSID match
+};
+
+epno_matcher *epno_matcher_create(const wifi_epno_ext_params *params, const int *members,
+        int num_members);
+void epno_matcher_free(epno_matcher *matcher);
+void epno_matcher_observe(epno_matcher *matcher, const wifi_scan_result *result);
+/* Ends a scan; returns the number of hits in matcher->hits, best first */
+int epno_matcher_complete_scan(epno_matcher *matcher);
+
+#endif /* __WIFI_HAL_EPNO_MATCH_H__ */
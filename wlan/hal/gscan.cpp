@@ -43,6 +43,17 @@
 #include "wifi_hal.h"
 #include "common.h"
 #include "cpp_bindings.h"
+#include "scan_cache.h"
+#include "scan_history.h"
+#include "scan_export.h"
+#include "scan_filter.h"
+#include "significant_change.h"
+#include "epno_match.h"
+#include "anqp_cache.h"
+#include "capabilities.h"
+#include "gscan_mux.h"
+#include "scan_planner.h"
+#include "warm_start.h"
 
 typedef enum {
 
@@ -159,17 +170,41 @@ typedef enum {
     GSCAN_ATTRIBUTE_EPNO_SECURE_BONUS,
     GSCAN_ATTRIBUTE_EPNO_5G_BONUS,
 
+    /* Full scan result filter */
+    GSCAN_ATTRIBUTE_FILTER_FLUSH = 140,
+    GSCAN_ATTRIBUTE_FILTER_SSID,                        /* one per SSID */
+    GSCAN_ATTRIBUTE_FILTER_OUI,                         /* one per OUI */
+    GSCAN_ATTRIBUTE_FILTER_MIN_RSSI,
+    GSCAN_ATTRIBUTE_FILTER_BAND,
+    GSCAN_ATTRIBUTE_FILTER_IE_IDS,                      /* elements that must be present */
+
     GSCAN_ATTRIBUTE_MAX
 
 } GSCAN_ATTRIBUTE;
 
+/* Set in the feature set by drivers that implement GSCAN_SUBCMD_SET_SCAN_FILTER and the
+ * FILTER attributes above; without it the filters run on the host only */
+#define WIFI_FEATURE_SCAN_FILTER_OFFLOAD    (1ULL << 48)
+
 
 // helper methods
 wifi_error wifi_enable_full_scan_results(wifi_request_id id, wifi_interface_handle iface,
          wifi_scan_result_handler handler);
 wifi_error wifi_disable_full_scan_results(wifi_request_id id, wifi_interface_handle iface);
-int wifi_handle_full_scan_event(wifi_request_id id, WifiEvent& event,
+int wifi_handle_full_scan_event(wifi_request_id id, interface_info *iface, WifiEvent& event,
          wifi_scan_result_handler handler);
+static void complete_full_scan_batch(interface_info *iface);
+static void discard_full_scan_batch(interface_info *iface);
+static void observe_sig_change(interface_info *iface, const wifi_scan_result *result);
+static void complete_sig_change_scan(interface_info *iface);
+static void observe_epno(interface_info *iface, const wifi_scan_result *result);
+static void complete_epno_scan(interface_info *iface);
+static wifi_gscan_full_result_t *parse_full_scan_event(WifiEvent& event, int *ie_len);
+static bool full_scan_observed(interface_info *iface);
+static wifi_scan_result *decode_full_scan_event(interface_info *iface,
+        wifi_gscan_full_result_t *drv_res, int ie_len, unsigned *buckets_scanned);
+static void deliver_full_scan_result(wifi_request_id id, interface_info *iface,
+        wifi_scan_result *result, unsigned buckets_scanned, wifi_scan_result_handler handler);
 void convert_to_hal_result(wifi_scan_result *to, wifi_gscan_result_t *from);
 
 
@@ -186,6 +221,25 @@ void convert_to_hal_result(wifi_scan_result *to, wifi_gscan_result_t *from)
     memcpy(&to->bssid, &from->bssid, sizeof(mac_addr));
 }
 
+/* Converts a whole array of driver results; kept free of calls and logging so the
+ * compiler can keep it tight */
+static void decode_scan_results(wifi_scan_result * __restrict to,
+        const wifi_gscan_result_t * __restrict from, int num)
+{
+    for (int i = 0; i < num; i++) {
+        to[i].ts = from[i].ts;
+        to[i].channel = from[i].channel;
+        to[i].rssi = from[i].rssi;
+        to[i].rtt = from[i].rtt;
+        to[i].rtt_sd = from[i].rtt_sd;
+        to[i].beacon_period = from[i].beacon_period;
+        to[i].capability = from[i].capability;
+        to[i].ie_length = 0;
+        memcpy(to[i].ssid, from[i].ssid, DOT11_MAX_SSID_LEN + 1);
+        memcpy(to[i].bssid, from[i].bssid, sizeof(mac_addr));
+    }
+}
+
 /////////////////////////////////////////////////////////////////////////////
 
 class GetCapabilitiesCommand : public WifiCommand
@@ -235,11 +289,21 @@ protected:
 };
 
 
+WifiCommand *wifi_new_gscan_capabilities_query(wifi_interface_handle handle,
+        wifi_gscan_capabilities *capabilities)
+{
+    return new GetCapabilitiesCommand(handle, capabilities);
+}
+
 wifi_error wifi_get_gscan_capabilities(wifi_interface_handle handle,
         wifi_gscan_capabilities *capabilities)
 {
-    GetCapabilitiesCommand command(handle, capabilities);
-    return (wifi_error) command.requestResponse();
+    wifi_capabilities *caps = wifi_get_capabilities(handle);
+    NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    memcpy(capabilities, &caps->gscan, sizeof(*capabilities));
+    wifi_error result = (wifi_error)caps->status[CAP_GSCAN];
+    wifi_put_capabilities(caps);
+    return result;
 }
 
 class GetChannelListCommand : public WifiCommand
@@ -317,10 +381,238 @@ protected:
     }
 };
 
+/* Usable frequencies of the interface's wiphy with their regulatory flags */
+class GetChannelFlagsCommand : public WifiCommand
+{
+    wifi_channel *mFreqs;
+    u8 *mFlags;
+    int mMax;
+    int *mNum;
+public:
+    GetChannelFlagsCommand(wifi_interface_handle iface, wifi_channel *freqs, u8 *flags,
+            int max, int *num)
+        : WifiCommand("GetChannelFlagsCommand", iface, 0), mFreqs(freqs), mFlags(flags),
+            mMax(max), mNum(num)
+    {
+        *mNum = 0;
+    }
+
+    virtual int create() {
+        int ret = mMsg.create(NL80211_CMD_GET_WIPHY);
+        if (ret < 0) {
+            return ret;
+        }
+        /* the split dump is filtered down to this interface's wiphy */
+        ret = mMsg.set_iface_id(ifaceId());
+        if (ret < 0) {
+            return ret;
+        }
+        return nla_put_flag(mMsg.getMessage(), NL80211_ATTR_SPLIT_WIPHY_DUMP);
+    }
+
+protected:
+    void parseFreq(nlattr *freq) {
+        wifi_channel channel = 0;
+        u8 flags = 0;
+        bool disabled = false;
+
+        for (nl_iterator it(freq); it.has_next(); it.next()) {
+            switch (it.get_type()) {
+            case NL80211_FREQUENCY_ATTR_FREQ:
+                channel = it.get_u32();
+                break;
+            case NL80211_FREQUENCY_ATTR_DISABLED:
+                disabled = true;
+                break;
+            case NL80211_FREQUENCY_ATTR_NO_IR:
+                flags |= WIFI_CHANNEL_FLAG_NO_IR;
+                break;
+            case NL80211_FREQUENCY_ATTR_RADAR:
+                flags |= WIFI_CHANNEL_FLAG_DFS;
+                break;
+            }
+        }
+
+        if (channel && !disabled && *mNum < mMax) {
+            mFreqs[*mNum] = channel;
+            mFlags[*mNum] = flags;
+            (*mNum)++;
+        }
+    }
+
+    virtual int handleResponse(WifiEvent& reply) {
+        nlattr *bands = reply.get_attribute(NL80211_ATTR_WIPHY_BANDS);
+        if (bands == NULL) {
+            return NL_SKIP;                 /* a part of the dump without band info */
+        }
+
+        for (nl_iterator band(bands); band.has_next(); band.next()) {
+            for (nl_iterator it(band.get()); it.has_next(); it.next()) {
+                if (it.get_type() != NL80211_BAND_ATTR_FREQS) {
+                    continue;
+                }
+                for (nl_iterator freq(it.get()); freq.has_next(); freq.next()) {
+                    parseFreq(freq.get());
+                }
+            }
+        }
+        return NL_SKIP;
+    }
+};
+
+void wifi_invalidate_channel_cache(hal_info *info, const char *reason)
+{
+    pthread_mutex_lock(&info->channel_lock);
+    channel_cache *cache = &info->channels;
+    cache->generation++;
+    cache->have_flags = false;
+    for (int i = 0; i < NUM_CHANNEL_BANDS; i++) {
+        cache->bands[i].valid = false;
+    }
+    cache->stats.invalidations++;
+    pthread_mutex_unlock(&info->channel_lock);
+
+    ALOGV("Channel cache dropped: %s", reason);
+}
+
+u32 wifi_channel_band(hal_info *info, wifi_channel channel)
+{
+    if (!wifi_is_5ghz(channel)) {
+        return WIFI_BAND_BG;
+    }
+
+    u32 band = WIFI_BAND_A;
+    pthread_mutex_lock(&info->channel_lock);
+    channel_cache *cache = &info->channels;
+    for (int i = 0; i < cache->num_freqs; i++) {
+        if (cache->freqs[i] == channel) {
+            if (cache->freq_flags[i] & WIFI_CHANNEL_FLAG_DFS) {
+                band = WIFI_BAND_A_DFS;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&info->channel_lock);
+    return band;
+}
+
+/* Copies the channel list for band out of the cache, reading it from the driver first
+ * if need be. Lists read while an invalidation came in are returned but not kept */
+static wifi_error get_channel_list(wifi_interface_handle handle, int band, channel_list *list)
+{
+    hal_info *info = getHalInfo(handle);
+    channel_cache *cache = &info->channels;
+
+    if (band < 0 || band >= NUM_CHANNEL_BANDS) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    pthread_mutex_lock(&info->channel_lock);
+    if (cache->bands[band].valid) {
+        *list = cache->bands[band];
+        cache->stats.hits++;
+        pthread_mutex_unlock(&info->channel_lock);
+        return WIFI_SUCCESS;
+    }
+    u32 generation = cache->generation;
+    bool need_flags = !cache->have_flags;
+    pthread_mutex_unlock(&info->channel_lock);
+
+    int num = 0;
+    GetChannelListCommand command(handle, list->channels, &num, MAX_CACHED_CHANNELS, band);
+    wifi_error result = (wifi_error)command.requestResponse();
+    if (result != WIFI_SUCCESS) {
+        ALOGE("Failed to get channel list for band %d: %d", band, result);
+        return result;
+    }
+    list->num = num;
+    list->valid = true;
+
+    wifi_channel freqs[MAX_CACHED_CHANNELS];
+    u8 freq_flags[MAX_CACHED_CHANNELS];
+    int num_freqs = 0;
+    bool have_flags = false;
+    if (need_flags) {
+        GetChannelFlagsCommand flags_command(handle, freqs, freq_flags,
+                MAX_CACHED_CHANNELS, &num_freqs);
+        have_flags = flags_command.requestDump() >= 0;
+        if (!have_flags) {
+            ALOGW("Could not read channel flags; reporting none");
+            num_freqs = 0;
+        }
+    }
+
+    pthread_mutex_lock(&info->channel_lock);
+    bool current = generation == cache->generation;
+    if (have_flags && current) {
+        memcpy(cache->freqs, freqs, sizeof(wifi_channel) * num_freqs);
+        memcpy(cache->freq_flags, freq_flags, num_freqs);
+        cache->num_freqs = num_freqs;
+        cache->have_flags = true;
+    } else if (!need_flags) {
+        /* the flags were cached before this call */
+        memcpy(freqs, cache->freqs, sizeof(wifi_channel) * cache->num_freqs);
+        memcpy(freq_flags, cache->freq_flags, cache->num_freqs);
+        num_freqs = cache->num_freqs;
+    }
+
+    for (int i = 0; i < list->num; i++) {
+        list->flags[i] = 0;
+        for (int j = 0; j < num_freqs; j++) {
+            if (freqs[j] == list->channels[i]) {
+                list->flags[i] = freq_flags[j];
+                break;
+            }
+        }
+    }
+
+    if (current) {
+        cache->bands[band] = *list;
+    }
+    cache->stats.fetches++;
+    pthread_mutex_unlock(&info->channel_lock);
+    return WIFI_SUCCESS;
+}
+
 wifi_error wifi_get_valid_channels(wifi_interface_handle handle,
         int band, int max_channels, wifi_channel *channels, int *num_channels)
 {
-    *num_channels = 12;
+    channel_list list;
+    wifi_error result = get_channel_list(handle, band, &list);
+    if (result != WIFI_SUCCESS) {
+        return result;
+    }
+
+    *num_channels = min(list.num, max_channels);
+    memcpy(channels, list.channels, sizeof(wifi_channel) * *num_channels);
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_get_valid_channels_ext(wifi_interface_handle handle, int band,
+        int max_channels, wifi_valid_channel *channels, int *num_channels)
+{
+    channel_list list;
+    wifi_error result = get_channel_list(handle, band, &list);
+    if (result != WIFI_SUCCESS) {
+        return result;
+    }
+
+    *num_channels = min(list.num, max_channels);
+    for (int i = 0; i < *num_channels; i++) {
+        channels[i].channel = list.channels[i];
+        channels[i].flags = list.flags[i];
+    }
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_get_channel_cache_stats(wifi_interface_handle handle,
+        wifi_channel_cache_stats *stats)
+{
+    hal_info *info = getHalInfo(handle);
+
+    pthread_mutex_lock(&info->channel_lock);
+    *stats = info->channels.stats;
+    pthread_mutex_unlock(&info->channel_lock);
     return WIFI_SUCCESS;
 }
 /////////////////////////////////////////////////////////////////////////////
@@ -449,6 +741,7 @@ public:
         }
 
         unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_FULL_SCAN_RESULTS);
+        discard_full_scan_batch(mIfaceInfo);
         return WIFI_SUCCESS;
     }
 
@@ -460,20 +753,49 @@ public:
 
     virtual int handleEvent(WifiEvent& event) {
         ALOGV("Full scan results:  Got an event");
-        return wifi_handle_full_scan_event(id(), event, mHandler);
+        return wifi_handle_full_scan_event(id(), mIfaceInfo, event, mHandler);
     }
 
 };
 /////////////////////////////////////////////////////////////////////////////
 
+/* Copies out where results go, so they can be delivered without holding the lock */
+static int get_gscan_routes(interface_info *iface, gscan_route *routes)
+{
+    int num = 0;
+
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    gscan_mux *mux = iface->gscan_mux;
+    if (mux) {
+        for (num = 0; num < mux->num_sessions; num++) {
+            routes[num] = mux->sessions[num].route;
+        }
+    }
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+    return num;
+}
+
+/* True while a background scan session reports full results */
+static bool gscan_full_results_on(interface_info *iface)
+{
+    gscan_route routes[GSCAN_MUX_MAX_SESSIONS];
+    int num = get_gscan_routes(iface, routes);
+    for (int i = 0; i < num; i++) {
+        if (routes[i].full_results) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Runs the merged schedule of the interface's gscan_mux; events go to every session */
 class ScanCommand : public WifiCommand
 {
+    wifi_scan_cmd_params mRunning;      // a copy, so the mux may change meanwhile
     wifi_scan_cmd_params *mParams;
-    wifi_scan_result_handler mHandler;
 public:
-    ScanCommand(wifi_interface_handle iface, int id, wifi_scan_cmd_params *params,
-                wifi_scan_result_handler handler)
-        : WifiCommand("ScanCommand", iface, id), mParams(params), mHandler(handler)
+    ScanCommand(wifi_interface_handle iface, int id, const wifi_scan_cmd_params *params)
+        : WifiCommand("ScanCommand", iface, id), mRunning(*params), mParams(&mRunning)
     { }
 
     int createSetupRequest(WifiRequest& request) {
@@ -588,8 +910,7 @@ public:
         return createFeatureRequest(request, GSCAN_SUBCMD_ENABLE_GSCAN, 0);
     }
 
-    int start() {
-        ALOGV("GSCAN start");
+    int configure() {
         WifiRequest request(familyId(), ifaceId());
         int result = createSetupRequest(request);
         if (result != WIFI_SUCCESS) {
@@ -616,20 +937,34 @@ public:
             ALOGE("failed to configure scan; result = %d", result);
             return result;
         }
+        return result;
+    }
 
-        ALOGV(" ....starting scan");
+    int enable(int enable) {
+        WifiRequest request(familyId(), ifaceId());
+        int result = enable ? createStartRequest(request) : createStopRequest(request);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("failed to create %s request; result = %d", enable ? "start" : "stop",
+                    result);
+            return result;
+        }
+        return requestResponse(request);
+    }
 
-        result = createStartRequest(request);
+    int start() {
+        ALOGV("GSCAN start");
+        int result = configure();
         if (result != WIFI_SUCCESS) {
-            ALOGE("failed to create start request; result = %d", result);
             return result;
         }
 
+        ALOGV(" ....starting scan");
+
         registerVendorHandler(GOOGLE_OUI, GSCAN_EVENT_SCAN_RESULTS_AVAILABLE);
         registerVendorHandler(GOOGLE_OUI, GSCAN_EVENT_COMPLETE_SCAN);
         registerVendorHandler(GOOGLE_OUI, GSCAN_EVENT_FULL_SCAN_RESULTS);
 
-        result = requestResponse(request);
+        result = enable(1);
         if (result != WIFI_SUCCESS) {
             ALOGE("failed to start scan; result = %d", result);
             unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_COMPLETE_SCAN);
@@ -640,6 +975,27 @@ public:
         return result;
     }
 
+    /* Switches the running scan over to changed params */
+    int reconfigure(const wifi_scan_cmd_params *params) {
+        ALOGV("GSCAN reconfigure");
+        mRunning = *params;
+        int result = enable(0);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("failed to stop scan; result = %d", result);
+        }
+
+        result = configure();
+        if (result != WIFI_SUCCESS) {
+            return result;
+        }
+
+        result = enable(1);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("failed to restart scan; result = %d", result);
+        }
+        return result;
+    }
+
     virtual int cancel() {
         ALOGV("Stopping scan");
 
@@ -657,6 +1013,18 @@ public:
         unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_COMPLETE_SCAN);
         unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_SCAN_RESULTS_AVAILABLE);
         unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_FULL_SCAN_RESULTS);
+        discard_full_scan_batch(mIfaceInfo);
+
+        /* cancelled from outside wifi_stop_gscan(), e.g. on cleanup; the sessions go too */
+        pthread_mutex_lock(&mIfaceInfo->gscan_mux_lock);
+        gscan_mux *mux = mIfaceInfo->gscan_mux;
+        if (mux && mux->cmd == this) {
+            mIfaceInfo->gscan_mux = NULL;
+        } else {
+            mux = NULL;
+        }
+        pthread_mutex_unlock(&mIfaceInfo->gscan_mux_lock);
+        wifi_hal_free(WIFI_ALLOC_GSCAN, mux);
         return WIFI_SUCCESS;
     }
 
@@ -667,6 +1035,8 @@ public:
 
     virtual int handleEvent(WifiEvent& event) {
         ALOGV("Got a scan results event");
+        gscan_route routes[GSCAN_MUX_MAX_SESSIONS];
+        int num_routes = get_gscan_routes(mIfaceInfo, routes);
         //event.log();
 
         nlattr *vendor_data = event.get_attribute(NL80211_ATTR_VENDOR_DATA);
@@ -682,63 +1052,411 @@ public:
             wifi_scan_event evt_type;
             evt_type = (wifi_scan_event) event.get_u32(NL80211_ATTR_VENDOR_DATA);
             ALOGV("Received event type %d", evt_type);
-            if(*mHandler.on_scan_event)
-                (*mHandler.on_scan_event)(id(), evt_type);
+            if (event_id == GSCAN_EVENT_COMPLETE_SCAN) {
+                /* batched results go out before the scan is reported done */
+                complete_full_scan_batch(mIfaceInfo);
+                complete_sig_change_scan(mIfaceInfo);
+                complete_epno_scan(mIfaceInfo);
+            }
+            for (int i = 0; i < num_routes; i++) {
+                if (routes[i].handler.on_scan_event)
+                    (*routes[i].handler.on_scan_event)(routes[i].id, evt_type);
+            }
         } else if (event_id == GSCAN_EVENT_FULL_SCAN_RESULTS) {
-            wifi_handle_full_scan_event(id(), event, mHandler);
+            int ie_len;
+            wifi_gscan_full_result_t *drv_res = parse_full_scan_event(event, &ie_len);
+            if (drv_res == NULL) {
+                return NL_SKIP;
+            }
+
+            /* without bucket bits, all sessions taking full results get it */
+            unsigned buckets_scanned = drv_res->scan_ch_bucket;
+            wifi_request_id ids[GSCAN_MUX_MAX_SESSIONS];
+            int wanting[GSCAN_MUX_MAX_SESSIONS];
+            int num_wanting = 0;
+            for (int i = 0; i < num_routes; i++) {
+                if (buckets_scanned == 0 ? routes[i].full_results != 0 :
+                        (routes[i].full_results & buckets_scanned) != 0) {
+                    ids[num_wanting] = routes[i].id;
+                    wanting[num_wanting++] = i;
+                }
+            }
+
+            /* filters run on the driver's record, before anything is copied */
+            u32 pass = wifi_scan_filter_check(mIfaceInfo, ids, num_wanting, &drv_res->fixed,
+                    drv_res->ie_data, ie_len);
+            if (pass == 0 && !full_scan_observed(mIfaceInfo)) {
+                return NL_SKIP;
+            }
+
+            wifi_scan_result *result = decode_full_scan_event(mIfaceInfo, drv_res, ie_len,
+                    &buckets_scanned);
+            for (int i = 0; i < num_wanting; i++) {
+                if (pass & (1U << i)) {
+                    gscan_route *route = &routes[wanting[i]];
+                    deliver_full_scan_result(route->id, mIfaceInfo, result,
+                            gscan_mux_route_buckets(route, buckets_scanned), route->handler);
+                }
+            }
         }
         return NL_SKIP;
     }
 };
 
+static int find_gscan_session(gscan_mux *mux, wifi_request_id id)
+{
+    for (int i = 0; i < mux->num_sessions; i++) {
+        if (mux->sessions[i].route.id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Reads the channel lists of the bands the sessions scan, for plan_gscan_mux(); they may
+ * come from the driver, so this runs without the lock. Called with gscan_apply_lock held,
+ * so the sessions can't change meanwhile */
+static void get_gscan_mux_bands(interface_info *iface, channel_list *bands)
+{
+    u32 wanted = 0;
+
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    gscan_mux *mux = iface->gscan_mux;
+    for (int s = 0; iface->scan_planner && mux && s < mux->num_sessions; s++) {
+        const wifi_scan_cmd_params *params = &mux->sessions[s].params;
+        for (int b = 0; b < params->num_buckets; b++) {
+            int band = params->buckets[b].band;
+            if (band > 0 && band < NUM_CHANNEL_BANDS) {
+                wanted |= 1U << band;
+            }
+        }
+    }
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+
+    memset(bands, 0, sizeof(channel_list) * NUM_CHANNEL_BANDS);
+    for (int band = 1; band < NUM_CHANNEL_BANDS; band++) {
+        if ((wanted & (1U << band)) &&
+                get_channel_list(getIfaceHandle(iface), band, &bands[band]) != WIFI_SUCCESS) {
+            bands[band].valid = false;
+        }
+    }
+}
+
+/* Rewrites the merged schedule into a cheaper one and points the routes at the buckets
+ * that now carry each session's channels. Called with the lock held */
+static void plan_gscan_mux(interface_info *iface, gscan_mux *mux, wifi_scan_cmd_params *merged,
+        const channel_list *bands)
+{
+    scan_plan plan;
+
+    int num_buckets = merged->num_buckets;
+    scan_plan_rewrite(merged, bands, &plan);
+
+    for (int s = 0; s < mux->num_sessions; s++) {
+        gscan_route *route = &mux->sessions[s].route;
+        u32 buckets[MAX_BUCKETS] = { 0 };
+        u32 full_results = 0;
+        for (int b = 0; b < num_buckets; b++) {
+            for (int i = 0; i < merged->num_buckets; i++) {
+                if (plan.remap[b] & (1U << i)) {
+                    buckets[i] |= route->buckets[b];
+                    if (route->full_results & (1U << b)) {
+                        full_results |= 1U << i;
+                    }
+                }
+            }
+        }
+        memcpy(route->buckets, buckets, sizeof(buckets));
+        route->full_results = full_results;
+    }
+
+    wifi_scan_plan_stats *stats = &iface->scan_plan_stats;
+    stats->plans++;
+    stats->channels_removed = plan.channels_removed;
+    stats->buckets_removed = plan.buckets_removed;
+    stats->bands_expanded = plan.bands_expanded;
+    stats->radio_ms_requested = plan.radio_ms_before;
+    stats->radio_ms_planned = plan.radio_ms_after;
+    ALOGD("Scan plan: %d -> %d buckets, %u channels dropped, %u -> %u ms/hour radio time",
+            num_buckets, merged->num_buckets, plan.channels_removed, plan.radio_ms_before,
+            plan.radio_ms_after);
+}
+
+/*
+ * Merges the sessions of the interface's mux and runs the result, starting the scan if
+ * need be. The schedule and routes are worked out under gscan_mux_lock, but the driver
+ * is only told once it is dropped, so events keep being routed meanwhile. The command is
+ * registered under the id of the oldest session. Called with gscan_apply_lock held
+ */
+static wifi_error apply_gscan_mux(interface_info *iface)
+{
+    wifi_handle handle = getWifiHandle(getIfaceHandle(iface));
+    wifi_scan_cmd_params merged;
+    channel_list bands[NUM_CHANNEL_BANDS];
+
+    get_gscan_mux_bands(iface, bands);
+
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    gscan_mux *mux = iface->gscan_mux;
+    if (mux == NULL || mux->num_sessions == 0) {
+        pthread_mutex_unlock(&iface->gscan_mux_lock);
+        return WIFI_SUCCESS;
+    }
+    wifi_error result = gscan_mux_merge(mux->sessions, mux->num_sessions, &merged);
+    if (result == WIFI_SUCCESS && iface->scan_planner) {
+        plan_gscan_mux(iface, mux, &merged, bands);
+    }
+    wifi_request_id id = mux->sessions[0].route.id;
+    wifi_request_id cmd_id = mux->cmd_id;
+    ScanCommand *cmd = (ScanCommand *)mux->cmd;
+    bool unchanged = cmd && memcmp(&mux->merged, &merged, sizeof(merged)) == 0;
+    if (cmd) {
+        cmd->addRef();
+    }
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+
+    if (result != WIFI_SUCCESS) {
+        if (cmd) {
+            cmd->releaseRef();
+        }
+        return result;
+    }
+
+    if (cmd == NULL) {
+        cmd = new ScanCommand(getIfaceHandle(iface), id, &merged);
+        NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+        result = wifi_register_cmd(handle, id, cmd);
+        if (result != WIFI_SUCCESS) {
+            cmd->releaseRef();
+            return result;
+        }
+        result = (wifi_error)cmd->start();
+        if (result != WIFI_SUCCESS) {
+            wifi_unregister_cmd(handle, (WifiCommand *)cmd);
+            cmd->releaseRef();
+            return result;
+        }
+
+        pthread_mutex_lock(&iface->gscan_mux_lock);
+        mux->merged = merged;
+        mux->cmd = cmd;
+        mux->cmd_id = id;
+        pthread_mutex_unlock(&iface->gscan_mux_lock);
+        return result;
+    }
+
+    if (cmd_id != id) {
+        /* the session it was registered under has gone. The new id goes in first, so that
+         * a failure leaves it reachable under the old one; removing by command then takes
+         * the older entry */
+        result = wifi_register_cmd(handle, id, cmd);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Could not register background scan as request %d; result = %d", id, result);
+            cmd->releaseRef();
+            return result;
+        }
+        wifi_unregister_cmd(handle, (WifiCommand *)cmd);
+        cmd_id = id;
+    }
+    if (!unchanged) {
+        result = (wifi_error)cmd->reconfigure(&merged);
+    }
+
+    /* cleanup may have cancelled the scan and freed mux meanwhile */
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    if (iface->gscan_mux == mux && mux->cmd == cmd) {
+        mux->cmd_id = cmd_id;
+        if (result == WIFI_SUCCESS) {
+            mux->merged = merged;
+        } else {
+            memset(&mux->merged, 0, sizeof(mux->merged));  /* retried on the next change */
+        }
+    }
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+    cmd->releaseRef();
+    return result;
+}
+
+/* Detaches the mux if no sessions are left, for stop_gscan_mux() */
+static gscan_mux *detach_idle_gscan_mux(interface_info *iface)
+{
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    gscan_mux *mux = iface->gscan_mux;
+    if (mux && mux->num_sessions == 0) {
+        iface->gscan_mux = NULL;
+    } else {
+        mux = NULL;
+    }
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+    return mux;
+}
+
+/* Drops session id; returns the number left */
+static int remove_gscan_session(interface_info *iface, wifi_request_id id)
+{
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    gscan_mux *mux = iface->gscan_mux;
+    int i = mux ? find_gscan_session(mux, id) : -1;
+    if (i >= 0) {
+        mux->num_sessions--;
+        memmove(&mux->sessions[i], &mux->sessions[i + 1],
+                sizeof(mux->sessions[0]) * (mux->num_sessions - i));
+    }
+    int num_sessions = mux ? mux->num_sessions : 0;
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+    return num_sessions;
+}
+
+/* Stops the scan of a mux already detached from iface, and frees it */
+static void stop_gscan_mux(interface_info *iface, gscan_mux *mux)
+{
+    if (mux->cmd) {
+        wifi_unregister_cmd(getWifiHandle(getIfaceHandle(iface)), mux->cmd);
+        mux->cmd->cancel();
+        mux->cmd->releaseRef();
+    }
+    wifi_hal_free(WIFI_ALLOC_GSCAN, mux);
+}
+
 wifi_error wifi_start_gscan(
         wifi_request_id id,
         wifi_interface_handle iface,
         wifi_scan_cmd_params params,
         wifi_scan_result_handler handler)
 {
-    wifi_handle handle = getWifiHandle(iface);
+    interface_info *info = getIfaceInfo(iface);
 
-    ALOGV("Starting GScan, halHandle = %p", handle);
+    ALOGV("Starting GScan, halHandle = %p", getWifiHandle(iface));
 
-    ScanCommand *cmd = new ScanCommand(iface, id, &params, handler);
-    NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
-    wifi_error result = wifi_register_cmd(handle, id, cmd);
-    if (result != WIFI_SUCCESS) {
-        cmd->releaseRef();
-        return result;
+    pthread_mutex_lock(&info->gscan_apply_lock);
+    pthread_mutex_lock(&info->gscan_mux_lock);
+    gscan_mux *mux = info->gscan_mux;
+    if (mux == NULL) {
+        mux = (gscan_mux *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*mux));
+        if (mux == NULL) {
+            pthread_mutex_unlock(&info->gscan_mux_lock);
+            pthread_mutex_unlock(&info->gscan_apply_lock);
+            ALOGE("memory allocation failure");
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+        memset(mux, 0, sizeof(*mux));
+        info->gscan_mux = mux;
     }
-    result = (wifi_error)cmd->start();
-    if (result != WIFI_SUCCESS) {
-        wifi_unregister_cmd(handle, id);
-        cmd->releaseRef();
-        return result;
+
+    if (find_gscan_session(mux, id) >= 0 || mux->num_sessions == GSCAN_MUX_MAX_SESSIONS) {
+        int num_sessions = mux->num_sessions;
+        pthread_mutex_unlock(&info->gscan_mux_lock);
+        pthread_mutex_unlock(&info->gscan_apply_lock);
+        ALOGE("Can't add background scan %d to the %d running", id, num_sessions);
+        return num_sessions == GSCAN_MUX_MAX_SESSIONS ?
+                WIFI_ERROR_TOO_MANY_REQUESTS : WIFI_ERROR_INVALID_REQUEST_ID;
     }
+
+    gscan_session *session = &mux->sessions[mux->num_sessions++];
+    session->params = params;
+    session->route.id = id;
+    session->route.handler = handler;
+    pthread_mutex_unlock(&info->gscan_mux_lock);
+
+    wifi_error result = apply_gscan_mux(info);
+    if (result != WIFI_SUCCESS && remove_gscan_session(info, id)) {
+        /* put back what the others had */
+        apply_gscan_mux(info);
+    }
+    mux = detach_idle_gscan_mux(info);
+    if (mux) {
+        stop_gscan_mux(info, mux);
+    }
+    pthread_mutex_unlock(&info->gscan_apply_lock);
+
+    wifi_refresh_scan_filter(info);
     return result;
 }
 
 wifi_error wifi_stop_gscan(wifi_request_id id, wifi_interface_handle iface)
 {
     wifi_handle handle = getWifiHandle(iface);
+    interface_info *info = getIfaceInfo(iface);
     ALOGV("Stopping GScan, wifi_request_id = %d, halHandle = %p", id, handle);
 
     if (id == -1) {
-        wifi_scan_result_handler handler;
-        wifi_scan_cmd_params dummy_params;
-        wifi_handle handle = getWifiHandle(iface);
-        memset(&handler, 0, sizeof(handler));
+        pthread_mutex_lock(&info->gscan_apply_lock);
+        pthread_mutex_lock(&info->gscan_mux_lock);
+        gscan_mux *mux = info->gscan_mux;
+        info->gscan_mux = NULL;
+        pthread_mutex_unlock(&info->gscan_mux_lock);
+        if (mux) {
+            stop_gscan_mux(info, mux);
+        }
+        pthread_mutex_unlock(&info->gscan_apply_lock);
+        if (mux) {
+            wifi_refresh_scan_filter(info);
+            return WIFI_SUCCESS;
+        }
 
-        ScanCommand *cmd = new ScanCommand(iface, id, &dummy_params, handler);
+        wifi_scan_cmd_params dummy_params;
+        memset(&dummy_params, 0, sizeof(dummy_params));
+        ScanCommand *cmd = new ScanCommand(iface, id, &dummy_params);
         NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
         cmd->cancel();
         cmd->releaseRef();
         return WIFI_SUCCESS;
     }
 
-    return wifi_cancel_cmd(id, iface);
-}
+    pthread_mutex_lock(&info->gscan_apply_lock);
+    pthread_mutex_lock(&info->gscan_mux_lock);
+    bool found = info->gscan_mux && find_gscan_session(info->gscan_mux, id) >= 0;
+    pthread_mutex_unlock(&info->gscan_mux_lock);
+    if (!found) {
+        pthread_mutex_unlock(&info->gscan_apply_lock);
+        return wifi_cancel_cmd(id, iface);
+    }
 
-wifi_error wifi_enable_full_scan_results(
+    wifi_error result = WIFI_SUCCESS;
+    if (remove_gscan_session(info, id)) {
+        /* the others keep running on the smaller schedule */
+        result = apply_gscan_mux(info);
+    }
+    gscan_mux *mux = detach_idle_gscan_mux(info);
+    if (mux) {
+        stop_gscan_mux(info, mux);
+    }
+    pthread_mutex_unlock(&info->gscan_apply_lock);
+
+    wifi_scan_filter_remove(info, id);
+    wifi_refresh_scan_filter(info);
+    return result;
+}
+
+wifi_error wifi_set_scan_planner(wifi_interface_handle handle, bool enable)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    wifi_error result = WIFI_SUCCESS;
+
+    pthread_mutex_lock(&iface->gscan_apply_lock);
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    bool changed = iface->scan_planner != enable;
+    iface->scan_planner = enable;
+    bool running = iface->gscan_mux && iface->gscan_mux->cmd;
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+    if (changed && running) {
+        result = apply_gscan_mux(iface);
+    }
+    pthread_mutex_unlock(&iface->gscan_apply_lock);
+    return result;
+}
+
+wifi_error wifi_get_scan_plan_stats(wifi_interface_handle handle, wifi_scan_plan_stats *stats)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    pthread_mutex_lock(&iface->gscan_mux_lock);
+    *stats = iface->scan_plan_stats;
+    pthread_mutex_unlock(&iface->gscan_mux_lock);
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_enable_full_scan_results(
         wifi_request_id id,
         wifi_interface_handle iface,
         wifi_scan_result_handler handler)
@@ -755,59 +1473,447 @@ wifi_error wifi_enable_full_scan_results(
         cmd->releaseRef();
         return result;
     }
+
+    /* before the results start, so a firmware filter that would hide them is lifted */
+    wifi_scan_filter_set_full_scan_id(getIfaceInfo(iface), id);
+    wifi_refresh_scan_filter(getIfaceInfo(iface));
     result = (wifi_error)cmd->start();
     if (result != WIFI_SUCCESS) {
         wifi_unregister_cmd(handle, id);
         cmd->releaseRef();
+        wifi_scan_filter_set_full_scan_id(getIfaceInfo(iface), -1);
+        wifi_refresh_scan_filter(getIfaceInfo(iface));
         return result;
     }
     return result;
 }
 
-int wifi_handle_full_scan_event(
-        wifi_request_id id,
-        WifiEvent& event,
-        wifi_scan_result_handler handler)
+static void free_full_scan_batch(full_scan_batch *batch)
+{
+    wifi_arena_free(&batch->arena);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, batch);
+}
+
+/* Takes the buffered results out for delivery, leaving the batch marked as delivering;
+ * returns NULL if there is nothing to deliver. batch_lock held */
+static full_scan_batch *detach_full_scan_batch(interface_info *iface,
+        wifi_batch_flush_reason reason)
+{
+    full_scan_batch *batch = iface->batch;
+    if (batch == NULL || batch->num_results == 0 || batch->delivering) {
+        return NULL;
+    }
+
+    wifi_full_scan_batch_stats *stats = &iface->batch_stats;
+    stats->batches++;
+    stats->results += batch->num_results;
+    stats->bytes += batch->bytes;
+    stats->max_batch_results = max(stats->max_batch_results, (u32)batch->num_results);
+    stats->max_batch_bytes = max(stats->max_batch_bytes, (u32)batch->bytes);
+    stats->flushes[reason]++;
+
+    batch->delivering = true;
+    return batch;
+}
+
+/* Hands detached results to the handler without batch_lock, so that it may change the
+ * batching, then rewinds the arena */
+static void deliver_full_scan_batch(interface_info *iface, full_scan_batch *batch)
+{
+    if (batch == NULL) {
+        return;
+    }
+
+    /* one callback per request, each with its results in the order they arrived */
+    for (int i = 0; i < batch->num_results && batch->handler.on_full_scan_results; i++) {
+        int j = 0;
+        while (j < i && batch->ids[j] != batch->ids[i]) {
+            j++;
+        }
+        if (j < i) {
+            continue;                       /* went out with that request's first result */
+        }
+
+        int num = 0;
+        for (j = i; j < batch->num_results; j++) {
+            if (batch->ids[j] == batch->ids[i]) {
+                batch->group[num] = batch->results[j];
+                batch->group_buckets[num++] = batch->buckets[j];
+            }
+        }
+        (*batch->handler.on_full_scan_results)(batch->ids[i], batch->group,
+                batch->group_buckets, num);
+    }
+
+    pthread_mutex_lock(&iface->batch_lock);
+    bool retired = batch->retired;
+    batch->num_results = 0;
+    batch->bytes = 0;
+    wifi_arena_reset(&batch->arena);
+    batch->delivering = false;
+    pthread_mutex_unlock(&iface->batch_lock);
+
+    if (retired) {
+        free_full_scan_batch(batch);
+    }
+}
+
+/* Returns false if batching is off and the result should be delivered on its own */
+static bool batch_full_scan_result(interface_info *iface, wifi_request_id id,
+        const wifi_scan_result *full_scan_result, unsigned buckets_scanned)
+{
+    pthread_mutex_lock(&iface->batch_lock);
+    full_scan_batch *batch = iface->batch;
+    if (batch == NULL || batch->delivering) {
+        pthread_mutex_unlock(&iface->batch_lock);
+        return false;
+    }
+
+    u64 now = wifi_get_monotonic_ms();
+    /* sessions of a shared background scan take turns, so results of every request
+     * share the batch and are only split up on delivery */
+    full_scan_batch *flushed = NULL;
+    if (batch->num_results && batch->params.max_delay_ms &&
+            now - batch->first_ms >= (u64)batch->params.max_delay_ms) {
+        flushed = detach_full_scan_batch(iface, WIFI_BATCH_FLUSH_TIME);
+    }
+    if (flushed) {
+        pthread_mutex_unlock(&iface->batch_lock);
+        deliver_full_scan_batch(iface, flushed);
+        return batch_full_scan_result(iface, id, full_scan_result, buckets_scanned);
+    }
+
+    int size = offsetof(wifi_scan_result, ie_data) + full_scan_result->ie_length;
+    wifi_scan_result *result = (wifi_scan_result *)wifi_arena_alloc(&batch->arena, size);
+    if (result == NULL) {
+        pthread_mutex_unlock(&iface->batch_lock);
+        ALOGE("Full scan results: no room to batch a result");
+        return false;
+    }
+    memcpy(result, full_scan_result, size);
+
+    if (batch->num_results == 0) {
+        batch->first_ms = now;
+    }
+    batch->results[batch->num_results] = result;
+    batch->buckets[batch->num_results] = buckets_scanned;
+    batch->ids[batch->num_results] = id;
+    batch->num_results++;
+    batch->bytes += size;
+
+    if (batch->num_results == batch->params.max_results ||
+            (batch->params.max_bytes && batch->bytes >= batch->params.max_bytes)) {
+        flushed = detach_full_scan_batch(iface, WIFI_BATCH_FLUSH_SIZE);
+    }
+    pthread_mutex_unlock(&iface->batch_lock);
+
+    deliver_full_scan_batch(iface, flushed);
+    return true;
+}
+
+static void complete_full_scan_batch(interface_info *iface)
+{
+    pthread_mutex_lock(&iface->batch_lock);
+    full_scan_batch *flushed = detach_full_scan_batch(iface, WIFI_BATCH_FLUSH_SCAN_COMPLETE);
+    pthread_mutex_unlock(&iface->batch_lock);
+
+    deliver_full_scan_batch(iface, flushed);
+}
+
+static void discard_full_scan_batch(interface_info *iface)
+{
+    pthread_mutex_lock(&iface->batch_lock);
+    full_scan_batch *batch = iface->batch;
+    if (batch && batch->num_results && !batch->delivering) {
+        iface->batch_stats.dropped += batch->num_results;
+        batch->num_results = 0;
+        batch->bytes = 0;
+        wifi_arena_reset(&batch->arena);
+    }
+    pthread_mutex_unlock(&iface->batch_lock);
+}
+
+wifi_error wifi_set_full_scan_batching(wifi_interface_handle handle,
+        const wifi_full_scan_batch_params *params, wifi_full_scan_batch_handler handler)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    full_scan_batch *batch = NULL;
+
+    if (params != NULL) {
+        if (params->max_results < 0 || params->max_results > MAX_FULL_SCAN_BATCH ||
+                params->max_bytes < 0 || params->max_delay_ms < 0) {
+            return WIFI_ERROR_INVALID_ARGS;
+        }
+
+        batch = (full_scan_batch *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*batch));
+        NULL_CHECK_RETURN(batch, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+        memset(batch, 0, sizeof(*batch));
+        batch->params = *params;
+        if (batch->params.max_results == 0) {
+            batch->params.max_results = MAX_FULL_SCAN_BATCH;
+        }
+        batch->handler = handler;
+
+        /* sized so that a typical scan fits without growing on the event loop */
+        int reserve = params->max_bytes ? params->max_bytes : FULL_SCAN_BATCH_RESERVE;
+        if (wifi_arena_init(&batch->arena, WIFI_ALLOC_GSCAN,
+                reserve + offsetof(wifi_scan_result, ie_data) + MAX_PROBE_RESP_IE_LEN) < 0) {
+            free_full_scan_batch(batch);
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+    }
+
+    pthread_mutex_lock(&iface->batch_lock);
+    full_scan_batch *old = iface->batch;
+    if (old && old->delivering) {
+        old->retired = true;                /* the delivering thread frees it */
+        old = NULL;
+    } else if (old) {
+        iface->batch_stats.dropped += old->num_results;
+    }
+    iface->batch = batch;
+    pthread_mutex_unlock(&iface->batch_lock);
+
+    if (old) {
+        free_full_scan_batch(old);
+    }
+
+    ALOGD("Full scan result batching %s on %s", batch ? "enabled" : "disabled", iface->name);
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_get_full_scan_batch_stats(wifi_interface_handle handle,
+        wifi_full_scan_batch_stats *stats)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    pthread_mutex_lock(&iface->batch_lock);
+    *stats = iface->batch_stats;
+    pthread_mutex_unlock(&iface->batch_lock);
+    return WIFI_SUCCESS;
+}
+
+/* Every full scan result passes through here before it is delivered */
+static void observe_full_scan_result(interface_info *iface, const wifi_scan_result *result)
+{
+    wifi_scan_cache_update(iface, result);
+    wifi_scan_history_add(iface, result);
+    wifi_scan_export_publish(iface, result, WIFI_SCAN_EXPORT_FULL);
+    wifi_warm_start_update(iface, result);
+    observe_sig_change(iface, result);
+    observe_epno(iface, result);
+}
+
+/* Validates a full scan result event; the driver's record, or NULL if it is malformed */
+static wifi_gscan_full_result_t *parse_full_scan_event(WifiEvent& event, int *ie_len)
 {
     nlattr *vendor_data = event.get_attribute(NL80211_ATTR_VENDOR_DATA);
     unsigned int len = event.get_vendor_data_len();
 
     if (vendor_data == NULL || len < sizeof(wifi_gscan_full_result_t)) {
         ALOGI("Full scan results: No scan results found");
-        return NL_SKIP;
+        return NULL;
     }
 
     wifi_gscan_full_result_t *drv_res = (wifi_gscan_full_result_t *)event.get_vendor_data();
     /* To protect against corrupted data, put a ceiling */
-    int ie_len = min(MAX_PROBE_RESP_IE_LEN, drv_res->ie_length);
-    wifi_scan_result *full_scan_result;
-    wifi_gscan_result_t *fixed = &drv_res->fixed;
+    *ie_len = min(MAX_PROBE_RESP_IE_LEN, drv_res->ie_length);
 
-    if ((ie_len + offsetof(wifi_gscan_full_result_t, ie_data)) > len) {
+    if ((*ie_len + offsetof(wifi_gscan_full_result_t, ie_data)) > len) {
         ALOGE("BAD event data, len %d ie_len %d fixed length %d!\n", len,
-            ie_len, offsetof(wifi_gscan_full_result_t, ie_data));
-        return NL_SKIP;
-    }
-    full_scan_result = (wifi_scan_result *) malloc((ie_len + offsetof(wifi_scan_result, ie_data)));
-    if (!full_scan_result) {
-        ALOGE("Full scan results: Can't malloc!\n");
-        return NL_SKIP;
+            *ie_len, offsetof(wifi_gscan_full_result_t, ie_data));
+        return NULL;
     }
+    return drv_res;
+}
+
+/* Host side observers want every result, whatever the filters of the sessions say */
+static bool full_scan_observed(interface_info *iface)
+{
+    return iface->scan_cache || iface->scan_history || iface->scan_export ||
+            iface->sig_change || iface->epno;
+}
+
+/* Decodes a validated full scan result into the interface's full_scan_buf and lets the
+ * host side observers see it */
+static wifi_scan_result *decode_full_scan_event(interface_info *iface,
+        wifi_gscan_full_result_t *drv_res, int ie_len, unsigned *buckets_scanned)
+{
+    wifi_scan_result *full_scan_result;
+    wifi_gscan_result_t *fixed = &drv_res->fixed;
+
+    full_scan_result = iface->full_scan_buf;
     convert_to_hal_result(full_scan_result, fixed);
     full_scan_result->ie_length = ie_len;
     memcpy(full_scan_result->ie_data, drv_res->ie_data, ie_len);
-    if(handler.on_full_scan_result)
-        handler.on_full_scan_result(id, full_scan_result, drv_res->scan_ch_bucket);
+    observe_full_scan_result(iface, full_scan_result);
 
     ALOGV("Full scan result: %-32s %02x:%02x:%02x:%02x:%02x:%02x %d %d %lld %lld %lld %x %d\n",
         fixed->ssid, fixed->bssid[0], fixed->bssid[1], fixed->bssid[2], fixed->bssid[3],
         fixed->bssid[4], fixed->bssid[5], fixed->rssi, fixed->channel, fixed->ts,
         fixed->rtt, fixed->rtt_sd, drv_res->scan_ch_bucket, drv_res->ie_length);
-    free(full_scan_result);
+    *buckets_scanned = drv_res->scan_ch_bucket;
+    return full_scan_result;
+}
+
+static void deliver_full_scan_result(wifi_request_id id, interface_info *iface,
+        wifi_scan_result *result, unsigned buckets_scanned, wifi_scan_result_handler handler)
+{
+    if (batch_full_scan_result(iface, id, result, buckets_scanned)) {
+        return;
+    }
+    if(handler.on_full_scan_result)
+        handler.on_full_scan_result(id, result, buckets_scanned);
+}
+
+int wifi_handle_full_scan_event(
+        wifi_request_id id,
+        interface_info *iface,
+        WifiEvent& event,
+        wifi_scan_result_handler handler)
+{
+    int ie_len;
+    wifi_gscan_full_result_t *drv_res = parse_full_scan_event(event, &ie_len);
+    if (drv_res == NULL) {
+        return NL_SKIP;
+    }
+
+    bool wanted = wifi_scan_filter_check(iface, &id, 1, &drv_res->fixed, drv_res->ie_data,
+            ie_len);
+    if (!wanted && !full_scan_observed(iface)) {
+        return NL_SKIP;
+    }
+
+    unsigned buckets_scanned;
+    wifi_scan_result *result = decode_full_scan_event(iface, drv_res, ie_len, &buckets_scanned);
+    if (wanted) {
+        deliver_full_scan_result(id, iface, result, buckets_scanned, handler);
+    }
     return NL_SKIP;
 }
 
 
+/////////////////////////////////////////////////////////////////////////////
+
+/* Replaces the firmware's full scan result filter; an empty filter passes everything */
+class ScanFilterCommand : public WifiCommand
+{
+    const wifi_scan_filter *mFilter;
+public:
+    ScanFilterCommand(wifi_interface_handle iface, const wifi_scan_filter *filter)
+        : WifiCommand("ScanFilterCommand", iface, 0), mFilter(filter)
+    { }
+
+    int createRequest(WifiRequest& request) {
+        int result = request.create(GOOGLE_OUI, GSCAN_SUBCMD_SET_SCAN_FILTER);
+        if (result < 0) {
+            return result;
+        }
+
+        nlattr *data = request.attr_start(NL80211_ATTR_VENDOR_DATA);
+        result = request.put_u8(GSCAN_ATTRIBUTE_FILTER_FLUSH, 1);
+        for (int i = 0; result >= 0 && i < mFilter->num_ssids; i++) {
+            result = request.put(GSCAN_ATTRIBUTE_FILTER_SSID, (void *)mFilter->ssids[i],
+                    strlen(mFilter->ssids[i]));
+        }
+        for (int i = 0; result >= 0 && i < mFilter->num_ouis; i++) {
+            result = request.put(GSCAN_ATTRIBUTE_FILTER_OUI, (void *)mFilter->ouis[i], 3);
+        }
+        if (result >= 0 && mFilter->min_rssi) {
+            result = request.put_u32(GSCAN_ATTRIBUTE_FILTER_MIN_RSSI, mFilter->min_rssi);
+        }
+        if (result >= 0 && mFilter->bands) {
+            result = request.put_u32(GSCAN_ATTRIBUTE_FILTER_BAND, mFilter->bands);
+        }
+        if (result >= 0 && mFilter->num_ies) {
+            result = request.put(GSCAN_ATTRIBUTE_FILTER_IE_IDS, (void *)mFilter->required_ies,
+                    mFilter->num_ies);
+        }
+        if (result < 0) {
+            return result;
+        }
+
+        request.attr_end(data);
+        return WIFI_SUCCESS;
+    }
+
+    int start() {
+        WifiRequest request(familyId(), ifaceId());
+        int result = createRequest(request);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("failed to create scan filter request; result = %d", result);
+            return result;
+        }
+        return requestResponse(request);
+    }
+
+    virtual int handleResponse(WifiEvent& reply) {
+        /* Nothing to do on response! */
+        return NL_SKIP;
+    }
+};
+
+/*
+ * The firmware sees a single stream of full results for everyone, so it can only be
+ * given a filter loose enough for all of them, and none at all while something on the
+ * host wants every result. The host filters stay exact either way. The union is taken
+ * and pushed under one lock, so a refresh that read older state cannot land last.
+ */
+static bool scan_filter_offload_supported(interface_info *iface)
+{
+    wifi_capabilities *caps = wifi_get_capabilities(getIfaceHandle(iface));
+    if (caps == NULL) {
+        return false;
+    }
+    bool supported = caps->status[CAP_FEATURE_SET] == WIFI_SUCCESS &&
+            (caps->features & WIFI_FEATURE_SCAN_FILTER_OFFLOAD);
+    wifi_put_capabilities(caps);
+    return supported;
+}
+
+void wifi_refresh_scan_filter(interface_info *iface)
+{
+    pthread_mutex_lock(&iface->scan_filter_push_lock);
+    gscan_route routes[GSCAN_MUX_MAX_SESSIONS];
+    wifi_request_id ids[GSCAN_MUX_MAX_SESSIONS];
+    int num_routes = get_gscan_routes(iface, routes);
+    int num = 0;
+    for (int i = 0; i < num_routes; i++) {
+        if (routes[i].full_results) {
+            ids[num++] = routes[i].id;
+        }
+    }
+
+    wifi_scan_filter filter;
+    memset(&filter, 0, sizeof(filter));
+    bool push = !full_scan_observed(iface) && wifi_scan_filter_union(iface, ids, num, &filter);
+    if (!push && (iface->scan_filters == NULL || !iface->scan_filters->offloaded)) {
+        pthread_mutex_unlock(&iface->scan_filter_push_lock);
+        return;                             /* nothing in the firmware to take back */
+    }
+    /* nothing is ever pushed to a driver that does not say it takes filters */
+    if (!scan_filter_offload_supported(iface)) {
+        pthread_mutex_unlock(&iface->scan_filter_push_lock);
+        return;
+    }
+
+    uint64_t value = wifi_shadow_hash(&filter, sizeof(filter));
+    if (wifi_shadow_begin(iface, SHADOW_SCAN_FILTER, value)) {
+        pthread_mutex_unlock(&iface->scan_filter_push_lock);
+        return;
+    }
+    ScanFilterCommand command(getIfaceHandle(iface), &filter);
+    int result = command.start();
+    wifi_shadow_end(iface, SHADOW_SCAN_FILTER, value, result);
+
+    bool unsupported = result == -EOPNOTSUPP || result == WIFI_ERROR_NOT_SUPPORTED;
+    if (unsupported) {
+        ALOGI("No firmware scan filter support, filtering on the host");
+    }
+    wifi_scan_filter_set_offloaded(iface, push && result == WIFI_SUCCESS, unsupported);
+    pthread_mutex_unlock(&iface->scan_filter_push_lock);
+}
+
 wifi_error wifi_disable_full_scan_results(wifi_request_id id, wifi_interface_handle iface)
 {
     ALOGV("Disabling full scan results");
@@ -823,10 +1929,15 @@ wifi_error wifi_disable_full_scan_results(wifi_request_id id, wifi_interface_han
         NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
         cmd->cancel();
         cmd->releaseRef();
+        wifi_scan_filter_set_full_scan_id(getIfaceInfo(iface), -1);
+        wifi_refresh_scan_filter(getIfaceInfo(iface));
         return WIFI_SUCCESS;
     }
 
-    return wifi_cancel_cmd(id, iface);
+    wifi_error result = wifi_cancel_cmd(id, iface);
+    wifi_scan_filter_remove(getIfaceInfo(iface), id);
+    wifi_refresh_scan_filter(getIfaceInfo(iface));
+    return result;
 }
 
 
@@ -871,7 +1982,32 @@ public:
         WifiRequest request(familyId(), ifaceId());
         ALOGV("retrieving %d scan results", mMax);
 
-        for (int i = 0; i < 10 && mRetrieved < mMax; i++) {
+        if (!mInfo->scan_dump_unsupported) {
+            /* every cached scan comes back in one multi-part reply */
+            int result = createRequest(request, mMax, mFlush);
+            if (result < 0) {
+                ALOGE("failed to create request");
+                return result;
+            }
+
+            result = requestDump(request);
+            if (result == -EOPNOTSUPP || result == -EINVAL) {
+                ALOGD("driver can't dump scan results; falling back to requests");
+                mInfo->scan_dump_unsupported = true;
+                mRetrieved = 0;
+                request.destroy();
+            } else if (result != WIFI_SUCCESS) {
+                ALOGE("failed to dump scan results; result = %d", result);
+                return result;
+            } else {
+                ALOGV("GetScanResults read %d results", mRetrieved);
+                *mNum = mRetrieved;
+                return WIFI_SUCCESS;
+            }
+        }
+
+        /* ask again for as long as the driver makes progress */
+        while (mRetrieved < mMax && !mCompleted) {
             int num_to_retrieve = mMax - mRetrieved;
             // ALOGI("retrieving %d scan results in one shot", num_to_retrieve);
             int result = createRequest(request, num_to_retrieve, mFlush);
@@ -889,7 +2025,7 @@ public:
                 return result;
             }
 
-            if (mRetrieved == prev_retrieved || mCompleted) {
+            if (mRetrieved == prev_retrieved) {
                 /* no more items left to retrieve */
                 break;
             }
@@ -897,6 +2033,10 @@ public:
             request.destroy();
         }
 
+        if (mRetrieved == mMax && !mCompleted) {
+            ALOGW("GetScanResults filled all %d slots; later scans were not read", mMax);
+        }
+
         ALOGV("GetScanResults read %d results", mRetrieved);
         *mNum = mRetrieved;
         return WIFI_SUCCESS;
@@ -952,23 +2092,22 @@ public:
                     } else if (it2.get_type() == GSCAN_ATTRIBUTE_SCAN_RESULTS && num) {
                         if (mRetrieved >= mMax) {
                             ALOGW("Stored %d scans, ignoring excess results", mRetrieved);
-                            break;
+                            return NL_STOP;
                         }
                         num = min(num, (int)(it2.get_len()/sizeof(wifi_gscan_result)));
+                        /* wifi_cached_scan_results has room for no more than this */
                         num = min(num, (int)MAX_AP_CACHE_PER_SCAN);
                         ALOGV("Copying %d scan results", num);
-                        wifi_gscan_result_t *results = (wifi_gscan_result_t *)it2.get_data();
-                        wifi_scan_result *mScanResults = mScans[mRetrieved].results;
-
-                        for (int i = 0; i < num; i++) {
-                            wifi_gscan_result_t *result = &results[i];
-                            convert_to_hal_result(&mScanResults[i], result);
-                            mScanResults[i].ie_length = 0;
-                            ALOGV("%02d  %-32s  %02x:%02x:%02x:%02x:%02x:%02x  %04d", i,
-                                result->ssid, result->bssid[0], result->bssid[1], result->bssid[2],
-                                result->bssid[3], result->bssid[4], result->bssid[5],
-                                result->rssi);
-                        }
+                        decode_scan_results(mScans[mRetrieved].results,
+                                (wifi_gscan_result_t *)it2.get_data(), num);
+                        wifi_scan_cache_update_results(mIfaceInfo, mScans[mRetrieved].results,
+                                num);
+                        wifi_scan_history_add_results(mIfaceInfo, mScans[mRetrieved].results,
+                                num);
+                        wifi_scan_export_publish_results(mIfaceInfo,
+                                mScans[mRetrieved].results, num, WIFI_SCAN_EXPORT_CACHED);
+                        wifi_warm_start_update_results(mIfaceInfo, mScans[mRetrieved].results,
+                                num);
                         mScans[mRetrieved].scan_id = scan_id;
                         mScans[mRetrieved].flags = flags;
                         mScans[mRetrieved].num_results = num;
@@ -988,20 +2127,251 @@ public:
         ALOGV("GetScanResults read %d results", mRetrieved);
         return NL_OK;
     }
-};
+};
+
+/* Puts cached scans in terms of a session's own buckets, leaving out scans of none of
+ * them; scans the firmware gave no buckets for are kept */
+static void route_cached_scans(const gscan_route *route, wifi_cached_scan_results *results,
+        int *num)
+{
+    int kept = 0;
+    for (int i = 0; i < *num; i++) {
+        if (results[i].buckets_scanned) {
+            results[i].buckets_scanned = gscan_mux_route_buckets(route,
+                    results[i].buckets_scanned);
+            if (results[i].buckets_scanned == 0) {
+                continue;
+            }
+        }
+        if (kept != i) {
+            memcpy(&results[kept], &results[i], sizeof(results[i]));
+        }
+        kept++;
+    }
+    *num = kept;
+}
+
+/* Cached results as session id sees them, or the oldest session if id is -1 */
+static wifi_error get_cached_gscan_results(wifi_request_id id, wifi_interface_handle iface,
+        byte flush, int max, wifi_cached_scan_results *results, int *num)
+{
+    interface_info *info = getIfaceInfo(iface);
+    gscan_route route;
+    bool routed = false;
+    int num_sessions = 0;
+
+    pthread_mutex_lock(&info->gscan_mux_lock);
+    gscan_mux *mux = info->gscan_mux;
+    if (mux && mux->num_sessions) {
+        int i = id == -1 ? 0 : find_gscan_session(mux, id);
+        if (i >= 0) {
+            route = mux->sessions[i].route;
+            routed = true;
+        }
+        num_sessions = mux->num_sessions;
+    }
+    pthread_mutex_unlock(&info->gscan_mux_lock);
+
+    if (id != -1 && !routed) {
+        return WIFI_ERROR_INVALID_REQUEST_ID;
+    }
+    if (flush && num_sessions > 1) {
+        /* the firmware keeps one set for everyone; flushing would take the others' too */
+        ALOGE("Can't flush cached results shared by %d background scans", num_sessions);
+        return WIFI_ERROR_BUSY;
+    }
+
+    GetScanResultsCommand *cmd = new GetScanResultsCommand(iface, flush, results, max, num);
+    NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    wifi_error err = (wifi_error)cmd->execute();
+    cmd->releaseRef();
+
+    if (err == WIFI_SUCCESS && routed) {
+        route_cached_scans(&route, results, num);
+    }
+    return err;
+}
+
+wifi_error wifi_get_cached_gscan_results(wifi_interface_handle iface, byte flush,
+        int max, wifi_cached_scan_results *results, int *num) {
+    ALOGV("Getting cached scan results, iface handle = %p, num = %d", iface, *num);
+    return get_cached_gscan_results(-1, iface, flush, max, results, num);
+}
+
+wifi_error wifi_get_cached_gscan_results_ext(wifi_request_id id, wifi_interface_handle iface,
+        byte flush, int max, wifi_cached_scan_results *results, int *num)
+{
+    if (id == -1) {
+        return WIFI_ERROR_INVALID_REQUEST_ID;
+    }
+    return get_cached_gscan_results(id, iface, flush, max, results, num);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+
+/*
+ * BSSIDs currently watched by a hotlist. Entries are kept dense so they can be uploaded
+ * as they are, with an open addressed index of twice the capacity for lookups.
+ */
+typedef struct {
+    ap_threshold_param *aps;
+    int num;
+    int capacity;                                   // power of two
+    int *index;                                     // position in aps, -1 when empty
+} hotlist_set;
+
+static int hotlist_slot(const hotlist_set *set, const u8 *bssid)
+{
+    int mask = 2 * set->capacity - 1;
+    int slot = wifi_bssid_hash(bssid) & mask;
+    while (set->index[slot] >= 0 &&
+            memcmp(set->aps[set->index[slot]].bssid, bssid, sizeof(mac_addr)) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int hotlist_find(const hotlist_set *set, const u8 *bssid)
+{
+    return set->num ? set->index[hotlist_slot(set, bssid)] : -1;
+}
+
+static void hotlist_reindex(hotlist_set *set)
+{
+    for (int i = 0; i < 2 * set->capacity; i++) {
+        set->index[i] = -1;
+    }
+    for (int i = 0; i < set->num; i++) {
+        set->index[hotlist_slot(set, set->aps[i].bssid)] = i;
+    }
+}
+
+static wifi_error hotlist_reserve(hotlist_set *set, int num)
+{
+    if (num <= set->capacity) {
+        return WIFI_SUCCESS;
+    } else if (num > WIFI_HOTLIST_MAX_BSSIDS) {
+        ALOGE("Hotlist of %d BSSIDs is over the limit of %d", num, WIFI_HOTLIST_MAX_BSSIDS);
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    int capacity = max(set->capacity, MAX_HOTLIST_APS);
+    while (capacity < num) {
+        capacity <<= 1;
+    }
+
+    ap_threshold_param *aps = (ap_threshold_param *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+            sizeof(ap_threshold_param) * capacity);
+    int *index = (int *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(int) * 2 * capacity);
+    if (aps == NULL || index == NULL) {
+        wifi_hal_free(WIFI_ALLOC_GSCAN, aps);
+        wifi_hal_free(WIFI_ALLOC_GSCAN, index);
+        return WIFI_ERROR_OUT_OF_MEMORY;
+    }
+
+    if (set->num) {
+        memcpy(aps, set->aps, sizeof(ap_threshold_param) * set->num);
+    }
+    wifi_hal_free(WIFI_ALLOC_GSCAN, set->aps);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, set->index);
+    set->aps = aps;
+    set->index = index;
+    set->capacity = capacity;
+    hotlist_reindex(set);
+    return WIFI_SUCCESS;
+}
+
+/* Returns true if the firmware copy of an existing entry is now out of date; room
+ * must have been reserved */
+static bool hotlist_add(hotlist_set *set, const ap_threshold_param *ap)
+{
+    int slot = hotlist_slot(set, ap->bssid);
+    int pos = set->index[slot];
+    if (pos >= 0) {
+        bool changed = set->aps[pos].low != ap->low || set->aps[pos].high != ap->high;
+        set->aps[pos] = *ap;
+        return changed;
+    }
+
+    set->aps[set->num] = *ap;
+    set->index[slot] = set->num++;
+    return false;
+}
+
+static bool hotlist_remove(hotlist_set *set, const u8 *bssid)
+{
+    int pos = hotlist_find(set, bssid);
+    if (pos < 0) {
+        return false;
+    }
+
+    /* backward shift deletion: linear probing can't leave holes, so later entries of the
+     * run move back into the gap unless that would put them before their home slot */
+    int mask = 2 * set->capacity - 1;
+    int hole = hotlist_slot(set, bssid);
+    for (int slot = (hole + 1) & mask; set->index[slot] >= 0; slot = (slot + 1) & mask) {
+        int home = wifi_bssid_hash(set->aps[set->index[slot]].bssid) & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            set->index[hole] = set->index[slot];
+            hole = slot;
+        }
+    }
+    set->index[hole] = -1;
 
-wifi_error wifi_get_cached_gscan_results(wifi_interface_handle iface, byte flush,
-        int max, wifi_cached_scan_results *results, int *num) {
-    ALOGV("Getting cached scan results, iface handle = %p, num = %d", iface, *num);
+    /* the last entry fills the gap in aps; until the index is updated it finds the
+     * entry by its old position, which holds the same BSSID */
+    if (pos != --set->num) {
+        set->aps[pos] = set->aps[set->num];
+        set->index[hotlist_slot(set, set->aps[pos].bssid)] = pos;
+    }
+    return true;
+}
 
-    GetScanResultsCommand *cmd = new GetScanResultsCommand(iface, flush, results, max, num);
-    NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
-    wifi_error err = (wifi_error)cmd->execute();
-    cmd->releaseRef();
-    return err;
+/* Entries the set would hold once remove and then add were applied */
+static int hotlist_size_after(const hotlist_set *set, const ap_threshold_param *add, int num_add,
+        const mac_addr *remove, int num_remove)
+{
+    int num = set->num;
+    for (int i = 0; i < num_remove; i++) {
+        bool counted = hotlist_find(set, remove[i]) < 0;
+        for (int j = 0; j < i && !counted; j++) {
+            counted = memcmp(remove[j], remove[i], sizeof(mac_addr)) == 0;
+        }
+        for (int j = 0; j < num_add && !counted; j++) {
+            counted = memcmp(add[j].bssid, remove[i], sizeof(mac_addr)) == 0;
+        }
+        num -= !counted;
+    }
+    for (int i = 0; i < num_add; i++) {
+        bool counted = hotlist_find(set, add[i].bssid) >= 0;
+        for (int j = 0; j < i && !counted; j++) {
+            counted = memcmp(add[j].bssid, add[i].bssid, sizeof(mac_addr)) == 0;
+        }
+        num += !counted;
+    }
+    return num;
 }
 
-/////////////////////////////////////////////////////////////////////////////
+/* BSSIDs the firmware can track; the HAL's own limit if the driver did not say */
+static int hotlist_firmware_max(wifi_interface_handle iface)
+{
+    int max_bssids = WIFI_HOTLIST_MAX_BSSIDS;
+    wifi_capabilities *caps = wifi_get_capabilities(iface);
+    if (caps) {
+        if (caps->status[CAP_GSCAN] == WIFI_SUCCESS && caps->gscan.max_hotlist_bssids > 0) {
+            max_bssids = min(max_bssids, caps->gscan.max_hotlist_bssids);
+        }
+        wifi_put_capabilities(caps);
+    }
+    return max_bssids;
+}
+
+static void hotlist_free(hotlist_set *set)
+{
+    wifi_hal_free(WIFI_ALLOC_GSCAN, set->aps);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, set->index);
+    memset(set, 0, sizeof(*set));
+}
 
 class BssidHotlistCommand : public WifiCommand
 {
@@ -1009,21 +2379,38 @@ private:
     wifi_bssid_hotlist_params mParams;
     wifi_hotlist_ap_found_handler mHandler;
     static const int MAX_RESULTS = 64;
+    static const int UPLOAD_CHUNK = 64;             // BSSIDs per setup request
     wifi_scan_result mResults[MAX_RESULTS];
+    hotlist_set mSet;
+    bool mReloadPending;                            // firmware list may not match mSet
+    pthread_mutex_t mLock;                          // guards mSet
+    pthread_mutex_t mUpdateLock;                    // serialises uploads
 public:
     BssidHotlistCommand(wifi_interface_handle handle, int id,
             wifi_bssid_hotlist_params params, wifi_hotlist_ap_found_handler handler)
-        : WifiCommand("BssidHotlistCommand", handle, id), mParams(params), mHandler(handler)
-    { }
+        : WifiCommand("BssidHotlistCommand", handle, id), mParams(params), mHandler(handler),
+          mReloadPending(false)
+    {
+        memset(&mSet, 0, sizeof(mSet));
+        pthread_mutex_init(&mLock, NULL);
+        pthread_mutex_init(&mUpdateLock, NULL);
+    }
 
-    int createSetupRequest(WifiRequest& request) {
+    virtual ~BssidHotlistCommand() {
+        hotlist_free(&mSet);
+        pthread_mutex_destroy(&mLock);
+        pthread_mutex_destroy(&mUpdateLock);
+    }
+
+    int createSetupRequest(WifiRequest& request, bool flush, const ap_threshold_param *aps,
+            int num) {
         int result = request.create(GOOGLE_OUI, GSCAN_SUBCMD_SET_HOTLIST);
         if (result < 0) {
             return result;
         }
 
         nlattr *data = request.attr_start(NL80211_ATTR_VENDOR_DATA);
-        result = request.put_u8(GSCAN_ATTRIBUTE_HOTLIST_FLUSH, 1);
+        result = request.put_u8(GSCAN_ATTRIBUTE_HOTLIST_FLUSH, flush);
         if (result < 0) {
             return result;
         }
@@ -1033,26 +2420,26 @@ public:
             return result;
         }
 
-        result = request.put_u32(GSCAN_ATTRIBUTE_HOTLIST_BSSID_COUNT, mParams.num_bssid);
+        result = request.put_u32(GSCAN_ATTRIBUTE_HOTLIST_BSSID_COUNT, num);
         if (result < 0) {
             return result;
         }
 
         struct nlattr * attr = request.attr_start(GSCAN_ATTRIBUTE_HOTLIST_BSSIDS);
-        for (int i = 0; i < mParams.num_bssid; i++) {
+        for (int i = 0; i < num; i++) {
             nlattr *attr2 = request.attr_start(GSCAN_ATTRIBUTE_HOTLIST_ELEM);
             if (attr2 == NULL) {
                 return WIFI_ERROR_OUT_OF_MEMORY;
             }
-            result = request.put_addr(GSCAN_ATTRIBUTE_BSSID, mParams.ap[i].bssid);
+            result = request.put_addr(GSCAN_ATTRIBUTE_BSSID, (u8 *)aps[i].bssid);
             if (result < 0) {
                 return result;
             }
-            result = request.put_u8(GSCAN_ATTRIBUTE_RSSI_HIGH, mParams.ap[i].high);
+            result = request.put_u8(GSCAN_ATTRIBUTE_RSSI_HIGH, aps[i].high);
             if (result < 0) {
                 return result;
             }
-            result = request.put_u8(GSCAN_ATTRIBUTE_RSSI_LOW, mParams.ap[i].low);
+            result = request.put_u8(GSCAN_ATTRIBUTE_RSSI_LOW, aps[i].low);
             if (result < 0) {
                 return result;
             }
@@ -1082,15 +2469,46 @@ public:
         return result;
     }
 
+    /* Sends aps in chunks; with flush the firmware list is replaced, otherwise appended to */
+    int upload(const ap_threshold_param *aps, int num, bool flush) {
+        if (num == 0 && flush) {
+            WifiRequest request(familyId(), ifaceId());
+            int result = createTeardownRequest(request);
+            return result < 0 ? result : requestResponse(request);
+        }
+
+        for (int i = 0; i < num; i += UPLOAD_CHUNK) {
+            WifiRequest request(familyId(), ifaceId());
+            int result = createSetupRequest(request, flush && i == 0, &aps[i],
+                    min(UPLOAD_CHUNK, num - i));
+            if (result < 0) {
+                return result;
+            }
+            result = requestResponse(request);
+            if (result < 0) {
+                return result;
+            }
+        }
+        return WIFI_SUCCESS;
+    }
+
     int start() {
         ALOGI("Executing hotlist setup request, num = %d", mParams.num_bssid);
-        WifiRequest request(familyId(), ifaceId());
-        int result = createSetupRequest(request);
+        int num_bssid = min(mParams.num_bssid, MAX_HOTLIST_APS);
+        int max_bssids = hotlist_firmware_max(ifaceHandle());
+        if (num_bssid > max_bssids) {
+            ALOGE("Hotlist of %d BSSIDs is over the firmware's %d", num_bssid, max_bssids);
+            return WIFI_ERROR_TOO_MANY_REQUESTS;
+        }
+        int result = hotlist_reserve(&mSet, num_bssid);
         if (result < 0) {
             return result;
         }
+        for (int i = 0; i < num_bssid; i++) {
+            hotlist_add(&mSet, &mParams.ap[i]);
+        }
 
-        result = requestResponse(request);
+        result = upload(mSet.aps, mSet.num, true);
         if (result < 0) {
             ALOGI("Failed to execute hotlist setup request, result = %d", result);
             unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_HOTLIST_RESULTS_FOUND);
@@ -1098,7 +2516,8 @@ public:
             return result;
         }
 
-        ALOGI("Successfully set %d APs in the hotlist ", mParams.num_bssid);
+        ALOGI("Successfully set %d APs in the hotlist ", mSet.num);
+        WifiRequest request(familyId(), ifaceId());
         result = createFeatureRequest(request, GSCAN_SUBCMD_ENABLE_GSCAN, 1);
         if (result < 0) {
             return result;
@@ -1118,6 +2537,70 @@ public:
         return result;
     }
 
+    /* Additions go to the firmware as a delta; the firmware can't drop single entries,
+     * so removals and threshold changes reload the whole list */
+    int update(const ap_threshold_param *add, int num_add, const mac_addr *remove,
+            int num_remove) {
+        int max_bssids = hotlist_firmware_max(ifaceHandle());
+        pthread_mutex_lock(&mUpdateLock);
+        pthread_mutex_lock(&mLock);
+
+        /* entries past what the firmware tracks would never fire */
+        int num_after = hotlist_size_after(&mSet, add, num_add, remove, num_remove);
+        if (num_after > max_bssids) {
+            pthread_mutex_unlock(&mLock);
+            pthread_mutex_unlock(&mUpdateLock);
+            ALOGE("Hotlist of %d BSSIDs is over the firmware's %d", num_after, max_bssids);
+            return WIFI_ERROR_TOO_MANY_REQUESTS;
+        }
+
+        bool reload = mReloadPending;
+        for (int i = 0; i < num_remove; i++) {
+            reload |= hotlist_remove(&mSet, remove[i]);
+        }
+
+        int result = hotlist_reserve(&mSet, mSet.num + num_add);
+        if (result < 0) {
+            mReloadPending = reload;
+            pthread_mutex_unlock(&mLock);
+            pthread_mutex_unlock(&mUpdateLock);
+            return result;
+        }
+
+        int first_new = mSet.num;
+        for (int i = 0; i < num_add; i++) {
+            reload |= hotlist_add(&mSet, &add[i]);
+        }
+
+        /* upload from a copy so events aren't held up behind the driver */
+        int first = reload ? 0 : first_new;
+        int num = mSet.num - first;
+        ap_threshold_param *aps = NULL;
+        if (num) {
+            aps = (ap_threshold_param *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+                    sizeof(ap_threshold_param) * num);
+            if (aps == NULL) {
+                mReloadPending = true;
+                pthread_mutex_unlock(&mLock);
+                pthread_mutex_unlock(&mUpdateLock);
+                return WIFI_ERROR_OUT_OF_MEMORY;
+            }
+            memcpy(aps, &mSet.aps[first], sizeof(ap_threshold_param) * num);
+        }
+        pthread_mutex_unlock(&mLock);
+
+        result = WIFI_SUCCESS;
+        if (reload || num) {
+            ALOGI("Hotlist %s of %d APs", reload ? "reload" : "update", num);
+            result = upload(aps, num, reload);
+        }
+        mReloadPending = result < 0;
+
+        wifi_hal_free(WIFI_ALLOC_GSCAN, aps);
+        pthread_mutex_unlock(&mUpdateLock);
+        return result;
+    }
+
     virtual int cancel() {
         /* unregister event handler */
         unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_HOTLIST_RESULTS_FOUND);
@@ -1143,6 +2626,26 @@ public:
         return NL_SKIP;
     }
 
+    void deliver(int event_id, int num) {
+        if (event_id == GSCAN_EVENT_HOTLIST_RESULTS_FOUND) {
+            ALOGI("FOUND %d hotlist APs", num);
+            wifi_scan_cache_update_results(mIfaceInfo, mResults, num);
+            wifi_scan_history_add_results(mIfaceInfo, mResults, num);
+            wifi_scan_export_publish_results(mIfaceInfo, mResults, num,
+                    WIFI_SCAN_EXPORT_HOTLIST);
+            wifi_warm_start_update_results(mIfaceInfo, mResults, num);
+            if (*mHandler.on_hotlist_ap_found)
+                (*mHandler.on_hotlist_ap_found)(id(), num, mResults);
+        } else if (event_id == GSCAN_EVENT_HOTLIST_RESULTS_LOST) {
+            ALOGI("LOST %d hotlist APs", num);
+            for (int i = 0; i < num; i++) {
+                wifi_scan_cache_remove(mIfaceInfo, mResults[i].bssid);
+            }
+            if (*mHandler.on_hotlist_ap_lost)
+                (*mHandler.on_hotlist_ap_lost)(id(), num, mResults);
+        }
+    }
+
     virtual int handleEvent(WifiEvent& event) {
         ALOGI("Hotlist AP event");
         int event_id = event.get_vendor_subcmd();
@@ -1156,23 +2659,26 @@ public:
             return NL_SKIP;
         }
 
-        memset(mResults, 0, sizeof(wifi_scan_result) * MAX_RESULTS);
-
+        /* deliver MAX_RESULTS at a time, skipping BSSIDs removed since the firmware
+         * queued the event; the lock is dropped around callbacks that may update */
         int num = len / sizeof(wifi_gscan_result_t);
         wifi_gscan_result_t *inp = (wifi_gscan_result_t *)event.get_vendor_data();
-        num = min(MAX_RESULTS, num);
-        for (int i = 0; i < num; i++, inp++) {
-            convert_to_hal_result(&(mResults[i]), inp);
-        }
+        int i = 0;
+        while (i < num) {
+            int n = 0;
+            pthread_mutex_lock(&mLock);
+            for (; i < num && n < MAX_RESULTS; i++) {
+                if (hotlist_find(&mSet, inp[i].bssid) < 0) {
+                    continue;
+                }
+                memset(&mResults[n], 0, sizeof(wifi_scan_result));
+                convert_to_hal_result(&mResults[n++], &inp[i]);
+            }
+            pthread_mutex_unlock(&mLock);
 
-        if (event_id == GSCAN_EVENT_HOTLIST_RESULTS_FOUND) {
-            ALOGI("FOUND %d hotlist APs", num);
-            if (*mHandler.on_hotlist_ap_found)
-                (*mHandler.on_hotlist_ap_found)(id(), num, mResults);
-        } else if (event_id == GSCAN_EVENT_HOTLIST_RESULTS_LOST) {
-            ALOGI("LOST %d hotlist APs", num);
-            if (*mHandler.on_hotlist_ap_lost)
-                (*mHandler.on_hotlist_ap_lost)(id(), num, mResults);
+            if (n) {
+                deliver(event_id, n);
+            }
         }
         return NL_SKIP;
     }
@@ -1184,10 +2690,12 @@ private:
     wifi_epno_params epno_params;
     wifi_epno_handler mHandler;
     wifi_scan_result mResults[MAX_EPNO_NETWORKS];
+    epno_matcher *mMatcher;                         // networks the firmware wasn't given
 public:
     ePNOCommand(wifi_interface_handle handle, int id,
-            const wifi_epno_params *params, wifi_epno_handler handler)
-        : WifiCommand("ePNOCommand", handle, id), mHandler(handler)
+            const wifi_epno_params *params, wifi_epno_handler handler,
+            epno_matcher *matcher = NULL)
+        : WifiCommand("ePNOCommand", handle, id), mHandler(handler), mMatcher(matcher)
     {
         if (params != NULL) {
             memcpy(&epno_params, params, sizeof(wifi_epno_params));
@@ -1195,6 +2703,12 @@ public:
             memset(&epno_params, 0, sizeof(wifi_epno_params));
         }
     }
+
+    virtual ~ePNOCommand() {
+        if (mMatcher) {
+            epno_matcher_free(mMatcher);
+        }
+    }
     int createSetupRequest(WifiRequest& request) {
         if (epno_params.num_networks > MAX_EPNO_NETWORKS) {
             ALOGE("wrong epno num_networks:%d", epno_params.num_networks);
@@ -1298,11 +2812,42 @@ public:
         return result;
     }
 
+    /* Stops matching on the host; returns true if a matcher was detached. The reset
+     * command (id -1) has none of its own and takes down whichever command matches */
+    bool detachMatcher() {
+        pthread_mutex_lock(&mIfaceInfo->epno_lock);
+        WifiCommand *matcher = mIfaceInfo->epno;
+        bool attached = matcher != NULL && (matcher == this || id() == -1);
+        if (attached) {
+            mIfaceInfo->epno = NULL;
+        }
+        pthread_mutex_unlock(&mIfaceInfo->epno_lock);
+        if (attached) {
+            matcher->releaseRef();
+        }
+        return attached;
+    }
+
     int start() {
         ALOGI("Executing ePNO setup request, num = %d", epno_params.num_networks);
+
+        /* claimed before the firmware list is replaced, so a refused list changes nothing */
+        if (mMatcher) {
+            pthread_mutex_lock(&mIfaceInfo->epno_lock);
+            if (mIfaceInfo->epno != NULL) {
+                pthread_mutex_unlock(&mIfaceInfo->epno_lock);
+                ALOGE("Host ePNO matching already running on %s", mIfaceInfo->name);
+                return WIFI_ERROR_BUSY;
+            }
+            addRef();
+            mIfaceInfo->epno = this;
+            pthread_mutex_unlock(&mIfaceInfo->epno_lock);
+        }
+
         WifiRequest request(familyId(), ifaceId());
         int result = createSetupRequest(request);
         if (result < 0) {
+            detachMatcher();
             return result;
         }
 
@@ -1310,11 +2855,17 @@ public:
         if (result < 0) {
             ALOGI("Failed to execute ePNO setup request, result = %d", result);
             unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_EPNO_EVENT);
+            detachMatcher();
             return result;
         }
 
         ALOGI("Successfully set %d SSIDs for ePNO", epno_params.num_networks);
         registerVendorHandler(GOOGLE_OUI, GSCAN_EVENT_EPNO_EVENT);
+
+        if (mMatcher) {
+            wifi_refresh_scan_filter(mIfaceInfo);
+            ALOGI("Matching %d more SSIDs on the host", mMatcher->num_networks);
+        }
         ALOGI("successfully restarted the scan");
         return result;
     }
@@ -1322,6 +2873,10 @@ public:
     virtual int cancel() {
         /* unregister event handler */
         unregisterVendorHandler(GOOGLE_OUI, GSCAN_EVENT_EPNO_EVENT);
+
+        if (detachMatcher()) {
+            wifi_refresh_scan_filter(mIfaceInfo);
+        }
         /* create set hotlist message with empty hotlist */
         WifiRequest request(familyId(), ifaceId());
         int result = createTeardownRequest(request);
@@ -1376,8 +2931,57 @@ public:
             (*mHandler.on_network_found)(id(), num, mResults);
         return NL_SKIP;
     }
+
+    /* called with epno_lock held */
+    void observe(const wifi_scan_result *result) {
+        epno_matcher_observe(mMatcher, result);
+    }
+
+    int completeScan() {
+        return epno_matcher_complete_scan(mMatcher);
+    }
+
+    /* hits stay put until the next completeScan(), which is on this thread */
+    void deliver(int num) {
+        ALOGI("Host ePNO matched %d networks", num);
+        if (*mHandler.on_network_found)
+            (*mHandler.on_network_found)(id(), num, mMatcher->hits);
+    }
 };
 
+static void observe_epno(interface_info *iface, const wifi_scan_result *result)
+{
+    if (iface->epno == NULL) {
+        return;                             /* checked again under the lock */
+    }
+
+    pthread_mutex_lock(&iface->epno_lock);
+    if (iface->epno) {
+        ((ePNOCommand *)iface->epno)->observe(result);
+    }
+    pthread_mutex_unlock(&iface->epno_lock);
+}
+
+static void complete_epno_scan(interface_info *iface)
+{
+    if (iface->epno == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&iface->epno_lock);
+    ePNOCommand *cmd = (ePNOCommand *)iface->epno;
+    int num = cmd ? cmd->completeScan() : 0;
+    if (num) {
+        cmd->addRef();
+    }
+    pthread_mutex_unlock(&iface->epno_lock);
+
+    if (num) {
+        cmd->deliver(num);
+        cmd->releaseRef();
+    }
+}
+
 wifi_error wifi_set_bssid_hotlist(wifi_request_id id, wifi_interface_handle iface,
         wifi_bssid_hotlist_params params, wifi_hotlist_ap_found_handler handler)
 {
@@ -1404,6 +3008,32 @@ wifi_error wifi_reset_bssid_hotlist(wifi_request_id id, wifi_interface_handle if
     return wifi_cancel_cmd(id, iface);
 }
 
+wifi_error wifi_update_bssid_hotlist(wifi_request_id id, wifi_interface_handle iface,
+        const ap_threshold_param *add, int num_add, const mac_addr *remove, int num_remove)
+{
+    if (num_add < 0 || num_remove < 0 || num_add > WIFI_HOTLIST_MAX_BSSIDS ||
+            num_remove > WIFI_HOTLIST_MAX_BSSIDS || (num_add && add == NULL) ||
+            (num_remove && remove == NULL)) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    /* a reset may unregister and release the command meanwhile */
+    hal_info *info = getHalInfo(iface);
+    pthread_mutex_lock(&info->cb_lock);
+    WifiCommand *cmd = wifi_get_cmd(getWifiHandle(iface), id);
+    if (cmd == NULL || strcmp(cmd->getType(), "BssidHotlistCommand") != 0) {
+        pthread_mutex_unlock(&info->cb_lock);
+        return WIFI_ERROR_INVALID_REQUEST_ID;
+    }
+    cmd->addRef();
+    pthread_mutex_unlock(&info->cb_lock);
+
+    wifi_error result = (wifi_error)((BssidHotlistCommand *)cmd)->update(add, num_add,
+            remove, num_remove);
+    cmd->releaseRef();
+    return result;
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 
@@ -1607,6 +3237,148 @@ public:
     }
 };
 
+/* Significant change worked out on the host from full scan results */
+class HostSignificantChangeCommand : public WifiCommand
+{
+private:
+    sig_change_engine *mEngine;
+    wifi_significant_change_handler mHandler;
+public:
+    HostSignificantChangeCommand(wifi_interface_handle handle, int id,
+            sig_change_engine *engine, wifi_significant_change_handler handler)
+        : WifiCommand("HostSignificantChangeCommand", handle, id), mEngine(engine),
+            mHandler(handler)
+    { }
+
+    virtual ~HostSignificantChangeCommand() {
+        sig_change_free(mEngine);
+    }
+
+    int start() {
+        pthread_mutex_lock(&mIfaceInfo->sig_change_lock);
+        if (mIfaceInfo->sig_change != NULL) {
+            pthread_mutex_unlock(&mIfaceInfo->sig_change_lock);
+            ALOGE("Host significant change already running on %s", mIfaceInfo->name);
+            return WIFI_ERROR_BUSY;
+        }
+        addRef();
+        mIfaceInfo->sig_change = this;
+        pthread_mutex_unlock(&mIfaceInfo->sig_change_lock);
+        wifi_refresh_scan_filter(mIfaceInfo);
+
+        ALOGI("Tracking significant change of %d APs on the host", mEngine->num_aps);
+        return WIFI_SUCCESS;
+    }
+
+    virtual int cancel() {
+        pthread_mutex_lock(&mIfaceInfo->sig_change_lock);
+        bool attached = mIfaceInfo->sig_change == this;
+        if (attached) {
+            mIfaceInfo->sig_change = NULL;
+        }
+        pthread_mutex_unlock(&mIfaceInfo->sig_change_lock);
+
+        if (attached) {
+            wifi_refresh_scan_filter(mIfaceInfo);
+            releaseRef();
+        }
+        ALOGI("successfully reset host significant change");
+        return WIFI_SUCCESS;
+    }
+
+    /* called with sig_change_lock held */
+    void observe(const wifi_scan_result *result) {
+        sig_change_observe(mEngine, result);
+    }
+
+    int completeScan() {
+        return sig_change_complete_scan(mEngine);
+    }
+
+    /* engine results stay put until the next completeScan(), which is on this thread */
+    void deliver(int num) {
+        ALOGV("Host significant change in %d APs", num);
+        if (*mHandler.on_significant_change)
+            (*mHandler.on_significant_change)(id(), num, mEngine->results);
+    }
+
+    virtual int handleResponse(WifiEvent& reply) {
+        return NL_SKIP;
+    }
+
+    virtual int handleEvent(WifiEvent& event) {
+        return NL_SKIP;
+    }
+};
+
+static void observe_sig_change(interface_info *iface, const wifi_scan_result *result)
+{
+    if (iface->sig_change == NULL) {
+        return;                             /* checked again under the lock */
+    }
+
+    pthread_mutex_lock(&iface->sig_change_lock);
+    if (iface->sig_change) {
+        ((HostSignificantChangeCommand *)iface->sig_change)->observe(result);
+    }
+    pthread_mutex_unlock(&iface->sig_change_lock);
+}
+
+static void complete_sig_change_scan(interface_info *iface)
+{
+    if (iface->sig_change == NULL) {
+        return;
+    }
+
+    /* deliver outside the lock so the handler may reset */
+    pthread_mutex_lock(&iface->sig_change_lock);
+    HostSignificantChangeCommand *cmd = (HostSignificantChangeCommand *)iface->sig_change;
+    int num = cmd ? cmd->completeScan() : 0;
+    if (num) {
+        cmd->addRef();
+    }
+    pthread_mutex_unlock(&iface->sig_change_lock);
+
+    if (num) {
+        cmd->deliver(num);
+        cmd->releaseRef();
+    }
+}
+
+wifi_error wifi_set_host_significant_change_handler(wifi_request_id id,
+        wifi_interface_handle iface, const wifi_significant_change_ext_params *params,
+        wifi_significant_change_handler handler)
+{
+    wifi_handle handle = getWifiHandle(iface);
+
+    if (params == NULL || (params->num_bssid && params->ap == NULL)) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+    sig_change_engine *engine = sig_change_create(params->rssi_sample_size,
+            params->lost_ap_sample_size, params->min_breaching, params->ap, params->num_bssid);
+    if (engine == NULL) {
+        ALOGE("Bad host significant change params: %d BSSIDs, %d samples",
+                params->num_bssid, params->rssi_sample_size);
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    HostSignificantChangeCommand *cmd = new HostSignificantChangeCommand(
+            iface, id, engine, handler);
+    NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    wifi_error result = wifi_register_cmd(handle, id, cmd);
+    if (result != WIFI_SUCCESS) {
+        cmd->releaseRef();
+        return result;
+    }
+    result = (wifi_error)cmd->start();
+    if (result != WIFI_SUCCESS) {
+        wifi_unregister_cmd(handle, id);
+        cmd->releaseRef();
+        return result;
+    }
+    return result;
+}
+
 wifi_error wifi_set_significant_change_handler(wifi_request_id id, wifi_interface_handle iface,
         wifi_significant_change_params params, wifi_significant_change_handler handler)
 {
@@ -1624,6 +3396,22 @@ wifi_error wifi_set_significant_change_handler(wifi_request_id id, wifi_interfac
     if (result != WIFI_SUCCESS) {
         wifi_unregister_cmd(handle, id);
         cmd->releaseRef();
+        if (result == -EOPNOTSUPP || result == WIFI_ERROR_NOT_SUPPORTED) {
+            /* the host engine only sees full results; without them it would never fire */
+            if (!gscan_full_results_on(getIfaceInfo(iface))) {
+                ALOGI("No firmware significant change support and no full results");
+                return WIFI_ERROR_NOT_SUPPORTED;
+            }
+            ALOGI("No firmware significant change support, tracking on the host");
+            wifi_significant_change_ext_params ext;
+            ext.rssi_sample_size = min(params.rssi_sample_size,
+                    WIFI_SIGNIFICANT_CHANGE_MAX_SAMPLES);
+            ext.lost_ap_sample_size = params.lost_ap_sample_size;
+            ext.min_breaching = params.min_breaching;
+            ext.num_bssid = min(params.num_bssid, MAX_SIGNIFICANT_CHANGE_APS);
+            ext.ap = params.ap;
+            return wifi_set_host_significant_change_handler(id, iface, &ext, handler);
+        }
         return result;
     }
     return result;
@@ -1671,6 +3459,79 @@ wifi_error wifi_set_epno_list(wifi_request_id id, wifi_interface_handle iface,
     return result;
 }
 
+wifi_error wifi_set_epno_list_ext(wifi_request_id id, wifi_interface_handle iface,
+        const wifi_epno_ext_params *params, wifi_epno_handler handler)
+{
+    wifi_handle handle = getWifiHandle(iface);
+
+    if (params == NULL || params->num_networks < 0 ||
+            params->num_networks > WIFI_EPNO_MAX_NETWORKS ||
+            (params->num_networks && params->networks == NULL)) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    /* order by priority, keeping list order between equals */
+    int num = params->num_networks;
+    int *order = (int *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(int) * (num + 1));
+    NULL_CHECK_RETURN(order, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    for (int i = 0; i < num; i++) {
+        int j = i;
+        for (; j > 0 && params->networks[order[j - 1]].priority < params->networks[i].priority;
+                j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    wifi_epno_params fw_params;
+    memset(&fw_params, 0, sizeof(fw_params));
+    fw_params.min5GHz_rssi = params->min5GHz_rssi;
+    fw_params.min24GHz_rssi = params->min24GHz_rssi;
+    fw_params.initial_score_max = params->initial_score_max;
+    fw_params.current_connection_bonus = params->current_connection_bonus;
+    fw_params.same_network_bonus = params->same_network_bonus;
+    fw_params.secure_bonus = params->secure_bonus;
+    fw_params.band5GHz_bonus = params->band5GHz_bonus;
+    fw_params.num_networks = min(num, MAX_EPNO_NETWORKS);
+    for (int i = 0; i < fw_params.num_networks; i++) {
+        const wifi_epno_network_ext *network = &params->networks[order[i]];
+        memcpy(fw_params.networks[i].ssid, network->ssid, sizeof(fw_params.networks[i].ssid));
+        fw_params.networks[i].flags = network->flags;
+        fw_params.networks[i].auth_bit_field = network->auth_bit_field;
+    }
+
+    epno_matcher *matcher = NULL;
+    if (num > MAX_EPNO_NETWORKS) {
+        matcher = epno_matcher_create(params, &order[MAX_EPNO_NETWORKS],
+                num - MAX_EPNO_NETWORKS);
+        if (matcher == NULL) {
+            wifi_hal_free(WIFI_ALLOC_GSCAN, order);
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    wifi_hal_free(WIFI_ALLOC_GSCAN, order);
+
+    ePNOCommand *cmd = new ePNOCommand(iface, id, &fw_params, handler, matcher);
+    if (cmd == NULL) {
+        if (matcher) {
+            epno_matcher_free(matcher);
+        }
+        return WIFI_ERROR_OUT_OF_MEMORY;
+    }
+    wifi_error result = wifi_register_cmd(handle, id, cmd);
+    if (result != WIFI_SUCCESS) {
+        cmd->releaseRef();
+        return result;
+    }
+    result = (wifi_error)cmd->start();
+    if (result != WIFI_SUCCESS) {
+        wifi_unregister_cmd(handle, id);
+        cmd->releaseRef();
+        return result;
+    }
+    return result;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1679,20 +3540,20 @@ class AnqpoConfigureCommand : public WifiCommand
     int num_hs;
     wifi_passpoint_network *mNetworks;
     wifi_passpoint_event_handler mHandler;
-    wifi_scan_result *mResult;
+    wifi_scan_result mResult;
 public:
     AnqpoConfigureCommand(wifi_request_id id, wifi_interface_handle iface,
         int num, wifi_passpoint_network *hs_list, wifi_passpoint_event_handler handler)
         : WifiCommand("AnqpoConfigureCommand", iface, id), num_hs(num), mNetworks(hs_list),
             mHandler(handler)
     {
-        mResult = NULL;
     }
 
+    /* val networks from mNetworks; 0 clears the list */
     int createRequest(WifiRequest& request, int val) {
 
         int result = request.create(GOOGLE_OUI, GSCAN_SUBCMD_ANQPO_CONFIG);
-        result = request.put_u32(GSCAN_ATTRIBUTE_ANQPO_HS_LIST_SIZE, num_hs);
+        result = request.put_u32(GSCAN_ATTRIBUTE_ANQPO_HS_LIST_SIZE, val);
         if (result < 0) {
             return result;
         }
@@ -1700,7 +3561,7 @@ public:
         nlattr *data = request.attr_start(NL80211_ATTR_VENDOR_DATA);
 
         struct nlattr * attr = request.attr_start(GSCAN_ATTRIBUTE_ANQPO_HS_LIST);
-        for (int i = 0; i < num_hs; i++) {
+        for (int i = 0; i < val; i++) {
             nlattr *attr2 = request.attr_start(i);
             if (attr2 == NULL) {
                 return WIFI_ERROR_OUT_OF_MEMORY;
@@ -1709,12 +3570,20 @@ public:
             if (result < 0) {
                 return result;
             }
-            result = request.put(GSCAN_ATTRIBUTE_ANQPO_HS_NAI_REALM, mNetworks[i].realm, 256);
+            /* only the used part of the realm and RCOI arrays, straight from the
+             * caller's list: the realm with its terminator, RCOIs up to the last set */
+            int realm_len = strnlen(mNetworks[i].realm, sizeof(mNetworks[i].realm) - 1) + 1;
+            result = request.put_external(GSCAN_ATTRIBUTE_ANQPO_HS_NAI_REALM,
+                         mNetworks[i].realm, realm_len);
             if (result < 0) {
                 return result;
             }
-            result = request.put(GSCAN_ATTRIBUTE_ANQPO_HS_ROAM_CONSORTIUM_ID,
-                         mNetworks[i].roamingConsortiumIds, 128);
+            int num_rcoi = sizeof(mNetworks[i].roamingConsortiumIds) / sizeof(int64_t);
+            while (num_rcoi > 0 && mNetworks[i].roamingConsortiumIds[num_rcoi - 1] == 0) {
+                num_rcoi--;
+            }
+            result = request.put_external(GSCAN_ATTRIBUTE_ANQPO_HS_ROAM_CONSORTIUM_ID,
+                         mNetworks[i].roamingConsortiumIds, num_rcoi * sizeof(int64_t));
             if (result < 0) {
                 return result;
             }
@@ -1791,37 +3660,49 @@ public:
         nlattr *vendor_data = event.get_attribute(NL80211_ATTR_VENDOR_DATA);
         unsigned int len = event.get_vendor_data_len();
 
-        if (vendor_data == NULL || len < sizeof(wifi_scan_result)) {
+        if (vendor_data == NULL || len < sizeof(wifi_gscan_full_result_t)) {
             ALOGI("No scan results found");
             return NL_SKIP;
         }
-        mResult = (wifi_scan_result *)malloc(sizeof(wifi_scan_result));
-        if (!mResult) {
-            return NL_SKIP;
-        }
         wifi_gscan_full_result_t *drv_res = (wifi_gscan_full_result_t *)event.get_vendor_data();
         wifi_gscan_result_t *fixed = &drv_res->fixed;
-        convert_to_hal_result(mResult, fixed);
 
-        byte *anqp = (byte *)drv_res + offsetof(wifi_gscan_full_result_t, ie_data) + drv_res->ie_length;
+        /* IEs, then the GAS response, then the network id */
+        unsigned int anqp_off = offsetof(wifi_gscan_full_result_t, ie_data) + drv_res->ie_length;
+        if (anqp_off + offsetof(wifi_anqp_gas_resp, data) > len) {
+            ALOGE("BAD ANQPO event, len %d ie_len %d", len, drv_res->ie_length);
+            return NL_SKIP;
+        }
+        byte *anqp = (byte *)drv_res + anqp_off;
         wifi_anqp_gas_resp *gas = (wifi_anqp_gas_resp *)anqp;
         int anqp_len = offsetof(wifi_anqp_gas_resp, data) + gas->data_len;
+        if (anqp_off + anqp_len + sizeof(int) > len) {
+            ALOGE("BAD ANQPO event, len %d anqp_len %d", len, anqp_len);
+            return NL_SKIP;
+        }
         int networkId = *(int *)((byte *)anqp + anqp_len);
 
-        ALOGI("%-32s\t", mResult->ssid);
+        memset(&mResult, 0, sizeof(mResult));
+        convert_to_hal_result(&mResult, fixed);
+
+        ALOGI("%-32s\t", mResult.ssid);
 
-        ALOGI("%02x:%02x:%02x:%02x:%02x:%02x ", mResult->bssid[0], mResult->bssid[1],
-                mResult->bssid[2], mResult->bssid[3], mResult->bssid[4], mResult->bssid[5]);
+        ALOGI("%02x:%02x:%02x:%02x:%02x:%02x ", mResult.bssid[0], mResult.bssid[1],
+                mResult.bssid[2], mResult.bssid[3], mResult.bssid[4], mResult.bssid[5]);
 
-        ALOGI("%d\t", mResult->rssi);
-        ALOGI("%d\t", mResult->channel);
-        ALOGI("%lld\t", mResult->ts);
-        ALOGI("%lld\t", mResult->rtt);
-        ALOGI("%lld\n", mResult->rtt_sd);
+        ALOGI("%d\t", mResult.rssi);
+        ALOGI("%d\t", mResult.channel);
+        ALOGI("%lld\t", mResult.ts);
+        ALOGI("%lld\t", mResult.rtt);
+        ALOGI("%lld\n", mResult.rtt_sd);
+
+        mac_addr hessid;
+        bool has_hessid = anqp_get_hessid(drv_res->ie_data, drv_res->ie_length, hessid);
+        anqp_cache_store(mIfaceInfo, mResult.bssid, has_hessid ? hessid : NULL, networkId,
+                anqp, anqp_len);
 
         if(*mHandler.on_passpoint_network_found)
-            (*mHandler.on_passpoint_network_found)(id(), networkId, mResult, anqp_len, anqp);
-        free(mResult);
+            (*mHandler.on_passpoint_network_found)(id(), networkId, &mResult, anqp_len, anqp);
         return NL_SKIP;
     }
 };
@@ -1831,6 +3712,9 @@ wifi_error wifi_set_passpoint_list(wifi_request_id id, wifi_interface_handle ifa
 {
     wifi_handle handle = getWifiHandle(iface);
 
+    /* matches are cached from the event loop, so the cache has to be there already */
+    anqp_cache_prepare(getIfaceInfo(iface));
+
     AnqpoConfigureCommand *cmd = new AnqpoConfigureCommand(id, iface, num, networks, handler);
     NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
     wifi_error result = wifi_register_cmd(handle, id, cmd);
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "gscan_mux.h"
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*
+ * Buckets can share a merged bucket if the firmware would scan them at the same times
+ * and batch them alike; a bucket without batching would leave the other session with
+ * nothing cached
+ */
+static bool same_timing(const wifi_scan_bucket_spec *a, const wifi_scan_bucket_spec *b)
+{
+    return a->period == b->period && a->max_period == b->max_period &&
+            a->base == b->base && a->step_count == b->step_count &&
+            (a->report_events & REPORT_EVENTS_NO_BATCH) ==
+            (b->report_events & REPORT_EVENTS_NO_BATCH);
+}
+
+/* Adds the channels of from to to; false if the union would not fit */
+static bool merge_channels(wifi_scan_bucket_spec *to, const wifi_scan_bucket_spec *from)
+{
+    wifi_scan_channel_spec channels[MAX_CHANNELS];
+    int num = to->num_channels;
+
+    memcpy(channels, to->channels, sizeof(channels[0]) * num);
+    for (int i = 0; i < from->num_channels; i++) {
+        const wifi_scan_channel_spec *channel = &from->channels[i];
+        int j = 0;
+        while (j < num && channels[j].channel != channel->channel) {
+            j++;
+        }
+        if (j == num) {
+            if (num == MAX_CHANNELS) {
+                return false;
+            }
+            channels[num++] = *channel;
+        } else {
+            /* the longer dwell serves both, and an active scan finds what a passive one does */
+            channels[j].dwellTimeMs = max(channels[j].dwellTimeMs, channel->dwellTimeMs);
+            channels[j].passive = channels[j].passive && channel->passive;
+        }
+    }
+
+    memcpy(to->channels, channels, sizeof(channels[0]) * num);
+    to->num_channels = num;
+    return true;
+}
+
+static int find_merged_bucket(wifi_scan_cmd_params *merged, const wifi_scan_bucket_spec *bucket)
+{
+    for (int i = 0; i < merged->num_buckets; i++) {
+        wifi_scan_bucket_spec *candidate = &merged->buckets[i];
+        if (!same_timing(candidate, bucket) || candidate->band != bucket->band) {
+            continue;
+        }
+        if (bucket->band != WIFI_BAND_UNSPECIFIED || merge_channels(candidate, bucket)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+wifi_error gscan_mux_merge(gscan_session *sessions, int num_sessions,
+        wifi_scan_cmd_params *merged)
+{
+    memset(merged, 0, sizeof(*merged));
+
+    for (int s = 0; s < num_sessions; s++) {
+        const wifi_scan_cmd_params *params = &sessions[s].params;
+        gscan_route *route = &sessions[s].route;
+
+        memset(route->buckets, 0, sizeof(route->buckets));
+        route->full_results = 0;
+
+        merged->base_period = gcd(merged->base_period, params->base_period);
+        merged->max_ap_per_scan = max(merged->max_ap_per_scan, params->max_ap_per_scan);
+        /* report as soon as the most eager session wants it */
+        if (params->report_threshold_percent && (merged->report_threshold_percent == 0 ||
+                params->report_threshold_percent < merged->report_threshold_percent)) {
+            merged->report_threshold_percent = params->report_threshold_percent;
+        }
+        if (params->report_threshold_num_scans && (merged->report_threshold_num_scans == 0 ||
+                params->report_threshold_num_scans < merged->report_threshold_num_scans)) {
+            merged->report_threshold_num_scans = params->report_threshold_num_scans;
+        }
+
+        for (int b = 0; b < params->num_buckets && b < MAX_BUCKETS; b++) {
+            const wifi_scan_bucket_spec *bucket = &params->buckets[b];
+            merged->base_period = gcd(merged->base_period, bucket->period);
+
+            int i = find_merged_bucket(merged, bucket);
+            if (i < 0) {
+                if (merged->num_buckets == MAX_BUCKETS) {
+                    ALOGW("Background scans need more than %d buckets", MAX_BUCKETS);
+                    return WIFI_ERROR_TOO_MANY_REQUESTS;
+                }
+                i = merged->num_buckets++;
+                merged->buckets[i] = *bucket;
+                merged->buckets[i].bucket = i;
+                merged->buckets[i].report_events = bucket->report_events & REPORT_EVENTS_NO_BATCH;
+            }
+
+            /* NO_BATCH is the same for every bucket merged here; the rest add up */
+            merged->buckets[i].report_events |= bucket->report_events & ~REPORT_EVENTS_NO_BATCH;
+            route->buckets[i] |= 1U << (bucket->bucket & 31);
+            if (bucket->report_events & REPORT_EVENTS_FULL_RESULTS) {
+                route->full_results |= 1U << i;
+            }
+        }
+    }
+
+    ALOGV("Merged %d background scans into %d buckets, base period %d", num_sessions,
+            merged->num_buckets, merged->base_period);
+    return WIFI_SUCCESS;
+}
+
+u32 gscan_mux_route_buckets(const gscan_route *route, u32 merged_buckets)
+{
+    u32 buckets = 0;
+    for (int i = 0; merged_buckets && i < MAX_BUCKETS; i++, merged_buckets >>= 1) {
+        if (merged_buckets & 1) {
+            buckets |= route->buckets[i];
+        }
+    }
+    return buckets;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_GSCAN_MUX_H__
+#define __WIFI_HAL_GSCAN_MUX_H__
+
+#include "common.h"
+
+#define GSCAN_MUX_MAX_SESSIONS  8
+
+/* Where results from the merged schedule go for one session */
+typedef struct {
+    wifi_request_id id;
+    wifi_scan_result_handler handler;
+    u32 buckets[MAX_BUCKETS];                       // session bucket bits per merged bucket
+    u32 full_results;                               // merged buckets it wants full results of
+} gscan_route;
+
+/* One client's background scan, as it asked for it */
+typedef struct {
+    wifi_scan_cmd_params params;
+    gscan_route route;
+} gscan_session;
+
+/*
+ * Background scans of several clients run as one firmware schedule. Buckets with the
+ * same timing share a merged bucket, so a channel wanted by two clients at the same
+ * rate is scanned once; the base period is the GCD of everything asked for. Results
+ * are handed back to each session in terms of its own buckets.
+ */
+struct gscan_mux {
+    gscan_session sessions[GSCAN_MUX_MAX_SESSIONS];
+    int num_sessions;
+    wifi_scan_cmd_params merged;                    // what the firmware runs
+    WifiCommand *cmd;                               // ScanCommand running merged, if any
+    wifi_request_id cmd_id;                         // what cmd is registered under
+};
+
+/* Builds the merged schedule of all sessions and their routes; fails with
+ * WIFI_ERROR_TOO_MANY_REQUESTS if it would need more than MAX_BUCKETS buckets */
+wifi_error gscan_mux_merge(gscan_session *sessions, int num_sessions,
+        wifi_scan_cmd_params *merged);
+/* Translates merged buckets_scanned bits into the session's own; 0 if none are its */
+u32 gscan_mux_route_buckets(const gscan_route *route, u32 merged_buckets);
+
+#endif /* __WIFI_HAL_GSCAN_MUX_H__ */
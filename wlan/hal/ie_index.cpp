@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+
+/*
+ * Offsets of the first element with each id, built in a single pass the first time an
+ * element is asked for. Only the presence bitmaps are cleared per blob; an offset is
+ * read only when its bit is set, so the 1K of offsets never needs initialising.
+ */
+
+static inline void set_bit(u32 *bitmap, int bit)
+{
+    bitmap[bit >> 5] |= 1U << (bit & 31);
+}
+
+static inline bool test_bit(const u32 *bitmap, int bit)
+{
+    return (bitmap[bit >> 5] >> (bit & 31)) & 1;
+}
+
+static inline u32 vendor_key(const u8 *oui, u8 type)
+{
+    return ((u32)oui[0] << 24) | ((u32)oui[1] << 16) | ((u32)oui[2] << 8) | type;
+}
+
+int wifi_ie_element_len(const u8 *ies, int ie_length, int pos)
+{
+    if (pos + 2 > ie_length || pos + 2 + ies[pos + 1] > ie_length) {
+        return 0;
+    }
+    return 2 + ies[pos + 1];
+}
+
+static void build_index(wifi_ie_index *index)
+{
+    const u8 *ies = index->ies;
+    int length = index->ie_length;
+    int pos = 0;
+
+    memset(index->present, 0, sizeof(index->present));
+    memset(index->ext_present, 0, sizeof(index->ext_present));
+    index->num_vendor = 0;
+    index->truncated = 0;
+
+    for (int size; (size = wifi_ie_element_len(ies, length, pos)) != 0; pos += size) {
+        u8 id = ies[pos];
+        u8 len = ies[pos + 1];
+
+        if (!test_bit(index->present, id)) {
+            set_bit(index->present, id);
+            index->offset[id] = pos;
+        }
+
+        if (id == WIFI_IE_EXTENSION && len >= 1 && !test_bit(index->ext_present, ies[pos + 2])) {
+            set_bit(index->ext_present, ies[pos + 2]);
+            index->ext_offset[ies[pos + 2]] = pos;
+        } else if (id == WIFI_IE_VENDOR && len >= 4) {
+            if (index->num_vendor == WIFI_IE_MAX_VENDOR) {
+                index->truncated = 1;               /* later ones can't be looked up */
+                continue;
+            }
+            /* OUI and OUI type as one word so lookups are a single compare per element */
+            index->vendor_key[index->num_vendor] = vendor_key(&ies[pos + 2], ies[pos + 5]);
+            index->vendor_offset[index->num_vendor] = pos;
+            index->num_vendor++;
+        }
+    }
+
+    if (pos != length) {
+        ALOGV("IE blob malformed at %d of %d bytes", pos, length);
+        index->truncated = 1;
+    }
+    index->built = 1;
+}
+
+static inline wifi_ie_index *built(wifi_ie_index *index)
+{
+    if (!index->built) {
+        build_index(index);
+    }
+    return index;
+}
+
+void wifi_ie_index_init(wifi_ie_index *index, const u8 *ies, int ie_length)
+{
+    index->ies = ies;
+    index->ie_length = (ies && ie_length > 0) ? min(ie_length, 0xffff) : 0;
+    index->built = 0;
+}
+
+const u8 *wifi_ie_get(wifi_ie_index *index, int id, int *len)
+{
+    if (id < 0 || id > 255 || !test_bit(built(index)->present, id)) {
+        return NULL;
+    }
+
+    const u8 *ie = &index->ies[index->offset[id]];
+    if (len) {
+        *len = ie[1];
+    }
+    return ie + 2;
+}
+
+const u8 *wifi_ie_get_ext(wifi_ie_index *index, int ext_id, int *len)
+{
+    if (ext_id < 0 || ext_id > 255 || !test_bit(built(index)->ext_present, ext_id)) {
+        return NULL;
+    }
+
+    /* skip the extension id too */
+    const u8 *ie = &index->ies[index->ext_offset[ext_id]];
+    if (len) {
+        *len = ie[1] - 1;
+    }
+    return ie + 3;
+}
+
+const u8 *wifi_ie_get_vendor(wifi_ie_index *index, const u8 *oui, u8 type, int *len)
+{
+    u32 key = vendor_key(oui, type);
+
+    built(index);
+    for (int i = 0; i < index->num_vendor; i++) {
+        if (index->vendor_key[i] == key) {
+            const u8 *ie = &index->ies[index->vendor_offset[i]];
+            if (len) {
+                *len = ie[1];
+            }
+            return ie + 2;
+        }
+    }
+    return NULL;
+}
+
+bool wifi_ie_is_truncated(wifi_ie_index *index)
+{
+    return built(index)->truncated;
+}
+
+const u8 *wifi_ie_ssid(wifi_ie_index *index, int *len)
+{
+    int ssid_len;
+    const u8 *ssid = wifi_ie_get(index, WIFI_IE_SSID, &ssid_len);
+    if (ssid == NULL || ssid_len > DOT11_MAX_SSID_LEN) {
+        return NULL;
+    }
+    *len = ssid_len;
+    return ssid;
+}
+
+const u8 *wifi_ie_rsn(wifi_ie_index *index, int *len)
+{
+    int rsn_len;
+    const u8 *rsn = wifi_ie_get(index, WIFI_IE_RSN, &rsn_len);
+    if (rsn == NULL || rsn_len < 2) {               /* version at least */
+        return NULL;
+    }
+    *len = rsn_len;
+    return rsn;
+}
+
+const u8 *wifi_ie_ht_cap(wifi_ie_index *index)
+{
+    int len;
+    const u8 *ht = wifi_ie_get(index, WIFI_IE_HT_CAP, &len);
+    return (ht && len >= WIFI_IE_HT_CAP_LEN) ? ht : NULL;
+}
+
+const u8 *wifi_ie_vht_cap(wifi_ie_index *index)
+{
+    int len;
+    const u8 *vht = wifi_ie_get(index, WIFI_IE_VHT_CAP, &len);
+    return (vht && len >= WIFI_IE_VHT_CAP_LEN) ? vht : NULL;
+}
+
+const u8 *wifi_ie_ext_cap(wifi_ie_index *index, int *len)
+{
+    return wifi_ie_get(index, WIFI_IE_EXT_CAP, len);
+}
+
+bool wifi_ie_bss_load(wifi_ie_index *index, u16 *station_count, u8 *channel_util,
+        u16 *admission_capacity)
+{
+    int len;
+    const u8 *load = wifi_ie_get(index, WIFI_IE_BSS_LOAD, &len);
+    if (load == NULL || len < 5) {
+        return false;
+    }
+
+    /* little endian fields */
+    *station_count = load[0] | (load[1] << 8);
+    *channel_util = load[2];
+    *admission_capacity = load[3] | (load[4] << 8);
+    return true;
+}
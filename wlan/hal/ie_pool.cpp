@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "ie_pool.h"
+
+/*
+ * Neighbouring APs, and the several BSSIDs of one AP, mostly advertise the same rates,
+ * RSN, HT/VHT and vendor elements; only a few (SSID, TIM, BSS load) differ between them.
+ * Blobs are split into elements and each distinct element is stored once, so a cache
+ * pays for what the APs around it have in common only one time. Elements that change
+ * from one beacon to the next are kept private to their blob instead of filling the
+ * table with copies nobody else will match.
+ */
+
+/*
+ * Objects come from slabs of one size class each. Every object starts with a pointer to
+ * its slab, so a free finds the slab without a search; a slab whose last object goes is
+ * kept as a spare for stores made during dispatch, or given back.
+ */
+#define OBJ_HEADER  sizeof(ie_slab *)
+
+/* Header included; the largest well formed element takes 289 bytes */
+static const u16 obj_classes[IE_POOL_NUM_CLASSES] = { 32, 48, 64, 96, 128, 192, 296, 520 };
+
+static int class_of(size_t size)
+{
+    for (int i = 0; i < IE_POOL_NUM_CLASSES; i++) {
+        if (size + OBJ_HEADER <= obj_classes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Bytes an object of size can actually use */
+static size_t obj_bytes(size_t size)
+{
+    int cls = class_of(size);
+    return cls < 0 ? size : obj_classes[cls] - OBJ_HEADER;
+}
+
+static void slab_unlink(ie_slab **list, ie_slab *slab)
+{
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+}
+
+static void slab_push(ie_slab **list, ie_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+/* A spare if there is one, else a new slab unless the allocator is off limits */
+static ie_slab *slab_get(ie_pool *pool, int cls)
+{
+    ie_slab *slab = pool->spare;
+    if (slab) {
+        slab_unlink(&pool->spare, slab);
+        pool->num_spare--;
+    } else if (!wifi_alloc_restricted()) {
+        slab = (ie_slab *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, IE_POOL_SLAB_SIZE);
+        if (slab == NULL) {
+            return NULL;
+        }
+        pool->bytes += IE_POOL_SLAB_SIZE;
+    } else {
+        return NULL;
+    }
+
+    slab->cls = cls;
+    slab->num_live = 0;
+    slab->free_objs = NULL;
+    u32 size = obj_classes[cls];
+    u32 end = IE_POOL_SLAB_SIZE - offsetof(ie_slab, data);
+    for (u32 pos = 0; pos + size <= end; pos += size) {
+        *(void **)&slab->data[pos] = slab->free_objs;
+        slab->free_objs = &slab->data[pos];
+    }
+    slab_push(&pool->partial[cls], slab);
+    return slab;
+}
+
+/* Keeps an empty slab as a spare, or frees it once there are enough */
+static void slab_put(ie_pool *pool, ie_slab *slab)
+{
+    if (pool->num_spare < pool->max_spare) {
+        slab_push(&pool->spare, slab);
+        pool->num_spare++;
+        return;
+    }
+    pool->bytes -= IE_POOL_SLAB_SIZE;
+    wifi_hal_free(WIFI_ALLOC_GSCAN, slab);
+}
+
+static void *obj_alloc(ie_pool *pool, size_t size)
+{
+    int cls = class_of(size);
+    if (cls < 0) {
+        /* only malformed tails and blobs of very many elements are this large */
+        u8 *obj = wifi_alloc_restricted() ? NULL :
+                (u8 *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, OBJ_HEADER + size);
+        if (obj == NULL) {
+            return NULL;
+        }
+        *(ie_slab **)obj = NULL;
+        pool->bytes += OBJ_HEADER + size;
+        return obj + OBJ_HEADER;
+    }
+
+    ie_slab *slab = pool->partial[cls];
+    if (slab == NULL) {
+        slab = slab_get(pool, cls);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+
+    u8 *obj = (u8 *)slab->free_objs;
+    slab->free_objs = *(void **)obj;
+    slab->num_live++;
+    if (slab->free_objs == NULL) {
+        slab_unlink(&pool->partial[cls], slab);
+    }
+    *(ie_slab **)obj = slab;
+    return obj + OBJ_HEADER;
+}
+
+static void obj_free(ie_pool *pool, void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    u8 *obj = (u8 *)ptr - OBJ_HEADER;
+    ie_slab *slab = *(ie_slab **)obj;
+    if (slab == NULL) {
+        pool->bytes -= OBJ_HEADER + size;
+        wifi_hal_free(WIFI_ALLOC_GSCAN, obj);
+        return;
+    }
+
+    bool was_full = slab->free_objs == NULL;
+    *(void **)obj = slab->free_objs;
+    slab->free_objs = obj;
+    slab->num_live--;
+    if (slab->num_live == 0) {
+        if (!was_full) {
+            slab_unlink(&pool->partial[slab->cls], slab);
+        }
+        slab_put(pool, slab);
+    } else if (was_full) {
+        slab_push(&pool->partial[slab->cls], slab);
+    }
+}
+
+static inline u32 elem_hash(const u8 *data, int length)
+{
+    u64 hash = wifi_shadow_hash(data, length);
+    return (u32)(hash ^ (hash >> 32));
+}
+
+/* Elements carrying per beacon counters, which another blob will almost never match */
+static bool is_volatile(const u8 *data, int length)
+{
+    static const u8 wfa_oui[3] = { 0x50, 0x6f, 0x9a };
+    static const u8 ms_oui[3] = { 0x00, 0x50, 0xf2 };
+
+    if (length < 2) {
+        return false;
+    }
+    switch (data[0]) {
+        case WIFI_IE_TIM:                   /* DTIM count and traffic bitmap */
+        case WIFI_IE_BSS_LOAD:              /* station count and channel utilization */
+            return true;
+        case WIFI_IE_VENDOR:
+            /* WPA, WMM, WPS, P2P, Hotspot 2.0 and the like are stable; private vendor
+             * elements often carry timestamps or counters */
+            return length < 5 || (memcmp(&data[2], ms_oui, 3) != 0 &&
+                    memcmp(&data[2], wfa_oui, 3) != 0);
+        default:
+            return false;
+    }
+}
+
+static void grow_buckets(ie_pool *pool)
+{
+    if (wifi_alloc_restricted()) {
+        return;                             /* longer chains until the next store outside */
+    }
+
+    u32 num_buckets = (pool->bucket_mask + 1) * 2;
+    ie_pool_elem **buckets = (ie_pool_elem **)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+            sizeof(ie_pool_elem *) * num_buckets);
+    if (buckets == NULL) {
+        return;                             /* longer chains, still correct */
+    }
+    memset(buckets, 0, sizeof(ie_pool_elem *) * num_buckets);
+
+    for (u32 i = 0; i <= pool->bucket_mask; i++) {
+        ie_pool_elem *elem = pool->buckets[i];
+        while (elem) {
+            ie_pool_elem *next = elem->hash_next;
+            elem->hash_next = buckets[elem->hash & (num_buckets - 1)];
+            buckets[elem->hash & (num_buckets - 1)] = elem;
+            elem = next;
+        }
+    }
+
+    wifi_hal_free(WIFI_ALLOC_GSCAN, pool->buckets);
+    pool->bytes += sizeof(ie_pool_elem *) * (num_buckets - (pool->bucket_mask + 1));
+    pool->buckets = buckets;
+    pool->bucket_mask = num_buckets - 1;
+}
+
+static ie_pool_elem *acquire(ie_pool *pool, const u8 *data, int length)
+{
+    if (is_volatile(data, length)) {
+        ie_pool_elem *elem = (ie_pool_elem *)obj_alloc(pool, sizeof(ie_pool_elem) + length);
+        if (elem) {
+            elem->hash_next = NULL;
+            elem->hash = 0;
+            elem->refs = 1;
+            elem->length = length;
+            elem->interned = false;
+            memcpy(elem->data, data, length);
+        }
+        return elem;
+    }
+
+    u32 hash = elem_hash(data, length);
+    ie_pool_elem *elem = pool->buckets[hash & pool->bucket_mask];
+    while (elem && (elem->hash != hash || elem->length != length ||
+            memcmp(elem->data, data, length) != 0)) {
+        elem = elem->hash_next;
+    }
+    if (elem) {
+        elem->refs++;
+        return elem;
+    }
+
+    elem = (ie_pool_elem *)obj_alloc(pool, sizeof(*elem) + length);
+    if (elem == NULL) {
+        return NULL;
+    }
+    elem->hash = hash;
+    elem->refs = 1;
+    elem->length = length;
+    elem->interned = true;
+    memcpy(elem->data, data, length);
+    elem->hash_next = pool->buckets[hash & pool->bucket_mask];
+    pool->buckets[hash & pool->bucket_mask] = elem;
+    pool->num_elems++;
+
+    if (pool->num_elems > pool->bucket_mask + 1) {
+        grow_buckets(pool);
+    }
+    return elem;
+}
+
+static void release(ie_pool *pool, ie_pool_elem *elem)
+{
+    if (--elem->refs > 0) {
+        return;
+    }
+
+    if (elem->interned) {
+        ie_pool_elem **link = &pool->buckets[elem->hash & pool->bucket_mask];
+        while (*link != elem) {
+            link = &(*link)->hash_next;
+        }
+        *link = elem->hash_next;
+        pool->num_elems--;
+    }
+    obj_free(pool, elem, sizeof(*elem) + elem->length);
+}
+
+bool ie_pool_init(ie_pool *pool, size_t reserve)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->buckets = (ie_pool_elem **)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+            sizeof(ie_pool_elem *) * IE_POOL_MIN_BUCKETS);
+    if (pool->buckets == NULL) {
+        return false;
+    }
+    memset(pool->buckets, 0, sizeof(ie_pool_elem *) * IE_POOL_MIN_BUCKETS);
+    pool->bucket_mask = IE_POOL_MIN_BUCKETS - 1;
+    pool->bytes = sizeof(ie_pool_elem *) * IE_POOL_MIN_BUCKETS;
+
+    pool->max_spare = reserve / IE_POOL_SLAB_SIZE;
+    while (pool->num_spare < pool->max_spare) {
+        ie_slab *slab = (ie_slab *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, IE_POOL_SLAB_SIZE);
+        if (slab == NULL) {
+            ie_pool_free(pool);
+            return false;
+        }
+        pool->bytes += IE_POOL_SLAB_SIZE;
+        slab_push(&pool->spare, slab);
+        pool->num_spare++;
+    }
+    return true;
+}
+
+void ie_pool_free(ie_pool *pool)
+{
+    if (pool->num_elems) {
+        ALOGE("IE pool freed with %u elements still referenced", pool->num_elems);
+    }
+    wifi_hal_free(WIFI_ALLOC_GSCAN, pool->buckets);
+    while (pool->spare) {
+        ie_slab *slab = pool->spare;
+        slab_unlink(&pool->spare, slab);
+        wifi_hal_free(WIFI_ALLOC_GSCAN, slab);
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+bool ie_pool_store(ie_pool *pool, ie_blob *blob, const u8 *ies, int ie_length)
+{
+    ie_pool_elem **elems = pool->scratch;
+    int num_elems = 0;
+    int pos = 0;
+
+    /*
+     * Take the new references before dropping the old ones, so elements the blob
+     * still carries are never freed and allocated again in between
+     */
+    ie_length = min(ie_length, MAX_PROBE_RESP_IE_LEN);
+    while (pos < ie_length) {
+        /* a malformed tail is kept as one piece so the blob comes back unchanged */
+        int length = wifi_ie_element_len(ies, ie_length, pos);
+        if (length == 0) {
+            length = ie_length - pos;
+        }
+
+        ie_pool_elem *elem = acquire(pool, &ies[pos], length);
+        if (elem == NULL) {
+            break;
+        }
+        elems[num_elems++] = elem;
+        pos += length;
+    }
+
+    if (pos < ie_length || num_elems > blob->capacity) {
+        ie_pool_elem **array = NULL;
+        if (pos == ie_length) {
+            array = (ie_pool_elem **)obj_alloc(pool, sizeof(ie_pool_elem *) * num_elems);
+        }
+        if (array == NULL) {
+            for (int i = 0; i < num_elems; i++) {
+                release(pool, elems[i]);
+            }
+            ie_pool_release(pool, blob);
+            return false;
+        }
+
+        ie_pool_clear(pool, blob);
+        blob->elems = array;
+        blob->capacity = obj_bytes(sizeof(ie_pool_elem *) * num_elems) / sizeof(ie_pool_elem *);
+    } else {
+        ie_pool_release(pool, blob);
+    }
+
+    memcpy(blob->elems, elems, sizeof(ie_pool_elem *) * num_elems);
+    blob->num_elems = num_elems;
+    blob->length = ie_length;
+    pool->unshared_bytes += ie_length;
+    return true;
+}
+
+bool ie_pool_trim(ie_pool *pool)
+{
+    ie_slab *slab = pool->spare;
+    if (slab == NULL) {
+        return false;
+    }
+    slab_unlink(&pool->spare, slab);
+    pool->num_spare--;
+    pool->bytes -= IE_POOL_SLAB_SIZE;
+    wifi_hal_free(WIFI_ALLOC_GSCAN, slab);
+    return true;
+}
+
+void ie_pool_release(ie_pool *pool, ie_blob *blob)
+{
+    for (int i = 0; i < blob->num_elems; i++) {
+        release(pool, blob->elems[i]);
+    }
+    pool->unshared_bytes -= blob->length;
+    blob->num_elems = 0;
+    blob->length = 0;
+}
+
+void ie_pool_clear(ie_pool *pool, ie_blob *blob)
+{
+    ie_pool_release(pool, blob);
+    obj_free(pool, blob->elems, sizeof(ie_pool_elem *) * blob->capacity);
+    blob->elems = NULL;
+    blob->capacity = 0;
+}
+
+int ie_blob_copy(const ie_blob *blob, u8 *buf, int buf_len)
+{
+    if (blob->length > buf_len) {
+        return -1;
+    }
+
+    int pos = 0;
+    for (int i = 0; i < blob->num_elems; i++) {
+        memcpy(&buf[pos], blob->elems[i]->data, blob->elems[i]->length);
+        pos += blob->elems[i]->length;
+    }
+    return pos;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_IE_POOL_H__
+#define __WIFI_HAL_IE_POOL_H__
+
+#include "common.h"
+
+#define IE_POOL_MIN_BUCKETS     64
+#define IE_POOL_MAX_ELEMS       (MAX_PROBE_RESP_IE_LEN / 2)
+#define IE_POOL_NUM_CLASSES     8
+#define IE_POOL_SLAB_SIZE       4096
+
+/* Objects of one size class; full slabs are on no list, so only a free finds them */
+typedef struct ie_slab {
+    struct ie_slab *next;                           // in its class's partial list, or spare
+    struct ie_slab *prev;
+    void *free_objs;                                // objects not handed out
+    u16 cls;                                        // index into the size classes
+    u16 num_live;                                   // objects handed out
+    u8 data[0] __attribute__((aligned(8)));
+} ie_slab;
+
+/* One element, header included; interned ones are shared by every blob that carries them */
+typedef struct ie_pool_elem {
+    struct ie_pool_elem *hash_next;
+    u32 hash;
+    u32 refs;                                       // blob positions pointing here
+    u16 length;                                     // bytes in data
+    bool interned;                                  // in the table; else private to one blob
+    u8 data[];
+} ie_pool_elem;
+
+/*
+ * Interned elements keyed by content; owned by a cache and protected by its lock.
+ * Elements and small blob arrays come from slabs, so a store only reaches the allocator
+ * when every slab of its size is full and no spare is left.
+ */
+typedef struct {
+    ie_pool_elem **buckets;
+    u32 bucket_mask;
+    u32 num_elems;                                  // distinct elements held
+    u32 bytes;                                      // slabs, spares included, and the table
+    u32 unshared_bytes;                             // IE bytes a private copy per blob would take
+    ie_slab *partial[IE_POOL_NUM_CLASSES];          // slabs with free objects, by size class
+    ie_slab *spare;                                 // empty slabs kept for dispatch
+    u32 num_spare;
+    u32 max_spare;
+    ie_pool_elem *scratch[IE_POOL_MAX_ELEMS];       // a store's new elements until they replace
+                                                    // the blob's
+} ie_pool;
+
+/* An IE blob kept as references to its elements, in the order they arrived */
+typedef struct {
+    ie_pool_elem **elems;
+    u16 num_elems;
+    u16 capacity;
+    u16 length;                                     // bytes once put back together
+} ie_blob;
+
+/* reserve is the slab memory set aside up front, and kept, for stores made during
+ * dispatch */
+bool ie_pool_init(ie_pool *pool, size_t reserve);
+/* Every blob must have been cleared first */
+void ie_pool_free(ie_pool *pool);
+/* Gives back one spare slab; false if there was none */
+bool ie_pool_trim(ie_pool *pool);
+
+/* Replaces the contents of blob with ies; on failure blob is left empty */
+bool ie_pool_store(ie_pool *pool, ie_blob *blob, const u8 *ies, int ie_length);
+/* Drops the references but keeps the array for the next store */
+void ie_pool_release(ie_pool *pool, ie_blob *blob);
+/* Drops the references and the array */
+void ie_pool_clear(ie_pool *pool, ie_blob *blob);
+/* Copies the blob out as one buffer; returns its length, or -1 if buf is too small */
+int ie_blob_copy(const ie_blob *blob, u8 *buf, int buf_len);
+
+#endif /* __WIFI_HAL_IE_POOL_H__ */
@@ -46,6 +46,7 @@
 #include "wifi_hal.h"
 #include "common.h"
 #include "cpp_bindings.h"
+#include "capabilities.h"
 
 using namespace android;
 #define RTT_RESULT_SIZE (sizeof(wifi_rtt_result));
@@ -94,6 +95,8 @@ struct dot11_rm_ie {
 } __attribute__ ((packed));
 typedef struct dot11_rm_ie dot11_rm_ie_t;
 #define DOT11_HDR_LEN 2
+/* room for a result with both an LCI and an LCR element */
+#define RTT_RESULT_RESERVE (sizeof(wifi_rtt_result) + 2 * (DOT11_HDR_LEN + 255))
 #define DOT11_RM_IE_LEN       5
 #define DOT11_MNG_MEASURE_REQUEST_ID		38	/* 11H MeasurementRequest */
 #define DOT11_MEASURE_TYPE_LCI		8   /* d11 measurement LCI type */
@@ -316,6 +319,7 @@ class RttCommand : public WifiCommand
     int totalCnt;
     static const int MAX_RESULTS = 1024;
     wifi_rtt_result *rttResults[MAX_RESULTS];
+    wifi_arena mResultArena;            // backs rttResults; set up by start()
     wifi_rtt_config *rttParams;
     wifi_rtt_event_handler rttHandler;
 public:
@@ -325,6 +329,7 @@ public:
         rttHandler(handler)
     {
         memset(rttResults, 0, sizeof(rttResults));
+        memset(&mResultArena, 0, sizeof(mResultArena));
         currentIdx = 0;
         mCompleted = 0;
         totalCnt = 0;
@@ -333,12 +338,17 @@ public:
     RttCommand(wifi_interface_handle iface, int id)
         : WifiCommand("RttCommand", iface, id)
     {
+        memset(&mResultArena, 0, sizeof(mResultArena));
         currentIdx = 0;
         mCompleted = 0;
         totalCnt = 0;
         numRttParams = 0;
     }
 
+    virtual ~RttCommand() {
+        wifi_arena_free(&mResultArena);
+    }
+
     int createSetupRequest(WifiRequest& request) {
         int result = request.create(GOOGLE_OUI, RTT_SUBCMD_SET_CONFIG);
         if (result < 0) {
@@ -463,8 +473,23 @@ public:
     }
     int start() {
         ALOGD("Setting RTT configuration");
+
+        /* results are copied here from the event loop, which shouldn't have to allocate;
+         * num_burst is an exponent, as in the FTM frame, and each burst reports a result */
+        unsigned reserved = 0;
+        for (unsigned i = 0; i < numRttParams && reserved < MAX_RESULTS; i++) {
+            reserved += 1u << min(rttParams[i].num_burst, 10u);
+        }
+        reserved = min(reserved, (unsigned)MAX_RESULTS);
+        int result = wifi_arena_init(&mResultArena, WIFI_ALLOC_RTT,
+                reserved * RTT_RESULT_RESERVE);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("failed to allocate RTT results");
+            return result;
+        }
+
         WifiRequest request(familyId(), ifaceId());
-        int result = createSetupRequest(request);
+        result = createSetupRequest(request);
         if (result != WIFI_SUCCESS) {
             ALOGE("failed to create setup request; result = %d", result);
             return result;
@@ -551,11 +576,16 @@ public:
                         ALOGI("retrieved result_cnt : %d\n", result_cnt);
                     } else if (it2.get_type() == RTT_ATTRIBUTE_RESULT) {
                         int result_len = it2.get_len();
-                        rttResults[currentIdx] =  (wifi_rtt_result *)malloc(it2.get_len());
+                        if (currentIdx == MAX_RESULTS) {
+                            ALOGE("too many RTT results; dropping the rest");
+                            break;
+                        }
+                        rttResults[currentIdx] = (wifi_rtt_result *)wifi_arena_alloc(
+                                &mResultArena, it2.get_len());
                         wifi_rtt_result *rtt_result = rttResults[currentIdx];
                         if (rtt_result == NULL) {
                             mCompleted = 1;
-                            ALOGE("failed to allocate the wifi_rtt_result\n");
+                            ALOGE("no room left for the wifi_rtt_result\n");
                             break;
                         }
                         memcpy(rtt_result, it2.get_data(), it2.get_len());
@@ -613,9 +643,9 @@ public:
             unregisterVendorHandler(GOOGLE_OUI, RTT_EVENT_COMPLETE);
             (*rttHandler.on_rtt_results)(id(), totalCnt, rttResults);
             for (int i = 0; i < currentIdx; i++) {
-                free(rttResults[i]);
                 rttResults[i] = NULL;
             }
+            wifi_arena_reset(&mResultArena);
             totalCnt = currentIdx = 0;
             WifiCommand *cmd = wifi_unregister_cmd(wifiHandle(), id());
             if (cmd)
@@ -663,8 +693,18 @@ wifi_error wifi_rtt_range_cancel(wifi_request_id id,  wifi_interface_handle ifac
 wifi_error wifi_get_rtt_capabilities(wifi_interface_handle iface,
         wifi_rtt_capabilities *capabilities)
 {
-    GetRttCapabilitiesCommand command(iface, capabilities);
-    return (wifi_error) command.requestResponse();
+    wifi_capabilities *caps = wifi_get_capabilities(iface);
+    NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    memcpy(capabilities, &caps->rtt, sizeof(*capabilities));
+    wifi_error result = (wifi_error)caps->status[CAP_RTT];
+    wifi_put_capabilities(caps);
+    return result;
+}
+
+WifiCommand *wifi_new_rtt_capabilities_query(wifi_interface_handle iface,
+        wifi_rtt_capabilities *capabilities)
+{
+    return new GetRttCapabilitiesCommand(iface, capabilities);
 }
 
 /* API to get the responder information */
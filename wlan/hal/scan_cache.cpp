@@ -0,0 +1,460 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "scan_cache.h"
+#include "scan_filter.h"
+
+/*
+ * Latest sighting of each BSSID seen on an interface. Slots live in one array sized at
+ * configure time; they are chained off a power of two hash table and linked in the
+ * order they were last seen, so aging and eviction always start from lru_head.
+ */
+
+static void lru_unlink(scan_cache *cache, int index)
+{
+    scan_cache_slot *slot = &cache->slots[index];
+
+    if (slot->lru_prev >= 0) {
+        cache->slots[slot->lru_prev].lru_next = slot->lru_next;
+    } else {
+        cache->lru_head = slot->lru_next;
+    }
+    if (slot->lru_next >= 0) {
+        cache->slots[slot->lru_next].lru_prev = slot->lru_prev;
+    } else {
+        cache->lru_tail = slot->lru_prev;
+    }
+}
+
+static void lru_append(scan_cache *cache, int index)
+{
+    scan_cache_slot *slot = &cache->slots[index];
+
+    slot->lru_prev = cache->lru_tail;
+    slot->lru_next = -1;
+    if (cache->lru_tail >= 0) {
+        cache->slots[cache->lru_tail].lru_next = index;
+    } else {
+        cache->lru_head = index;
+    }
+    cache->lru_tail = index;
+}
+
+static int find_slot(scan_cache *cache, const u8 *bssid)
+{
+    int index = cache->buckets[wifi_bssid_hash(bssid) & cache->bucket_mask];
+    while (index >= 0 && memcmp(cache->slots[index].bssid, bssid, sizeof(mac_addr)) != 0) {
+        index = cache->slots[index].hash_next;
+    }
+    return index;
+}
+
+static void remove_slot(scan_cache *cache, int index)
+{
+    scan_cache_slot *slot = &cache->slots[index];
+
+    int *link = &cache->buckets[wifi_bssid_hash(slot->bssid) & cache->bucket_mask];
+    while (*link != index) {
+        link = &cache->slots[*link].hash_next;
+    }
+    *link = slot->hash_next;
+    lru_unlink(cache, index);
+
+    /* the element array stays with the slot for whoever takes it next */
+    ie_pool_release(&cache->ies, &slot->ie);
+    slot->hash_next = cache->free_slot;
+    cache->free_slot = index;
+    cache->stats.entries--;
+}
+
+static void expire_slots(scan_cache *cache, u64 now)
+{
+    if (cache->params.max_age_ms == 0) {
+        return;
+    }
+
+    while (cache->lru_head >= 0 &&
+            now - cache->slots[cache->lru_head].seen_ms > (u64)cache->params.max_age_ms) {
+        remove_slot(cache, cache->lru_head);
+        cache->stats.expired++;
+    }
+}
+
+static int take_slot(scan_cache *cache, const u8 *bssid)
+{
+    if (cache->free_slot < 0) {
+        remove_slot(cache, cache->lru_head);
+        cache->stats.evicted++;
+    }
+
+    int index = cache->free_slot;
+    scan_cache_slot *slot = &cache->slots[index];
+    cache->free_slot = slot->hash_next;
+
+    unsigned bucket = wifi_bssid_hash(bssid) & cache->bucket_mask;
+    memcpy(slot->bssid, bssid, sizeof(mac_addr));
+    slot->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = index;
+    lru_append(cache, index);
+    cache->stats.entries++;
+    return index;
+}
+
+static void update_locked(scan_cache *cache, const wifi_scan_result *result, u64 now)
+{
+    int index = find_slot(cache, (const u8 *)result->bssid);
+    if (index < 0) {
+        index = take_slot(cache, (const u8 *)result->bssid);
+    } else if (index != cache->lru_tail) {
+        lru_unlink(cache, index);
+        lru_append(cache, index);
+    }
+
+    scan_cache_slot *slot = &cache->slots[index];
+    memcpy(slot->ssid, result->ssid, sizeof(slot->ssid));
+    slot->ssid[DOT11_MAX_SSID_LEN] = '\0';
+    slot->channel = result->channel;
+    slot->rssi = result->rssi;
+    slot->beacon_period = result->beacon_period;
+    slot->capability = result->capability;
+    slot->ts = result->ts;
+    slot->seen_ms = now;
+    cache->stats.updates++;
+
+    /* cached results and hotlist events carry no IEs; keep the last ones seen */
+    if (result->ie_length == 0) {
+        return;
+    }
+    ie_pool_store(&cache->ies, &slot->ie, (const u8 *)result->ie_data, result->ie_length);
+
+    /*
+     * Stay under the memory cap, which counts every slab the IEs hold: spare slabs go
+     * first, then the least recently seen entries until enough slabs empty out
+     */
+    while (cache->params.max_bytes &&
+            cache->table_bytes + cache->ies.bytes > (u32)cache->params.max_bytes) {
+        if (ie_pool_trim(&cache->ies)) {
+            continue;
+        }
+        if (cache->lru_head == index) {
+            break;
+        }
+        int oldest = cache->lru_head;
+        remove_slot(cache, oldest);
+        ie_pool_clear(&cache->ies, &cache->slots[oldest].ie);
+        cache->stats.evicted++;
+    }
+}
+
+static void fill_entry(wifi_scan_cache_entry *entry, const scan_cache_slot *slot, u64 now)
+{
+    memcpy(entry->bssid, slot->bssid, sizeof(mac_addr));
+    memcpy(entry->ssid, slot->ssid, sizeof(entry->ssid));
+    entry->channel = slot->channel;
+    entry->rssi = slot->rssi;
+    entry->beacon_period = slot->beacon_period;
+    entry->capability = slot->capability;
+    entry->ts = slot->ts;
+    entry->age_ms = now - slot->seen_ms;
+    entry->ie_length = slot->ie.length;
+}
+
+static void free_cache(scan_cache *cache)
+{
+    for (int i = 0; i < cache->params.max_entries && cache->slots; i++) {
+        ie_pool_clear(&cache->ies, &cache->slots[i].ie);
+    }
+    ie_pool_free(&cache->ies);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, cache->slots);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, cache->buckets);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, cache);
+}
+
+/* Returns the cache with scan_cache_lock held and stale entries dropped, or NULL */
+static scan_cache *lock_cache(interface_info *iface, u64 now)
+{
+    pthread_mutex_lock(&iface->scan_cache_lock);
+    scan_cache *cache = iface->scan_cache;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&iface->scan_cache_lock);
+        return NULL;
+    }
+    expire_slots(cache, now);
+    return cache;
+}
+
+void wifi_scan_cache_update(interface_info *iface, const wifi_scan_result *result)
+{
+    wifi_scan_cache_update_results(iface, result, 1);
+}
+
+void wifi_scan_cache_update_results(interface_info *iface, const wifi_scan_result *results,
+        int num)
+{
+    if (iface->scan_cache == NULL) {
+        return;                             /* checked again under the lock */
+    }
+
+    u64 now = wifi_get_monotonic_ms();
+    scan_cache *cache = lock_cache(iface, now);
+    if (cache == NULL) {
+        return;
+    }
+    for (int i = 0; i < num; i++) {
+        update_locked(cache, &results[i], now);
+    }
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+}
+
+void wifi_scan_cache_remove(interface_info *iface, const mac_addr bssid)
+{
+    if (iface->scan_cache == NULL) {
+        return;
+    }
+
+    scan_cache *cache = lock_cache(iface, wifi_get_monotonic_ms());
+    if (cache == NULL) {
+        return;
+    }
+    int index = find_slot(cache, bssid);
+    if (index >= 0) {
+        remove_slot(cache, index);
+    }
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+}
+
+wifi_error wifi_scan_cache_configure(wifi_interface_handle handle,
+        const wifi_scan_cache_params *params)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    scan_cache *cache = NULL;
+
+    if (params != NULL) {
+        if (params->max_entries < 0 || params->max_bytes < 0 || params->max_age_ms < 0) {
+            return WIFI_ERROR_INVALID_ARGS;
+        }
+
+        cache = (scan_cache *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*cache));
+        NULL_CHECK_RETURN(cache, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+        memset(cache, 0, sizeof(*cache));
+        cache->params = *params;
+
+        /* a bucket per slot, rounded up, keeps the chains short; max_entries stays the
+         * bound eviction works to */
+        int max_entries = params->max_entries ? params->max_entries : SCAN_CACHE_DEFAULT_ENTRIES;
+        int num_buckets = 1;
+        while (num_buckets < max_entries) {
+            num_buckets <<= 1;
+        }
+        cache->params.max_entries = max_entries;
+        cache->bucket_mask = num_buckets - 1;
+
+        cache->slots = (scan_cache_slot *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+                sizeof(scan_cache_slot) * max_entries);
+        cache->buckets = (int *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(int) * num_buckets);
+
+        /* results are cached from the event loop, which must not have to grow the pool;
+         * the reserve counts against max_bytes, so it takes no more than a quarter */
+        size_t ie_reserve = (size_t)max_entries * SCAN_CACHE_IE_RESERVE;
+        if (params->max_bytes) {
+            ie_reserve = min(ie_reserve, (size_t)params->max_bytes / 4);
+        }
+        if (cache->slots == NULL || cache->buckets == NULL ||
+                !ie_pool_init(&cache->ies, ie_reserve)) {
+            free_cache(cache);
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+
+        memset(cache->slots, 0, sizeof(scan_cache_slot) * max_entries);
+        for (int i = 0; i < num_buckets; i++) {
+            cache->buckets[i] = -1;
+        }
+        for (int i = 0; i < max_entries; i++) {
+            cache->slots[i].hash_next = i + 1 < max_entries ? i + 1 : -1;
+        }
+        cache->free_slot = 0;
+        cache->lru_head = -1;
+        cache->lru_tail = -1;
+        cache->table_bytes = sizeof(*cache) + sizeof(scan_cache_slot) * max_entries +
+                sizeof(int) * num_buckets;
+    }
+
+    pthread_mutex_lock(&iface->scan_cache_lock);
+    scan_cache *old = iface->scan_cache;
+    iface->scan_cache = cache;
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+
+    if (old) {
+        free_cache(old);
+    }
+
+    ALOGD("Scan cache %s on %s", cache ? "enabled" : "disabled", iface->name);
+    /* the cache wants every result, filtered or not */
+    wifi_refresh_scan_filter(iface);
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_scan_cache_lookup(wifi_interface_handle handle, mac_addr bssid,
+        wifi_scan_cache_entry *entry)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    u64 now = wifi_get_monotonic_ms();
+
+    scan_cache *cache = lock_cache(iface, now);
+    if (cache == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    int index = find_slot(cache, bssid);
+    if (index >= 0) {
+        fill_entry(entry, &cache->slots[index], now);
+        cache->stats.hits++;
+    } else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+    return index >= 0 ? WIFI_SUCCESS : WIFI_ERROR_NOT_AVAILABLE;
+}
+
+wifi_error wifi_scan_cache_get_ies(wifi_interface_handle handle, mac_addr bssid,
+        u8 *buf, int buf_len, int *ie_length)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    scan_cache *cache = lock_cache(iface, wifi_get_monotonic_ms());
+    if (cache == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    wifi_error result = WIFI_ERROR_NOT_AVAILABLE;
+    int index = find_slot(cache, bssid);
+    if (index >= 0) {
+        scan_cache_slot *slot = &cache->slots[index];
+        *ie_length = slot->ie.length;
+        if (ie_blob_copy(&slot->ie, buf, buf_len) >= 0) {
+            result = WIFI_SUCCESS;
+        } else {
+            result = WIFI_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+    return result;
+}
+
+wifi_error wifi_scan_cache_find_ssid(wifi_interface_handle handle, const char *ssid,
+        wifi_scan_cache_entry *entries, int max, int *num)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    u64 now = wifi_get_monotonic_ms();
+
+    scan_cache *cache = lock_cache(iface, now);
+    if (cache == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    /* newest first */
+    int found = 0;
+    for (int i = cache->lru_tail; i >= 0 && found < max; i = cache->slots[i].lru_prev) {
+        if (strncmp(cache->slots[i].ssid, ssid, DOT11_MAX_SSID_LEN) == 0) {
+            fill_entry(&entries[found++], &cache->slots[i], now);
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+    *num = found;
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_scan_cache_find_channel(wifi_interface_handle handle, wifi_channel channel,
+        wifi_scan_cache_entry *entries, int max, int *num)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    u64 now = wifi_get_monotonic_ms();
+
+    scan_cache *cache = lock_cache(iface, now);
+    if (cache == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    int found = 0;
+    for (int i = cache->lru_tail; i >= 0 && found < max; i = cache->slots[i].lru_prev) {
+        if (cache->slots[i].channel == channel) {
+            fill_entry(&entries[found++], &cache->slots[i], now);
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+    *num = found;
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_scan_cache_top_rssi(wifi_interface_handle handle,
+        wifi_scan_cache_entry *entries, int k, int *num)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    u64 now = wifi_get_monotonic_ms();
+
+    scan_cache *cache = lock_cache(iface, now);
+    if (cache == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    /* insertion into the k strongest so far; k is small next to the cache */
+    int found = 0;
+    for (int i = cache->lru_head; i >= 0 && k > 0; i = cache->slots[i].lru_next) {
+        scan_cache_slot *slot = &cache->slots[i];
+        if (found == k && slot->rssi <= entries[k - 1].rssi) {
+            continue;
+        }
+
+        int pos = found < k ? found++ : k - 1;
+        while (pos > 0 && entries[pos - 1].rssi < slot->rssi) {
+            entries[pos] = entries[pos - 1];
+            pos--;
+        }
+        fill_entry(&entries[pos], slot, now);
+    }
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+    *num = found;
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_scan_cache_get_stats(wifi_interface_handle handle, wifi_scan_cache_stats *stats)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    scan_cache *cache = lock_cache(iface, wifi_get_monotonic_ms());
+    if (cache == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+    *stats = cache->stats;
+    stats->bytes = cache->table_bytes + cache->ies.bytes;
+    stats->ie_bytes = cache->ies.bytes;
+    stats->ie_unshared_bytes = cache->ies.unshared_bytes;
+    stats->ie_elements = cache->ies.num_elems;
+    pthread_mutex_unlock(&iface->scan_cache_lock);
+    return WIFI_SUCCESS;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_SCAN_CACHE_H__
+#define __WIFI_HAL_SCAN_CACHE_H__
+
+#include "common.h"
+#include "ie_pool.h"
+
+#define SCAN_CACHE_DEFAULT_ENTRIES  256
+#define SCAN_CACHE_IE_RESERVE       512             // slab bytes set aside per entry
+
+/* One cached BSSID; slots are chained by hash and kept in least recently seen order */
+typedef struct {
+    mac_addr bssid;
+    char ssid[DOT11_MAX_SSID_LEN + 1];
+    wifi_channel channel;
+    wifi_rssi rssi;
+    u16 beacon_period;
+    u16 capability;
+    wifi_timestamp ts;
+    u64 seen_ms;                                    // monotonic time of the last sighting
+    ie_blob ie;                                     // last IEs seen; kept if an update has none
+    int hash_next;                                  // next slot in the bucket, or free list
+    int lru_prev;                                   // towards the oldest entry
+    int lru_next;                                   // towards the newest entry
+} scan_cache_slot;
+
+struct scan_cache {
+    wifi_scan_cache_params params;
+    scan_cache_slot *slots;
+    int *buckets;                                   // first slot of each hash chain
+    int bucket_mask;
+    int free_slot;                                  // first unused slot
+    int lru_head;                                   // least recently seen
+    int lru_tail;                                   // most recently seen
+    ie_pool ies;                                    // elements shared by every slot
+    u32 table_bytes;                                // slots and buckets
+    wifi_scan_cache_stats stats;
+};
+
+/* Called with results as they arrive; all of them are no-ops while the cache is off */
+void wifi_scan_cache_update(interface_info *iface, const wifi_scan_result *result);
+void wifi_scan_cache_update_results(interface_info *iface, const wifi_scan_result *results,
+        int num);
+void wifi_scan_cache_remove(interface_info *iface, const mac_addr bssid);
+
+#endif /* __WIFI_HAL_SCAN_CACHE_H__ */
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "scan_export.h"
+#include "scan_filter.h"
+
+/*
+ * One writer per interface, serialised by scan_export_lock, and any number of readers
+ * in other processes. Each slot is guarded by its own sequence count so a reader can
+ * tell a torn copy from a good one without the writer ever waiting on readers; the
+ * header generation is advanced only once a slot is complete.
+ */
+
+static void free_export(scan_export *exp)
+{
+    if (exp->map) {
+        munmap(exp->map, exp->size);
+    }
+    if (exp->fd >= 0) {
+        close(exp->fd);
+    }
+    wifi_hal_free(WIFI_ALLOC_GSCAN, exp);
+}
+
+static wifi_scan_export_slot *slot_at(scan_export *exp, u64 n)
+{
+    return (wifi_scan_export_slot *)(exp->map + WIFI_SCAN_EXPORT_HEADER_SIZE +
+            (n % exp->header->num_slots) * exp->header->slot_size);
+}
+
+/* The size is sealed so a reader's mapping can never be cut short under it */
+static wifi_error create_region(scan_export *exp, const char *name)
+{
+    exp->fd = syscall(__NR_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (exp->fd < 0) {
+        ALOGE("Could not create scan export region: %s", strerror(errno));
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    if (ftruncate(exp->fd, exp->size) < 0 ||
+            fcntl(exp->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        ALOGE("Could not size scan export region: %s", strerror(errno));
+        return WIFI_ERROR_UNKNOWN;
+    }
+
+    void *map = mmap(NULL, exp->size, PROT_READ | PROT_WRITE, MAP_SHARED, exp->fd, 0);
+    if (map == MAP_FAILED) {
+        ALOGE("Could not map scan export region: %s", strerror(errno));
+        return WIFI_ERROR_OUT_OF_MEMORY;
+    }
+    exp->map = (u8 *)map;
+    exp->header = (wifi_scan_export_header *)map;
+    return WIFI_SUCCESS;
+}
+
+/* Results that come in arrays carry no IEs, and their ie_length is not to be trusted */
+static void publish_locked(scan_export *exp, const wifi_scan_result *result, int source,
+        bool with_ies)
+{
+    u64 n = exp->header->generation;
+    wifi_scan_export_slot *slot = slot_at(exp, n);
+    u32 ie_length = with_ies ? min(result->ie_length, (u32)exp->max_ie_length) : 0;
+
+    u32 seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->source = source;
+    slot->truncated = with_ies && ie_length < result->ie_length;
+    slot->index = n;
+    memcpy(&slot->result, result, sizeof(*result) + ie_length);
+    slot->result.ie_length = ie_length;
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&exp->header->generation, n + 1, __ATOMIC_RELEASE);
+
+    exp->stats.published++;
+    if (slot->truncated) {
+        exp->stats.truncated++;
+    }
+}
+
+static void publish(interface_info *iface, const wifi_scan_result *results, int num,
+        int source, bool with_ies)
+{
+    if (iface->scan_export == NULL) {
+        return;                             /* checked again under the lock */
+    }
+
+    pthread_mutex_lock(&iface->scan_export_lock);
+    scan_export *exp = iface->scan_export;
+    if (exp) {
+        for (int i = 0; i < num; i++) {
+            publish_locked(exp, &results[i], source, with_ies);
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_export_lock);
+}
+
+void wifi_scan_export_publish(interface_info *iface, const wifi_scan_result *result, int source)
+{
+    publish(iface, result, 1, source, true);
+}
+
+void wifi_scan_export_publish_results(interface_info *iface, const wifi_scan_result *results,
+        int num, int source)
+{
+    publish(iface, results, num, source, false);
+}
+
+wifi_error wifi_scan_export_configure(wifi_interface_handle handle,
+        const wifi_scan_export_params *params)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    scan_export *exp = NULL;
+
+    if (params != NULL) {
+        if (params->num_slots < 0 || params->max_ie_length < 0 ||
+                params->max_ie_length > 0xffff) {
+            return WIFI_ERROR_INVALID_ARGS;
+        }
+
+        exp = (scan_export *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*exp));
+        NULL_CHECK_RETURN(exp, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+        memset(exp, 0, sizeof(*exp));
+        exp->fd = -1;
+
+        u32 num_slots = params->num_slots ? params->num_slots : SCAN_EXPORT_DEFAULT_SLOTS;
+        exp->max_ie_length = params->max_ie_length ? params->max_ie_length :
+                SCAN_EXPORT_DEFAULT_IE_LENGTH;
+        u32 slot_size = (sizeof(wifi_scan_export_slot) + exp->max_ie_length + 7) & ~7U;
+        exp->size = WIFI_SCAN_EXPORT_HEADER_SIZE + (size_t)num_slots * slot_size;
+
+        char name[IFNAMSIZ + 16];
+        snprintf(name, sizeof(name), "wifi-scans-%s", iface->name);
+        wifi_error result = create_region(exp, name);
+        if (result != WIFI_SUCCESS) {
+            free_export(exp);
+            return result;
+        }
+
+        /* a fresh memfd reads as zeroes; readers check the magic last */
+        exp->header->version = WIFI_SCAN_EXPORT_VERSION;
+        exp->header->num_slots = num_slots;
+        exp->header->slot_size = slot_size;
+        __atomic_store_n(&exp->header->magic, WIFI_SCAN_EXPORT_MAGIC, __ATOMIC_RELEASE);
+        exp->stats.bytes = exp->size;
+    }
+
+    pthread_mutex_lock(&iface->scan_export_lock);
+    scan_export *old = iface->scan_export;
+    iface->scan_export = exp;
+    pthread_mutex_unlock(&iface->scan_export_lock);
+
+    if (old) {
+        free_export(old);
+    }
+
+    ALOGD("Scan export %s on %s", exp ? "enabled" : "disabled", iface->name);
+    wifi_refresh_scan_filter(iface);
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_scan_export_get_fd(wifi_interface_handle handle, int *fd, size_t *size)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    wifi_error result = WIFI_SUCCESS;
+
+    pthread_mutex_lock(&iface->scan_export_lock);
+    scan_export *exp = iface->scan_export;
+    if (exp == NULL) {
+        result = WIFI_ERROR_NOT_SUPPORTED;
+    } else {
+        /* reopening through /proc is what gives a descriptor that cannot map writable */
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", exp->fd);
+        *fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (*fd < 0) {
+            ALOGE("Could not reopen scan export region: %s", strerror(errno));
+            result = WIFI_ERROR_UNKNOWN;
+        } else {
+            *size = exp->size;
+            exp->stats.fds++;
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_export_lock);
+    return result;
+}
+
+wifi_error wifi_scan_export_get_stats(wifi_interface_handle handle,
+        wifi_scan_export_stats *stats)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    wifi_error result = WIFI_SUCCESS;
+
+    pthread_mutex_lock(&iface->scan_export_lock);
+    if (iface->scan_export) {
+        *stats = iface->scan_export->stats;
+    } else {
+        result = WIFI_ERROR_NOT_SUPPORTED;
+    }
+    pthread_mutex_unlock(&iface->scan_export_lock);
+    return result;
+}
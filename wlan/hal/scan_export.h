@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_SCAN_EXPORT_H__
+#define __WIFI_HAL_SCAN_EXPORT_H__
+
+#include "common.h"
+
+#define SCAN_EXPORT_DEFAULT_SLOTS       256
+#define SCAN_EXPORT_DEFAULT_IE_LENGTH   1024
+
+struct scan_export {
+    int fd;                                         // memfd the region lives in
+    u8 *map;
+    size_t size;
+    wifi_scan_export_header *header;
+    int max_ie_length;
+    wifi_scan_export_stats stats;
+};
+
+/* Called with results as they arrive; no-ops while the export is off */
+void wifi_scan_export_publish(interface_info *iface, const wifi_scan_result *result, int source);
+void wifi_scan_export_publish_results(interface_info *iface, const wifi_scan_result *results,
+        int num, int source);
+
+#endif /* __WIFI_HAL_SCAN_EXPORT_H__ */
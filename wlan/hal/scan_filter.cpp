@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "scan_filter.h"
+
+/*
+ * Filters are kept per request id, so background scan sessions and the standalone full
+ * scan results request are treated alike. The check runs before a result is decoded,
+ * on the driver's fixed fields and IE blob; IE presence is worked out at most once per
+ * result, and only if some filter asks for elements.
+ */
+
+static scan_filter_entry *find_entry(scan_filter_table *table, wifi_request_id id)
+{
+    for (int i = 0; i < table->num_entries; i++) {
+        if (table->entries[i].id == id) {
+            return &table->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static bool filter_matches(const wifi_scan_filter *filter, const wifi_gscan_result_t *fixed,
+        u32 band, wifi_ie_index *index)
+{
+    if (filter->min_rssi && fixed->rssi < filter->min_rssi) {
+        return false;
+    }
+    if (filter->bands && !(filter->bands & band)) {
+        return false;
+    }
+
+    if (filter->num_ouis) {
+        int i = 0;
+        while (i < filter->num_ouis && memcmp(filter->ouis[i], fixed->bssid, 3) != 0) {
+            i++;
+        }
+        if (i == filter->num_ouis) {
+            return false;
+        }
+    }
+
+    if (filter->num_ssids) {
+        int i = 0;
+        while (i < filter->num_ssids && strncmp(filter->ssids[i], (const char *)fixed->ssid,
+                DOT11_MAX_SSID_LEN + 1) != 0) {
+            i++;
+        }
+        if (i == filter->num_ssids) {
+            return false;
+        }
+    }
+
+    /* the index is only built if a filter asks for an element */
+    for (int i = 0; i < filter->num_ies; i++) {
+        if (wifi_ie_get(index, filter->required_ies[i], NULL) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+u32 wifi_scan_filter_check(interface_info *iface, const wifi_request_id *ids, int num,
+        const wifi_gscan_result_t *fixed, const u8 *ies, int ie_length)
+{
+    u32 all = num >= 32 ? ~0U : (1U << num) - 1;
+    if (iface->scan_filters == NULL || iface->scan_filters->num_entries == 0) {
+        return all;                         /* checked again under the lock */
+    }
+
+    wifi_ie_index index;
+    wifi_ie_index_init(&index, ies, ie_length);
+    u32 pass = 0;
+    u32 band = wifi_channel_band(getHalInfo(iface->handle), fixed->channel);
+
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_table *table = iface->scan_filters;
+    for (int i = 0; i < num && i < 32; i++) {
+        scan_filter_entry *entry = table ? find_entry(table, ids[i]) : NULL;
+        if (entry == NULL) {
+            pass |= 1U << i;
+        } else if (filter_matches(&entry->filter, fixed, band, &index)) {
+            entry->stats.passed++;
+            pass |= 1U << i;
+        } else {
+            entry->stats.filtered++;
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+    return pass;
+}
+
+void wifi_scan_filter_remove(interface_info *iface, wifi_request_id id)
+{
+    if (iface->scan_filters == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_table *table = iface->scan_filters;
+    scan_filter_entry *entry = find_entry(table, id);
+    if (entry) {
+        *entry = table->entries[--table->num_entries];
+    }
+    if (table->full_scan_id == id) {
+        table->full_scan_id = -1;
+    }
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+}
+
+/* The table is made on first use and kept; it is small */
+static scan_filter_table *get_table_locked(interface_info *iface)
+{
+    if (iface->scan_filters == NULL) {
+        scan_filter_table *table = (scan_filter_table *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+                sizeof(*table));
+        if (table) {
+            memset(table, 0, sizeof(*table));
+            table->full_scan_id = -1;
+        }
+        iface->scan_filters = table;
+    }
+    return iface->scan_filters;
+}
+
+void wifi_scan_filter_set_full_scan_id(interface_info *iface, wifi_request_id id)
+{
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_table *table = get_table_locked(iface);
+    if (table) {
+        table->full_scan_id = id;
+    }
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+}
+
+/* Widens merged so it also passes everything filter does */
+static void widen(wifi_scan_filter *merged, const wifi_scan_filter *filter, bool first)
+{
+    if (first) {
+        *merged = *filter;
+        return;
+    }
+
+    merged->min_rssi = (merged->min_rssi && filter->min_rssi) ?
+            min(merged->min_rssi, filter->min_rssi) : 0;
+    merged->bands = (merged->bands && filter->bands) ? merged->bands | filter->bands : 0;
+
+    /* a list that would overflow stops constraining at all */
+    if (merged->num_ssids && filter->num_ssids) {
+        for (int i = 0; i < filter->num_ssids && merged->num_ssids; i++) {
+            int j = 0;
+            while (j < merged->num_ssids && strcmp(merged->ssids[j], filter->ssids[i]) != 0) {
+                j++;
+            }
+            if (j < merged->num_ssids) {
+                continue;
+            }
+            if (merged->num_ssids == WIFI_SCAN_FILTER_MAX_SSIDS) {
+                merged->num_ssids = 0;
+            } else {
+                memcpy(merged->ssids[merged->num_ssids++], filter->ssids[i],
+                        sizeof(filter->ssids[i]));
+            }
+        }
+    } else {
+        merged->num_ssids = 0;
+    }
+
+    if (merged->num_ouis && filter->num_ouis) {
+        for (int i = 0; i < filter->num_ouis && merged->num_ouis; i++) {
+            int j = 0;
+            while (j < merged->num_ouis && memcmp(merged->ouis[j], filter->ouis[i], 3) != 0) {
+                j++;
+            }
+            if (j < merged->num_ouis) {
+                continue;
+            }
+            if (merged->num_ouis == WIFI_SCAN_FILTER_MAX_OUIS) {
+                merged->num_ouis = 0;
+            } else {
+                memcpy(merged->ouis[merged->num_ouis++], filter->ouis[i], 3);
+            }
+        }
+    } else {
+        merged->num_ouis = 0;
+    }
+
+    /* only elements every filter requires */
+    int n = 0;
+    for (int i = 0; i < merged->num_ies; i++) {
+        for (int j = 0; j < filter->num_ies; j++) {
+            if (filter->required_ies[j] == merged->required_ies[i]) {
+                merged->required_ies[n++] = merged->required_ies[i];
+                break;
+            }
+        }
+    }
+    merged->num_ies = n;
+}
+
+bool wifi_scan_filter_union(interface_info *iface, const wifi_request_id *ids, int num,
+        wifi_scan_filter *merged)
+{
+    bool ok = false;
+    memset(merged, 0, sizeof(*merged));
+
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_table *table = iface->scan_filters;
+    if (table && !table->offload_unsupported) {
+        int consumers = 0;
+        ok = true;
+        for (int i = 0; i <= num && ok; i++) {
+            wifi_request_id id = i < num ? ids[i] : table->full_scan_id;
+            if (i == num && id == -1) {
+                break;
+            }
+            scan_filter_entry *entry = find_entry(table, id);
+            if (entry == NULL) {
+                ok = false;
+            } else {
+                widen(merged, &entry->filter, consumers++ == 0);
+            }
+        }
+        ok = ok && consumers > 0;
+    }
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+
+    if (!ok) {
+        memset(merged, 0, sizeof(*merged));
+    }
+    return ok;
+}
+
+void wifi_scan_filter_set_offloaded(interface_info *iface, bool offloaded, bool unsupported)
+{
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_table *table = get_table_locked(iface);
+    if (table) {
+        table->offloaded = offloaded;
+        table->offload_unsupported |= unsupported;
+        for (int i = 0; i < table->num_entries; i++) {
+            table->entries[i].stats.offloaded = offloaded;
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+}
+
+void wifi_scan_filter_unload(interface_info *iface)
+{
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_table *table = iface->scan_filters;
+    iface->scan_filters = NULL;
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+
+    wifi_hal_free(WIFI_ALLOC_GSCAN, table);
+}
+
+wifi_error wifi_set_scan_filter(wifi_request_id id, wifi_interface_handle handle,
+        const wifi_scan_filter *filter)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    if (filter == NULL) {
+        wifi_scan_filter_remove(iface, id);
+        wifi_refresh_scan_filter(iface);
+        return WIFI_SUCCESS;
+    }
+    if (filter->num_ssids < 0 || filter->num_ssids > WIFI_SCAN_FILTER_MAX_SSIDS ||
+            filter->num_ouis < 0 || filter->num_ouis > WIFI_SCAN_FILTER_MAX_OUIS ||
+            filter->num_ies < 0 || filter->num_ies > WIFI_SCAN_FILTER_MAX_IES) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    wifi_error result = WIFI_SUCCESS;
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_table *table = get_table_locked(iface);
+    scan_filter_entry *entry = table ? find_entry(table, id) : NULL;
+    if (table == NULL) {
+        result = WIFI_ERROR_OUT_OF_MEMORY;
+    } else if (entry == NULL && table->num_entries == SCAN_FILTER_MAX_REQUESTS) {
+        result = WIFI_ERROR_TOO_MANY_REQUESTS;
+    } else {
+        if (entry == NULL) {
+            entry = &table->entries[table->num_entries++];
+            entry->id = id;
+        }
+        /* unused slots zeroed, so equal filters hash alike for the shadow */
+        wifi_scan_filter *stored = &entry->filter;
+        memset(stored, 0, sizeof(*stored));
+        stored->num_ssids = filter->num_ssids;
+        for (int i = 0; i < filter->num_ssids; i++) {
+            strncpy(stored->ssids[i], filter->ssids[i], DOT11_MAX_SSID_LEN);
+        }
+        stored->num_ouis = filter->num_ouis;
+        memcpy(stored->ouis, filter->ouis, sizeof(stored->ouis[0]) * filter->num_ouis);
+        stored->min_rssi = filter->min_rssi;
+        stored->bands = filter->bands;
+        stored->num_ies = filter->num_ies;
+        memcpy(stored->required_ies, filter->required_ies, filter->num_ies);
+        memset(&entry->stats, 0, sizeof(entry->stats));
+    }
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+
+    if (result == WIFI_SUCCESS) {
+        wifi_refresh_scan_filter(iface);
+    }
+    return result;
+}
+
+wifi_error wifi_get_scan_filter_stats(wifi_request_id id, wifi_interface_handle handle,
+        wifi_scan_filter_stats *stats)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    wifi_error result = WIFI_ERROR_NOT_AVAILABLE;
+
+    pthread_mutex_lock(&iface->scan_filter_lock);
+    scan_filter_entry *entry = iface->scan_filters ? find_entry(iface->scan_filters, id) : NULL;
+    if (entry) {
+        *stats = entry->stats;
+        result = WIFI_SUCCESS;
+    }
+    pthread_mutex_unlock(&iface->scan_filter_lock);
+    return result;
+}
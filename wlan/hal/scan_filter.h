@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_SCAN_FILTER_H__
+#define __WIFI_HAL_SCAN_FILTER_H__
+
+#include "common.h"
+
+#define SCAN_FILTER_MAX_REQUESTS    8
+
+typedef struct {
+    wifi_request_id id;
+    wifi_scan_filter filter;
+    wifi_scan_filter_stats stats;
+} scan_filter_entry;
+
+struct scan_filter_table {
+    scan_filter_entry entries[SCAN_FILTER_MAX_REQUESTS];
+    int num_entries;
+    wifi_request_id full_scan_id;                   // standalone full scan results, or -1
+    bool offloaded;                                 // a filter is in effect in the firmware
+    bool offload_unsupported;                       // the firmware has refused one
+};
+
+/* Bit i of the result is set if ids[i] wants the result; requests without a filter
+ * want everything. Works on the driver's record so nothing is copied for a result
+ * nobody wants */
+u32 wifi_scan_filter_check(interface_info *iface, const wifi_request_id *ids, int num,
+        const wifi_gscan_result_t *fixed, const u8 *ies, int ie_length);
+/* Forgets the filter of a request that has stopped; the caller refreshes */
+void wifi_scan_filter_remove(interface_info *iface, wifi_request_id id);
+void wifi_scan_filter_set_full_scan_id(interface_info *iface, wifi_request_id id);
+/* Builds a filter passing everything any of ids and the standalone full scan results
+ * request want; false if one of them has no filter or the firmware cannot take one */
+bool wifi_scan_filter_union(interface_info *iface, const wifi_request_id *ids, int num,
+        wifi_scan_filter *merged);
+void wifi_scan_filter_set_offloaded(interface_info *iface, bool offloaded, bool unsupported);
+/* Drops every filter without telling the firmware; for cleanup */
+void wifi_scan_filter_unload(interface_info *iface);
+/* Recomputes and pushes the firmware filter; called whenever a filter, a consumer of
+ * full results or a host side observer of them comes or goes */
+void wifi_refresh_scan_filter(interface_info *iface);
+
+#endif /* __WIFI_HAL_SCAN_FILTER_H__ */
@@ -0,0 +1,589 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "scan_history.h"
+#include "scan_filter.h"
+
+/*
+ * Sightings are appended to fixed size chunks that hold one array per column: a
+ * dictionary id for the BSSID, the time from the previous row, RSSI and a channel
+ * index. That is eight bytes a row, a tenth of the 80 that a wifi_scan_result takes
+ * before its IEs. Chunks form a ring; when it wraps the oldest chunk is reused, and
+ * dictionary ids no longer referred to by any chunk are handed out again once the
+ * dictionary fills up.
+ */
+
+static size_t bssids_offset()
+{
+    return (sizeof(scan_history_header) + 7) & ~(size_t)7;
+}
+
+static size_t buckets_offset(const scan_history_header *hdr)
+{
+    return bssids_offset() + sizeof(scan_history_bssid) * hdr->max_bssids;
+}
+
+static size_t chunks_offset(const scan_history_header *hdr)
+{
+    return (buckets_offset(hdr) + sizeof(int) * hdr->num_buckets + 7) & ~(size_t)7;
+}
+
+static size_t store_size(const scan_history_header *hdr)
+{
+    return chunks_offset(hdr) + sizeof(scan_history_chunk) * hdr->num_chunks;
+}
+
+static void attach(scan_history *history, void *base)
+{
+    u8 *p = (u8 *)base;
+
+    history->hdr = (scan_history_header *)p;
+    history->bssids = (scan_history_bssid *)(p + bssids_offset());
+    history->buckets = (int *)(p + buckets_offset(history->hdr));
+    history->chunks = (scan_history_chunk *)(p + chunks_offset(history->hdr));
+}
+
+static void read_boot_id(char *boot_id)
+{
+    memset(boot_id, 0, SCAN_HISTORY_BOOT_ID_LEN);
+
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t len = read(fd, boot_id, SCAN_HISTORY_BOOT_ID_LEN - 1);
+        if (len > 0 && boot_id[len - 1] == '\n') {
+            boot_id[len - 1] = 0;
+        }
+        close(fd);
+    }
+}
+
+static void init_store(scan_history *history, const scan_history_header *layout)
+{
+    memset(history->hdr, 0, history->size);
+    *history->hdr = *layout;
+    history->hdr->magic = SCAN_HISTORY_MAGIC;
+    history->hdr->version = SCAN_HISTORY_VERSION;
+    attach(history, history->hdr);
+
+    for (u32 i = 0; i < layout->num_buckets; i++) {
+        history->buckets[i] = -1;
+    }
+}
+
+/* A file from an earlier run is kept if it has the same layout and boot */
+static bool store_matches(const scan_history_header *hdr, const scan_history_header *layout)
+{
+    return hdr->magic == SCAN_HISTORY_MAGIC && hdr->version == SCAN_HISTORY_VERSION &&
+            hdr->max_bssids == layout->max_bssids && hdr->num_buckets == layout->num_buckets &&
+            hdr->num_chunks == layout->num_chunks && hdr->num_bssids <= hdr->max_bssids &&
+            hdr->num_channels <= SCAN_HISTORY_MAX_CHANNELS &&
+            memcmp(hdr->boot_id, layout->boot_id, SCAN_HISTORY_BOOT_ID_LEN) == 0;
+}
+
+static void free_history(scan_history *history)
+{
+    if (history->hdr) {
+        if (history->mapped) {
+            munmap(history->hdr, history->size);
+        } else {
+            wifi_hal_free(WIFI_ALLOC_GSCAN, history->hdr);
+        }
+    }
+    wifi_hal_free(WIFI_ALLOC_GSCAN, history);
+}
+
+static wifi_error map_store(scan_history *history, const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ALOGE("Could not open scan history file %s: %s", path, strerror(errno));
+        return WIFI_ERROR_UNKNOWN;
+    }
+
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, history->size) == 0) {
+        base = mmap(NULL, history->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        ALOGE("Could not map scan history file %s: %s", path, strerror(errno));
+        return WIFI_ERROR_UNKNOWN;
+    }
+    history->hdr = (scan_history_header *)base;
+    history->mapped = true;
+    return WIFI_SUCCESS;
+}
+
+static int find_bssid(const scan_history *history, const u8 *bssid)
+{
+    unsigned bucket = wifi_bssid_hash(bssid) & (history->hdr->num_buckets - 1);
+    for (int i = history->buckets[bucket]; i >= 0; i = history->bssids[i].hash_next) {
+        if (memcmp(history->bssids[i].bssid, bssid, sizeof(mac_addr)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void unlink_bssid(scan_history *history, int id)
+{
+    unsigned bucket = wifi_bssid_hash(history->bssids[id].bssid) &
+            (history->hdr->num_buckets - 1);
+    int *link = &history->buckets[bucket];
+
+    while (*link != id) {
+        link = &history->bssids[*link].hash_next;
+    }
+    *link = history->bssids[id].hash_next;
+}
+
+static u64 oldest_seq(const scan_history_header *hdr)
+{
+    u64 oldest = hdr->next_seq >= hdr->num_chunks ? hdr->next_seq - hdr->num_chunks + 1 : 0;
+    return max(oldest, hdr->first_seq);
+}
+
+/*
+ * Reuses an id whose rows have all been evicted. If every id is still live the oldest
+ * chunks go early, so a burst of new BSSIDs displaces old history rather than being
+ * dropped. The chunk being filled has fewer rows than there are ids, so once it is all
+ * that is left some id is always free.
+ */
+static int recycle_bssid(scan_history *history)
+{
+    scan_history_header *hdr = history->hdr;
+
+    for (;;) {
+        u64 oldest = oldest_seq(hdr);
+        for (u32 n = 0; n < hdr->num_bssids; n++) {
+            u32 id = hdr->recycle_next;
+            hdr->recycle_next = (id + 1) % hdr->num_bssids;
+            if (history->bssids[id].last_seq < oldest) {
+                unlink_bssid(history, id);
+                hdr->bssids_recycled++;
+                return id;
+            }
+        }
+
+        history->chunks[oldest % hdr->num_chunks].rows = 0;
+        hdr->first_seq = oldest + 1;
+        hdr->chunks_evicted++;
+    }
+}
+
+static int add_bssid(scan_history *history, const u8 *bssid)
+{
+    scan_history_header *hdr = history->hdr;
+    int id = hdr->num_bssids < hdr->max_bssids ? (int)hdr->num_bssids++ : recycle_bssid(history);
+
+    scan_history_bssid *entry = &history->bssids[id];
+    unsigned bucket = wifi_bssid_hash(bssid) & (hdr->num_buckets - 1);
+    memcpy(entry->bssid, bssid, sizeof(mac_addr));
+    entry->last_ts = 0;
+    entry->hash_next = history->buckets[bucket];
+    history->buckets[bucket] = id;
+    return id;
+}
+
+static u8 channel_index(scan_history_header *hdr, wifi_channel channel)
+{
+    for (u32 i = 0; i < hdr->num_channels; i++) {
+        if (hdr->channels[i] == channel) {
+            return i;
+        }
+    }
+    if (hdr->num_channels == SCAN_HISTORY_MAX_CHANNELS) {
+        return SCAN_HISTORY_MAX_CHANNELS;
+    }
+    hdr->channels[hdr->num_channels] = channel;
+    return hdr->num_channels++;
+}
+
+static wifi_channel channel_at(const scan_history_header *hdr, u8 index)
+{
+    return index < hdr->num_channels ? hdr->channels[index] : 0;
+}
+
+static scan_history_chunk *current_chunk(scan_history *history)
+{
+    return &history->chunks[history->hdr->next_seq % history->hdr->num_chunks];
+}
+
+static scan_history_chunk *start_chunk(scan_history *history)
+{
+    scan_history_header *hdr = history->hdr;
+
+    hdr->next_seq++;
+    scan_history_chunk *chunk = current_chunk(history);
+    if (chunk->rows && chunk->seq >= hdr->first_seq) {
+        hdr->chunks_evicted++;
+    }
+    chunk->seq = hdr->next_seq;
+    chunk->rows = 0;
+    return chunk;
+}
+
+static void add_locked(scan_history *history, const wifi_scan_result *result, u64 ts_ms)
+{
+    scan_history_header *hdr = history->hdr;
+
+    int id = find_bssid(history, result->bssid);
+    if (id >= 0 && result->ts && history->bssids[id].last_ts == result->ts) {
+        /* the same sighting again, as when cached results are fetched twice */
+        hdr->duplicates++;
+        return;
+    }
+
+    /* late results from the firmware's cache can step backwards, hence signed deltas */
+    scan_history_chunk *chunk = current_chunk(history);
+    s64 delta = chunk->rows ? (s64)(ts_ms - chunk->last_ms) : 0;
+    if (chunk->rows == SCAN_HISTORY_CHUNK_ROWS || delta < INT32_MIN || delta > INT32_MAX) {
+        chunk = start_chunk(history);
+        delta = 0;
+    }
+
+    /* after starting a chunk, so ids only the evicted chunk used can be reused */
+    if (id < 0) {
+        id = add_bssid(history, result->bssid);
+    }
+
+    u32 row = chunk->rows;
+    if (row == 0) {
+        chunk->base_ms = ts_ms;
+        chunk->max_ms = ts_ms;
+    }
+    chunk->delta_ms[row] = delta;
+    chunk->last_ms = ts_ms;
+    chunk->max_ms = max(chunk->max_ms, ts_ms);
+    chunk->bssid[row] = id;
+    chunk->rssi[row] = result->rssi < -128 ? -128 : result->rssi > 127 ? 127 : result->rssi;
+    chunk->channel[row] = channel_index(hdr, result->channel);
+    chunk->rows = row + 1;
+
+    history->bssids[id].last_seq = chunk->seq;
+    history->bssids[id].last_ts = result->ts;
+    hdr->observations++;
+}
+
+static scan_history *lock_history(interface_info *iface)
+{
+    pthread_mutex_lock(&iface->scan_history_lock);
+    scan_history *history = iface->scan_history;
+    if (history == NULL) {
+        pthread_mutex_unlock(&iface->scan_history_lock);
+    }
+    return history;
+}
+
+void wifi_scan_history_add(interface_info *iface, const wifi_scan_result *result)
+{
+    wifi_scan_history_add_results(iface, result, 1);
+}
+
+void wifi_scan_history_add_results(interface_info *iface, const wifi_scan_result *results,
+        int num)
+{
+    if (iface->scan_history == NULL || num <= 0) {
+        return;                             /* checked again under the lock */
+    }
+
+    /*
+     * Results fetched from the firmware's cache can be minutes old. Their driver
+     * timestamps only say how far apart they are, so the newest is taken as now and
+     * the rest are placed relative to it.
+     */
+    u64 now = wifi_get_monotonic_ms();
+    wifi_timestamp newest = 0;
+    for (int i = 0; i < num; i++) {
+        newest = max(newest, results[i].ts);
+    }
+
+    scan_history *history = lock_history(iface);
+    if (history == NULL) {
+        return;
+    }
+    for (int i = 0; i < num; i++) {
+        u64 age_ms = results[i].ts ? (newest - results[i].ts) / 1000 : 0;
+        add_locked(history, &results[i], age_ms < now ? now - age_ms : 0);
+    }
+    pthread_mutex_unlock(&iface->scan_history_lock);
+}
+
+/*
+ * Calls visit(row time, chunk, row) for each row at or after since_ms in the order they
+ * were recorded; chunks with nothing that recent are skipped without decoding.
+ */
+template <typename Visit>
+static void scan_rows(const scan_history *history, u64 since_ms, Visit visit)
+{
+    const scan_history_header *hdr = history->hdr;
+
+    for (u64 seq = oldest_seq(hdr); seq <= hdr->next_seq; seq++) {
+        const scan_history_chunk *chunk = &history->chunks[seq % hdr->num_chunks];
+        if (chunk->seq != seq || chunk->rows == 0 || chunk->max_ms < since_ms) {
+            continue;
+        }
+
+        u64 ts_ms = chunk->base_ms;
+        for (u32 row = 0; row < chunk->rows; row++) {
+            /* the first delta is always 0 */
+            ts_ms += chunk->delta_ms[row];
+            if (ts_ms >= since_ms && !visit(ts_ms, chunk, row)) {
+                return;
+            }
+        }
+    }
+}
+
+wifi_error wifi_scan_history_configure(wifi_interface_handle handle,
+        const wifi_scan_history_params *params)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    scan_history *history = NULL;
+
+    if (params != NULL) {
+        if (params->max_bssids < 0 || params->max_bssids > 0xffff || params->num_chunks < 0) {
+            return WIFI_ERROR_INVALID_ARGS;
+        }
+
+        scan_history_header layout;
+        memset(&layout, 0, sizeof(layout));
+        layout.max_bssids = params->max_bssids ? params->max_bssids : SCAN_HISTORY_DEFAULT_BSSIDS;
+        layout.max_bssids = max(layout.max_bssids, (u32)SCAN_HISTORY_CHUNK_ROWS);
+        layout.num_chunks = params->num_chunks ? params->num_chunks : SCAN_HISTORY_DEFAULT_CHUNKS;
+        layout.num_buckets = 1;
+        while (layout.num_buckets < layout.max_bssids) {
+            layout.num_buckets <<= 1;
+        }
+        read_boot_id(layout.boot_id);
+
+        history = (scan_history *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*history));
+        NULL_CHECK_RETURN(history, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+        memset(history, 0, sizeof(*history));
+        history->size = store_size(&layout);
+
+        if (params->backing_file) {
+            wifi_error result = map_store(history, params->backing_file);
+            if (result != WIFI_SUCCESS) {
+                free_history(history);
+                return result;
+            }
+        } else {
+            history->hdr = (scan_history_header *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+                    history->size);
+            if (history->hdr == NULL) {
+                free_history(history);
+                return WIFI_ERROR_OUT_OF_MEMORY;
+            }
+        }
+
+        if (history->mapped && store_matches(history->hdr, &layout)) {
+            attach(history, history->hdr);
+            ALOGI("Scan history resumed with %llu sightings",
+                    (unsigned long long)history->hdr->observations);
+        } else {
+            init_store(history, &layout);
+        }
+    }
+
+    pthread_mutex_lock(&iface->scan_history_lock);
+    scan_history *old = iface->scan_history;
+    iface->scan_history = history;
+    pthread_mutex_unlock(&iface->scan_history_lock);
+
+    if (old) {
+        free_history(old);
+    }
+
+    ALOGD("Scan history %s on %s", history ? "enabled" : "disabled", iface->name);
+    wifi_refresh_scan_filter(iface);
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_scan_history_rssi_series(wifi_interface_handle handle, mac_addr bssid,
+        u64 since_ms, wifi_scan_history_sample *samples, int max, int *num)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    *num = 0;
+
+    scan_history *history = lock_history(iface);
+    if (history == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    int id = find_bssid(history, bssid);
+    if (id >= 0 && max > 0) {
+        const scan_history_header *hdr = history->hdr;
+        scan_rows(history, since_ms, [&](u64 ts_ms, const scan_history_chunk *chunk, u32 row) {
+            if (chunk->bssid[row] == id) {
+                samples[*num].ts_ms = ts_ms;
+                samples[*num].channel = channel_at(hdr, chunk->channel[row]);
+                samples[*num].rssi = chunk->rssi[row];
+                (*num)++;
+            }
+            return *num < max;
+        });
+    }
+    pthread_mutex_unlock(&iface->scan_history_lock);
+    return id >= 0 ? WIFI_SUCCESS : WIFI_ERROR_NOT_AVAILABLE;
+}
+
+wifi_error wifi_scan_history_visibility(wifi_interface_handle handle, mac_addr bssid,
+        u64 since_ms, u32 max_gap_ms, wifi_scan_history_window *windows, int max, int *num)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    *num = 0;
+
+    scan_history *history = lock_history(iface);
+    if (history == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    int id = find_bssid(history, bssid);
+    if (id >= 0 && max > 0) {
+        scan_rows(history, since_ms, [&](u64 ts_ms, const scan_history_chunk *chunk, u32 row) {
+            if (chunk->bssid[row] != id) {
+                return true;
+            }
+            /* a late cached sighting can land just before the window it belongs to */
+            wifi_scan_history_window *last = *num ? &windows[*num - 1] : NULL;
+            if (last && ts_ms + max_gap_ms >= last->first_ms &&
+                    ts_ms <= last->last_ms + max_gap_ms) {
+                last->first_ms = min(last->first_ms, ts_ms);
+                last->last_ms = max(last->last_ms, ts_ms);
+                last->sightings++;
+                return true;
+            }
+            if (*num == max) {
+                return false;
+            }
+            wifi_scan_history_window *window = &windows[(*num)++];
+            window->first_ms = ts_ms;
+            window->last_ms = ts_ms;
+            window->sightings = 1;
+            return true;
+        });
+    }
+    pthread_mutex_unlock(&iface->scan_history_lock);
+    return id >= 0 ? WIFI_SUCCESS : WIFI_ERROR_NOT_AVAILABLE;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    u32 ka = *(const u32 *)a, kb = *(const u32 *)b;
+    return ka < kb ? -1 : ka > kb;
+}
+
+static int compare_channels(const void *a, const void *b)
+{
+    const wifi_scan_history_channel *ca = (const wifi_scan_history_channel *)a;
+    const wifi_scan_history_channel *cb = (const wifi_scan_history_channel *)b;
+    return ca->channel < cb->channel ? -1 : ca->channel > cb->channel;
+}
+
+wifi_error wifi_scan_history_channel_counts(wifi_interface_handle handle, u64 since_ms,
+        wifi_scan_history_channel *channels, int max, int *num)
+{
+    interface_info *iface = getIfaceInfo(handle);
+    *num = 0;
+
+    scan_history *history = lock_history(iface);
+    if (history == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    /* channel and BSSID id pairs, sorted so each distinct pair is counted once */
+    size_t max_rows = (size_t)history->hdr->num_chunks * SCAN_HISTORY_CHUNK_ROWS;
+    u32 *keys = (u32 *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(u32) * max_rows);
+    if (keys == NULL) {
+        pthread_mutex_unlock(&iface->scan_history_lock);
+        return WIFI_ERROR_OUT_OF_MEMORY;
+    }
+
+    size_t num_keys = 0;
+    scan_rows(history, since_ms, [&](u64 ts_ms, const scan_history_chunk *chunk, u32 row) {
+        keys[num_keys++] = ((u32)chunk->channel[row] << 16) | chunk->bssid[row];
+        return true;
+    });
+    qsort(keys, num_keys, sizeof(u32), compare_keys);
+
+    /* keys come grouped by channel index, and each index is a different channel */
+    wifi_scan_history_channel counts[SCAN_HISTORY_MAX_CHANNELS + 1];
+    int n = 0;
+    for (size_t i = 0; i < num_keys; i++) {
+        if (i == 0 || (keys[i] >> 16) != (keys[i - 1] >> 16)) {
+            counts[n].channel = channel_at(history->hdr, keys[i] >> 16);
+            counts[n].num_aps = 0;
+            counts[n].sightings = 0;
+            n++;
+        }
+        counts[n - 1].sightings++;
+        if (i == 0 || keys[i] != keys[i - 1]) {
+            counts[n - 1].num_aps++;
+        }
+    }
+    pthread_mutex_unlock(&iface->scan_history_lock);
+    wifi_hal_free(WIFI_ALLOC_GSCAN, keys);
+
+    qsort(counts, n, sizeof(counts[0]), compare_channels);
+    n = n < max ? n : max > 0 ? max : 0;
+    memcpy(channels, counts, sizeof(counts[0]) * n);
+    *num = n;
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_scan_history_get_stats(wifi_interface_handle handle,
+        wifi_scan_history_stats *stats)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    scan_history *history = lock_history(iface);
+    if (history == NULL) {
+        return WIFI_ERROR_NOT_SUPPORTED;
+    }
+
+    const scan_history_header *hdr = history->hdr;
+    memset(stats, 0, sizeof(*stats));
+    stats->observations = hdr->observations;
+    stats->duplicates = hdr->duplicates;
+    for (u32 i = 0; i < hdr->num_chunks; i++) {
+        stats->rows += history->chunks[i].rows;
+    }
+    stats->bssids = hdr->num_bssids;
+    stats->bssids_recycled = hdr->bssids_recycled;
+    stats->chunks_evicted = hdr->chunks_evicted;
+    stats->bytes = sizeof(*history) + history->size;
+    pthread_mutex_unlock(&iface->scan_history_lock);
+    return WIFI_SUCCESS;
+}
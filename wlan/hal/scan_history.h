@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_SCAN_HISTORY_H__
+#define __WIFI_HAL_SCAN_HISTORY_H__
+
+#include "common.h"
+
+#define SCAN_HISTORY_MAGIC              0x57534831  /* "WSH1" */
+#define SCAN_HISTORY_VERSION            3           /* 3 widened delta_ms */
+#define SCAN_HISTORY_CHUNK_ROWS         256
+#define SCAN_HISTORY_MAX_CHANNELS       255         /* index 255 stands for any other */
+#define SCAN_HISTORY_DEFAULT_BSSIDS     1024
+#define SCAN_HISTORY_DEFAULT_CHUNKS     64
+#define SCAN_HISTORY_BOOT_ID_LEN        40
+
+/*
+ * Start of the store. Everything after it is addressed by offset so the same layout
+ * works from the heap and from a mapped file.
+ */
+typedef struct {
+    u32 magic;
+    u32 version;
+    char boot_id[SCAN_HISTORY_BOOT_ID_LEN];        // times are only valid within one boot
+    u32 max_bssids;
+    u32 num_buckets;
+    u32 num_chunks;
+    u32 num_bssids;                                 // dictionary ids handed out so far
+    u32 num_channels;
+    u32 recycle_next;                               // where the next search for a stale id starts
+    u64 next_seq;                                   // sequence number of the chunk being filled
+    u64 first_seq;                                  // oldest chunk not evicted early
+    u64 observations;
+    u64 duplicates;
+    u64 bssids_recycled;
+    u64 chunks_evicted;
+    wifi_channel channels[SCAN_HISTORY_MAX_CHANNELS];
+} scan_history_header;
+
+/* One dictionary entry; rows refer to it by index */
+typedef struct {
+    mac_addr bssid;
+    u16 reserved;
+    int hash_next;                                  // next entry in the bucket, or -1
+    u64 last_seq;                                   // newest chunk that refers to this id
+    wifi_timestamp last_ts;                         // driver timestamp of the newest row
+} scan_history_bssid;
+
+/* Fixed size block of observations, one array per column */
+typedef struct {
+    u64 seq;
+    u64 base_ms;                                    // time of the first row
+    u64 last_ms;                                    // time of the last row
+    u64 max_ms;                                     // time of the newest row
+    u32 rows;
+    u32 reserved;
+    u16 bssid[SCAN_HISTORY_CHUNK_ROWS];             // dictionary id
+    int32_t delta_ms[SCAN_HISTORY_CHUNK_ROWS];      // from the previous row; gaps between
+                                                    // scans are often minutes
+    s8 rssi[SCAN_HISTORY_CHUNK_ROWS];
+    u8 channel[SCAN_HISTORY_CHUNK_ROWS];            // index into channels[]
+} scan_history_chunk;
+
+struct scan_history {
+    scan_history_header *hdr;
+    scan_history_bssid *bssids;
+    int *buckets;
+    scan_history_chunk *chunks;
+    size_t size;
+    bool mapped;                                    // backed by a file rather than the heap
+};
+
+/* Called with results as they arrive; no-ops while the history is off */
+void wifi_scan_history_add(interface_info *iface, const wifi_scan_result *result);
+void wifi_scan_history_add_results(interface_info *iface, const wifi_scan_result *results,
+        int num);
+
+#endif /* __WIFI_HAL_SCAN_HISTORY_H__ */
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "scan_planner.h"
+
+static int dwell_ms(const wifi_scan_channel_spec *channel)
+{
+    if (channel->dwellTimeMs > 0) {
+        return channel->dwellTimeMs;
+    }
+    return channel->passive ? SCAN_PASSIVE_DWELL_MS : SCAN_ACTIVE_DWELL_MS;
+}
+
+/* Radio time of one scan of the channels, visited in the order given */
+static u32 pass_ms(const wifi_scan_channel_spec *channels, int num)
+{
+    u32 ms = 0;
+    for (int i = 0; i < num; i++) {
+        ms += dwell_ms(&channels[i]);
+        if (i > 0) {
+            ms += wifi_is_5ghz(channels[i].channel) != wifi_is_5ghz(channels[i - 1].channel) ?
+                    SCAN_BAND_SWITCH_MS : SCAN_RETUNE_MS;
+        }
+    }
+    return ms;
+}
+
+/* Fills channels from a band's list, passive where active scanning is not allowed */
+static int band_channels(const channel_list *list, wifi_scan_channel_spec *channels, int max)
+{
+    int num = min(list->num, max);
+    for (int i = 0; i < num; i++) {
+        channels[i].channel = list->channels[i];
+        channels[i].dwellTimeMs = 0;
+        channels[i].passive = (list->flags[i] & (WIFI_CHANNEL_FLAG_DFS |
+                WIFI_CHANNEL_FLAG_NO_IR)) != 0;
+    }
+    return num;
+}
+
+u32 scan_plan_radio_ms(const wifi_scan_cmd_params *params, const channel_list *bands)
+{
+    u64 total = 0;
+
+    for (int b = 0; b < params->num_buckets; b++) {
+        const wifi_scan_bucket_spec *bucket = &params->buckets[b];
+        if (bucket->period <= 0) {
+            continue;
+        }
+
+        u32 ms;
+        if (bucket->band != WIFI_BAND_UNSPECIFIED) {
+            const channel_list *list = &bands[bucket->band & (NUM_CHANNEL_BANDS - 1)];
+            wifi_scan_channel_spec channels[MAX_CACHED_CHANNELS];
+            ms = list->valid ? pass_ms(channels, band_channels(list, channels,
+                    MAX_CACHED_CHANNELS)) : 0;
+        } else {
+            ms = pass_ms(bucket->channels, bucket->num_channels);
+        }
+        total += (u64)ms * (3600000 / bucket->period);
+    }
+    return (u32)min(total, (u64)UINT32_MAX);
+}
+
+/* Exponential buckets scan at changing times; only fixed ones can stand in for others */
+static inline bool is_fixed(const wifi_scan_bucket_spec *bucket)
+{
+    return bucket->period > 0 && (bucket->max_period == 0 ||
+            bucket->max_period == bucket->period);
+}
+
+static int find_channel(const wifi_scan_bucket_spec *bucket, wifi_channel channel)
+{
+    for (int i = 0; i < bucket->num_channels; i++) {
+        if (bucket->channels[i].channel == channel) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* True if every scan of channel c in bucket b also happens, the same way, in bucket a */
+static bool covers(const wifi_scan_bucket_spec *a, const wifi_scan_channel_spec *ca,
+        const wifi_scan_bucket_spec *b, const wifi_scan_channel_spec *cb)
+{
+    const u8 reports = REPORT_EVENTS_FULL_RESULTS | REPORT_EVENTS_NO_BATCH;
+    return is_fixed(a) && is_fixed(b) && b->period % a->period == 0 &&
+            (a->report_events & reports) == (b->report_events & reports) &&
+            ca->passive <= cb->passive && dwell_ms(ca) >= dwell_ms(cb);
+}
+
+static int compare_channels(const void *a, const void *b)
+{
+    return (int)((const wifi_scan_channel_spec *)a)->channel -
+            (int)((const wifi_scan_channel_spec *)b)->channel;
+}
+
+void scan_plan_rewrite(wifi_scan_cmd_params *params, const channel_list *bands,
+        scan_plan *plan)
+{
+    int num = min(params->num_buckets, MAX_BUCKETS);
+    wifi_scan_bucket_spec *buckets = params->buckets;
+    u32 moved[MAX_BUCKETS];                         // buckets that took over channels of each
+    int folded[MAX_BUCKETS];                        // bucket each was folded into, or itself
+
+    memset(plan, 0, sizeof(*plan));
+    plan->radio_ms_before = scan_plan_radio_ms(params, bands);
+
+    /* band buckets become channel lists, so they can share channels with the others */
+    for (int b = 0; b < num; b++) {
+        const channel_list *list = &bands[buckets[b].band & (NUM_CHANNEL_BANDS - 1)];
+        if (buckets[b].band != WIFI_BAND_UNSPECIFIED && list->valid &&
+                list->num <= MAX_CHANNELS) {
+            buckets[b].num_channels = band_channels(list, buckets[b].channels, MAX_CHANNELS);
+            buckets[b].band = WIFI_BAND_UNSPECIFIED;
+            plan->bands_expanded++;
+        }
+    }
+
+    /* a channel is left only in the fastest bucket covering it, which is never dropped
+     * itself since anything covering that would cover the others too */
+    for (int b = 0; b < num; b++) {
+        moved[b] = 0;
+        folded[b] = b;
+        for (int c = 0; c < buckets[b].num_channels; ) {
+            const wifi_scan_channel_spec *channel = &buckets[b].channels[c];
+            int best = -1;
+            for (int a = 0; a < num; a++) {
+                int i = a == b ? -1 : find_channel(&buckets[a], channel->channel);
+                if (i >= 0 && covers(&buckets[a], &buckets[a].channels[i], &buckets[b], channel)
+                        && (buckets[a].period < buckets[b].period || a < b) &&
+                        (best < 0 || buckets[a].period < buckets[best].period)) {
+                    best = a;
+                }
+            }
+            if (best < 0) {
+                c++;
+                continue;
+            }
+            buckets[b].channels[c] = buckets[b].channels[--buckets[b].num_channels];
+            moved[b] |= 1U << best;
+            plan->channels_removed++;
+        }
+    }
+
+    /* buckets run at the same times are scanned as one if the channels fit */
+    for (int a = 0; a < num; a++) {
+        if (folded[a] != a || buckets[a].band != WIFI_BAND_UNSPECIFIED) {
+            continue;
+        }
+        for (int b = a + 1; b < num; b++) {
+            wifi_scan_bucket_spec *from = &buckets[b];
+            wifi_scan_bucket_spec *to = &buckets[a];
+            if (folded[b] != b || from->band != WIFI_BAND_UNSPECIFIED ||
+                    from->period != to->period || from->max_period != to->max_period ||
+                    from->step_count != to->step_count || from->base != to->base ||
+                    from->report_events != to->report_events) {
+                continue;
+            }
+
+            int added = 0;
+            for (int c = 0; c < from->num_channels; c++) {
+                added += find_channel(to, from->channels[c].channel) < 0;
+            }
+            if (to->num_channels + added > MAX_CHANNELS) {
+                continue;
+            }
+            for (int c = 0; c < from->num_channels; c++) {
+                int i = find_channel(to, from->channels[c].channel);
+                if (i < 0) {
+                    to->channels[to->num_channels++] = from->channels[c];
+                } else {
+                    to->channels[i].dwellTimeMs = max(to->channels[i].dwellTimeMs,
+                            from->channels[c].dwellTimeMs);
+                    to->channels[i].passive &= from->channels[c].passive;
+                }
+            }
+            folded[b] = a;
+        }
+    }
+
+    /* compact, numbering the buckets left in order */
+    int index[MAX_BUCKETS];
+    int kept = 0;
+    for (int b = 0; b < num; b++) {
+        bool empty = buckets[b].band == WIFI_BAND_UNSPECIFIED && buckets[b].num_channels == 0;
+        if (folded[b] != b || (empty && moved[b])) {
+            index[b] = -1;
+            plan->buckets_removed++;
+            continue;
+        }
+        index[b] = kept;
+        if (kept != b) {
+            buckets[kept] = buckets[b];
+        }
+        buckets[kept].bucket = kept;
+        qsort(buckets[kept].channels, buckets[kept].num_channels,
+                sizeof(wifi_scan_channel_spec), compare_channels);
+        kept++;
+    }
+    params->num_buckets = kept;
+
+    for (int b = 0; b < num; b++) {
+        u32 remap = 0;
+        if (index[folded[b]] >= 0) {
+            remap |= 1U << index[folded[b]];
+        }
+        for (int a = 0; a < num; a++) {
+            if (moved[b] & (1U << a)) {
+                remap |= 1U << index[folded[a]];
+            }
+        }
+        plan->remap[b] = remap;
+    }
+
+    plan->radio_ms_after = scan_plan_radio_ms(params, bands);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_SCAN_PLANNER_H__
+#define __WIFI_HAL_SCAN_PLANNER_H__
+
+#include "common.h"
+
+/* Radio time model used to compare schedules */
+#define SCAN_ACTIVE_DWELL_MS    30                  // firmware default dwell times
+#define SCAN_PASSIVE_DWELL_MS   110
+#define SCAN_RETUNE_MS          2                   // next channel in the same band
+#define SCAN_BAND_SWITCH_MS     5                   // between 2.4 and 5 GHz
+
+typedef struct {
+    u32 remap[MAX_BUCKETS];                         // new buckets carrying each old one's channels
+    u32 channels_removed;                           // scanned as often by a faster bucket
+    u32 buckets_removed;                            // folded into another or left empty
+    u32 bands_expanded;                             // band buckets turned into channel lists
+    u32 radio_ms_before;                            // estimated radio time per hour
+    u32 radio_ms_after;
+} scan_plan;
+
+/*
+ * Rewrites params in place into a schedule that scans every requested channel at least
+ * as often, in the same way, for less radio time. bands[b] is the valid channel list of
+ * wifi_band b; lists that are not valid leave buckets of that band alone.
+ */
+void scan_plan_rewrite(wifi_scan_cmd_params *params, const channel_list *bands,
+        scan_plan *plan);
+/* Estimated radio on time per hour of running params */
+u32 scan_plan_radio_ms(const wifi_scan_cmd_params *params, const channel_list *bands);
+
+#endif /* __WIFI_HAL_SCAN_PLANNER_H__ */
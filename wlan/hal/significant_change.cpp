@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "significant_change.h"
+
+
+/* Lays the columns out back to back after the engine; with base NULL only sizes them */
+#define CARVE(ptr, bytes) do { \
+        (ptr) = base ? (decltype(ptr))(base + size) : NULL; \
+        size += ((bytes) + 7) & ~(size_t)7; \
+    } while (0)
+
+static size_t layout(sig_change_engine *engine, u8 *base, int num_aps, int window,
+        int index_size, int stride)
+{
+    size_t size = (sizeof(sig_change_engine) + 7) & ~(size_t)7;
+
+    CARVE(engine->bssid, sizeof(mac_addr) * num_aps);
+    CARVE(engine->low, num_aps);
+    CARVE(engine->high, num_aps);
+    CARVE(engine->channel, sizeof(wifi_channel) * num_aps);
+    CARVE(engine->ring, num_aps * window);
+    CARVE(engine->ring_pos, num_aps);
+    CARVE(engine->ring_count, num_aps);
+    CARVE(engine->rssi_sum, sizeof(int16_t) * num_aps);
+    CARVE(engine->missed, num_aps);
+    CARVE(engine->seen, num_aps);
+    CARVE(engine->state, num_aps);
+    CARVE(engine->pending, num_aps);
+    CARVE(engine->index, sizeof(int) * index_size);
+    CARVE(engine->report, stride * num_aps);
+    CARVE(engine->results, sizeof(wifi_significant_change_result *) * num_aps);
+    return size;
+}
+
+#undef CARVE
+
+static int index_slot(const sig_change_engine *engine, const u8 *bssid)
+{
+    int slot = wifi_bssid_hash(bssid) & engine->index_mask;
+    while (engine->index[slot] >= 0 &&
+            memcmp(engine->bssid[engine->index[slot]], bssid, sizeof(mac_addr)) != 0) {
+        slot = (slot + 1) & engine->index_mask;
+    }
+    return slot;
+}
+
+static void set_pending(sig_change_engine *engine, int i, bool pending)
+{
+    if (engine->pending[i] != pending) {
+        engine->pending[i] = pending;
+        engine->num_pending += pending ? 1 : -1;
+    }
+}
+
+sig_change_engine *sig_change_create(int rssi_sample_size, int lost_ap_sample_size,
+        int min_breaching, const ap_threshold_param *aps, int num_aps)
+{
+    int window = rssi_sample_size;
+    if (window <= 0 || window > WIFI_SIGNIFICANT_CHANGE_MAX_SAMPLES || num_aps <= 0 ||
+            num_aps > WIFI_SIGNIFICANT_CHANGE_MAX_BSSIDS || lost_ap_sample_size > 255) {
+        return NULL;
+    }
+
+    int index_size = 2;
+    while (index_size < 2 * num_aps) {
+        index_size <<= 1;
+    }
+    int stride = (sizeof(wifi_significant_change_result) + sizeof(wifi_rssi) * window + 7) & ~7;
+
+    sig_change_engine sizing;
+    size_t size = layout(&sizing, NULL, num_aps, window, index_size, stride);
+    u8 *base = (u8 *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, size);
+    if (base == NULL) {
+        return NULL;
+    }
+    memset(base, 0, size);
+
+    sig_change_engine *engine = (sig_change_engine *)base;
+    layout(engine, base, num_aps, window, index_size, stride);
+    engine->window = window;
+    engine->lost_ap_sample_size = max(lost_ap_sample_size, 1);
+    engine->min_breaching = max(min_breaching, 1);
+    engine->index_mask = index_size - 1;
+    engine->report_stride = stride;
+    for (int i = 0; i < index_size; i++) {
+        engine->index[i] = -1;
+    }
+
+    for (int i = 0; i < num_aps; i++) {
+        int slot = index_slot(engine, aps[i].bssid);
+        if (engine->index[slot] >= 0) {
+            continue;                                   /* listed twice */
+        }
+        int n = engine->num_aps++;
+        memcpy(engine->bssid[n], aps[i].bssid, sizeof(mac_addr));
+        engine->low[n] = aps[i].low;
+        engine->high[n] = aps[i].high;
+        engine->index[slot] = n;
+    }
+    return engine;
+}
+
+void sig_change_free(sig_change_engine *engine)
+{
+    wifi_hal_free(WIFI_ALLOC_GSCAN, engine);
+}
+
+void sig_change_observe(sig_change_engine *engine, const wifi_scan_result *result)
+{
+    int i = engine->index[index_slot(engine, (const u8 *)result->bssid)];
+    if (i < 0) {
+        return;
+    }
+
+    int window = engine->window;
+    s8 rssi = max(min(result->rssi, 127), -128);
+    s8 *ring = &engine->ring[i * window];
+
+    if (engine->state[i] == SIG_CHANGE_LOST) {
+        /* back in range; judge it on fresh samples */
+        engine->state[i] = SIG_CHANGE_INSIDE;
+        engine->ring_count[i] = 0;
+        engine->ring_pos[i] = 0;
+        engine->rssi_sum[i] = 0;
+        set_pending(engine, i, false);
+    }
+
+    if (engine->ring_count[i] == window) {
+        engine->rssi_sum[i] -= ring[engine->ring_pos[i]];
+    } else {
+        engine->ring_count[i]++;
+    }
+    ring[engine->ring_pos[i]] = rssi;
+    engine->rssi_sum[i] += rssi;
+    engine->ring_pos[i] = engine->ring_pos[i] + 1 == window ? 0 : engine->ring_pos[i] + 1;
+    engine->channel[i] = result->channel;
+    engine->missed[i] = 0;
+    engine->seen[i] = 1;
+
+    if (engine->ring_count[i] < window) {
+        return;
+    }
+
+    int sum = engine->rssi_sum[i];
+    bool breached = sum < engine->low[i] * window || sum > engine->high[i] * window;
+    if (breached && engine->state[i] != SIG_CHANGE_BREACHED) {
+        engine->state[i] = SIG_CHANGE_BREACHED;
+        set_pending(engine, i, true);
+    } else if (!breached && engine->state[i] == SIG_CHANGE_BREACHED) {
+        /* recovered before it was reported */
+        engine->state[i] = SIG_CHANGE_INSIDE;
+        set_pending(engine, i, false);
+    }
+}
+
+int sig_change_complete_scan(sig_change_engine *engine)
+{
+    for (int i = 0; i < engine->num_aps; i++) {
+        if (engine->seen[i]) {
+            engine->seen[i] = 0;
+        } else if (engine->ring_count[i] && engine->missed[i] < engine->lost_ap_sample_size &&
+                ++engine->missed[i] == engine->lost_ap_sample_size) {
+            engine->state[i] = SIG_CHANGE_LOST;
+            set_pending(engine, i, true);
+        }
+    }
+
+    if (engine->num_pending < engine->min_breaching) {
+        return 0;
+    }
+
+    /* window samples go out oldest first */
+    int num = 0;
+    int window = engine->window;
+    for (int i = 0; i < engine->num_aps && num < engine->num_pending; i++) {
+        if (!engine->pending[i]) {
+            continue;
+        }
+        wifi_significant_change_result *result = (wifi_significant_change_result *)
+                (engine->report + num * engine->report_stride);
+        memcpy(result->bssid, engine->bssid[i], sizeof(mac_addr));
+        result->channel = engine->channel[i];
+        result->num_rssi = engine->ring_count[i];
+        int first = engine->ring_count[i] == window ? engine->ring_pos[i] : 0;
+        for (int j = 0; j < result->num_rssi; j++) {
+            result->rssi[j] = engine->ring[i * window + (first + j) % window];
+        }
+        engine->results[num++] = result;
+        engine->pending[i] = 0;
+    }
+    engine->num_pending = 0;
+    return num;
+}
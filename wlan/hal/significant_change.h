@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_SIGNIFICANT_CHANGE_H__
+#define __WIFI_HAL_SIGNIFICANT_CHANGE_H__
+
+#include "common.h"
+
+typedef enum {
+    SIG_CHANGE_INSIDE,                              // mean RSSI within [low, high]
+    SIG_CHANGE_BREACHED,                            // mean RSSI outside [low, high]
+    SIG_CHANGE_LOST                                 // missed lost_ap_sample_size scans
+} sig_change_state;
+
+/*
+ * Host side significant change tracking. Per BSSID state is kept as parallel columns so
+ * a sample touches only its own window and sums, and the end of scan sweep walks the
+ * small missed/seen columns. Windows are rssi_sample_size samples with a running sum,
+ * which is compared against the thresholds scaled by the window instead of dividing.
+ */
+struct sig_change_engine {
+    int window;                                     // rssi_sample_size
+    int lost_ap_sample_size;
+    int min_breaching;
+    int num_aps;
+
+    mac_addr *bssid;
+    s8 *low;
+    s8 *high;
+    wifi_channel *channel;                          // last channel seen on
+    s8 *ring;                                       // window samples per BSSID
+    u8 *ring_pos;                                   // next sample to overwrite
+    u8 *ring_count;                                 // samples in the window
+    int16_t *rssi_sum;                              // sum of the window
+    u8 *missed;                                     // consecutive scans without a sighting
+    u8 *seen;                                       // sighted in the scan in progress
+    u8 *state;                                      // sig_change_state
+    u8 *pending;                                    // state changed since the last report
+    int num_pending;
+
+    int *index;                                     // open addressed BSSID -> column
+    int index_mask;
+
+    u8 *report;                                     // results handed to the handler
+    int report_stride;
+    wifi_significant_change_result **results;
+};
+
+sig_change_engine *sig_change_create(int rssi_sample_size, int lost_ap_sample_size,
+        int min_breaching, const ap_threshold_param *aps, int num_aps);
+void sig_change_free(sig_change_engine *engine);
+void sig_change_observe(sig_change_engine *engine, const wifi_scan_result *result);
+/* Ends a scan; returns the number of results in engine->results to report, if any */
+int sig_change_complete_scan(sig_change_engine *engine);
+
+#endif /* __WIFI_HAL_SIGNIFICANT_CHANGE_H__ */
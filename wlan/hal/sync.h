@@ -43,14 +43,16 @@ public:
     }
 };
 
+/* A signal() that comes before wait() is not lost; the next wait() returns at once */
 class Condition
 {
 private:
     pthread_cond_t mCondition;
     pthread_mutex_t mMutex;
+    bool mSignalled;                    // signal() seen since the last wait() or reset()
 
 public:
-    Condition() {
+    Condition() : mSignalled(false) {
         pthread_mutex_init(&mMutex, NULL);
         pthread_cond_init(&mCondition, NULL);
     }
@@ -59,12 +61,29 @@ public:
         pthread_mutex_destroy(&mMutex);
     }
 
+    /* forgets signals that came before the caller started what it will wait for */
+    void reset() {
+        pthread_mutex_lock(&mMutex);
+        mSignalled = false;
+        pthread_mutex_unlock(&mMutex);
+    }
+
     int wait() {
-        return pthread_cond_wait(&mCondition, &mMutex);
+        int res = 0;
+        pthread_mutex_lock(&mMutex);
+        while (!mSignalled && res == 0) {
+            res = pthread_cond_wait(&mCondition, &mMutex);
+        }
+        mSignalled = false;
+        pthread_mutex_unlock(&mMutex);
+        return -res;
     }
 
     void signal() {
+        pthread_mutex_lock(&mMutex);
+        mSignalled = true;
         pthread_cond_signal(&mCondition);
+        pthread_mutex_unlock(&mMutex);
     }
 };
 
@@ -0,0 +1,417 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <netlink/genl/genl.h>
+
+#define LOG_TAG  "WifiHAL"
+
+#include <log/log.h>
+
+#include "wifi_hal.h"
+#include "common.h"
+#include "warm_start.h"
+
+/*
+ * Recent results are kept in memory as they arrive and copied into a mapped file no
+ * more than once a minute, plus once more at cleanup. The file holds two snapshots;
+ * the one not in use is written and then made current with a single store, so a
+ * process killed halfway through leaves the previous snapshot intact. Each snapshot
+ * also carries a checksum for writes the kernel never got to disk.
+ */
+
+static u64 wall_clock_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static u64 copy_checksum(const warm_start_copy *copy)
+{
+    const u8 *start = (const u8 *)&copy->saved_ms;
+    size_t length = offsetof(warm_start_copy, entries) - offsetof(warm_start_copy, saved_ms) +
+            sizeof(warm_start_entry) * copy->num_entries;
+    return wifi_shadow_hash(start, length);
+}
+
+static bool copy_valid(const warm_start_copy *copy)
+{
+    return copy->num_entries <= WARM_START_ENTRIES && copy->checksum == copy_checksum(copy);
+}
+
+/* Appends an element found through the index, which points past its header */
+static void append_ie(warm_start_entry *entry, const u8 *ie, int len)
+{
+    if (ie != NULL && entry->ie_length + 2 + len <= WIFI_WARM_START_IE_LEN) {
+        memcpy(&entry->ies[entry->ie_length], ie - 2, 2 + len);
+        entry->ie_length += 2 + len;
+    }
+}
+
+/* Keeps the elements a connection attempt needs, in the order a beacon carries them, as
+ * many as fit; the first of each is enough */
+static void copy_key_ies(warm_start_entry *entry, const u8 *ies, int ie_length)
+{
+    static const u8 key_ids[] = {
+        WIFI_IE_RSN, WIFI_IE_MOBILITY_DOMAIN, WIFI_IE_HT_CAP, WIFI_IE_HT_OP,
+        WIFI_IE_EXT_CAP, WIFI_IE_INTERWORKING, WIFI_IE_VHT_CAP, WIFI_IE_VHT_OP,
+    };
+    static const u8 wpa_oui[] = { 0x00, 0x50, 0xf2 };
+    wifi_ie_index index;
+    const u8 *ie;
+    int len = 0;
+
+    wifi_ie_index_init(&index, ies, ie_length);
+    entry->ie_length = 0;
+    for (size_t i = 0; i < sizeof(key_ids); i++) {
+        ie = wifi_ie_get(&index, key_ids[i], &len);
+        append_ie(entry, ie, len);
+    }
+    ie = wifi_ie_get_vendor(&index, wpa_oui, 0x01, &len);
+    append_ie(entry, ie, len);
+}
+
+static void write_file(warm_start *warm, u64 now)
+{
+    warm_start_file *file = warm->file;
+    if (file == NULL) {
+        return;
+    }
+
+    u32 next = file->active ^ 1;
+    warm_start_copy *copy = &file->copies[next];
+    copy->saved_ms = wall_clock_ms();
+    copy->num_entries = warm->num_entries;
+    memcpy(copy->entries, warm->entries, sizeof(warm_start_entry) * warm->num_entries);
+    copy->checksum = copy_checksum(copy);
+    __atomic_store_n(&file->active, next, __ATOMIC_RELEASE);
+
+    warm->dirty = false;
+    warm->last_write_ms = now;
+}
+
+static warm_start_file *map_file(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ALOGW("Could not open warm start file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, sizeof(warm_start_file)) == 0) {
+        base = mmap(NULL, sizeof(warm_start_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        ALOGW("Could not map warm start file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    return (warm_start_file *)base;
+}
+
+/* Takes the current snapshot, or the other one if the current one did not make it to disk */
+static void read_file(warm_start *warm)
+{
+    warm_start_file *file = warm->file;
+
+    if (file->magic != WARM_START_MAGIC || file->version != WARM_START_VERSION ||
+            file->entry_size != sizeof(warm_start_entry) || file->active > 1) {
+        memset(file, 0, sizeof(*file));
+        file->magic = WARM_START_MAGIC;
+        file->version = WARM_START_VERSION;
+        file->entry_size = sizeof(warm_start_entry);
+        return;
+    }
+
+    const warm_start_copy *copy = &file->copies[file->active];
+    if (!copy_valid(copy)) {
+        copy = &file->copies[file->active ^ 1];
+        if (!copy_valid(copy)) {
+            ALOGW("No usable warm start snapshot");
+            return;
+        }
+    }
+
+    u64 now = wall_clock_ms();
+    for (u32 i = 0; i < copy->num_entries; i++) {
+        const warm_start_entry *entry = &copy->entries[i];
+        if (entry->seen_ms > now || now - entry->seen_ms > WARM_START_MAX_AGE_MS ||
+                entry->ie_length > WIFI_WARM_START_IE_LEN) {
+            continue;
+        }
+        warm->entries[warm->num_entries] = *entry;
+        warm->entries[warm->num_entries].stale = 1;
+        warm->num_entries++;
+    }
+}
+
+void wifi_warm_start_load(interface_info *iface)
+{
+    warm_start *warm = (warm_start *)wifi_hal_malloc(WIFI_ALLOC_GSCAN, sizeof(*warm));
+    if (warm == NULL) {
+        ALOGE("Could not allocate warm start state");
+        return;
+    }
+    memset(warm, 0, sizeof(*warm));
+
+    /* without the file results are still remembered for this run */
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/warm_start_%s", WIFI_HAL_WARM_START_DIR, iface->name);
+    warm->file = map_file(path);
+    if (warm->file) {
+        read_file(warm);
+    }
+    warm->last_write_ms = wifi_get_monotonic_ms();
+
+    pthread_mutex_lock(&iface->warm_start_lock);
+    iface->warm_start = warm;
+    pthread_mutex_unlock(&iface->warm_start_lock);
+    ALOGD("Warm start on %s with %d entries", iface->name, warm->num_entries);
+}
+
+void wifi_warm_start_unload(interface_info *iface)
+{
+    pthread_mutex_lock(&iface->warm_start_lock);
+    warm_start *warm = iface->warm_start;
+    iface->warm_start = NULL;
+    pthread_mutex_unlock(&iface->warm_start_lock);
+
+    if (warm == NULL) {
+        return;
+    }
+    if (warm->dirty) {
+        write_file(warm, wifi_get_monotonic_ms());
+    }
+    if (warm->file) {
+        munmap(warm->file, sizeof(warm_start_file));
+    }
+    wifi_hal_free(WIFI_ALLOC_GSCAN, warm);
+}
+
+static void update_locked(warm_start *warm, const wifi_scan_result *result, u64 seen_ms)
+{
+    warm_start_entry *entry = NULL;
+    int oldest = 0;
+
+    for (int i = 0; i < warm->num_entries; i++) {
+        if (memcmp(warm->entries[i].bssid, result->bssid, sizeof(mac_addr)) == 0) {
+            entry = &warm->entries[i];
+            break;
+        }
+        /* of results seen together, the weakest goes */
+        const warm_start_entry *entry_i = &warm->entries[i];
+        const warm_start_entry *other = &warm->entries[oldest];
+        if (entry_i->seen_ms < other->seen_ms ||
+                (entry_i->seen_ms == other->seen_ms && entry_i->rssi < other->rssi)) {
+            oldest = i;
+        }
+    }
+
+    if (entry == NULL) {
+        /* stale entries are older than anything seen since, so they go first */
+        if (warm->num_entries < WARM_START_ENTRIES) {
+            oldest = warm->num_entries++;
+        }
+        entry = &warm->entries[oldest];
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->bssid, result->bssid, sizeof(mac_addr));
+    }
+
+    memcpy(entry->ssid, result->ssid, sizeof(entry->ssid));
+    entry->ssid[DOT11_MAX_SSID_LEN] = '\0';
+    entry->stale = 0;
+    entry->channel = result->channel;
+    entry->rssi = result->rssi;
+    entry->capability = result->capability;
+    entry->beacon_period = result->beacon_period;
+    entry->seen_ms = seen_ms;
+
+    /* cached results and hotlist events carry no IEs; keep the last ones seen */
+    if (result->ie_length) {
+        copy_key_ies(entry, (const u8 *)result->ie_data,
+                min(result->ie_length, (u32)MAX_PROBE_RESP_IE_LEN));
+    }
+    warm->dirty = true;
+}
+
+void wifi_warm_start_update(interface_info *iface, const wifi_scan_result *result)
+{
+    wifi_warm_start_update_results(iface, result, 1);
+}
+
+void wifi_warm_start_update_results(interface_info *iface, const wifi_scan_result *results,
+        int num)
+{
+    if (iface->warm_start == NULL || num <= 0) {
+        return;                             /* checked again under the lock */
+    }
+
+    u64 seen_ms = wall_clock_ms();
+    pthread_mutex_lock(&iface->warm_start_lock);
+    warm_start *warm = iface->warm_start;
+    if (warm) {
+        for (int i = 0; i < num; i++) {
+            update_locked(warm, &results[i], seen_ms);
+        }
+
+        u64 now = wifi_get_monotonic_ms();
+        if (now - warm->last_write_ms >= WARM_START_WRITE_INTERVAL_MS) {
+            write_file(warm, now);
+        }
+    }
+    pthread_mutex_unlock(&iface->warm_start_lock);
+}
+
+static void fill_entry(wifi_warm_start_entry *out, const warm_start_entry *entry, u64 now)
+{
+    memcpy(out->bssid, entry->bssid, sizeof(mac_addr));
+    memcpy(out->ssid, entry->ssid, sizeof(out->ssid));
+    out->channel = entry->channel;
+    out->rssi = entry->rssi;
+    out->beacon_period = entry->beacon_period;
+    out->capability = entry->capability;
+    out->age_ms = now > entry->seen_ms ? min(now - entry->seen_ms, (u64)UINT32_MAX) : 0;
+    out->stale = entry->stale;
+    out->ie_length = entry->ie_length;
+    memcpy(out->ies, entry->ies, entry->ie_length);
+}
+
+wifi_error wifi_warm_start_get_entries(wifi_interface_handle handle,
+        wifi_warm_start_entry *entries, int max, int *num)
+{
+    if (max < 0 || (max && entries == NULL) || num == NULL) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    interface_info *iface = getIfaceInfo(handle);
+    u64 now = wall_clock_ms();
+
+    pthread_mutex_lock(&iface->warm_start_lock);
+    warm_start *warm = iface->warm_start;
+    if (warm == NULL) {
+        pthread_mutex_unlock(&iface->warm_start_lock);
+        return WIFI_ERROR_NOT_AVAILABLE;
+    }
+
+    /* insertion by last sighting, newest first; there are few entries */
+    int found = 0;
+    for (int i = 0; i < warm->num_entries && max > 0; i++) {
+        u32 age = now > warm->entries[i].seen_ms ? now - warm->entries[i].seen_ms : 0;
+        if (found == max && age >= entries[max - 1].age_ms) {
+            continue;
+        }
+
+        int pos = found < max ? found++ : max - 1;
+        while (pos > 0 && entries[pos - 1].age_ms > age) {
+            entries[pos] = entries[pos - 1];
+            pos--;
+        }
+        fill_entry(&entries[pos], &warm->entries[i], now);
+    }
+    pthread_mutex_unlock(&iface->warm_start_lock);
+    *num = found;
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_warm_start_get_channels(wifi_interface_handle handle, wifi_channel *channels,
+        int max, int *num)
+{
+    if (max < 0 || (max && channels == NULL) || num == NULL) {
+        return WIFI_ERROR_INVALID_ARGS;
+    }
+
+    interface_info *iface = getIfaceInfo(handle);
+    wifi_rssi best[WARM_START_ENTRIES];
+    int found = 0;
+
+    pthread_mutex_lock(&iface->warm_start_lock);
+    warm_start *warm = iface->warm_start;
+    if (warm == NULL) {
+        pthread_mutex_unlock(&iface->warm_start_lock);
+        return WIFI_ERROR_NOT_AVAILABLE;
+    }
+
+    /* every distinct channel with the strongest RSSI seen on it */
+    wifi_channel seen[WARM_START_ENTRIES];
+    for (int i = 0; i < warm->num_entries; i++) {
+        const warm_start_entry *entry = &warm->entries[i];
+        int c = 0;
+        while (c < found && seen[c] != entry->channel) {
+            c++;
+        }
+        if (c == found) {
+            seen[found] = entry->channel;
+            best[found++] = entry->rssi;
+        } else if (entry->rssi > best[c]) {
+            best[c] = entry->rssi;
+        }
+    }
+    pthread_mutex_unlock(&iface->warm_start_lock);
+
+    /* strongest first */
+    for (int i = 1; i < found; i++) {
+        wifi_channel channel = seen[i];
+        wifi_rssi rssi = best[i];
+        int pos = i;
+        while (pos > 0 && best[pos - 1] < rssi) {
+            seen[pos] = seen[pos - 1];
+            best[pos] = best[pos - 1];
+            pos--;
+        }
+        seen[pos] = channel;
+        best[pos] = rssi;
+    }
+
+    *num = min(found, max);
+    memcpy(channels, seen, sizeof(wifi_channel) * *num);
+    return WIFI_SUCCESS;
+}
+
+wifi_error wifi_warm_start_clear(wifi_interface_handle handle)
+{
+    interface_info *iface = getIfaceInfo(handle);
+
+    pthread_mutex_lock(&iface->warm_start_lock);
+    warm_start *warm = iface->warm_start;
+    if (warm == NULL) {
+        pthread_mutex_unlock(&iface->warm_start_lock);
+        return WIFI_ERROR_NOT_AVAILABLE;
+    }
+
+    /* written at once, and the previous snapshot wiped, rather than left for later */
+    warm->num_entries = 0;
+    write_file(warm, wifi_get_monotonic_ms());
+    if (warm->file) {
+        memset(&warm->file->copies[warm->file->active ^ 1], 0, sizeof(warm_start_copy));
+    }
+    pthread_mutex_unlock(&iface->warm_start_lock);
+    ALOGD("Warm start entries cleared on %s", iface->name);
+    return WIFI_SUCCESS;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_WARM_START_H__
+#define __WIFI_HAL_WARM_START_H__
+
+#include "common.h"
+
+#ifndef WIFI_HAL_WARM_START_DIR
+#define WIFI_HAL_WARM_START_DIR         "/data/vendor/wifi"
+#endif
+
+#define WARM_START_MAGIC                0x5753574d  /* "WSWM" */
+#define WARM_START_VERSION              1
+#define WARM_START_ENTRIES              64
+#define WARM_START_WRITE_INTERVAL_MS    60000       /* at most one file update a minute */
+#define WARM_START_MAX_AGE_MS           (24 * 60 * 60 * 1000ULL)
+
+/* One remembered BSSID, as it is kept both in memory and in the file */
+typedef struct {
+    mac_addr bssid;
+    u8 stale;                                       // from an earlier run, not seen since
+    u8 ie_length;
+    char ssid[DOT11_MAX_SSID_LEN + 1];
+    wifi_channel channel;
+    wifi_rssi rssi;
+    u16 capability;
+    u16 beacon_period;
+    u64 seen_ms;                                    // wall clock, so ages survive a reboot
+    u8 ies[WIFI_WARM_START_IE_LEN];                 // key elements only
+} warm_start_entry;
+
+/* Whole snapshot; the file holds two and the header says which one is current */
+typedef struct {
+    u64 checksum;                                   // of what follows, up to the last entry
+    u64 saved_ms;
+    u32 num_entries;
+    u32 reserved;
+    warm_start_entry entries[WARM_START_ENTRIES];
+} warm_start_copy;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 entry_size;                                 // layout check
+    u32 active;                                     // copy to read; switched once the other
+                                                    // has been written
+    warm_start_copy copies[2];
+} warm_start_file;
+
+struct warm_start {
+    warm_start_file *file;                          // NULL if the file could not be mapped
+    warm_start_entry entries[WARM_START_ENTRIES];
+    int num_entries;
+    bool dirty;                                     // entries differ from the file
+    u64 last_write_ms;                              // monotonic time of the last file update
+};
+
+/* Reads the snapshot an earlier run left, each entry marked stale; from wifi_initialize */
+void wifi_warm_start_load(interface_info *iface);
+/* Writes out what has changed and lets go of the file; from wifi_cleanup */
+void wifi_warm_start_unload(interface_info *iface);
+/* Called with results as they arrive */
+void wifi_warm_start_update(interface_info *iface, const wifi_scan_result *result);
+void wifi_warm_start_update_results(interface_info *iface, const wifi_scan_result *results,
+        int num);
+
+#endif /* __WIFI_HAL_WARM_START_H__ */
@@ -52,6 +52,9 @@
 #include "common.h"
 #include "cpp_bindings.h"
 #include "rtt.h"
+#include "capabilities.h"
+#include "warm_start.h"
+#include "scan_filter.h"
 /*
  BUGBUG: normally, libnl allocates ports for all connections it makes; but
  being a static library, it doesn't really know how many other netlink connections
@@ -62,6 +65,18 @@
 
 #define WIFI_HAL_CMD_SOCK_PORT       644
 #define WIFI_HAL_EVENT_SOCK_PORT     645
+#define WIFI_HAL_ASYNC_SOCK_PORT     646
+#define WIFI_HAL_CMD_POOL_PORT_BASE  647    /* ports for cmd_socks[1..MAX_CMD_SOCKS-1] */
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK                  270
+#endif
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK              10
+#endif
+#ifndef NETLINK_EXT_ACK
+#define NETLINK_EXT_ACK              11
+#endif
 
 /*
  * Defines for wifi_wait_for_driver_ready()
@@ -76,6 +91,8 @@ static int internal_valid_message_handler(nl_msg *msg, void *arg);
 static int wifi_get_multicast_id(wifi_handle handle, const char *name, const char *group);
 static int wifi_add_membership(wifi_handle handle, const char *group);
 static wifi_error wifi_init_interfaces(wifi_handle handle);
+static void wifi_free_interfaces(hal_info *info);
+static void wifi_start_driver_monitor(wifi_handle handle);
 static wifi_error wifi_start_rssi_monitoring(wifi_request_id id, wifi_interface_handle
                         iface, s8 max_rssi, s8 min_rssi, wifi_rssi_event_handler eh);
 static wifi_error wifi_stop_rssi_monitoring(wifi_request_id id, wifi_interface_handle iface);
@@ -191,6 +208,8 @@ wifi_error init_wifi_vendor_hal_func_table(wifi_hal_fn *fn)
     fn->wifi_start_logging = wifi_start_logging;
     fn->wifi_set_epno_list = wifi_set_epno_list;
     fn->wifi_reset_epno_list = wifi_reset_epno_list;
+    fn->wifi_set_passpoint_list = wifi_set_passpoint_list;
+    fn->wifi_reset_passpoint_list = wifi_reset_passpoint_list;
     fn->wifi_set_country_code = wifi_set_country_code;
     fn->wifi_get_firmware_memory_dump = wifi_get_firmware_memory_dump;
     fn->wifi_set_log_handler = wifi_set_log_handler;
@@ -215,6 +234,108 @@ wifi_error init_wifi_vendor_hal_func_table(wifi_hal_fn *fn)
     return WIFI_SUCCESS;
 }
 
+/*
+ * Error acks normally echo the whole request back; with NETLINK_CAP_ACK only its
+ * header comes back, and NETLINK_EXT_ACK lets the kernel say what went wrong.
+ * Both are optional, older kernels just keep the default behaviour.
+ */
+static void wifi_enable_capped_acks(struct nl_sock *sock)
+{
+    int fd = nl_socket_get_fd(sock);
+    int one = 1;
+
+    if (setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one)) < 0) {
+        ALOGD("NETLINK_CAP_ACK not supported: %s", strerror(errno));
+    }
+    if (setsockopt(fd, SOL_NETLINK, NETLINK_EXT_ACK, &one, sizeof(one)) < 0) {
+        ALOGD("NETLINK_EXT_ACK not supported: %s", strerror(errno));
+    }
+}
+
+/* Frees pool sockets other than cmd_sock, which is owned by hal_info, and all callbacks */
+static void wifi_free_cmd_socks(hal_info *info)
+{
+    for (int i = 0; i < info->num_cmd_socks; i++) {
+        if (i > 0) {
+            nl_socket_free(info->cmd_socks[i].sock);
+        }
+        nl_cb_put(info->cmd_socks[i].cb);
+    }
+    info->num_cmd_socks = 0;
+    pthread_cond_destroy(&info->cmd_sock_cond);
+    pthread_mutex_destroy(&info->cmd_sock_lock);
+}
+
+/* Called with cmd_sock_lock held */
+static cmd_sock_info *wifi_add_cmd_sock(hal_info *info)
+{
+    int index = info->num_cmd_socks;
+
+    struct nl_sock *sock = wifi_create_nl_socket(WIFI_HAL_CMD_POOL_PORT_BASE + index - 1);
+    if (sock == NULL) {
+        return NULL;
+    }
+
+    struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+    if (cb == NULL) {
+        nl_socket_free(sock);
+        return NULL;
+    }
+
+    wifi_enable_capped_acks(sock);
+    nl_socket_set_msg_buf_size(sock, CMD_REPLY_BUF_SIZE);
+
+    info->cmd_socks[index].sock = sock;
+    info->cmd_socks[index].cb = cb;
+    info->cmd_socks[index].in_use = false;
+    info->num_cmd_socks++;
+    ALOGD("Added command socket %d", index);
+    return &info->cmd_socks[index];
+}
+
+cmd_sock_info *wifi_lease_cmd_sock(hal_info *info)
+{
+    cmd_sock_info *sock = NULL;
+
+    pthread_mutex_lock(&info->cmd_sock_lock);
+
+    while (sock == NULL) {
+        for (int i = 0; i < info->num_cmd_socks; i++) {
+            if (!info->cmd_socks[i].in_use) {
+                sock = &info->cmd_socks[i];
+                break;
+            }
+        }
+
+        /* all sockets busy; grow the pool up to its limit, else wait for one */
+        if (sock == NULL && info->num_cmd_socks < MAX_CMD_SOCKS) {
+            sock = wifi_add_cmd_sock(info);
+        }
+
+        if (sock == NULL) {
+            pthread_cond_wait(&info->cmd_sock_cond, &info->cmd_sock_lock);
+        }
+    }
+
+    sock->in_use = true;
+    info->cmd_socks_in_use++;
+    if (info->cmd_socks_in_use > info->max_cmd_socks_in_use) {
+        info->max_cmd_socks_in_use = info->cmd_socks_in_use;
+    }
+
+    pthread_mutex_unlock(&info->cmd_sock_lock);
+    return sock;
+}
+
+void wifi_release_cmd_sock(hal_info *info, cmd_sock_info *sock)
+{
+    pthread_mutex_lock(&info->cmd_sock_lock);
+    sock->in_use = false;
+    info->cmd_socks_in_use--;
+    pthread_cond_signal(&info->cmd_sock_cond);
+    pthread_mutex_unlock(&info->cmd_sock_lock);
+}
+
 wifi_error wifi_initialize(wifi_handle *handle)
 {
     srand(getpid());
@@ -250,11 +371,28 @@ wifi_error wifi_initialize(wifi_handle *handle)
         return WIFI_ERROR_UNKNOWN;
     }
 
+    struct nl_sock *async_sock = wifi_create_nl_socket(WIFI_HAL_ASYNC_SOCK_PORT);
+    if (async_sock == NULL) {
+        ALOGE("Could not create handle");
+        nl_socket_free(cmd_sock);
+        nl_socket_free(event_sock);
+        free(info);
+        return WIFI_ERROR_UNKNOWN;
+    }
+
+    /* replies to async requests are read from the event loop, which must never block */
+    nl_socket_set_nonblocking(async_sock);
+
+    wifi_enable_capped_acks(cmd_sock);
+    nl_socket_set_msg_buf_size(cmd_sock, CMD_REPLY_BUF_SIZE);
+    wifi_enable_capped_acks(async_sock);
+
     struct nl_cb *cb = nl_socket_get_cb(event_sock);
     if (cb == NULL) {
         ALOGE("Could not create handle");
         nl_socket_free(cmd_sock);
         nl_socket_free(event_sock);
+        nl_socket_free(async_sock);
         free(info);
         return WIFI_ERROR_UNKNOWN;
     }
@@ -264,8 +402,56 @@ wifi_error wifi_initialize(wifi_handle *handle)
     nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, internal_valid_message_handler, info);
     nl_cb_put(cb);
 
+    cb = nl_socket_get_cb(async_sock);
+    if (cb == NULL) {
+        ALOGE("Could not create handle");
+        nl_socket_free(cmd_sock);
+        nl_socket_free(event_sock);
+        nl_socket_free(async_sock);
+        free(info);
+        return WIFI_ERROR_UNKNOWN;
+    }
+
+    WifiCommand::setAsyncHandlers(cb, info);
+    nl_cb_put(cb);
+
+    struct nl_cb *cmd_cb = nl_cb_alloc(NL_CB_DEFAULT);
+    if (cmd_cb == NULL) {
+        ALOGE("Could not create handle");
+        nl_socket_free(cmd_sock);
+        nl_socket_free(event_sock);
+        nl_socket_free(async_sock);
+        free(info);
+        return WIFI_ERROR_UNKNOWN;
+    }
+
+    /* events are received straight into this, so the event loop never allocates one */
+    struct nl_msg *event_msg = nlmsg_alloc_size(EVENT_BUF_SIZE);
+    if (event_msg == NULL) {
+        ALOGE("Could not allocate the event buffer");
+        nl_cb_put(cmd_cb);
+        nl_socket_free(cmd_sock);
+        nl_socket_free(event_sock);
+        nl_socket_free(async_sock);
+        free(info);
+        return WIFI_ERROR_OUT_OF_MEMORY;
+    }
+    info->event_msg = event_msg;
+    info->event_msg_size = EVENT_BUF_SIZE;
+
     info->cmd_sock = cmd_sock;
     info->event_sock = event_sock;
+    info->async_sock = async_sock;
+
+    /* the pool starts with cmd_sock and grows with concurrent requests */
+    info->cmd_socks[0].sock = cmd_sock;
+    info->cmd_socks[0].cb = cmd_cb;
+    info->cmd_socks[0].in_use = false;
+    info->num_cmd_socks = 1;
+    info->cmd_socks_in_use = 0;
+    info->max_cmd_socks_in_use = 0;
+    pthread_mutex_init(&info->cmd_sock_lock, NULL);
+    pthread_cond_init(&info->cmd_sock_cond, NULL);
     info->clean_up = false;
     info->in_event_loop = false;
 
@@ -277,16 +463,27 @@ wifi_error wifi_initialize(wifi_handle *handle)
     info->alloc_cmd = DEFAULT_CMD_SIZE;
     info->num_cmd = 0;
 
+    info->async_cmd = (async_info *)malloc(sizeof(async_info) * DEFAULT_ASYNC_CMD_SIZE);
+    info->alloc_async_cmd = DEFAULT_ASYNC_CMD_SIZE;
+    info->num_async_cmd = 0;
+
     info->nl80211_family_id = genl_ctrl_resolve(cmd_sock, "nl80211");
     if (info->nl80211_family_id < 0) {
         ALOGE("Could not resolve nl80211 familty id");
         nl_socket_free(cmd_sock);
         nl_socket_free(event_sock);
+        nl_socket_free(async_sock);
+        nlmsg_free(info->event_msg);
+        wifi_free_cmd_socks(info);
         free(info);
         return WIFI_ERROR_UNKNOWN;
     }
 
     pthread_mutex_init(&info->cb_lock, NULL);
+    pthread_mutex_init(&info->channel_lock, NULL);
+    pthread_mutex_init(&info->caps_lock, NULL);
+    pthread_mutex_init(&info->shadow.lock, NULL);
+    pthread_cond_init(&info->shadow.idle, NULL);
 
     *handle = (wifi_handle) info;
 
@@ -294,6 +491,9 @@ wifi_error wifi_initialize(wifi_handle *handle)
         ALOGE("No wifi interface found");
         nl_socket_free(cmd_sock);
         nl_socket_free(event_sock);
+        nl_socket_free(async_sock);
+        nlmsg_free(info->event_msg);
+        wifi_free_cmd_socks(info);
         pthread_mutex_destroy(&info->cb_lock);
         free(info);
         return WIFI_ERROR_NOT_AVAILABLE;
@@ -306,11 +506,27 @@ wifi_error wifi_initialize(wifi_handle *handle)
         ALOGE("Add membership failed");
         nl_socket_free(cmd_sock);
         nl_socket_free(event_sock);
+        nl_socket_free(async_sock);
+        nlmsg_free(info->event_msg);
+        wifi_free_cmd_socks(info);
         pthread_mutex_destroy(&info->cb_lock);
         free(info);
         return WIFI_ERROR_NOT_AVAILABLE;
     }
 
+    /* interface add/remove notifications; without them shadow state only resets here */
+    if (wifi_add_membership(*handle, "config") == 0) {
+        wifi_start_driver_monitor(*handle);
+    }
+
+    /* one round trip now rather than one per capability getter later */
+    wifi_prefetch_capabilities(info);
+
+    /* what was in range before a restart, until scans say otherwise */
+    for (int i = 0; i < info->num_interfaces; i++) {
+        wifi_warm_start_load(info->interfaces[i]);
+    }
+
     // ALOGI("Found %d interfaces", info->num_interfaces);
 
     ALOGI("Initialized Wifi HAL Successfully; vendor cmd = %d", NL80211_CMD_VENDOR);
@@ -363,14 +579,28 @@ static void internal_cleaned_up_handler(wifi_handle handle)
     if (info->cmd_sock != 0) {
         close(info->cleanup_socks[0]);
         close(info->cleanup_socks[1]);
+        ALOGI("Used up to %d of %d command sockets concurrently",
+                info->max_cmd_socks_in_use, info->num_cmd_socks);
         nl_socket_free(info->cmd_sock);
         nl_socket_free(info->event_sock);
+        nl_socket_free(info->async_sock);
+        wifi_free_cmd_socks(info);
         info->cmd_sock = NULL;
         info->event_sock = NULL;
+        info->async_sock = NULL;
     }
 
     (*cleaned_up_handler)(handle);
+    wifi_invalidate_capabilities(info, "cleanup");
+    pthread_mutex_destroy(&info->caps_lock);
+    pthread_mutex_destroy(&info->shadow.lock);
+    pthread_cond_destroy(&info->shadow.idle);
+    pthread_mutex_destroy(&info->channel_lock);
     pthread_mutex_destroy(&info->cb_lock);
+    free(info->async_cmd);
+    if (info->event_msg) {
+        nlmsg_free(info->event_msg);
+    }
     free(info);
 
     ALOGI("Internal cleanup completed");
@@ -402,6 +632,13 @@ void wifi_cleanup(wifi_handle handle, wifi_cleaned_up_handler handler)
         }
     }
     info->clean_up = true;
+
+    if (info->driver_monitor) {
+        info->driver_monitor->cancel();
+        info->driver_monitor->releaseRef();
+        info->driver_monitor = NULL;
+    }
+
     pthread_mutex_lock(&info->cb_lock);
 
     int bad_commands = 0;
@@ -435,15 +672,88 @@ void wifi_cleanup(wifi_handle handle, wifi_cleaned_up_handler handler)
         WifiCommand *cmd = (WifiCommand *)cbi->cb_arg;
         ALOGE("Leaked command %p", cmd);
     }
+
+    /* the event loop is gone, nobody will complete these any more */
+    for (int i = 0; i < info->num_async_cmd; i++) {
+        WifiCommand *cmd = info->async_cmd[i].cmd;
+        ALOGI("Dropping async request %u of %p:%s", info->async_cmd[i].seq, cmd, cmd->getType());
+        cmd->releaseRef();
+    }
+    info->num_async_cmd = 0;
     pthread_mutex_unlock(&info->cb_lock);
+
+    /* no more results can arrive; keep the latest for the next start */
+    for (int i = 0; i < info->num_interfaces; i++) {
+        wifi_warm_start_unload(info->interfaces[i]);
+    }
+    wifi_free_interfaces(info);
     internal_cleaned_up_handler(handle);
 }
 
 static int internal_pollin_handler(wifi_handle handle)
 {
     hal_info *info = getHalInfo(handle);
-    struct nl_cb *cb = nl_socket_get_cb(info->event_sock);
-    int res = nl_recvmsgs(info->event_sock, cb);
+    int fd = nl_socket_get_fd(info->event_sock);
+
+    /* grow the message for an oversized datagram before dispatch starts; if that fails,
+     * the datagram is dropped below */
+    ssize_t size = TEMP_FAILURE_RETRY(recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC));
+    if (size > info->event_msg_size) {
+        int new_size = (size + EVENT_BUF_SIZE - 1) / EVENT_BUF_SIZE * EVENT_BUF_SIZE;
+        struct nl_msg *event_msg = nlmsg_alloc_size(new_size);
+        if (event_msg == NULL) {
+            ALOGW("Could not grow the event buffer to %d bytes", new_size);
+        } else {
+            nlmsg_free(info->event_msg);
+            info->event_msg = event_msg;
+            info->event_msg_size = new_size;
+        }
+    }
+
+    /* receive straight into the preallocated message instead of one libnl allocates */
+    struct nlmsghdr *hdr = nlmsg_hdr(info->event_msg);
+    struct iovec iov = { hdr, (size_t)info->event_msg_size };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    ssize_t len = TEMP_FAILURE_RETRY(recvmsg(fd, &msg, 0));
+    if (len < 0) {
+        ALOGE("Failed to receive events; error no = %d (%s)", errno, strerror(errno));
+        return -errno;
+    }
+    if (msg.msg_flags & MSG_TRUNC) {
+        /* only if the peek or the grow failed; the next oversized datagram tries again */
+        ALOGE("Dropped events larger than %d bytes", info->event_msg_size);
+        return 0;
+    }
+
+    int remaining = len;
+    wifi_alloc_dispatch_begin();
+    while (nlmsg_ok(hdr, remaining)) {
+        int msg_len = NLMSG_ALIGN(hdr->nlmsg_len);
+        if (hdr->nlmsg_type >= NLMSG_MIN_TYPE) {
+            internal_valid_message_handler(info->event_msg, handle);
+        }
+        remaining -= msg_len;
+        if (remaining <= 0) {
+            break;
+        }
+        /* handlers find the message at the start of event_msg */
+        memmove(hdr, (char *)hdr + msg_len, remaining);
+    }
+    wifi_alloc_dispatch_end();
+    return 0;
+}
+
+static int internal_async_pollin_handler(wifi_handle handle)
+{
+    hal_info *info = getHalInfo(handle);
+    struct nl_cb *cb = nl_socket_get_cb(info->async_sock);
+    wifi_alloc_dispatch_begin();
+    int res = nl_recvmsgs(info->async_sock, cb);
+    wifi_alloc_dispatch_end();
     // ALOGD("nl_recvmsgs returned %d", res);
     nl_cb_put(cb);
     return res;
@@ -459,13 +769,16 @@ void wifi_event_loop(wifi_handle handle)
         info->in_event_loop = true;
     }
 
-    pollfd pfd[2];
-    memset(&pfd[0], 0, sizeof(pollfd) * 2);
+
+    pollfd pfd[3];
+    memset(&pfd[0], 0, sizeof(pollfd) * 3);
 
     pfd[0].fd = nl_socket_get_fd(info->event_sock);
     pfd[0].events = POLLIN;
     pfd[1].fd = info->cleanup_socks[1];
     pfd[1].events = POLLIN;
+    pfd[2].fd = nl_socket_get_fd(info->async_sock);
+    pfd[2].events = POLLIN;
 
     char buf[2048];
     /* TODO: Add support for timeouts */
@@ -474,8 +787,9 @@ void wifi_event_loop(wifi_handle handle)
         int timeout = -1;                   /* Infinite timeout */
         pfd[0].revents = 0;
         pfd[1].revents = 0;
+        pfd[2].revents = 0;
         // ALOGI("Polling socket");
-        int result = TEMP_FAILURE_RETRY(poll(pfd, 2, timeout));
+        int result = TEMP_FAILURE_RETRY(poll(pfd, 3, timeout));
         if (result < 0) {
             // ALOGE("Error polling socket");
         } else if (pfd[0].revents & POLLERR) {
@@ -486,25 +800,33 @@ void wifi_event_loop(wifi_handle handle)
         } else if (pfd[0].revents & POLLHUP) {
             ALOGE("Remote side hung up");
             break;
-        } else if (pfd[0].revents & POLLIN) {
-            // ALOGI("Found some events!!!");
-            internal_pollin_handler(handle);
-        } else if (pfd[1].revents & POLLIN) {
-            memset(buf, 0, sizeof(buf));
-            ssize_t result2 = TEMP_FAILURE_RETRY(read(pfd[1].fd, buf, sizeof(buf)));
-            ALOGE("%s: Read after POLL returned %zd, error no = %d (%s)", __FUNCTION__,
-                   result2, errno, strerror(errno));
-            if (strncmp(buf, "Exit", 4) == 0) {
-                ALOGD("Got a signal to exit!!!");
-                if (TEMP_FAILURE_RETRY(write(pfd[1].fd, "Done", 4)) < 1) {
-                    ALOGE("could not write to the cleanup socket");
+        } else if ((pfd[0].revents | pfd[1].revents | pfd[2].revents) & POLLIN) {
+            /* service every ready socket so a busy event stream can't starve the others */
+            if (pfd[0].revents & POLLIN) {
+                // ALOGI("Found some events!!!");
+                internal_pollin_handler(handle);
+            }
+            if (pfd[2].revents & POLLIN) {
+                internal_async_pollin_handler(handle);
+            }
+            if (pfd[1].revents & POLLIN) {
+                memset(buf, 0, sizeof(buf));
+                ssize_t result2 = TEMP_FAILURE_RETRY(read(pfd[1].fd, buf, sizeof(buf)));
+                ALOGE("%s: Read after POLL returned %zd, error no = %d (%s)", __FUNCTION__,
+                       result2, errno, strerror(errno));
+                if (strncmp(buf, "Exit", 4) == 0) {
+                    ALOGD("Got a signal to exit!!!");
+                    if (TEMP_FAILURE_RETRY(write(pfd[1].fd, "Done", 4)) < 1) {
+                        ALOGE("could not write to the cleanup socket");
+                    }
+                    break;
+                } else {
+                    ALOGD("Rx'ed %s on the cleanup socket\n", buf);
                 }
-                break;
-            } else {
-                ALOGD("Rx'ed %s on the cleanup socket\n", buf);
             }
         } else {
-            ALOGE("Unknown event - %0x, %0x", pfd[0].revents, pfd[1].revents);
+            ALOGE("Unknown event - %0x, %0x, %0x", pfd[0].revents, pfd[1].revents,
+                    pfd[2].revents);
         }
     } while (!info->clean_up);
     ALOGI("Exit %s", __FUNCTION__);
@@ -605,7 +927,12 @@ public:
     }
 
     virtual int create() {
-        int nlctrlFamily = genl_ctrl_resolve(mInfo->cmd_sock, "nlctrl");
+        cmd_sock_info *sock = wifi_lease_cmd_sock(mInfo);
+        if (sock == NULL) {
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+        int nlctrlFamily = genl_ctrl_resolve(sock->sock, "nlctrl");
+        wifi_release_cmd_sock(mInfo, sock);
         // ALOGI("ctrl family = %d", nlctrlFamily);
         int ret = mMsg.create(nlctrlFamily, CTRL_CMD_GETFAMILY, 0, 0);
         if (ret < 0) {
@@ -804,13 +1131,28 @@ public:
         return result;
     }
 
-    int start() {
+    /* shadow value of the monitor state; 0 when stopped */
+    uint64_t shadowValue(int enable) {
+        return enable ? (1 << 16) | ((u8)mMax_rssi << 8) | (u8)mMin_rssi : 0;
+    }
+
+    int setMonitor(int enable) {
+        uint64_t value = shadowValue(enable);
+        if (wifi_shadow_begin(mIfaceInfo, SHADOW_RSSI_MONITOR, value)) {
+            return WIFI_SUCCESS;
+        }
+
         WifiRequest request(familyId(), ifaceId());
-        int result = createRequest(request, 1);
-        if (result < 0) {
-            return result;
+        int result = createRequest(request, enable);
+        if (result == WIFI_SUCCESS) {
+            result = requestResponse(request);
         }
-        result = requestResponse(request);
+        wifi_shadow_end(mIfaceInfo, SHADOW_RSSI_MONITOR, value, result);
+        return result;
+    }
+
+    int start() {
+        int result = setMonitor(1);
         if (result < 0) {
             ALOGI("Failed to set RSSI Monitor, result = %d", result);
             return result;
@@ -829,15 +1171,9 @@ public:
 
     virtual int cancel() {
 
-        WifiRequest request(familyId(), ifaceId());
-        int result = createRequest(request, 0);
+        int result = setMonitor(0);
         if (result != WIFI_SUCCESS) {
-            ALOGE("failed to create request; result = %d", result);
-        } else {
-            result = requestResponse(request);
-            if (result != WIFI_SUCCESS) {
-                ALOGE("failed to stop RSSI monitoring = %d", result);
-            }
+            ALOGE("failed to stop RSSI monitoring = %d", result);
         }
         unregisterVendorHandler(GOOGLE_OUI, GOOGLE_RSSI_MONITOR_EVENT);
         return WIFI_SUCCESS;
@@ -923,8 +1259,6 @@ class AndroidPktFilterCommand : public WifiCommand {
     }
 
     int createSetPktFilterRequest(WifiRequest& request) {
-        u8 *program = new u8[mProgramLen];
-        NULL_CHECK_RETURN(program, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
         int result = request.create(GOOGLE_OUI, APF_SUBCMD_SET_FILTER);
         if (result < 0) {
             return result;
@@ -935,13 +1269,12 @@ class AndroidPktFilterCommand : public WifiCommand {
         if (result < 0) {
             return result;
         }
-        memcpy(program, mProgram, mProgramLen);
-        result = request.put(APF_ATTRIBUTE_PROGRAM, program, mProgramLen);
+        /* the program is sent from the caller's buffer, which outlives the request */
+        result = request.put_external(APF_ATTRIBUTE_PROGRAM, mProgram, mProgramLen);
         if (result < 0) {
             return result;
         }
         request.attr_end(data);
-        delete[] program;
         return result;
     }
 
@@ -956,6 +1289,11 @@ class AndroidPktFilterCommand : public WifiCommand {
         return result;
     }
 
+    /* so the command can be sent with WifiCommand::requestBatch() */
+    virtual int create() {
+        return createRequest(mMsg);
+    }
+
     int start() {
         WifiRequest request(familyId(), ifaceId());
         int result = createRequest(request);
@@ -1162,6 +1500,103 @@ static int wifi_get_multicast_id(wifi_handle handle, const char *name, const cha
 
 /////////////////////////////////////////////////////////////////////////
 
+/*
+ * An interface that is removed or (re)created, e.g. by a driver restart, loses
+ * whatever the HAL configured on it, so its shadow state must be dropped. The same
+ * events, and regulatory changes, make the cached channel lists stale.
+ */
+class DriverStateMonitor : public WifiCommand
+{
+public:
+    DriverStateMonitor(wifi_handle handle)
+        : WifiCommand("DriverStateMonitor", handle, 0)
+    { }
+
+    int start() {
+        int result = registerHandler(NL80211_CMD_NEW_INTERFACE);
+        if (result != WIFI_SUCCESS) {
+            return result;
+        }
+        result = registerHandler(NL80211_CMD_DEL_INTERFACE);
+        if (result != WIFI_SUCCESS) {
+            unregisterHandler(NL80211_CMD_NEW_INTERFACE);
+            return result;
+        }
+
+        /* not fatal; the cache is still dropped on country code changes */
+        if (registerHandler(NL80211_CMD_REG_CHANGE) != WIFI_SUCCESS ||
+                registerHandler(NL80211_CMD_REG_BEACON_HINT) != WIFI_SUCCESS) {
+            ALOGW("Could not watch for regulatory changes");
+        }
+        return result;
+    }
+
+    virtual int cancel() {
+        unregisterHandler(NL80211_CMD_NEW_INTERFACE);
+        unregisterHandler(NL80211_CMD_DEL_INTERFACE);
+        unregisterHandler(NL80211_CMD_REG_CHANGE);
+        unregisterHandler(NL80211_CMD_REG_BEACON_HINT);
+        return WIFI_SUCCESS;
+    }
+
+protected:
+    virtual int handleEvent(WifiEvent& event) {
+        int cmd = event.get_cmd();
+        if (cmd == NL80211_CMD_REG_CHANGE || cmd == NL80211_CMD_REG_BEACON_HINT) {
+            wifi_invalidate_channel_cache(mInfo, cmd == NL80211_CMD_REG_CHANGE ?
+                    "regulatory change" : "beacon hint");
+            if (cmd == NL80211_CMD_REG_CHANGE) {
+                /* the country code may have been set by someone else */
+                wifi_wiphy_shadow_invalidate(mInfo);
+            }
+            return NL_OK;
+        }
+
+        int ifindex = event.get_u32(NL80211_ATTR_IFINDEX);
+        const char *name = (const char *)event.get_data(NL80211_ATTR_IFNAME);
+
+        for (int i = 0; i < mInfo->num_interfaces; i++) {
+            interface_info *iface = mInfo->interfaces[i];
+            if (iface->id != ifindex
+                    && (name == NULL || strncmp(iface->name, name, IFNAMSIZ) != 0)) {
+                continue;
+            }
+
+            if (cmd == NL80211_CMD_NEW_INTERFACE && ifindex != 0) {
+                /* a recreated interface may come back with a new index */
+                __atomic_store_n(&iface->id, ifindex, __ATOMIC_RELAXED);
+            }
+            ALOGI("%s %s; dropping driver shadow state", iface->name,
+                    cmd == NL80211_CMD_NEW_INTERFACE ? "created" : "removed");
+            wifi_shadow_invalidate(iface);
+            wifi_wiphy_shadow_invalidate(mInfo);
+            wifi_invalidate_channel_cache(mInfo, "interface change");
+            wifi_invalidate_capabilities(mInfo, "interface change");
+        }
+        return NL_OK;
+    }
+};
+
+static void wifi_start_driver_monitor(wifi_handle handle)
+{
+    hal_info *info = getHalInfo(handle);
+
+    DriverStateMonitor *monitor = new DriverStateMonitor(handle);
+    if (monitor == NULL) {
+        ALOGE("memory allocation failure");
+        return;
+    }
+
+    if (monitor->start() != WIFI_SUCCESS) {
+        ALOGE("Could not watch for interface changes");
+        monitor->releaseRef();
+        return;
+    }
+    info->driver_monitor = monitor;
+}
+
+/////////////////////////////////////////////////////////////////////////
+
 static bool is_wifi_interface(const char *name)
 {
     if (strncmp(name, "wlan", 4) != 0 && strncmp(name, "p2p", 3) != 0) {
@@ -1216,11 +1651,34 @@ wifi_error wifi_init_interfaces(wifi_handle handle)
             continue;
         if (is_wifi_interface(de->d_name)) {
             interface_info *ifinfo = (interface_info *)malloc(sizeof(interface_info));
+            memset(ifinfo, 0, sizeof(*ifinfo));
             if (get_interface(de->d_name, ifinfo) != WIFI_SUCCESS) {
                 free(ifinfo);
                 continue;
             }
+            /* results are decoded on the event loop, which must not allocate */
+            ifinfo->full_scan_buf = (wifi_scan_result *)wifi_hal_malloc(WIFI_ALLOC_GSCAN,
+                    offsetof(wifi_scan_result, ie_data) + MAX_PROBE_RESP_IE_LEN);
+            if (ifinfo->full_scan_buf == NULL) {
+                ALOGE("Could not allocate the full scan buffer of %s", de->d_name);
+                free(ifinfo);
+                continue;
+            }
             ifinfo->handle = handle;
+            pthread_mutex_init(&ifinfo->shadow.lock, NULL);
+            pthread_cond_init(&ifinfo->shadow.idle, NULL);
+            pthread_mutex_init(&ifinfo->batch_lock, NULL);
+            pthread_mutex_init(&ifinfo->scan_cache_lock, NULL);
+            pthread_mutex_init(&ifinfo->scan_history_lock, NULL);
+            pthread_mutex_init(&ifinfo->scan_export_lock, NULL);
+            pthread_mutex_init(&ifinfo->scan_filter_lock, NULL);
+            pthread_mutex_init(&ifinfo->scan_filter_push_lock, NULL);
+            pthread_mutex_init(&ifinfo->warm_start_lock, NULL);
+            pthread_mutex_init(&ifinfo->sig_change_lock, NULL);
+            pthread_mutex_init(&ifinfo->epno_lock, NULL);
+            pthread_mutex_init(&ifinfo->anqp_cache_lock, NULL);
+            pthread_mutex_init(&ifinfo->gscan_mux_lock, NULL);
+            pthread_mutex_init(&ifinfo->gscan_apply_lock, NULL);
             info->interfaces[i] = ifinfo;
             i++;
         }
@@ -1232,6 +1690,48 @@ wifi_error wifi_init_interfaces(wifi_handle handle)
     return WIFI_SUCCESS;
 }
 
+/*
+ * Called once the event loop and every command are gone. The filters go first, so the
+ * teardown of the observers below finds nothing to take back from the firmware
+ */
+static void wifi_free_interfaces(hal_info *info)
+{
+    wifi_full_scan_batch_handler no_batch_handler;
+    memset(&no_batch_handler, 0, sizeof(no_batch_handler));
+
+    for (int i = 0; i < info->num_interfaces; i++) {
+        interface_info *ifinfo = info->interfaces[i];
+        wifi_interface_handle iface = getIfaceHandle(ifinfo);
+
+        wifi_scan_filter_unload(ifinfo);
+        wifi_set_full_scan_batching(iface, NULL, no_batch_handler);
+        wifi_scan_export_configure(iface, NULL);
+        wifi_scan_cache_configure(iface, NULL);
+        wifi_scan_history_configure(iface, NULL);
+        wifi_set_anqp_cache_ttl(iface, 0);
+
+        pthread_mutex_destroy(&ifinfo->shadow.lock);
+        pthread_cond_destroy(&ifinfo->shadow.idle);
+        pthread_mutex_destroy(&ifinfo->batch_lock);
+        pthread_mutex_destroy(&ifinfo->scan_cache_lock);
+        pthread_mutex_destroy(&ifinfo->scan_history_lock);
+        pthread_mutex_destroy(&ifinfo->scan_export_lock);
+        pthread_mutex_destroy(&ifinfo->scan_filter_lock);
+        pthread_mutex_destroy(&ifinfo->scan_filter_push_lock);
+        pthread_mutex_destroy(&ifinfo->warm_start_lock);
+        pthread_mutex_destroy(&ifinfo->sig_change_lock);
+        pthread_mutex_destroy(&ifinfo->epno_lock);
+        pthread_mutex_destroy(&ifinfo->anqp_cache_lock);
+        pthread_mutex_destroy(&ifinfo->gscan_mux_lock);
+        pthread_mutex_destroy(&ifinfo->gscan_apply_lock);
+        wifi_hal_free(WIFI_ALLOC_GSCAN, ifinfo->full_scan_buf);
+        free(ifinfo);
+    }
+    free(info->interfaces);
+    info->interfaces = NULL;
+    info->num_interfaces = 0;
+}
+
 wifi_error wifi_get_ifaces(wifi_handle handle, int *num, wifi_interface_handle **interfaces)
 {
     hal_info *info = (hal_info *)handle;
@@ -1249,37 +1749,84 @@ wifi_error wifi_get_iface_name(wifi_interface_handle handle, char *name, size_t
     return WIFI_SUCCESS;
 }
 
+WifiCommand *wifi_new_feature_set_query(wifi_interface_handle handle, feature_set *set)
+{
+    return new GetFeatureSetCommand(handle, ANDR_WIFI_ATTRIBUTE_NUM_FEATURE_SET, set,
+            NULL, NULL, 1);
+}
+
+WifiCommand *wifi_new_concurrency_matrix_query(wifi_interface_handle handle,
+        feature_set set[], int *set_size, int set_size_max)
+{
+    return new GetFeatureSetCommand(handle, ANDR_WIFI_ATTRIBUTE_FEATURE_SET, NULL,
+            set, set_size, set_size_max);
+}
+
 wifi_error wifi_get_supported_feature_set(wifi_interface_handle handle, feature_set *set)
 {
-    GetFeatureSetCommand command(handle, ANDR_WIFI_ATTRIBUTE_NUM_FEATURE_SET, set, NULL, NULL, 1);
-    return (wifi_error) command.requestResponse();
+    wifi_capabilities *caps = wifi_get_capabilities(handle);
+    NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    *set = caps->features;
+    wifi_error result = (wifi_error)caps->status[CAP_FEATURE_SET];
+    wifi_put_capabilities(caps);
+    return result;
 }
 
 wifi_error wifi_get_concurrency_matrix(wifi_interface_handle handle, int set_size_max,
        feature_set set[], int *set_size)
 {
-    GetFeatureSetCommand command(handle, ANDR_WIFI_ATTRIBUTE_FEATURE_SET, NULL,
-            set, set_size, set_size_max);
-    return (wifi_error) command.requestResponse();
+    wifi_capabilities *caps = wifi_get_capabilities(handle);
+    NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    int num = max(min(caps->num_concurrency, set_size_max), 0);
+    memcpy(set, caps->concurrency, sizeof(feature_set) * num);
+    *set_size = num;
+    wifi_error result = (wifi_error)caps->status[CAP_CONCURRENCY_MATRIX];
+    wifi_put_capabilities(caps);
+    return result;
 }
 
 wifi_error wifi_set_scanning_mac_oui(wifi_interface_handle handle, oui scan_oui)
 {
-    SetPnoMacAddrOuiCommand command(handle, scan_oui);
-    return (wifi_error)command.start();
+    interface_info *iface = getIfaceInfo(handle);
+    uint64_t value = ((uint64_t)scan_oui[0] << 16) | (scan_oui[1] << 8) | scan_oui[2];
+    if (wifi_shadow_begin(iface, SHADOW_PNO_OUI, value)) {
+        return WIFI_SUCCESS;
+    }
 
+    SetPnoMacAddrOuiCommand command(handle, scan_oui);
+    wifi_error ret = (wifi_error)command.start();
+    wifi_shadow_end(iface, SHADOW_PNO_OUI, value, ret);
+    return ret;
 }
 
 wifi_error wifi_set_nodfs_flag(wifi_interface_handle handle, u32 nodfs)
 {
+    interface_info *iface = getIfaceInfo(handle);
+    if (wifi_shadow_begin(iface, SHADOW_NODFS, nodfs)) {
+        return WIFI_SUCCESS;
+    }
+
+    /* idempotent; a failure is reported from the event loop */
     SetNodfsCommand command(handle, nodfs);
-    return (wifi_error) command.requestResponse();
+    wifi_error ret = (wifi_error) command.requestNoAck();
+    wifi_shadow_end(iface, SHADOW_NODFS, nodfs, ret);
+    return ret;
 }
 
 wifi_error wifi_set_country_code(wifi_interface_handle handle, const char *country_code)
 {
+    hal_info *info = getHalInfo(handle);
+    uint64_t value = wifi_shadow_hash(country_code, strlen(country_code));
+    if (wifi_wiphy_shadow_begin(info, SHADOW_COUNTRY_CODE, value)) {
+        return WIFI_SUCCESS;
+    }
+
     SetCountryCodeCommand command(handle, country_code);
     wifi_error ret = (wifi_error) command.requestResponse();
+    wifi_wiphy_shadow_end(info, SHADOW_COUNTRY_CODE, value, ret);
+    if (ret == WIFI_SUCCESS) {
+        wifi_invalidate_channel_cache(info, "country code");
+    }
     return ret;
 }
 
@@ -1327,31 +1874,54 @@ static wifi_error wifi_get_packet_filter_capabilities(wifi_interface_handle hand
         u32 *version, u32 *max_len)
 {
     ALOGD("Getting APF capabilities, halHandle = %p\n", handle);
-    AndroidPktFilterCommand *cmd = new AndroidPktFilterCommand(handle, version, max_len);
-    NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
-    wifi_error result = (wifi_error)cmd->start();
-    if (result == WIFI_SUCCESS) {
-        ALOGD("Getting APF capability, version = %d, max_len = %d\n", *version, *max_len);
-    }
-    cmd->releaseRef();
+    wifi_capabilities *caps = wifi_get_capabilities(handle);
+    NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    *version = caps->apf_version;
+    *max_len = caps->apf_max_len;
+    wifi_error result = (wifi_error)caps->status[CAP_APF];
+    wifi_put_capabilities(caps);
     return result;
 }
 
+WifiCommand *wifi_new_apf_capabilities_query(wifi_interface_handle handle, u32 *version,
+        u32 *max_len)
+{
+    return new AndroidPktFilterCommand(handle, version, max_len);
+}
+
 static wifi_error wifi_set_packet_filter(wifi_interface_handle handle,
         const u8 *program, u32 len)
 {
     ALOGD("Setting APF program, halHandle = %p\n", handle);
+    interface_info *iface = getIfaceInfo(handle);
+    uint64_t value = wifi_shadow_hash(program, len) ^ len;
+    if (wifi_shadow_begin(iface, SHADOW_APF_PROGRAM, value)) {
+        return WIFI_SUCCESS;
+    }
+
     AndroidPktFilterCommand *cmd = new AndroidPktFilterCommand(handle, program, len);
-    NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+    if (cmd == NULL) {
+        wifi_shadow_end(iface, SHADOW_APF_PROGRAM, value, WIFI_ERROR_OUT_OF_MEMORY);
+        ALOGE("memory allocation failure");
+        return WIFI_ERROR_OUT_OF_MEMORY;
+    }
     wifi_error result = (wifi_error)cmd->start();
+    wifi_shadow_end(iface, SHADOW_APF_PROGRAM, value, result);
     cmd->releaseRef();
     return result;
 }
 
 static wifi_error wifi_configure_nd_offload(wifi_interface_handle handle, u8 enable)
 {
+    interface_info *iface = getIfaceInfo(handle);
+    if (wifi_shadow_begin(iface, SHADOW_ND_OFFLOAD, enable)) {
+        return WIFI_SUCCESS;
+    }
+
     SetNdoffloadCommand command(handle, enable);
-    return (wifi_error) command.requestResponse();
+    wifi_error ret = (wifi_error) command.requestResponse();
+    wifi_shadow_end(iface, SHADOW_ND_OFFLOAD, enable, ret);
+    return ret;
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2017 The Android Open Source Project
+ *
+ * Portions copyright (C) 2017 Broadcom Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __WIFI_HAL_EXT_H__
+#define __WIFI_HAL_EXT_H__
+
+/* Extensions to the vendor HAL interface that are specific to this HAL */
+
+#include <string.h>
+
+#include "wifi_hal.h"
+
+/* Batched full scan results */
+
+#define MAX_FULL_SCAN_BATCH     256
+
+typedef enum {
+    WIFI_BATCH_FLUSH_SCAN_COMPLETE,                 // GSCAN_EVENT_COMPLETE_SCAN arrived
+    WIFI_BATCH_FLUSH_SIZE,                          // max_results or max_bytes reached
+    WIFI_BATCH_FLUSH_TIME,                          // oldest result reached max_delay_ms
+    WIFI_BATCH_FLUSH_REQUEST,                       // no longer used; requests share batches
+    WIFI_BATCH_FLUSH_MAX
+} wifi_batch_flush_reason;
+
+typedef struct {
+    /* results[i] and buckets_scanned[i] are only valid during the callback */
+    void (*on_full_scan_results) (wifi_request_id id, wifi_scan_result **results,
+            unsigned *buckets_scanned, int num_results);
+} wifi_full_scan_batch_handler;
+
+typedef struct {
+    int max_results;                                // 0 or up to MAX_FULL_SCAN_BATCH
+    int max_bytes;                                  // 0 for no limit
+    int max_delay_ms;                               // 0 to hold results until the scan ends
+} wifi_full_scan_batch_params;
+
+typedef struct {
+    u32 batches;                                    // batches flushed; a callback per
+                                                    // request with results in each
+    u32 results;                                    // results delivered
+    u64 bytes;                                      // bytes of results delivered
+    u32 max_batch_results;                          // largest batch, in results
+    u32 max_batch_bytes;                            // largest batch, in bytes
+    u32 flushes[WIFI_BATCH_FLUSH_MAX];              // batches by reason
+    u32 dropped;                                    // results discarded by a cancel
+} wifi_full_scan_batch_stats;
+
+/* While enabled, full scan results on iface are buffered and handed to the batch handler
+ * instead of on_full_scan_result; a NULL params disables it. The handler runs on the
+ * event loop thread without HAL locks held, so it may change the batching */
+wifi_error wifi_set_full_scan_batching(wifi_interface_handle iface,
+        const wifi_full_scan_batch_params *params, wifi_full_scan_batch_handler handler);
+wifi_error wifi_get_full_scan_batch_stats(wifi_interface_handle iface,
+        wifi_full_scan_batch_stats *stats);
+
+/* Full scan result filters */
+
+#define WIFI_SCAN_FILTER_MAX_SSIDS  16
+#define WIFI_SCAN_FILTER_MAX_OUIS   16
+#define WIFI_SCAN_FILTER_MAX_IES    8
+
+typedef struct {
+    int num_ssids;                                  // 0 for any SSID
+    char ssids[WIFI_SCAN_FILTER_MAX_SSIDS][32+1];   // null terminated
+    int num_ouis;                                   // 0 for any BSSID
+    u8 ouis[WIFI_SCAN_FILTER_MAX_OUIS][3];          // first three bytes of the BSSID
+    wifi_rssi min_rssi;                             // 0 for no limit
+    u32 bands;                                      // wifi_band bits; 0 for all
+    int num_ies;
+    u8 required_ies[WIFI_SCAN_FILTER_MAX_IES];      // element ids that must all be present
+} wifi_scan_filter;
+
+typedef struct {
+    u32 passed;
+    u32 filtered;                                   // dropped on the host
+    u32 offloaded;                                  // 1 while the firmware filters as well
+} wifi_scan_filter_stats;
+
+/* Attaches a filter to the full scan results of background scan or full scan result
+ * request id; results it rejects are dropped before they are decoded or delivered. A NULL
+ * filter removes it, as does stopping the request. When every consumer of full results
+ * on iface has a filter and nothing else on the host needs the rest, a filter passing
+ * anything one of them wants is pushed to the firmware too, saving the wakeups; only
+ * drivers that advertise scan filter offload in their feature set are sent one */
+wifi_error wifi_set_scan_filter(wifi_request_id id, wifi_interface_handle iface,
+        const wifi_scan_filter *filter);
+wifi_error wifi_get_scan_filter_stats(wifi_request_id id, wifi_interface_handle iface,
+        wifi_scan_filter_stats *stats);
+
+/* Scan result cache, answered from memory without touching the driver */
+
+typedef struct {
+    int max_entries;                                // BSSIDs kept; 0 for the default
+    int max_bytes;                                  // memory cap, IEs included; 0 for none
+    int max_age_ms;                                 // entries not seen for longer expire; 0 never
+} wifi_scan_cache_params;
+
+typedef struct {
+    mac_addr bssid;
+    char ssid[32+1];                                // null terminated
+    wifi_channel channel;
+    wifi_rssi rssi;
+    u16 beacon_period;
+    u16 capability;
+    wifi_timestamp ts;                              // driver timestamp of the last sighting
+    u32 age_ms;                                     // time since the last sighting
+    u16 ie_length;                                  // IEs available from wifi_scan_cache_get_ies()
+} wifi_scan_cache_entry;
+
+typedef struct {
+    u32 entries;                                    // BSSIDs cached now
+    u32 bytes;                                      // memory in use
+    u32 updates;                                    // results folded in
+    u32 hits;                                       // lookups answered
+    u32 misses;                                     // lookups for unknown BSSIDs
+    u32 expired;                                    // entries aged out
+    u32 evicted;                                    // entries dropped to stay under a cap
+    u32 ie_bytes;                                   // part of bytes held for IEs, whole slabs
+                                                    // counted; each distinct element is
+                                                    // stored once
+    u32 ie_unshared_bytes;                          // what a private IE copy per entry would take
+    u32 ie_elements;                                // distinct elements held
+} wifi_scan_cache_stats;
+
+/* Starts caching results seen on iface (full scan results, cached result fetches and
+ * hotlist events); a NULL params stops it and frees the cache */
+wifi_error wifi_scan_cache_configure(wifi_interface_handle iface,
+        const wifi_scan_cache_params *params);
+wifi_error wifi_scan_cache_lookup(wifi_interface_handle iface, mac_addr bssid,
+        wifi_scan_cache_entry *entry);
+wifi_error wifi_scan_cache_get_ies(wifi_interface_handle iface, mac_addr bssid,
+        u8 *buf, int buf_len, int *ie_length);
+wifi_error wifi_scan_cache_find_ssid(wifi_interface_handle iface, const char *ssid,
+        wifi_scan_cache_entry *entries, int max, int *num);
+wifi_error wifi_scan_cache_find_channel(wifi_interface_handle iface, wifi_channel channel,
+        wifi_scan_cache_entry *entries, int max, int *num);
+/* strongest first */
+wifi_error wifi_scan_cache_top_rssi(wifi_interface_handle iface,
+        wifi_scan_cache_entry *entries, int k, int *num);
+wifi_error wifi_scan_cache_get_stats(wifi_interface_handle iface, wifi_scan_cache_stats *stats);
+
+/* Scan history, every sighting over time stored as small columns rather than results */
+
+typedef struct {
+    int max_bssids;                                 // distinct BSSIDs remembered, at least 256;
+                                                    // 0 for the default
+    int num_chunks;                                 // blocks of 256 sightings; 0 for the default
+    const char *backing_file;                       // map the history here so it outlives the
+                                                    // HAL process; NULL keeps it in memory
+} wifi_scan_history_params;
+
+typedef struct {
+    u64 ts_ms;                                      // monotonic time of the sighting
+    wifi_channel channel;
+    wifi_rssi rssi;
+} wifi_scan_history_sample;
+
+typedef struct {
+    u64 first_ms;                                   // first sighting in the window
+    u64 last_ms;                                    // last sighting in the window
+    u32 sightings;
+} wifi_scan_history_window;
+
+typedef struct {
+    wifi_channel channel;
+    u32 num_aps;                                    // distinct BSSIDs seen on the channel
+    u32 sightings;
+} wifi_scan_history_channel;
+
+typedef struct {
+    u64 observations;                               // sightings recorded
+    u64 duplicates;                                 // sightings already recorded, skipped
+    u32 rows;                                       // sightings held now
+    u32 bssids;                                     // BSSIDs held now
+    u32 bssids_recycled;                            // ids reused once no row referred to them
+    u32 chunks_evicted;
+    u32 bytes;                                      // size of the store
+} wifi_scan_history_stats;
+
+/* Starts recording results seen on iface (full scan results, cached result fetches and
+ * hotlist events); a NULL params stops it. A backing file left by an earlier run with the
+ * same sizes in the same boot is picked up where it left off */
+wifi_error wifi_scan_history_configure(wifi_interface_handle iface,
+        const wifi_scan_history_params *params);
+/* Sightings of bssid since since_ms in the order recorded, which is oldest first except
+ * for results fetched late from the firmware's cache */
+wifi_error wifi_scan_history_rssi_series(wifi_interface_handle iface, mac_addr bssid,
+        u64 since_ms, wifi_scan_history_sample *samples, int max, int *num);
+/* Spans of time bssid was in view; sightings more than max_gap_ms apart start a new one */
+wifi_error wifi_scan_history_visibility(wifi_interface_handle iface, mac_addr bssid,
+        u64 since_ms, u32 max_gap_ms, wifi_scan_history_window *windows, int max, int *num);
+/* Channels seen since since_ms, lowest frequency first */
+wifi_error wifi_scan_history_channel_counts(wifi_interface_handle iface, u64 since_ms,
+        wifi_scan_history_channel *channels, int max, int *num);
+wifi_error wifi_scan_history_get_stats(wifi_interface_handle iface,
+        wifi_scan_history_stats *stats);
+
+/* Scan result export. Results are published into a sealed memfd that other processes map
+ * read-only, so each consumer reads them in place rather than getting its own copy */
+
+#define WIFI_SCAN_EXPORT_MAGIC      0x57534552      /* "WSER" */
+#define WIFI_SCAN_EXPORT_VERSION    1
+#define WIFI_SCAN_EXPORT_HEADER_SIZE 64             // the first slot starts here
+
+#define WIFI_SCAN_EXPORT_FULL       0               // slot sources
+#define WIFI_SCAN_EXPORT_CACHED     1
+#define WIFI_SCAN_EXPORT_HOTLIST    2
+
+typedef struct {
+    int num_slots;                                  // results kept; 0 for the default
+    int max_ie_length;                              // IE bytes kept per result; 0 for the default
+} wifi_scan_export_params;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u32 num_slots;
+    u32 slot_size;                                  // bytes from one slot to the next
+    u64 generation;                                 // results published so far
+} wifi_scan_export_header;
+
+/* Result n lives in slot n % num_slots. A slot is written under a sequence count that is
+ * odd while the write is in progress */
+typedef struct {
+    u32 seq;
+    u16 source;
+    u16 truncated;                                  // not all of the IEs fitted
+    u64 index;                                      // n, to tell an overwritten slot apart
+    wifi_scan_result result;                        // result.ie_length bytes of IEs follow
+} wifi_scan_export_slot;
+
+typedef struct {
+    u64 published;
+    u32 truncated;                                  // results published without all of their IEs
+    u32 fds;                                        // read-only descriptors handed out
+    u32 bytes;                                      // size of the shared region
+} wifi_scan_export_stats;
+
+/* Publishes results seen on iface (full scan results, cached result fetches and hotlist
+ * events) into a new region; a NULL params stops publishing. Regions already mapped by
+ * readers stay valid but see no more results */
+wifi_error wifi_scan_export_configure(wifi_interface_handle iface,
+        const wifi_scan_export_params *params);
+/* A new read-only descriptor for the region, to be mapped PROT_READ and MAP_SHARED; the
+ * caller owns it */
+wifi_error wifi_scan_export_get_fd(wifi_interface_handle iface, int *fd, size_t *size);
+wifi_error wifi_scan_export_get_stats(wifi_interface_handle iface,
+        wifi_scan_export_stats *stats);
+
+/*
+ * Reader side, for use on a mapped region. Poll the header's generation for new results
+ * and read the ones not seen yet by number. Copies result n into slot, which must have
+ * room for slot_size bytes, and returns its size; 0 if it has not been published yet
+ * and -1 if it has already been overwritten.
+ */
+static inline int wifi_scan_export_read(const void *map, u64 n, wifi_scan_export_slot *slot)
+{
+    const wifi_scan_export_header *header = (const wifi_scan_export_header *)map;
+    if (n >= __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    const wifi_scan_export_slot *shared = (const wifi_scan_export_slot *)((const u8 *)map +
+            WIFI_SCAN_EXPORT_HEADER_SIZE + (n % header->num_slots) * header->slot_size);
+
+    /* n was complete when generation passed it, so a write seen now is overwriting it */
+    u32 seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return -1;
+    }
+    memcpy(slot, shared, header->slot_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) != seq || slot->index != n) {
+        return -1;
+    }
+    return sizeof(*slot) + slot->result.ie_length;
+}
+
+/* Warm start. Recent results are kept in a small file that survives HAL restarts and
+ * reboots, so the first scan after Wi-Fi comes up can be aimed at where APs were */
+
+#define WIFI_WARM_START_IE_LEN      128
+
+typedef struct {
+    mac_addr bssid;
+    char ssid[32+1];                                // null terminated
+    wifi_channel channel;
+    wifi_rssi rssi;
+    u16 beacon_period;
+    u16 capability;
+    u32 age_ms;                                     // time since the last sighting
+    u8 stale;                                       // from before the HAL started, not seen since
+    u8 ie_length;
+    u8 ies[WIFI_WARM_START_IE_LEN];                 // RSN, WPA, HT, VHT, mobility domain,
+                                                    // interworking and extended capabilities
+} wifi_warm_start_entry;
+
+/* Remembered BSSIDs, most recently seen first */
+wifi_error wifi_warm_start_get_entries(wifi_interface_handle iface,
+        wifi_warm_start_entry *entries, int max, int *num);
+/* Channels remembered BSSIDs were on, strongest first; the channel list for a targeted
+ * first scan */
+wifi_error wifi_warm_start_get_channels(wifi_interface_handle iface, wifi_channel *channels,
+        int max, int *num);
+/* Forgets every entry, in memory and in the file */
+wifi_error wifi_warm_start_clear(wifi_interface_handle iface);
+
+/* Incremental BSSID hotlist */
+
+#define WIFI_HOTLIST_MAX_BSSIDS 1024
+
+/* Adds (or changes the thresholds of) and removes BSSIDs in the hotlist started as id by
+ * wifi_set_bssid_hotlist(), which may grow past MAX_HOTLIST_APS this way. Removals are
+ * applied first; events for removed BSSIDs are no longer delivered. Nothing changes, and
+ * WIFI_ERROR_TOO_MANY_REQUESTS is returned, if the hotlist would outgrow the firmware's
+ * max_hotlist_bssids */
+wifi_error wifi_update_bssid_hotlist(wifi_request_id id, wifi_interface_handle iface,
+        const ap_threshold_param *add, int num_add, const mac_addr *remove, int num_remove);
+
+/* Host side significant change detection */
+
+#define WIFI_SIGNIFICANT_CHANGE_MAX_BSSIDS  1024
+#define WIFI_SIGNIFICANT_CHANGE_MAX_SAMPLES 16
+
+typedef struct {
+    int rssi_sample_size;                           // up to WIFI_SIGNIFICANT_CHANGE_MAX_SAMPLES
+    int lost_ap_sample_size;
+    int min_breaching;
+    int num_bssid;
+    const ap_threshold_param *ap;                   // copied; need not outlive the call
+} wifi_significant_change_ext_params;
+
+/* Tracks significant change on the host from the full scan results of a running
+ * background scan, which must report REPORT_EVENTS_FULL_RESULTS; one per interface.
+ * wifi_set_significant_change_handler() falls back to it when the firmware has no
+ * significant change support and such a scan is running, and returns
+ * WIFI_ERROR_NOT_SUPPORTED otherwise. Stop it with wifi_reset_significant_change_handler() */
+wifi_error wifi_set_host_significant_change_handler(wifi_request_id id,
+        wifi_interface_handle iface, const wifi_significant_change_ext_params *params,
+        wifi_significant_change_handler handler);
+
+/* ePNO lists larger than the firmware takes */
+
+#define WIFI_EPNO_MAX_NETWORKS  1024
+#define WIFI_EPNO_MAX_HOST_HITS 64                  // host matches reported per scan
+
+typedef struct {
+    char ssid[32+1];
+    byte flags;                                     // WIFI_PNO_FLAG_
+    byte auth_bit_field;                            // WIFI_PNO_AUTH_CODE_, 0 for any
+    int min_rssi;                                   // 0 for the band threshold
+    int priority;                                   // highest go to the firmware
+} wifi_epno_network_ext;
+
+typedef struct {
+    int min5GHz_rssi;
+    int min24GHz_rssi;
+    int initial_score_max;
+    int current_connection_bonus;
+    int same_network_bonus;
+    int secure_bonus;
+    int band5GHz_bonus;
+    int num_networks;                               // up to WIFI_EPNO_MAX_NETWORKS
+    const wifi_epno_network_ext *networks;          // copied
+} wifi_epno_ext_params;
+
+/* Programs the firmware with the MAX_EPNO_NETWORKS highest priority networks and
+ * matches the rest on the host against full scan results. Host matching only works
+ * while a background scan delivers full results (REPORT_EVENTS_FULL_RESULTS); when the
+ * firmware scans on its own, e.g. for PNO with the host asleep, only the networks it
+ * was given are found. Host matches are reported best first when each scan completes,
+ * through the same on_network_found. WIFI_ERROR_BUSY if another list is matched on the
+ * host already. Reset with wifi_reset_epno_list() */
+wifi_error wifi_set_epno_list_ext(wifi_request_id id, wifi_interface_handle iface,
+        const wifi_epno_ext_params *params, wifi_epno_handler handler);
+
+/* ANQP responses seen in Passpoint hotspot matches */
+
+typedef struct {
+    u32 entries;                                    // responses cached now
+    u32 stores;                                     // responses stored
+    u32 hits;                                       // lookups answered for the BSSID
+    u32 hessid_hits;                                // answered from another BSSID of the HESS
+    u32 misses;
+    u32 expired;
+} wifi_anqp_cache_stats;
+
+/* How long ANQP responses are kept; 0 stops caching and drops what is held */
+wifi_error wifi_set_anqp_cache_ttl(wifi_interface_handle iface, int ttl_ms);
+/* Looks for a live response from bssid, or failing that from any AP of the same HESS
+ * when hessid is given; check here before starting an ANQP query */
+wifi_error wifi_anqp_cache_lookup(wifi_interface_handle iface, mac_addr bssid,
+        const u8 *hessid, int *network_id, u8 *buf, int buf_len, int *anqp_len);
+wifi_error wifi_get_anqp_cache_stats(wifi_interface_handle iface, wifi_anqp_cache_stats *stats);
+
+/* Valid channels with regulatory flags, from the HAL's channel cache */
+
+#define WIFI_CHANNEL_FLAG_DFS   0x01                // radar detection required
+#define WIFI_CHANNEL_FLAG_NO_IR 0x02                // passive scan only
+
+typedef struct {
+    wifi_channel channel;                           // MHz
+    u32 flags;                                      // WIFI_CHANNEL_FLAG_
+} wifi_valid_channel;
+
+typedef struct {
+    u32 hits;                                       // answered from the cache
+    u32 fetches;                                    // channel lists read from the driver
+    u32 invalidations;                              // country code, regulatory and restarts
+} wifi_channel_cache_stats;
+
+wifi_error wifi_get_valid_channels_ext(wifi_interface_handle iface, int band,
+        int max_channels, wifi_valid_channel *channels, int *num_channels);
+wifi_error wifi_get_channel_cache_stats(wifi_interface_handle iface,
+        wifi_channel_cache_stats *stats);
+
+/* Background scans of several clients. Each wifi_start_gscan() id is a session of one
+ * merged firmware schedule, and its results arrive in terms of its own buckets */
+
+/* Cached results of the background scan started as id, leaving out scans of none of its
+ * buckets. The firmware keeps one set of cached results for all sessions, so flush is
+ * refused with WIFI_ERROR_BUSY while more than one runs. wifi_get_cached_gscan_results()
+ * answers for the oldest session, under the same rule */
+wifi_error wifi_get_cached_gscan_results_ext(wifi_request_id id, wifi_interface_handle iface,
+        byte flush, int max, wifi_cached_scan_results *results, int *num);
+
+/* Background scan planning */
+
+typedef struct {
+    u32 plans;                                      // schedules rewritten
+    u32 channels_removed;                           // in the last plan
+    u32 buckets_removed;
+    u32 bands_expanded;
+    u32 radio_ms_requested;                         // estimated radio time per hour
+    u32 radio_ms_planned;
+} wifi_scan_plan_stats;
+
+/* When enabled, background scan schedules on iface are rewritten before they go to the
+ * firmware: channels already scanned as often by another bucket are dropped, buckets
+ * running at the same times are folded and bands become explicit channel lists in
+ * frequency order. Results still arrive as the requested buckets. Applies at once to
+ * a running scan */
+wifi_error wifi_set_scan_planner(wifi_interface_handle iface, bool enable);
+wifi_error wifi_get_scan_plan_stats(wifi_interface_handle iface, wifi_scan_plan_stats *stats);
+
+/* Driver capabilities, read once after init and after a driver restart */
+
+/* Writes what the capability getters answer with, as text, for diagnostics */
+wifi_error wifi_dump_capabilities(wifi_interface_handle iface, char *buffer, int buffer_size);
+
+/* Information element index. wifi_ie_index_init() only records the blob; the first
+ * accessor makes one validated pass over it, after which lookups are constant time.
+ * Pointers returned refer into the indexed blob, past the element header */
+
+#define WIFI_IE_MAX_VENDOR      16
+
+#define WIFI_IE_SSID            0
+#define WIFI_IE_TIM             5
+#define WIFI_IE_BSS_LOAD        11
+#define WIFI_IE_HT_CAP          45
+#define WIFI_IE_RSN             48
+#define WIFI_IE_MOBILITY_DOMAIN 54
+#define WIFI_IE_HT_OP           61
+#define WIFI_IE_INTERWORKING    107
+#define WIFI_IE_ROAMING_CONS    111
+#define WIFI_IE_EXT_CAP         127
+#define WIFI_IE_VHT_CAP         191
+#define WIFI_IE_VHT_OP          192
+#define WIFI_IE_VENDOR          221
+#define WIFI_IE_EXTENSION       255
+
+#define WIFI_IE_HT_CAP_LEN      26
+#define WIFI_IE_VHT_CAP_LEN     12
+
+typedef struct {
+    const u8 *ies;
+    u16 ie_length;
+    u8 built;                                       // offsets below are filled in
+    u8 truncated;                                   // blob ended inside an element, or
+                                                    // had more vendor elements than fit
+    u32 present[8];                                 // bit per element id
+    u32 ext_present[8];                             // bit per extension element id
+    u16 offset[256];                                // first element with each id
+    u16 ext_offset[256];                            // first extension element with each id
+    int num_vendor;
+    u32 vendor_key[WIFI_IE_MAX_VENDOR];             // OUI << 8 | OUI type
+    u16 vendor_offset[WIFI_IE_MAX_VENDOR];
+} wifi_ie_index;
+
+void wifi_ie_index_init(wifi_ie_index *index, const u8 *ies, int ie_length);
+/* Size of the element at pos, header included, or 0 if the blob ends inside it; for
+ * walking every element in order where the first of each id is not enough */
+int wifi_ie_element_len(const u8 *ies, int ie_length, int pos);
+const u8 *wifi_ie_get(wifi_ie_index *index, int id, int *len);
+const u8 *wifi_ie_get_ext(wifi_ie_index *index, int ext_id, int *len);
+const u8 *wifi_ie_get_vendor(wifi_ie_index *index, const u8 *oui, u8 type, int *len);
+bool wifi_ie_is_truncated(wifi_ie_index *index);
+
+/* Typed accessors; each returns NULL (or false) if the element is missing or too short */
+const u8 *wifi_ie_ssid(wifi_ie_index *index, int *len);
+const u8 *wifi_ie_rsn(wifi_ie_index *index, int *len);
+const u8 *wifi_ie_ht_cap(wifi_ie_index *index);
+const u8 *wifi_ie_vht_cap(wifi_ie_index *index);
+const u8 *wifi_ie_ext_cap(wifi_ie_index *index, int *len);
+bool wifi_ie_bss_load(wifi_ie_index *index, u16 *station_count, u8 *channel_util,
+        u16 *admission_capacity);
+
+#endif /* __WIFI_HAL_EXT_H__ */
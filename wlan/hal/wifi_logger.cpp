@@ -44,6 +44,8 @@
 #include "wifi_hal.h"
 #include "common.h"
 #include "cpp_bindings.h"
+#include "cpp_coroutines.h"
+#include "capabilities.h"
 
 typedef enum {
     LOGGER_START_LOGGING = ANDROID_NL80211_SUBCMD_DEBUG_RANGE_START,
@@ -293,6 +295,11 @@ public:
         return result;
     }
 
+    /* so the command can be sent with WifiCommand::requestBatch() */
+    virtual int create() {
+        return createRequest(mMsg);
+    }
+
     int start() {
         // ALOGD("Start debug command");
         WifiRequest request(familyId(), ifaceId());
@@ -302,7 +309,12 @@ public:
             return result;
         }
 
-        result = requestResponse(request);
+        if (mType == START_RING_LOG) {
+            /* verbosity changes don't need an ack, failures are logged asynchronously */
+            result = requestNoAck(request);
+        } else {
+            result = requestResponse(request);
+        }
         if (result != WIFI_SUCCESS) {
             ALOGE("Failed to register debug response; result = %d", result);
         }
@@ -398,16 +410,36 @@ public:
     }
 };
 
+/* Copies a version string out of the capability snapshot */
+static wifi_error get_version(wifi_interface_handle iface, capability_id id, char *buffer,
+        int buffer_size)
+{
+    wifi_capabilities *caps = wifi_get_capabilities(iface);
+    NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+
+    memset(buffer, 0, buffer_size);
+    if (id == CAP_FIRMWARE_VERSION) {
+        memcpy(buffer, caps->firmware_version, min(caps->firmware_version_len, buffer_size));
+    } else {
+        memcpy(buffer, caps->driver_version, min(caps->driver_version_len, buffer_size));
+    }
+    wifi_error result = (wifi_error)caps->status[id];
+    wifi_put_capabilities(caps);
+    return result;
+}
+
+WifiCommand *wifi_new_version_query(wifi_interface_handle iface, bool firmware, char *buffer,
+        int *buffer_size)
+{
+    return new DebugCommand(iface, buffer, buffer_size, firmware ? GET_FW_VER : GET_DRV_VER);
+}
+
 /* API to collect a firmware version string */
 wifi_error wifi_get_firmware_version(wifi_interface_handle iface, char *buffer,
         int buffer_size)
 {
     if (buffer && (buffer_size > 0)) {
-        DebugCommand *cmd = new DebugCommand(iface, buffer, &buffer_size, GET_FW_VER);
-        NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
-        wifi_error result = (wifi_error)cmd->start();
-        cmd->releaseRef();
-        return result;
+        return get_version(iface, CAP_FIRMWARE_VERSION, buffer, buffer_size);
     } else {
         ALOGE("FW version buffer NULL");
         return  WIFI_ERROR_INVALID_ARGS;
@@ -418,11 +450,7 @@ wifi_error wifi_get_firmware_version(wifi_interface_handle iface, char *buffer,
 wifi_error wifi_get_driver_version(wifi_interface_handle iface, char *buffer, int buffer_size)
 {
     if (buffer && (buffer_size > 0)) {
-        DebugCommand *cmd = new DebugCommand(iface, buffer, &buffer_size, GET_DRV_VER);
-        NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
-        wifi_error result = (wifi_error)cmd->start();
-        cmd->releaseRef();
-        return result;
+        return get_version(iface, CAP_DRIVER_VERSION, buffer, buffer_size);
     } else {
         ALOGE("Driver version buffer NULL");
         return  WIFI_ERROR_INVALID_ARGS;
@@ -455,15 +483,21 @@ wifi_error wifi_get_ring_buffers_status(wifi_interface_handle iface,
     }
 }
 
+WifiCommand *wifi_new_logger_features_query(wifi_interface_handle iface, unsigned int *support)
+{
+    return new DebugCommand(iface, support, GET_FEATURE);
+}
+
 /* API to get supportable feature */
 wifi_error wifi_get_logger_supported_feature_set(wifi_interface_handle iface,
         unsigned int *support)
 {
     if (support) {
-        DebugCommand *cmd = new DebugCommand(iface, support, GET_FEATURE);
-        NULL_CHECK_RETURN(cmd, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
-        wifi_error result = (wifi_error)cmd->start();
-        cmd->releaseRef();
+        wifi_capabilities *caps = wifi_get_capabilities(iface);
+        NULL_CHECK_RETURN(caps, "memory allocation failure", WIFI_ERROR_OUT_OF_MEMORY);
+        *support = caps->logger_features;
+        wifi_error result = (wifi_error)caps->status[CAP_LOGGER_FEATURES];
+        wifi_put_capabilities(caps);
         return result;
     } else {
         ALOGE("Get support buffer NULL");
@@ -614,30 +648,53 @@ wifi_error wifi_reset_log_handler(wifi_request_id id, wifi_interface_handle ifac
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-class SetAlertHandler : public WifiCommand
+#ifdef WIFI_HAL_COROUTINES
+typedef CoroutineCommand AlertCommandBase;
+#else
+typedef WifiCommand AlertCommandBase;
+#endif
+
+class SetAlertHandler : public AlertCommandBase
 {
     wifi_alert_handler mHandler;
     int mBuffSize;
-    char *mBuff;
+    char *mBuff;                        // only held while a dump is being fetched
     int mErrCode;
 
 public:
     SetAlertHandler(wifi_interface_handle iface, int id, wifi_alert_handler handler)
-        : WifiCommand("SetAlertHandler", iface, id), mHandler(handler), mBuffSize(0), mBuff(NULL),
-            mErrCode(0)
+        : AlertCommandBase("SetAlertHandler", iface, id), mHandler(handler), mBuffSize(0),
+            mBuff(NULL), mErrCode(0)
     { }
 
+    virtual ~SetAlertHandler() {
+        freeBuffer();
+    }
+
     int start() {
         ALOGV("Start Alerting");
+#ifdef WIFI_HAL_COROUTINES
+        return spawn(dumpOnAlert());    /* runs until cancelled */
+#else
         registerVendorHandler(GOOGLE_OUI, GOOGLE_DEBUG_MEM_DUMP_EVENT);
         return WIFI_SUCCESS;
+#endif
     }
 
     virtual int cancel() {
         ALOGV("Clear alerthandler");
 
         /* unregister alert handler */
+#ifdef WIFI_HAL_COROUTINES
+        if (running()) {
+            cancelTask();
+        } else {
+            unregisterVendorHandler(GOOGLE_OUI, GOOGLE_DEBUG_MEM_DUMP_EVENT);
+        }
+#else
         unregisterVendorHandler(GOOGLE_OUI, GOOGLE_DEBUG_MEM_DUMP_EVENT);
+#endif
+        freeBuffer();
         wifi_unregister_cmd(wifiHandle(), id());
         ALOGD("Success to clear alerthandler");
         return WIFI_SUCCESS;
@@ -666,93 +723,148 @@ public:
                 if (mHandler.on_alert) {
                     (*mHandler.on_alert)(id(), mBuff, mBuffSize, mErrCode);
                 }
-                if (mBuff) {
-                    free(mBuff);
-                    mBuff = NULL;
-                }
             }
         }
         return NL_OK;
     }
 
-    virtual int handleEvent(WifiEvent& event) {
-        wifi_ring_buffer_id ring_id;
+    void freeBuffer() {
+        if (mBuff) {
+            wifi_hal_free(WIFI_ALLOC_LOGGER, mBuff);
+            mBuff = NULL;
+        }
+    }
+
+    /* Builds the request to fetch the dump for a dump event, into a buffer allocated for
+     * it. Where the event loop may not allocate, the dump is dropped */
+    int createMemoryDumpRequest(WifiEvent& event, WifiRequest& request) {
         char *buffer = NULL;
         int buffer_size = 0;
 
-
         nlattr *vendor_data = event.get_attribute(NL80211_ATTR_VENDOR_DATA);
         int len = event.get_vendor_data_len();
-        int event_id = event.get_vendor_subcmd();
-        ALOGI("Got event: %d", event_id);
 
         if (vendor_data == NULL || len == 0) {
             ALOGE("No Debug data found");
-            return NL_SKIP;
+            return WIFI_ERROR_INVALID_ARGS;
         }
 
-        if (event_id == GOOGLE_DEBUG_MEM_DUMP_EVENT) {
-            for (nl_iterator it(vendor_data); it.has_next(); it.next()) {
-                if (it.get_type() == LOGGER_ATTRIBUTE_FW_DUMP_LEN) {
-                    mBuffSize = it.get_u32();
-                } else if (it.get_type() == LOGGER_ATTRIBUTE_RING_DATA) {
-                    buffer_size = it.get_len();
-                    buffer = (char *)it.get_data();
-            /*
-                } else if (it.get_type() == LOGGER_ATTRIBUTE_FW_ERR_CODE) {
-                    mErrCode = it.get_u32();
-            */
-                } else {
-                    ALOGW("Ignoring invalid attribute type = %d, size = %d",
-                            it.get_type(), it.get_len());
-                }
+        mBuffSize = 0;
+
+        for (nl_iterator it(vendor_data); it.has_next(); it.next()) {
+            if (it.get_type() == LOGGER_ATTRIBUTE_FW_DUMP_LEN) {
+                mBuffSize = it.get_u32();
+            } else if (it.get_type() == LOGGER_ATTRIBUTE_RING_DATA) {
+                buffer_size = it.get_len();
+                buffer = (char *)it.get_data();
+        /*
+            } else if (it.get_type() == LOGGER_ATTRIBUTE_FW_ERR_CODE) {
+                mErrCode = it.get_u32();
+        */
+            } else {
+                ALOGW("Ignoring invalid attribute type = %d, size = %d",
+                        it.get_type(), it.get_len());
             }
-            if (mBuffSize) {
-                ALOGD("dump size: %d meta data size: %d", mBuffSize, buffer_size);
-                if (mBuff) free(mBuff);
-                mBuff = (char *)malloc(mBuffSize + buffer_size);
-                if (!mBuff) {
-                    ALOGE("Buffer allocation failed");
-                    return NL_SKIP;
-                }
-                memcpy(mBuff, buffer, buffer_size);
+        }
 
-                WifiRequest request(familyId(), ifaceId());
-                int result = request.create(GOOGLE_OUI, LOGGER_GET_MEM_DUMP);
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to create get memory dump request; result = %d", result);
-                    free(mBuff);
-                    return NL_SKIP;
-                }
-                nlattr *data = request.attr_start(NL80211_ATTR_VENDOR_DATA);
-                result = request.put_u32(LOGGER_ATTRIBUTE_FW_DUMP_LEN, mBuffSize);
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to put get memory dump request; result = %d", result);
-                    return result;
-                }
+        if (!mBuffSize) {
+            ALOGE("dump event missing dump length attribute");
+            return WIFI_ERROR_INVALID_ARGS;
+        }
 
-                result = request.put_u64(LOGGER_ATTRIBUTE_FW_DUMP_DATA,
-                         (uint64_t)(mBuff+buffer_size));
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to put get memory dump request; result = %d", result);
-                    return result;
-                }
+        ALOGD("dump size: %d meta data size: %d", mBuffSize, buffer_size);
+        if (wifi_alloc_restricted()) {
+            ALOGE("Dropping a %d byte dump; the event loop may not allocate",
+                    mBuffSize + buffer_size);
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+        freeBuffer();
+        mBuff = (char *)wifi_hal_malloc(WIFI_ALLOC_LOGGER, mBuffSize + buffer_size);
+        if (!mBuff) {
+            ALOGE("Buffer allocation failed");
+            return WIFI_ERROR_OUT_OF_MEMORY;
+        }
+        memcpy(mBuff, buffer, buffer_size);
 
-                request.attr_end(data);
-                mBuffSize += buffer_size;
+        int result = request.create(GOOGLE_OUI, LOGGER_GET_MEM_DUMP);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to create get memory dump request; result = %d", result);
+            return result;
+        }
+        nlattr *data = request.attr_start(NL80211_ATTR_VENDOR_DATA);
+        result = request.put_u32(LOGGER_ATTRIBUTE_FW_DUMP_LEN, mBuffSize);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to put get memory dump request; result = %d", result);
+            return result;
+        }
 
-                result = requestResponse(request);
+        result = request.put_u64(LOGGER_ATTRIBUTE_FW_DUMP_DATA,
+                 (uint64_t)(mBuff+buffer_size));
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to put get memory dump request; result = %d", result);
+            return result;
+        }
 
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to register get momory dump response; result = %d", result);
-                }
-            } else {
-                ALOGE("dump event missing dump length attribute");
+        request.attr_end(data);
+        mBuffSize += buffer_size;
+        return WIFI_SUCCESS;
+    }
+
+#ifdef WIFI_HAL_COROUTINES
+    WifiTask dumpOnAlert() {
+        for (;;) {
+            WifiEvent *alert = co_await event(GOOGLE_DEBUG_MEM_DUMP_EVENT);
+            if (alert == NULL) {
+                ALOGE("Failed to wait for memory dump event");
+                co_return WIFI_ERROR_UNKNOWN;
+            }
+            ALOGI("Got event: %d", alert->get_vendor_subcmd());
+
+            WifiRequest dumpRequest(familyId(), ifaceId());
+            if (createMemoryDumpRequest(*alert, dumpRequest) != WIFI_SUCCESS) {
+                freeBuffer();
+                continue;
+            }
+
+            /* dump data is delivered to handleResponse before the ack resumes us */
+            int result = co_await request(dumpRequest);
+            if (result != WIFI_SUCCESS) {
+                ALOGE("Failed to get memory dump; result = %d", result);
+            }
+            freeBuffer();
+        }
+    }
+#else
+    static void onMemoryDumpDone(WifiCommand *cmd, int result, void *arg) {
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to get memory dump; result = %d", result);
+        }
+        /* the dump has been handed to the framework, or is lost */
+        ((SetAlertHandler *)cmd)->freeBuffer();
+    }
+
+    virtual int handleEvent(WifiEvent& event) {
+        int event_id = event.get_vendor_subcmd();
+        ALOGI("Got event: %d", event_id);
+
+        if (event_id == GOOGLE_DEBUG_MEM_DUMP_EVENT) {
+            WifiRequest request(familyId(), ifaceId());
+            int result = createMemoryDumpRequest(event, request);
+            if (result != WIFI_SUCCESS) {
+                freeBuffer();
                 return NL_SKIP;
             }
+
+            /* we are on the event loop; the dump data arrives in handleResponse later */
+            result = requestResponseAsync(request, &SetAlertHandler::onMemoryDumpDone, NULL);
+            if (result != WIFI_SUCCESS) {
+                ALOGE("Failed to request memory dump; result = %d", result);
+                freeBuffer();
+            }
         }
         return NL_OK;
     }
+#endif
 };
 
 wifi_error wifi_set_alert_handler(wifi_request_id id, wifi_interface_handle iface,
@@ -802,12 +914,20 @@ class MemoryDumpCommand: public WifiCommand
     wifi_firmware_memory_dump_handler mHandler;
     int mBuffSize;
     char *mBuff;
+    bool mFetchPending;
 
 public:
     MemoryDumpCommand(wifi_interface_handle iface, wifi_firmware_memory_dump_handler handler)
-        : WifiCommand("MemoryDumpCommand", iface, 0), mHandler(handler), mBuffSize(0), mBuff(NULL)
+        : WifiCommand("MemoryDumpCommand", iface, 0), mHandler(handler), mBuffSize(0), mBuff(NULL),
+            mFetchPending(false)
     { }
 
+    ~MemoryDumpCommand() {
+        if (mBuff) {
+            free(mBuff);
+        }
+    }
+
     int start() {
         ALOGD("Start memory dump command");
         WifiRequest request(familyId(), ifaceId());
@@ -821,6 +941,43 @@ public:
         result = requestResponse(request);
         if (result != WIFI_SUCCESS) {
             ALOGE("Failed to register trigger memory dump response; result = %d", result);
+            return result;
+        }
+
+        /* the fetch is queued by handleResponse and sent once the trigger has completed,
+         * rather than from inside the trigger's receive loop */
+        if (mFetchPending) {
+            mFetchPending = false;
+            result = fetchMemoryDump();
+        }
+        return result;
+    }
+
+    int fetchMemoryDump() {
+        WifiRequest request(familyId(), ifaceId());
+        int result = request.create(GOOGLE_OUI, LOGGER_GET_MEM_DUMP);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to create get memory dump request; result = %d", result);
+            return result;
+        }
+
+        nlattr *data = request.attr_start(NL80211_ATTR_VENDOR_DATA);
+        result = request.put_u32(LOGGER_ATTRIBUTE_FW_DUMP_LEN, mBuffSize);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to put get memory dump request; result = %d", result);
+            return result;
+        }
+
+        result = request.put_u64(LOGGER_ATTRIBUTE_FW_DUMP_DATA, (uint64_t)mBuff);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to put get memory dump request; result = %d", result);
+            return result;
+        }
+        request.attr_end(data);
+
+        result = requestResponse(request);
+        if (result != WIFI_SUCCESS) {
+            ALOGE("Failed to register get momory dump response; result = %d", result);
         }
         return result;
     }
@@ -853,32 +1010,7 @@ public:
                     ALOGE("Buffer allocation failed");
                     return NL_SKIP;
                 }
-                WifiRequest request(familyId(), ifaceId());
-                int result = request.create(GOOGLE_OUI, LOGGER_GET_MEM_DUMP);
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to create get memory dump request; result = %d", result);
-                    free(mBuff);
-                    return NL_SKIP;
-                }
-
-                nlattr *data = request.attr_start(NL80211_ATTR_VENDOR_DATA);
-                result = request.put_u32(LOGGER_ATTRIBUTE_FW_DUMP_LEN, mBuffSize);
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to put get memory dump request; result = %d", result);
-                    return result;
-                }
-
-                result = request.put_u64(LOGGER_ATTRIBUTE_FW_DUMP_DATA, (uint64_t)mBuff);
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to put get memory dump request; result = %d", result);
-                    return result;
-                }
-                request.attr_end(data);
-
-                result = requestResponse(request);
-                if (result != WIFI_SUCCESS) {
-                    ALOGE("Failed to register get momory dump response; result = %d", result);
-                }
+                mFetchPending = true;
             } else if (it.get_type() == LOGGER_ATTRIBUTE_FW_DUMP_DATA) {
                 ALOGI("Initiating memory dump callback");
                 if (mHandler.on_firmware_memory_dump) {
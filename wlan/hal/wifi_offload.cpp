@@ -117,7 +117,7 @@ public:
                     return result;
                 }
 
-                result = request.put(MKEEP_ALIVE_ATTRIBUTE_IP_PKT, (u8*)mIpPkt, mIpPktLen);
+                result = request.put_external(MKEEP_ALIVE_ATTRIBUTE_IP_PKT, mIpPkt, mIpPktLen);
                 if (result < 0) {
                     ALOGE("Failed to put ip pkt request; result = %d", result);
                     return result;